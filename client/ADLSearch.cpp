@@ -428,7 +428,7 @@ void ADLSearchManager::matchesFile(DestDirList& destDirVector, DirectoryListing:
 			DirectoryListing::File *copyFile = new DirectoryListing::File(*currentFile, true);
 			dcassert(id->subdir->getAdls());
 
-			id->subdir->files.insert(copyFile);
+			id->files.push_back(make_pair(id->subdir, copyFile));
 		}
 		id->fileAdded = false;	// Prepare for next stage
 	}
@@ -451,7 +451,7 @@ void ADLSearchManager::matchesFile(DestDirList& destDirVector, DirectoryListing:
 				copyFile->setAdlsComment(is->adlsComment);
 				copyFile->setAdlsPriority(is->adlsPriority);
 			}
-			destDirVector[is->ddIndex].dir->files.insert(copyFile);
+			destDirVector[is->ddIndex].files.push_back(make_pair(destDirVector[is->ddIndex].dir, copyFile));
 			destDirVector[is->ddIndex].fileAdded = true;
 
 			if(is->isAutoQueue && !is->isForbidden) {
@@ -475,7 +475,7 @@ void ADLSearchManager::matchesDirectory(DestDirList& destDirVector, DirectoryLis
 		if(id->subdir != NULL) {
 			DirectoryListing::Directory* newDir = 
 				new DirectoryListing::AdlDirectory(fullPath, id->subdir, currentDir->getName());
-			id->subdir->directories.insert(newDir);
+			id->directories.push_back(make_pair(id->subdir, newDir));
 			id->subdir = newDir;
 		}
 	}
@@ -493,7 +493,7 @@ void ADLSearchManager::matchesDirectory(DestDirList& destDirVector, DirectoryLis
 		if(is->matchesDirectory(currentDir->getName(), noAdlSearch)) {
 			destDirVector[is->ddIndex].subdir = 
 				new DirectoryListing::AdlDirectory(fullPath, destDirVector[is->ddIndex].dir, currentDir->getName());
-			destDirVector[is->ddIndex].dir->directories.insert(destDirVector[is->ddIndex].subdir);
+			destDirVector[is->ddIndex].directories.push_back(make_pair(destDirVector[is->ddIndex].dir, destDirVector[is->ddIndex].subdir));
 			if(breakOnFirst) {
 				// Found a match, search no more
 				break;
@@ -555,11 +555,37 @@ void ADLSearchManager::prepareDestinationDirectories(DestDirList& destDirVector,
 	}
 }
 
+namespace {
+
+/** Puts the collected children into their parents, one range insert per parent */
+template<typename T, typename Set>
+void insertGrouped(vector<pair<DirectoryListing::Directory*, T>>& entries, Set DirectoryListing::Directory::*children) {
+	typedef pair<DirectoryListing::Directory*, T> Entry;
+	std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+		return std::less<DirectoryListing::Directory*>()(a.first, b.first);
+	});
+
+	vector<T> group;
+	for(auto i = entries.begin(); i != entries.end();) {
+		auto parent = i->first;
+		group.clear();
+		for(; i != entries.end() && i->first == parent; ++i)
+			group.push_back(i->second);
+		(parent->*children).insert(group.begin(), group.end());
+	}
+	entries.clear();
+}
+
+}
+
 void ADLSearchManager::finalizeDestinationDirectories(DestDirList& destDirVector, DirectoryListing::Directory* root) {
 	string szDiscard("<<<" + STRING(ADLS_DISCARD) + ">>>");
 
 	// Add non-empty destination directories to the top level
 	for(vector<DestDir>::iterator id = destDirVector.begin(); id != destDirVector.end(); ++id) {
+		insertGrouped(id->directories, &DirectoryListing::Directory::directories);
+		insertGrouped(id->files, &DirectoryListing::Directory::files);
+
 		if(id->dir->files.size() == 0 && id->dir->directories.size() == 0) {
 			delete (id->dir);
 		} else if(stricmp(id->dir->getName(), szDiscard) == 0) {
@@ -144,6 +144,9 @@ public:
 		DirectoryListing::Directory* dir;
 		DirectoryListing::Directory* subdir;
 		bool fileAdded;
+		/** Copies waiting to be put into their parents, the sorted arrays take them in bulk when matching is done */
+		vector<pair<DirectoryListing::Directory*, DirectoryListing::File*>> files;
+		vector<pair<DirectoryListing::Directory*, DirectoryListing::Directory*>> directories;
 		DestDir() : name(""), dir(NULL), subdir(NULL) {}
 	};
 	typedef vector<DestDir> DestDirList;
@@ -86,6 +86,8 @@ OnlineUser& AdcHub::getUser(const uint32_t aSID, const CID& aCID) {
 		Lock l(cs);
 		ou = users.insert(make_pair(aSID, new OnlineUser(p, *this, aSID))).first->second;
 		ou->inc();
+		// a CID back under a new SID before the old one quit: the newest is the one to find
+		cids[p->getCID()] = ou;
 	}
 
 	if(aSID != AdcCommand::HUB_SID)
@@ -101,12 +103,8 @@ OnlineUser* AdcHub::findUser(const uint32_t aSID) const {
 
 OnlineUser* AdcHub::findUser(const CID& aCID) const {
 	Lock l(cs);
-	for(SIDMap::const_iterator i = users.begin(); i != users.end(); ++i) {
-		if(i->second->getUser()->getCID() == aCID) {
-			return i->second;
-		}
-	}
-	return 0;
+	CIDMap::const_iterator i = cids.find(aCID);
+	return i == cids.end() ? NULL : i->second;
 }
 
 void AdcHub::putUser(const uint32_t aSID, bool disconnect) {
@@ -119,6 +117,10 @@ void AdcHub::putUser(const uint32_t aSID, bool disconnect) {
 		ou = i->second;
 		users.erase(i);
 
+		CIDMap::iterator j = cids.find(ou->getUser()->getCID());
+		if(j != cids.end() && j->second == ou)
+			cids.erase(j);
+
 		availableBytes -= ou->getIdentity().getBytesShared();
 	}
 
@@ -134,6 +136,7 @@ void AdcHub::clearUsers() {
 	{
 		Lock l(cs);
 		users.swap(tmp);
+		cids.clear();
 		availableBytes = 0;
 	}
 
@@ -182,12 +185,14 @@ void AdcHub::handle(AdcCommand::INF, AdcCommand& c) noexcept {
 		if(i->length() < 2)
 			continue;
 
-		if(i->substr(0, 2) == "SS") {
+		// set straight from the parameter, the login burst has many of them
+		const char* name = i->c_str();
+		if(i->compare(0, 2, "SS") == 0) {
 			availableBytes -= u->getIdentity().getBytesShared();
-			u->getIdentity().setBytesShared(i->substr(2));
+			u->getIdentity().set(name, name + 2, i->length() - 2);
 			availableBytes += u->getIdentity().getBytesShared();
 		} else {
-			u->getIdentity().set(i->c_str(), i->substr(2));
+			u->getIdentity().set(name, name + 2, i->length() - 2);
 		}
 	}
 
@@ -289,11 +294,11 @@ void AdcHub::handle(AdcCommand::MSG, AdcCommand& c) noexcept {
 			return;
 
 		auto replyTo = findUser(AdcCommand::toSID(temp));
-		if(!replyTo || PluginManager::getInstance()->runHook(HOOK_CHAT_PM_IN, replyTo, message.text))
+		if(!replyTo || PluginManager::getInstance()->runHook(PluginManager::CHAT_PM_IN, replyTo, message.text))
 			return;
 
 		message.replyTo = replyTo;
-	} else if(PluginManager::getInstance()->runHook(HOOK_CHAT_IN, this, message.text))
+	} else if(PluginManager::getInstance()->runHook(PluginManager::CHAT_IN, this, message.text))
 		return;
 
 	message.thirdPerson = (c.hasFlag("ME", 1) || strnicmp(message.text, "+me ", 4) == 0);
@@ -775,7 +780,7 @@ void AdcHub::hubMessage(const string& aMessage, bool thirdPerson) {
 	if(state != STATE_NORMAL)
 		return;
 
-	if(PluginManager::getInstance()->runHook(HOOK_CHAT_OUT, this, aMessage))
+	if(PluginManager::getInstance()->runHook(PluginManager::CHAT_OUT, this, aMessage))
 		return;
 
 	AdcCommand c(AdcCommand::CMD_MSG, AdcCommand::TYPE_BROADCAST);
@@ -1214,7 +1219,7 @@ void AdcHub::on(Line l, const string& aLine) noexcept {
 		return;
 	}
 
-	if(PluginManager::getInstance()->runHook(HOOK_NETWORK_HUB_IN, this, aLine))
+	if(PluginManager::getInstance()->runHook(PluginManager::NETWORK_HUB_IN, this, aLine))
 		return;
 
 	dispatch(aLine);
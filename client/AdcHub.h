@@ -90,6 +90,8 @@ private:
 	/** Map session id to OnlineUser */
 	typedef unordered_map<uint32_t, OnlineUser*> SIDMap;
 	typedef UserMap<true, SIDMap>::const_iterator SIDIter;
+	/** Secondary index of users, maintained along with it */
+	typedef unordered_map<CID, OnlineUser*> CIDMap;
 
 	void getUserList(OnlineUserList& list) const {
 		Lock l(cs);
@@ -103,6 +105,7 @@ private:
 	bool oldPassword;
 	Socket udp;
 	UserMap<true, SIDMap> users;
+	CIDMap cids;
 	StringMap lastInfoMap;
 
 	string salt;
@@ -22,7 +22,9 @@
 #include <algorithm>
 #include <boost/scoped_array.hpp>
 
+#include "DiskIoManager.h"
 #include "ResourceManager.h"
+#include "ScopedFunctor.h"
 #include "TimerManager.h"
 #include "SettingsManager.h"
 
@@ -285,7 +287,7 @@ void BufferedSocket::threadRead() {
 	}	
 }
 
-void BufferedSocket::threadSendFile(InputStream* file) {
+void BufferedSocket::threadSendFile(InputStream* file, const string& device) {
 	if(state != RUNNING)
 		return;
 	
@@ -298,41 +300,47 @@ void BufferedSocket::threadSendFile(InputStream* file) {
 	ByteVector readBuf(bufSize);
 	ByteVector writeBuf(bufSize);
 
-	size_t readPos = 0;
+	// the next buffer is read on the device's disk threads while the current one is being sent;
+	// without a device (memory streams) it is read right away, no queue is shared by all uploads
+	size_t bytesRead = 0, actual = 0;
+	auto read = [&] {
+		bytesRead = readBuf.size();
+		actual = file->read(&readBuf[0], bytesRead);
+	};
+	auto readAhead = [&]() -> DiskIoManager::OpPtr {
+		if(device.empty()) {
+			read();
+			return nullptr;
+		}
+		return DiskIoManager::getInstance()->submit(device, read);
+	};
+
+	auto pending = readAhead();
+	// the read must be over before the buffers and the stream go away
+	ScopedFunctor([&pending] { try { if(pending) pending->wait(); } catch(const Exception&) { } });
 
-	bool readDone = false;
 	dcdebug("Starting threadSend\n");
 	while(!disconnecting) {
-		if(!readDone && readBuf.size() > readPos) {
-			// Fill read buffer
-			size_t bytesRead = readBuf.size() - readPos;
-			size_t actual = file->read(&readBuf[readPos], bytesRead);
-
-			if(bytesRead > 0) {
-				fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
-			}
+		if(pending)
+			pending->wait();
 
-			if(actual == 0) {
-				readDone = true;
-			} else {
-				readPos += actual;
-			}
+		if(bytesRead > 0) {
+			fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
 		}
 
-		if(readDone && readPos == 0) {
+		if(actual == 0) {
 			fire(BufferedSocketListener::TransmitDone());
 			return;
 		}
 
 		readBuf.swap(writeBuf);
-		readBuf.resize(bufSize);
-		writeBuf.resize(readPos);
-		readPos = 0;
+		size_t writeLen = actual;
+		pending = readAhead();
 
 		size_t writePos = 0, writeSize = 0;
 		int written = 0;
 
-		while(writePos < writeBuf.size()) {
+		while(writePos < writeLen) {
 			if(disconnecting)
 				return;
 			
@@ -340,7 +348,7 @@ void BufferedSocket::threadSendFile(InputStream* file) {
 				// workaround for OpenSSL (crashes when previous write failed and now retrying with different writeSize)
 				written = sock->write(&writeBuf[writePos], writeSize);
 			} else {
-				writeSize = min(sockSize / 2, writeBuf.size() - writePos);	
+				writeSize = min(sockSize / 2, writeLen - writePos);	
 				written = ThrottleManager::getInstance()->write(sock.get(), &writeBuf[writePos], writeSize, getSuperUser());
 			}
 			
@@ -350,31 +358,18 @@ void BufferedSocket::threadSendFile(InputStream* file) {
 				fire(BufferedSocketListener::BytesSent(), 0, written);
 
 			} else if(written == -1) {
-				if(!readDone && readPos < readBuf.size()) {
-					// Read a little since we're blocking anyway...
-					size_t bytesRead = min(readBuf.size() - readPos, readBuf.size() / 2);
-					size_t actual = file->read(&readBuf[readPos], bytesRead);
-
-					if(bytesRead > 0) {
-						fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
+				while(!disconnecting) {
+					int w = sock->wait(POLL_TIMEOUT, Socket::WAIT_WRITE | Socket::WAIT_READ);
+					if(w & Socket::WAIT_READ) {
+						// incoming commands may end the upload, leave them the stream to themselves
+						if(pending)
+							pending->wait();
+						threadRead();
 					}
-
-					if(actual == 0) {
-						readDone = true;
-					} else {
-						readPos += actual;
-					}
-				} else {
-					while(!disconnecting) {
-						int w = sock->wait(POLL_TIMEOUT, Socket::WAIT_WRITE | Socket::WAIT_READ);
-						if(w & Socket::WAIT_READ) {
-							threadRead();
-						}
-						if(w & Socket::WAIT_WRITE) {
-							break;
-						}
+					if(w & Socket::WAIT_WRITE) {
+						break;
 					}
-				}	
+				}
 			}
 		}
 	}
@@ -456,7 +451,8 @@ bool BufferedSocket::checkEvents() {
 			if(p.first == SEND_DATA) {
 				threadSendData();
 			} else if(p.first == SEND_FILE) {
-				threadSendFile(static_cast<SendFileInfo*>(p.second.get())->stream); break;
+				SendFileInfo* sfi = static_cast<SendFileInfo*>(p.second.get());
+				threadSendFile(sfi->stream, sfi->device); break;
 			} else if(p.first == DISCONNECT) {
 				fail(STRING(DISCONNECTED));
 			} else {
@@ -102,7 +102,8 @@ public:
 	void write(const string& aData) { write(aData.data(), aData.length()); }
 	void write(const char* aBuf, size_t aLen) noexcept;
 	/** Send the file f over this socket. */
-	void transmitFile(InputStream* f) { Lock l(cs); addTask(SEND_FILE, new SendFileInfo(f)); }
+	/** Reads ahead on the disk queue of device, an empty one (memory or unknown) reads synchronously */
+	void transmitFile(InputStream* f, const string& device = Util::emptyString) { Lock l(cs); addTask(SEND_FILE, new SendFileInfo(f, device)); }
 
 	/** Send an updated signal to all listeners */
 	void updated() { Lock l(cs); addTask(UPDATED, 0); }
@@ -144,8 +145,9 @@ private:
 		bool proxy;
 	};
 	struct SendFileInfo : public TaskData {
-		SendFileInfo(InputStream* stream_) : stream(stream_) { }
+		SendFileInfo(InputStream* stream_, const string& device_) : stream(stream_), device(device_) { }
 		InputStream* stream;
+		string device;
 	};
 
 	BufferedSocket(char aSeparator);
@@ -177,7 +179,7 @@ private:
 	void threadConnect(const string& aAddr, uint16_t aPort, uint16_t localPort, NatRoles natRole, bool proxy);
 	void threadAccept();
 	void threadRead();
-	void threadSendFile(InputStream* is);
+	void threadSendFile(InputStream* is, const string& device);
 	void threadSendData();
 
 	void fail(const string& aError);	
@@ -39,9 +39,10 @@ void sendRawCommand(const HintedUser& aUser, const string& aRawCommand) {
 }
 
 void setListLength(const UserPtr& p, const string& listLen) {
-	Lock l(cs);
-	OnlineIterC i = onlineUsers.find(const_cast<CID*>(&p->getCID()));
-	if(i != onlineUsers.end()) {
+	Shard& s = getShard(p->getCID());
+	Lock l(s.cs);
+	OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&p->getCID()));
+	if(i != s.onlineUsers.end()) {
 		i->second->getIdentity().set("LL", listLen);
 	}
 }
@@ -52,8 +53,10 @@ void fileListDisconnected(const UserPtr& p) {
 	Client* c = NULL;
 	{
 		Lock l(cs);
-		OnlineIterC i = onlineUsers.find(const_cast<CID*>(&p->getCID()));
-		if(i != onlineUsers.end() && i->second->getClientBase().type != ClientBase::DHT) {
+		Shard& s = getShard(p->getCID());
+		Lock sl(s.cs);
+		OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&p->getCID()));
+		if(i != s.onlineUsers.end() && i->second->getClientBase().type != ClientBase::DHT) {
 			OnlineUser& ou = *i->second;
 	
 			int fileListDisconnects = Util::toInt(ou.getIdentity().get("FD")) + 1;
@@ -87,8 +90,10 @@ void connectionTimeout(const UserPtr& p) {
 	Client* c = NULL;
 	{
 		Lock l(cs);
-		OnlineIterC i = onlineUsers.find(const_cast<CID*>(&p->getCID()));
-		if(i != onlineUsers.end() && i->second->getClientBase().type != ClientBase::DHT) {
+		Shard& s = getShard(p->getCID());
+		Lock sl(s.cs);
+		OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&p->getCID()));
+		if(i != s.onlineUsers.end() && i->second->getClientBase().type != ClientBase::DHT) {
 			OnlineUser& ou = *i->second;
 	
 			int connectionTimeouts = Util::toInt(ou.getIdentity().get("TO")) + 1;
@@ -122,9 +127,11 @@ void checkCheating(const UserPtr& p, DirectoryListing* dl) {
 	OnlineUserPtr ou = NULL;
 	{
 		Lock l(cs);
+		Shard& s = getShard(p->getCID());
+		Lock sl(s.cs);
 
-		OnlineIterC i = onlineUsers.find(const_cast<CID*>(&p->getCID()));
-		if(i == onlineUsers.end() || i->second->getClientBase().type == ClientBase::DHT)
+		OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&p->getCID()));
+		if(i == s.onlineUsers.end() || i->second->getClientBase().type == ClientBase::DHT)
 			return;
 
 		ou = i->second;
@@ -211,8 +218,10 @@ void setClientStatus(const UserPtr& p, const string& aCheatString, const int aRa
 	string report = Util::emptyString;
 	{
 		Lock l(cs);
-		OnlineIterC i = onlineUsers.find(const_cast<CID*>(&p->getCID()));
-		if(i == onlineUsers.end() || i->second->getClientBase().type == ClientBase::DHT) 
+		Shard& s = getShard(p->getCID());
+		Lock sl(s.cs);
+		OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&p->getCID()));
+		if(i == s.onlineUsers.end() || i->second->getClientBase().type == ClientBase::DHT) 
 			return;
 		
 		ou = i->second;
@@ -230,9 +239,10 @@ void setClientStatus(const UserPtr& p, const string& aCheatString, const int aRa
 }
 
 void setListSize(const UserPtr& p, int64_t aFileLength) {
-	Lock l(cs);
-	OnlineIterC i = onlineUsers.find(const_cast<CID*>(&p->getCID()));
-	if(i == onlineUsers.end()) return;
+	Shard& s = getShard(p->getCID());
+	Lock l(s.cs);
+	OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&p->getCID()));
+	if(i == s.onlineUsers.end()) return;
 	i->second->getIdentity().set("LS", Util::toString(aFileLength));
 }
 
@@ -251,33 +261,37 @@ void toggleChecks(bool aState) {
 }
 
 void setPkLock(const UserPtr& p, const string& aPk, const string& aLock) {
-	Lock l(cs);
-	OnlineIterC i = onlineUsers.find(const_cast<CID*>(&p->getCID()));
-	if(i == onlineUsers.end()) return;
+	Shard& s = getShard(p->getCID());
+	Lock l(s.cs);
+	OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&p->getCID()));
+	if(i == s.onlineUsers.end()) return;
 	
 	i->second->getIdentity().set("PK", aPk);
 	i->second->getIdentity().set("LO", aLock);
 }
 
 void setSupports(const UserPtr& p, const string& aSupports) {
-	Lock l(cs);
-	OnlineIterC i = onlineUsers.find(const_cast<CID*>(&p->getCID()));
-	if(i == onlineUsers.end()) return;
+	Shard& s = getShard(p->getCID());
+	Lock l(s.cs);
+	OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&p->getCID()));
+	if(i == s.onlineUsers.end()) return;
 	
 	i->second->getIdentity().set("SU", aSupports);
 }
 
 void setGenerator(const UserPtr& p, const string& aGenerator) {
-	Lock l(cs);
-	OnlineIterC i = onlineUsers.find(const_cast<CID*>(&p->getCID()));
-	if(i == onlineUsers.end()) return;
+	Shard& s = getShard(p->getCID());
+	Lock l(s.cs);
+	OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&p->getCID()));
+	if(i == s.onlineUsers.end()) return;
 	i->second->getIdentity().set("GE", aGenerator);
 }
 
 void setUnknownCommand(const UserPtr& p, const string& aUnknownCommand) {
-	Lock l(cs);
-	OnlineIterC i = onlineUsers.find(const_cast<CID*>(&p->getCID()));
-	if(i == onlineUsers.end()) return;
+	Shard& s = getShard(p->getCID());
+	Lock l(s.cs);
+	OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&p->getCID()));
+	if(i == s.onlineUsers.end()) return;
 	i->second->getIdentity().set("UC", aUnknownCommand);
 }
 
@@ -287,7 +301,7 @@ void reportUser(const HintedUser& user) {
 
 	{
 		Lock l(cs);
-		OnlineUser* ou = findOnlineUser(user.user->getCID(), user.hint, priv);
+		OnlineUserPtr ou = findOnlineUser(user.user->getCID(), user.hint, priv);
 		if(!ou || ou->getClientBase().type == ClientBase::DHT) 
 			return;
 
@@ -190,7 +190,7 @@ void Client::send(const char* aMessage, size_t aLen) {
 	if(!isReady())
 		return;
 
-	if(PluginManager::getInstance()->runHook(HOOK_NETWORK_HUB_OUT, this, aMessage))
+	if(PluginManager::getInstance()->runHook(PluginManager::NETWORK_HUB_OUT, this, aMessage))
 		return;
 
 	updateActivity();
@@ -68,6 +68,7 @@ void ClientManager::putClient(Client* aClient) {
 	{
 		Lock l(cs);
 		clients.erase(const_cast<string*>(&aClient->getHubUrl()));
+		removeHubIp(aClient);
 	}
 	aClient->shutdown();
 	delete aClient;
@@ -86,15 +87,16 @@ StringList ClientManager::getNicks(const CID& cid, const string& hintUrl) const
 }
 
 StringList ClientManager::getHubs(const CID& cid, const string& hintUrl, bool priv) const {
-	Lock l(cs);
+	Shard& s = getShard(cid);
+	Lock l(s.cs);
 	StringList lst;
 	if(!priv) {
-		OnlinePairC op = onlineUsers.equal_range(const_cast<CID*>(&cid));
+		OnlinePairC op = s.onlineUsers.equal_range(const_cast<CID*>(&cid));
 		for(OnlineIterC i = op.first; i != op.second; ++i) {
 			lst.push_back(i->second->getClientBase().getHubUrl());
 		}
 	} else {
-		OnlineUser* u = findOnlineUserHint(cid, hintUrl);
+		OnlineUser* u = findOnlineUserHint(s, cid, hintUrl);
 		if(u)
 			lst.push_back(u->getClientBase().getHubUrl());
 	}
@@ -102,15 +104,16 @@ StringList ClientManager::getHubs(const CID& cid, const string& hintUrl, bool pr
 }
 
 StringList ClientManager::getHubNames(const CID& cid, const string& hintUrl, bool priv) const {
-	Lock l(cs);
+	Shard& s = getShard(cid);
+	Lock l(s.cs);
 	StringList lst;
 	if(!priv) {
-		OnlinePairC op = onlineUsers.equal_range(const_cast<CID*>(&cid));
+		OnlinePairC op = s.onlineUsers.equal_range(const_cast<CID*>(&cid));
 		for(OnlineIterC i = op.first; i != op.second; ++i) {
 			lst.push_back(i->second->getClientBase().getHubName());		
 		}
 	} else {
-		OnlineUser* u = findOnlineUserHint(cid, hintUrl);
+		OnlineUser* u = findOnlineUserHint(s, cid, hintUrl);
 		if(u)
 			lst.push_back(u->getClientBase().getHubName());
 	}
@@ -118,24 +121,25 @@ StringList ClientManager::getHubNames(const CID& cid, const string& hintUrl, boo
 }
 
 StringList ClientManager::getNicks(const CID& cid, const string& hintUrl, bool priv) const {
-	Lock l(cs);
+	Shard& s = getShard(cid);
+	Lock l(s.cs);
 	StringSet ret;
 
 	if(!priv) {
-		OnlinePairC op = onlineUsers.equal_range(const_cast<CID*>(&cid));
+		OnlinePairC op = s.onlineUsers.equal_range(const_cast<CID*>(&cid));
 		for(OnlineIterC i = op.first; i != op.second; ++i) {
 			ret.insert(i->second->getIdentity().getNick());
 		}
 	} else {
-		OnlineUser* u = findOnlineUserHint(cid, hintUrl);
+		OnlineUser* u = findOnlineUserHint(s, cid, hintUrl);
 		if(u)
 			ret.insert(u->getIdentity().getNick());
 	}
 
 	if(ret.empty()) {
 		// offline
-		NickMap::const_iterator i = nicks.find(const_cast<CID*>(&cid));
-		if(i != nicks.end()) {
+		NickMap::const_iterator i = s.nicks.find(const_cast<CID*>(&cid));
+		if(i != s.nicks.end()) {
 			ret.insert(i->second);
 		} else {
 			ret.insert('{' + cid.toBase32() + '}');
@@ -146,10 +150,11 @@ StringList ClientManager::getNicks(const CID& cid, const string& hintUrl, bool p
 }
 
 string ClientManager::getField(const CID& cid, const string& hint, const char* field) const {
-	Lock l(cs);
+	Shard& s = getShard(cid);
+	Lock l(s.cs);
 
 	OnlinePairC p;
-	auto u = findOnlineUserHint(cid, hint, p);
+	auto u = findOnlineUserHint(s, cid, hint, p);
 	if(u) {
 		auto value = u->getIdentity().get(field);
 		if(!value.empty()) {
@@ -168,10 +173,11 @@ string ClientManager::getField(const CID& cid, const string& hint, const char* f
 }
 
 string ClientManager::getConnection(const CID& cid, int64_t& numeric) const {
-	Lock l(cs);
+	Shard& s = getShard(cid);
+	Lock l(s.cs);
 	numeric = -1;
-	OnlineIterC i = onlineUsers.find(const_cast<CID*>(&cid));
-	if(i != onlineUsers.end()) {
+	OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&cid));
+	if(i != s.onlineUsers.end()) {
 		numeric = i->second->getIdentity().getConnectionSpeed();
 		if(numeric == -1) {
 			return i->second->getIdentity().getConnection();
@@ -188,26 +194,36 @@ bool ClientManager::isConnected(const string& aUrl) const {
 }
 
 string ClientManager::findHub(const string& ipPort) const {
+	auto ipPortPair = NmdcHub::parseIpPort(ipPort);
+	uint16_t port = static_cast<uint16_t>(Util::toInt(ipPortPair.second));
+
 	Lock l(cs);
 
 	string url;
-	for(auto i = clients.cbegin(); i != clients.cend(); ++i) {
+	auto p = hubIps.equal_range(ipPortPair.first);
+	for(auto i = p.first; i != p.second; ++i) {
 		const Client* c = i->second;
-		auto ipPortPair = NmdcHub::parseIpPort(ipPort);
 
-		if(c->getIp() == ipPortPair.first) {
-			// If exact match is found, return it
-			if(c->getPort() == Util::toInt(ipPortPair.second))
-				return c->getHubUrl();
+		// If exact match is found, return it
+		if(c->getPort() == port)
+			return c->getHubUrl();
 
-			// Port is not always correct, so use this as a best guess...
-			url = c->getHubUrl();
-		}
+		// Port is not always correct, so use this as a best guess...
+		url = c->getHubUrl();
 	}
 
 	return url;
 }
 
+void ClientManager::removeHubIp(const Client* c) {
+	for(auto i = hubIps.begin(); i != hubIps.end(); ) {
+		if(i->second == c)
+			i = hubIps.erase(i);
+		else
+			++i;
+	}
+}
+
 const string& ClientManager::findHubEncoding(const string& aUrl) const {
 	Lock l(cs);
 
@@ -222,13 +238,13 @@ UserPtr ClientManager::findLegacyUser(const string& aNick) const noexcept {
 	if (aNick.empty())
 		return UserPtr();
 
-	Lock l(cs);
-
-	// this be slower now, but it's not called so often
-	for(NickMap::const_iterator i = nicks.begin(); i != nicks.end(); ++i) {
-		if(stricmp(i->second, aNick) == 0) {
-			UserMap::const_iterator u = users.find(i->first);
-			if(u != users.end() && u->second->getCID() == *i->first)
+	string nick = Text::toLower(aNick);
+	for(auto& s: shards) {
+		Lock l(s.cs);
+		auto p = s.legacyNicks.equal_range(nick);
+		for(auto i = p.first; i != p.second; ++i) {
+			UserMap::const_iterator u = s.users.find(i->second);
+			if(u != s.users.end())
 				return u->second;
 		}
 	}
@@ -237,30 +253,32 @@ UserPtr ClientManager::findLegacyUser(const string& aNick) const noexcept {
 
 UserPtr ClientManager::getUser(const string& aNick, const string& aHubUrl) noexcept {
 	CID cid = makeCid(aNick, aHubUrl);
-	Lock l(cs);
+	Shard& s = getShard(cid);
+	Lock l(s.cs);
 
-	UserMap::const_iterator ui = users.find(const_cast<CID*>(&cid));
-	if(ui != users.end()) {
+	UserMap::const_iterator ui = s.users.find(const_cast<CID*>(&cid));
+	if(ui != s.users.end()) {
 		ui->second->setFlag(User::NMDC);
 		return ui->second;
 	}
 
 	UserPtr p(new User(cid));
 	p->setFlag(User::NMDC);
-	users.insert(make_pair(const_cast<CID*>(&p->getCID()), p));
+	s.users.insert(make_pair(const_cast<CID*>(&p->getCID()), p));
 
 	return p;
 }
 
 UserPtr ClientManager::getUser(const CID& cid) noexcept {
-	Lock l(cs);
-	UserMap::const_iterator ui = users.find(const_cast<CID*>(&cid));
-	if(ui != users.end()) {
+	Shard& s = getShard(cid);
+	Lock l(s.cs);
+	UserMap::const_iterator ui = s.users.find(const_cast<CID*>(&cid));
+	if(ui != s.users.end()) {
 		return ui->second;
 	}
 
 	UserPtr p(new User(cid));
-	users.insert(make_pair(const_cast<CID*>(&p->getCID()), p));
+	s.users.insert(make_pair(const_cast<CID*>(&p->getCID()), p));
 	return p;
 }
 
@@ -268,16 +286,17 @@ Client* ClientManager::getUserClient(const HintedUser& user) {
 	bool priv = FavoriteManager::getInstance()->isPrivate(user.hint);
 
 	Lock l(cs);
-	OnlineUser* u = findOnlineUser(user.user->getCID(), user.hint, priv);
+	OnlineUserPtr u = findOnlineUser(user.user->getCID(), user.hint, priv);
 	if(!u) return NULL;
 
 	return (&u->getClient());
 }
 
 UserPtr ClientManager::findUser(const CID& cid) const noexcept {
-	Lock l(cs);
-	UserMap::const_iterator ui = users.find(const_cast<CID*>(&cid));
-	if(ui != users.end()) {
+	Shard& s = getShard(cid);
+	Lock l(s.cs);
+	UserMap::const_iterator ui = s.users.find(const_cast<CID*>(&cid));
+	if(ui != s.users.end()) {
 		return ui->second;
 	}
 	return 0;
@@ -285,8 +304,9 @@ UserPtr ClientManager::findUser(const CID& cid) const noexcept {
 
 // deprecated
 bool ClientManager::isOp(const UserPtr& user, const string& aHubUrl) const {
-	Lock l(cs);
-	OnlinePairC p = onlineUsers.equal_range(const_cast<CID*>(&user->getCID()));
+	Shard& s = getShard(user->getCID());
+	Lock l(s.cs);
+	OnlinePairC p = s.onlineUsers.equal_range(const_cast<CID*>(&user->getCID()));
 	for(OnlineIterC i = p.first; i != p.second; ++i) {
 		if(i->second->getClient().getHubUrl() == aHubUrl) {
 			return i->second->getIdentity().isOp();
@@ -316,8 +336,9 @@ CID ClientManager::makeCid(const string& aNick, const string& aHubUrl) const noe
 
 void ClientManager::putOnline(OnlineUser* ou) noexcept {
 	{
-		Lock l(cs);
-		onlineUsers.insert(make_pair(const_cast<CID*>(&ou->getUser()->getCID()), ou));
+		Shard& s = getShard(ou->getUser()->getCID());
+		Lock l(s.cs);
+		s.onlineUsers.insert(make_pair(const_cast<CID*>(&ou->getUser()->getCID()), ou));
 	}
 	
 	if(!ou->getUser()->isOnline()) {
@@ -330,14 +351,15 @@ void ClientManager::putOnline(OnlineUser* ou) noexcept {
 void ClientManager::putOffline(OnlineUser* ou, bool disconnect) noexcept {
 	bool lastUser = false;
 	{
-		Lock l(cs);
-		OnlinePair op = onlineUsers.equal_range(const_cast<CID*>(&ou->getUser()->getCID()));
+		Shard& s = getShard(ou->getUser()->getCID());
+		Lock l(s.cs);
+		OnlinePair op = s.onlineUsers.equal_range(const_cast<CID*>(&ou->getUser()->getCID()));
 		dcassert(op.first != op.second);
 		for(OnlineIter i = op.first; i != op.second; ++i) {
 			OnlineUser* ou2 = i->second;
 			if(ou == ou2) {
 				lastUser = (distance(op.first, op.second) == 1);
-				onlineUsers.erase(i);
+				s.onlineUsers.erase(i);
 				break;
 			}
 		}
@@ -353,8 +375,8 @@ void ClientManager::putOffline(OnlineUser* ou, bool disconnect) noexcept {
 	}
 }
 
-OnlineUser* ClientManager::findOnlineUserHint(const CID& cid, const string& hintUrl, OnlinePairC& p) const {
-	p = onlineUsers.equal_range(const_cast<CID*>(&cid));
+OnlineUser* ClientManager::findOnlineUserHint(const Shard& s, const CID& cid, const string& hintUrl, OnlinePairC& p) {
+	p = s.onlineUsers.equal_range(const_cast<CID*>(&cid));
 	if(p.first == p.second) // no user found with the given CID.
 		return 0;
 
@@ -370,32 +392,45 @@ OnlineUser* ClientManager::findOnlineUserHint(const CID& cid, const string& hint
 	return 0;
 }
 
-OnlineUser* ClientManager::findOnlineUser(const HintedUser& user, bool priv) const {
+OnlineUserPtr ClientManager::findOnlineUser(const HintedUser& user, bool priv) const {
 	return findOnlineUser(user.user->getCID(), user.hint, priv);
 }
 
-OnlineUser* ClientManager::findOnlineUser(const CID& cid, const string& hintUrl, bool priv) const {
+OnlineUserPtr ClientManager::findOnlineUser(const CID& cid, const string& hintUrl, bool priv) const {
+	Shard& s = getShard(cid);
+	Lock l(s.cs);
+
 	OnlinePairC p;
-	OnlineUser* u = findOnlineUserHint(cid, hintUrl, p);
-	if(u) // found an exact match (CID + hint).
-		return u;
+	OnlineUser* u = findOnlineUserHint(s, cid, hintUrl, p);
+	if(!u) {
+		if(p.first == p.second) // no user found with the given CID.
+			return 0;
 
-	if(p.first == p.second) // no user found with the given CID.
-		return 0;
+		// if the hint hub is private, don't allow connecting to the same user from another hub.
+		if(priv)
+			return 0;
 
-	// if the hint hub is private, don't allow connecting to the same user from another hub.
-	if(priv)
-		return 0;
+		// ok, hub not private, return a random user that matches the given CID but not the hint.
+		u = p.first->second;
+	}
 
-	// ok, hub not private, return a random user that matches the given CID but not the hint.
-	return p.first->second;
+	// the hub may be on its way out already, once it's out of clients nothing keeps it alive
+	return hasClient(*u) ? u : 0;
+}
+
+bool ClientManager::hasClient(const OnlineUser& ou) const {
+	if(ou.getClientBase().type == ClientBase::DHT)
+		return true;
+
+	auto i = clients.find(const_cast<string*>(&ou.getClientBase().getHubUrl()));
+	return i != clients.end() && i->second == &ou.getClient();
 }
 
 void ClientManager::connect(const HintedUser& user, const string& token) {
 	bool priv = FavoriteManager::getInstance()->isPrivate(user.hint);
 
 	Lock l(cs);
-	OnlineUser* u = findOnlineUser(user, priv);
+	OnlineUserPtr u = findOnlineUser(user, priv);
 
 	if(u) {
 		u->getClientBase().connect(*u, token);
@@ -406,9 +441,9 @@ void ClientManager::privateMessage(const HintedUser& user, const string& msg, bo
 	bool priv = FavoriteManager::getInstance()->isPrivate(user.hint);
 
 	Lock l(cs);
-	OnlineUser* u = findOnlineUser(user, priv);
+	OnlineUserPtr u = findOnlineUser(user, priv);
 	
-	if(u && !PluginManager::getInstance()->runHook(HOOK_CHAT_PM_OUT, u, msg)) {
+	if(u && !PluginManager::getInstance()->runHook(PluginManager::CHAT_PM_OUT, u.get(), msg)) {
 		u->getClientBase().privateMessage(u, msg, thirdPerson);
 	}
 }
@@ -420,7 +455,7 @@ void ClientManager::userCommand(const HintedUser& user, const UserCommand& uc, S
 	 * SearchManager::onRES(const AdcCommand& cmd, ...). when that is done, and SearchResults are
 	 * switched to storing only reliable HintedUsers (found with the token of the ADC command),
 	 * change this call to findOnlineUserHint. */
-	OnlineUser* ou = findOnlineUser(user.user->getCID(), user.hint.empty() ? uc.getHub() : user.hint, false);
+	OnlineUserPtr ou = findOnlineUser(user.user->getCID(), user.hint.empty() ? uc.getHub() : user.hint, false);
 	if(!ou || ou->getClientBase().type == ClientBase::DHT)
 		return;
 
@@ -436,20 +471,39 @@ void ClientManager::userCommand(const HintedUser& user, const UserCommand& uc, S
 }
 
 void ClientManager::send(AdcCommand& cmd, const CID& cid) {
-	Lock l(cs);
-	OnlineIterC i = onlineUsers.find(const_cast<CID*>(&cid));
-	if(i != onlineUsers.end()) {
+	bool udp = true;
+	string ip, port;
+	{
+		Shard& s = getShard(cid);
+		Lock l(s.cs);
+		OnlineIterC i = s.onlineUsers.find(const_cast<CID*>(&cid));
+		if(i == s.onlineUsers.end())
+			return;
+
 		OnlineUser& u = *i->second;
 		if(cmd.getType() == AdcCommand::TYPE_UDP && !u.getIdentity().isUdpActive()) {
 			if(u.getUser()->isNMDC() || u.getClientBase().getType() == Client::DHT)
 				return;
-			cmd.setType(AdcCommand::TYPE_DIRECT);
-			cmd.setTo(u.getIdentity().getSID());
-			u.getClient().send(cmd);
+			udp = false;
 		} else {
-			sendUDP(u.getIdentity().getIp(), u.getIdentity().getUdpPort(), cmd.toString(getMe()->getCID()));
+			ip = u.getIdentity().getIp();
+			port = u.getIdentity().getUdpPort();
 		}
 	}
+
+	if(udp) {
+		sendUDP(ip, port, cmd.toString(getMe()->getCID()));
+		return;
+	}
+
+	// passive, through the hub
+	Lock l(cs);
+	OnlineUserPtr u = findOnlineUser(cid, Util::emptyString, false);
+	if(u && u->getClientBase().getType() != Client::DHT) {
+		cmd.setType(AdcCommand::TYPE_DIRECT);
+		cmd.setTo(u->getIdentity().getSID());
+		u->getClient().send(cmd);
+	}
 }
 
 void ClientManager::sendUDP(const string& ip, const string& port, const string& data) {
@@ -533,9 +587,10 @@ void ClientManager::on(NmdcSearch, Client* aClient, const string& aSeeker, int a
 void ClientManager::on(AdcSearch, const Client* c, const AdcCommand& adc, const CID& from) noexcept {
 	bool isUdpActive = false;
 	{
-		Lock l(cs);
+		Shard& s = getShard(from);
+		Lock l(s.cs);
 		
-		OnlinePairC op = onlineUsers.equal_range(const_cast<CID*>(&from));
+		OnlinePairC op = s.onlineUsers.equal_range(const_cast<CID*>(&from));
 		for(OnlineIterC i = op.first; i != op.second; ++i) {
 			const OnlineUserPtr& u = i->second;
 			if(&u->getClient() == c)
@@ -584,20 +639,25 @@ uint64_t ClientManager::search(StringList& who, int aSizeMode, int64_t aSize, in
 }
 
 void ClientManager::on(TimerManagerListener::Minute, uint64_t /*aTick*/) noexcept {
-	Lock l(cs);
-
-	// Collect some garbage...
-	UserIter i = users.begin();
-	while(i != users.end()) {
-		if(i->second->unique()) {
-			NickMap::iterator n = nicks.find(const_cast<CID*>(&i->second->getCID()));
-			if(n != nicks.end()) nicks.erase(n);
-			users.erase(i++);
-		} else {
-			++i;
+	// Collect some garbage, a shard at a time so that hubs can go on meanwhile
+	for(auto& s: shards) {
+		Lock l(s.cs);
+		UserIter i = s.users.begin();
+		while(i != s.users.end()) {
+			if(i->second->unique()) {
+				NickMap::iterator n = s.nicks.find(const_cast<CID*>(&i->second->getCID()));
+				if(n != s.nicks.end()) {
+					removeLegacyNick(s, n->second, n->first);
+					s.nicks.erase(n);
+				}
+				s.users.erase(i++);
+			} else {
+				++i;
+			}
 		}
 	}
 
+	Lock l(cs);
 	for(auto j = clients.cbegin(); j != clients.cend(); ++j) {
 		j->second->info(false);
 	}
@@ -607,8 +667,7 @@ UserPtr& ClientManager::getMe() {
 	if(!me) {
 		Lock l(cs);
 		if(!me) {
-			me = new User(getMyCID());
-			users.insert(make_pair(const_cast<CID*>(&me->getCID()), me));
+			me = getUser(getMyCID());
 		}
 	}
 	return me;
@@ -632,12 +691,28 @@ void ClientManager::updateNick(const OnlineUser& user) noexcept {
 
 void ClientManager::updateNick(const UserPtr& user, const string& nick) noexcept {
 	if(!nick.empty()) {
-		Lock l(cs);
-		auto i = nicks.find(const_cast<CID*>(&user->getCID()));
-		if(i == nicks.end()) {
-			nicks[const_cast<CID*>(&user->getCID())] = nick;
-		} else {
+		CID* cid = const_cast<CID*>(&user->getCID());
+		Shard& s = getShard(*cid);
+		Lock l(s.cs);
+		auto i = s.nicks.find(cid);
+		if(i == s.nicks.end()) {
+			s.nicks[cid] = nick;
+		} else if(i->second != nick) {
+			removeLegacyNick(s, i->second, cid);
 			i->second = nick;
+		} else {
+			return;
+		}
+		s.legacyNicks.insert(make_pair(Text::toLower(nick), cid));
+	}
+}
+
+void ClientManager::removeLegacyNick(Shard& s, const string& nick, const CID* cid) {
+	auto p = s.legacyNicks.equal_range(Text::toLower(nick));
+	for(auto i = p.first; i != p.second; ++i) {
+		if(*i->second == *cid) {
+			s.legacyNicks.erase(i);
+			return;
 		}
 	}
 }
@@ -685,9 +760,10 @@ void ClientManager::cancelSearch(void* aOwner) {
 
 OnlineUserPtr ClientManager::findDHTNode(const CID& cid) const
 {
-	Lock l(cs);
+	Shard& s = getShard(cid);
+	Lock l(s.cs);
 	
-	OnlinePairC op = onlineUsers.equal_range(const_cast<CID*>(&cid));
+	OnlinePairC op = s.onlineUsers.equal_range(const_cast<CID*>(&cid));
 	for(OnlineIterC i = op.first; i != op.second; ++i) {
 		OnlineUser* ou = i->second;
 		
@@ -703,6 +779,12 @@ OnlineUserPtr ClientManager::findDHTNode(const CID& cid) const
 }
 
 void ClientManager::on(Connected, const Client* c) noexcept {
+	{
+		// the address is only known now and changes with every reconnect
+		Lock l(cs);
+		removeHubIp(c);
+		hubIps.insert(make_pair(c->getIp(), const_cast<Client*>(c)));
+	}
 	fire(ClientManagerListener::ClientConnected(), c);
 }
 
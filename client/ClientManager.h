@@ -94,11 +94,12 @@ public:
 	const string& findHubEncoding(const string& aUrl) const;
 
 	/**
+	* Call with lock() held, it keeps the user's hub from being deleted.
 	* @param priv discard any user that doesn't match the hint.
-	* @return OnlineUser* found by CID and hint; might be only by CID if priv is false.
+	* @return OnlineUser found by CID and hint; might be only by CID if priv is false.
 	*/
-	OnlineUser* findOnlineUser(const HintedUser& user, bool priv) const;
-	OnlineUser* findOnlineUser(const CID& cid, const string& hintUrl, bool priv) const;
+	OnlineUserPtr findOnlineUser(const HintedUser& user, bool priv) const;
+	OnlineUserPtr findOnlineUser(const CID& cid, const string& hintUrl, bool priv) const;
 
 	UserPtr findUser(const string& aNick, const string& aHubUrl) const noexcept { return findUser(makeCid(aNick, aHubUrl)); }
 	UserPtr findUser(const CID& cid) const noexcept;
@@ -111,8 +112,9 @@ public:
 		if(IP.empty())
 			return;
 			
-		Lock l(cs);
-		OnlinePairC p = onlineUsers.equal_range(const_cast<CID*>(&user->getCID()));
+		Shard& s = getShard(user->getCID());
+		Lock l(s.cs);
+		OnlinePairC p = s.onlineUsers.equal_range(const_cast<CID*>(&user->getCID()));
 		for (OnlineIterC i = p.first; i != p.second; i++) {
 			i->second->getIdentity().setIp(IP);
 			if(udpPort > 0)
@@ -121,8 +123,9 @@ public:
 	}
 	
 	bool isSharingHub(const HintedUser& p) {
-		Lock l(cs);
-		OnlineUser* u = findOnlineUserHint(p.user->getCID(), p.hint);
+		Shard& s = getShard(p.user->getCID());
+		Lock l(s.cs);
+		OnlineUser* u = findOnlineUserHint(s, p.user->getCID(), p.hint);
 		if(u && !u->getUser()->isSet(User::DHT))
 			return (!u->getClient().getHideShare());
 		return true;
@@ -148,12 +151,11 @@ public:
 	int getMode(const string& aHubUrl) const;
 	bool isActive(const string& aHubUrl = Util::emptyString) const { return getMode(aHubUrl) != SettingsManager::INCOMING_FIREWALL_PASSIVE; }
 
+	/** Holds the hub list, see findOnlineUser */
 	Lock lock() { return Lock(cs); }
 
 	const ClientList& getClients() const { return clients; }
 
-	const UserMap& getUsers() const { return users; }
-
 	CID getMyCID();
 	const CID& getMyPID();
 	
@@ -166,6 +168,8 @@ private:
 	typedef UserMap::iterator UserIter;
 
 	typedef unordered_map<CID*, std::string> NickMap;
+	/** Lowercase nick -> CID */
+	typedef unordered_multimap<string, CID*> LegacyMap;
 
 	typedef unordered_multimap<CID*, OnlineUser*> OnlineMap;
 	typedef OnlineMap::iterator OnlineIter;
@@ -173,12 +177,29 @@ private:
 	typedef pair<OnlineIter, OnlineIter> OnlinePair;
 	typedef pair<OnlineIterC, OnlineIterC> OnlinePairC;
 	
+	/**
+	 * The user tables, split by CID so that hubs putting users on and offline and
+	 * lookups of different users don't all queue up on one lock. Locks are taken
+	 * in the order cs, then a single shard; nothing calls into a hub with only a
+	 * shard locked.
+	 */
+	struct Shard {
+		CriticalSection cs;
+		UserMap users;
+		OnlineMap onlineUsers;
+		NickMap nicks;
+		/** findLegacyUser's index of nicks */
+		LegacyMap legacyNicks;
+	};
+
+	enum { SHARDS = 16 };
+
 	ClientList clients;
+	/** Connected hubs by IP, for findHub */
+	unordered_multimap<string, Client*> hubIps;
 	mutable CriticalSection cs;
 	
-	UserMap users;
-	OnlineMap onlineUsers;	
-	NickMap nicks;
+	mutable Shard shards[SHARDS];
 
 	UserPtr me;
 	
@@ -195,17 +216,27 @@ private:
 	}
 
 	void updateNick(const OnlineUser& user) noexcept;
+
+	/** The CID's last byte picks the shard, the maps inside hash its first bytes */
+	Shard& getShard(const CID& cid) const { return shards[cid.data()[CID::SIZE - 1] % SHARDS]; }
 		
-	/// @return OnlineUser* found by CID and hint; discard any user that doesn't match the hint.
-	OnlineUser* findOnlineUserHint(const CID& cid, const string& hintUrl) const {
+	/// @return OnlineUser* found by CID and hint; discard any user that doesn't match the hint. Call with s.cs held.
+	static OnlineUser* findOnlineUserHint(const Shard& s, const CID& cid, const string& hintUrl) {
 		OnlinePairC p;
-		return findOnlineUserHint(cid, hintUrl, p);
+		return findOnlineUserHint(s, cid, hintUrl, p);
 	}
 	/**
 	* @param p OnlinePair of all the users found by CID, even those who don't match the hint.
 	* @return OnlineUser* found by CID and hint; discard any user that doesn't match the hint.
 	*/
-	OnlineUser* findOnlineUserHint(const CID& cid, const string& hintUrl, OnlinePairC& p) const;
+	static OnlineUser* findOnlineUserHint(const Shard& s, const CID& cid, const string& hintUrl, OnlinePairC& p);
+
+	/** Whether the hub of an online user is still in clients; call with cs and the user's shard held */
+	bool hasClient(const OnlineUser& ou) const;
+	/** Call with cs held */
+	void removeHubIp(const Client* c);
+	/** Call with s.cs held */
+	static void removeLegacyNick(Shard& s, const string& nick, const CID* cid);
 
 	void sendUDP(const string& ip, const string& port, const string& data);
 
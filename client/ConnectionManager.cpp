@@ -33,7 +33,7 @@ namespace dcpp {
 
 uint16_t ConnectionManager::iConnToMeCount = 0;
 
-ConnectionManager::ConnectionManager() : floodCounter(0), server(0), secureServer(0), shuttingDown(false) {
+ConnectionManager::ConnectionManager() : cs("connection.cs"), floodCounter(0), server(0), secureServer(0), shuttingDown(false) {
 	TimerManager::getInstance()->addListener(this);
 
 	features.push_back(UserConnection::FEATURE_MINISLOTS);
@@ -70,7 +70,7 @@ void ConnectionManager::listen() {
 void ConnectionManager::getDownloadConnection(const HintedUser& aUser) {
 	dcassert((bool)aUser.user);
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 		ConnectionQueueItem::Iter i = find(downloads.begin(), downloads.end(), aUser.user);
 		if(i == downloads.end()) {
 			getCQI(aUser, true);
@@ -111,7 +111,7 @@ UserConnection* ConnectionManager::getConnection(bool aNmdc, bool secure) noexce
 	UserConnection* uc = new UserConnection(secure);
 	uc->addListener(this);
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 		userConnections.push_back(uc);
 	}
 	if(aNmdc)
@@ -123,7 +123,7 @@ void ConnectionManager::putConnection(UserConnection* aConn) {
 	aConn->removeListener(this);
 	aConn->disconnect(true);
 
-	Lock l(cs);
+	TimedLock l(cs);
 	userConnections.erase(remove(userConnections.begin(), userConnections.end(), aConn), userConnections.end());
 }
 
@@ -132,7 +132,7 @@ void ConnectionManager::on(TimerManagerListener::Second, uint64_t aTick) noexcep
 	ConnectionQueueItem::List removed;
 
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 
 		uint16_t attempts = 0;
 
@@ -208,7 +208,7 @@ void ConnectionManager::on(TimerManagerListener::Second, uint64_t aTick) noexcep
 }
 
 void ConnectionManager::on(TimerManagerListener::Minute, uint64_t aTick) noexcept {
-	Lock l(cs);
+	TimedLock l(cs);
 
 	for(UserConnectionList::const_iterator j = userConnections.begin(); j != userConnections.end(); ++j) {
 		if(((*j)->getLastActivity() + 180*1000) < aTick) {
@@ -280,6 +280,9 @@ int ConnectionManager::Server::run() noexcept {
  * It's always the other fellow that starts sending if he made the connection.
  */
 void ConnectionManager::accept(const Socket& sock, bool secure) noexcept {
+	static Counter& accepted = Metrics::counter("connection.accepted");
+	static Counter& flooded = Metrics::counter("connection.flooded");
+
 	uint64_t now = GET_TICK();
 
 	if(iConnToMeCount > 0)
@@ -296,12 +299,14 @@ void ConnectionManager::accept(const Socket& sock, bool secure) noexcept {
 				// ...
 			}
 			dcdebug("Connection flood detected!\n");
+			++flooded;
 			return;
 		} else {
 			if(iConnToMeCount <= 0)
 				floodCounter += FLOOD_ADD;
 		}
 	}
+	++accepted;
 	UserConnection* uc = getConnection(false, secure);
 	uc->setFlag(UserConnection::FLAG_INCOMING);
 	uc->setState(UserConnection::STATE_SUPNICK);
@@ -315,7 +320,7 @@ void ConnectionManager::accept(const Socket& sock, bool secure) noexcept {
 }
 
 bool ConnectionManager::checkIpFlood(const string& aServer, uint16_t aPort, const string& userInfo) {
-	Lock l(cs);
+	TimedLock l(cs);
 
 	// Temporary fix to avoid spamming
 	if(aPort == 80 || aPort == 2501) {
@@ -430,6 +435,8 @@ void ConnectionManager::on(AdcCommand::SUP, UserConnection* aSource, const AdcCo
 				aSource->setFlag(UserConnection::FLAG_SUPPORTS_ZLIB_GET);
 			} else if(feat == UserConnection::FEATURE_ADC_BZIP) {
 				aSource->setFlag(UserConnection::FLAG_SUPPORTS_XML_BZLIST);
+			} else if(feat == UserConnection::FEATURE_ADC_PIPE) {
+				aSource->setFlag(UserConnection::FLAG_SUPPORTS_PIPELINE);
 			}
 		}
 	}
@@ -445,6 +452,9 @@ void ConnectionManager::on(AdcCommand::SUP, UserConnection* aSource, const AdcCo
 		if(BOOLSETTING(COMPRESS_TRANSFERS)) {
 			defFeatures.push_back("AD" + UserConnection::FEATURE_ZLIB_GET);
 		}
+		if(BOOLSETTING(SEGMENT_PIPELINING)) {
+			defFeatures.push_back("AD" + UserConnection::FEATURE_ADC_PIPE);
+		}
 		aSource->sup(defFeatures);
 	} else {
 		aSource->inf(true);
@@ -466,6 +476,9 @@ void ConnectionManager::on(UserConnectionListener::Connected, UserConnection* aS
 		if(BOOLSETTING(COMPRESS_TRANSFERS)) {
 			defFeatures.push_back("AD" + UserConnection::FEATURE_ZLIB_GET);
 		}
+		if(BOOLSETTING(SEGMENT_PIPELINING)) {
+			defFeatures.push_back("AD" + UserConnection::FEATURE_ADC_PIPE);
+		}
 		aSource->sup(defFeatures);
 		aSource->send(AdcCommand(AdcCommand::SEV_SUCCESS, AdcCommand::SUCCESS, Util::emptyString).addParam("RF", aSource->getHubUrl()));
 	}
@@ -502,7 +515,7 @@ void ConnectionManager::on(UserConnectionListener::MyNick, UserConnection* aSour
 
 	// First, we try looking in the pending downloads...hopefully it's one of them...
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 		for(ConnectionQueueItem::Iter i = downloads.begin(); i != downloads.end(); ++i) {
 			ConnectionQueueItem* cqi = *i;
 			cqi->setErrors(0);
@@ -607,7 +620,7 @@ void ConnectionManager::addDownloadConnection(UserConnection* uc) {
 	dcassert(uc->isSet(UserConnection::FLAG_DOWNLOAD));
 	bool addConn = false;
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 
 		ConnectionQueueItem::Iter i = find(downloads.begin(), downloads.end(), uc->getUser());
 		if(i != downloads.end()) {
@@ -636,7 +649,7 @@ void ConnectionManager::addUploadConnection(UserConnection* uc) {
 
 	bool addConn = false;
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 
 		ConnectionQueueItem::Iter i = find(uploads.begin(), uploads.end(), uc->getUser());
 		if(i == uploads.end()) {
@@ -724,7 +737,7 @@ void ConnectionManager::on(AdcCommand::INF, UserConnection* aSource, const AdcCo
 
 	bool down = false;
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 		auto i = find(downloads.begin(), downloads.end(), aSource->getUser());
 
 		if(i != downloads.end()) {
@@ -750,7 +763,7 @@ void ConnectionManager::on(AdcCommand::INF, UserConnection* aSource, const AdcCo
 }
 
 void ConnectionManager::force(const UserPtr& aUser) {
-	Lock l(cs);
+	TimedLock l(cs);
 
 	ConnectionQueueItem::Iter i = find(downloads.begin(), downloads.end(), aUser);
 	if(i == downloads.end()) {
@@ -771,7 +784,10 @@ bool ConnectionManager::checkKeyprint(UserConnection *aSource) {
 }
 
 void ConnectionManager::failed(UserConnection* aSource, const string& aError, bool protocolError) {
-	Lock l(cs);
+	static Counter& failures = Metrics::counter("connection.failed");
+	++failures;
+
+	TimedLock l(cs);
 
 	if(aSource->isSet(UserConnection::FLAG_ASSOCIATED)) {
 		if(aSource->isSet(UserConnection::FLAG_DOWNLOAD)) {
@@ -801,7 +817,7 @@ void ConnectionManager::on(UserConnectionListener::ProtocolError, UserConnection
 }
 
 void ConnectionManager::disconnect(const UserPtr& aUser) {
-	Lock l(cs);
+	TimedLock l(cs);
 	for(UserConnectionList::const_iterator i = userConnections.begin(); i != userConnections.end(); ++i) {
 		UserConnection* uc = *i;
 		if(uc->getUser() == aUser)
@@ -810,7 +826,7 @@ void ConnectionManager::disconnect(const UserPtr& aUser) {
 }
 
 void ConnectionManager::disconnect(const UserPtr& aUser, int isDownload) {
-	Lock l(cs);
+	TimedLock l(cs);
 	for(UserConnectionList::const_iterator i = userConnections.begin(); i != userConnections.end(); ++i) {
 		UserConnection* uc = *i;
 		if(uc->getUser() == aUser && uc->isSet((Flags::MaskType)(isDownload ? UserConnection::FLAG_DOWNLOAD : UserConnection::FLAG_UPLOAD))) {
@@ -825,7 +841,7 @@ void ConnectionManager::shutdown() {
 	shuttingDown = true;
 	disconnect();
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 		for(UserConnectionList::const_iterator j = userConnections.begin(); j != userConnections.end(); ++j) {
 			(*j)->disconnect(true);
 		}
@@ -833,7 +849,7 @@ void ConnectionManager::shutdown() {
 	// Wait until all connections have died out...
 	while(true) {
 		{
-			Lock l(cs);
+			TimedLock l(cs);
 			if(userConnections.empty()) {
 				break;
 			}
@@ -20,6 +20,7 @@
 #define DCPLUSPLUS_DCPP_CONNECTION_MANAGER_H
 
 #include "TimerManager.h"
+#include "Metrics.h"
 
 #include "UserConnectionListener.h"
 #include "Singleton.h"
@@ -141,7 +142,7 @@ private:
 
 	friend class Server;
 
-	CriticalSection cs;
+	TimedCriticalSection cs;
 
 	/** All ConnectionQueueItems */
 	ConnectionQueueItem::List downloads;
@@ -21,6 +21,7 @@
 
 #include "ConnectionManager.h"
 #include "DownloadManager.h"
+#include "DiskIoManager.h"
 #include "UploadManager.h"
 #include "CryptoManager.h"
 #include "ShareManager.h"
@@ -29,6 +30,7 @@
 #include "ClientManager.h"
 #include "HashManager.h"
 #include "LogManager.h"
+#include "Metrics.h"
 #include "FavoriteManager.h"
 #include "SettingsManager.h"
 #include "FinishedManager.h"
@@ -70,6 +72,7 @@ void startup() {
 	SettingsManager::newInstance();
 
 	TimerManager::newInstance();
+	DiskIoManager::newInstance();
 	LogManager::newInstance();
 	HashManager::newInstance();
 	CryptoManager::newInstance();
@@ -134,6 +137,8 @@ void load(function<void (const string&)> stepF, function<void (float)> progressF
 	announce(STRING(DOWNLOAD_QUEUE));
 	QueueManager::getInstance()->loadQueue(progressF);
 
+	Metrics::startup();
+
 	if(stepF && Util::fileExists(UPDATE_TEMP_DIR)) {
 		stepF(_("Removing temporary updater files..."));
 		UpdateManager::cleanTempFiles();
@@ -144,6 +149,7 @@ void shutdown() {
 	PluginManager::getInstance()->unloadPlugins();
 	HashManager::getInstance()->shutdown();
 	ThrottleManager::getInstance()->shutdown();
+	Metrics::shutdown();
 	TimerManager::getInstance()->shutdown();
 	ConnectionManager::getInstance()->shutdown();
 	WebServerManager::getInstance()->shutdown();
@@ -180,6 +186,7 @@ void shutdown() {
 	FavoriteManager::deleteInstance();
 	ClientManager::deleteInstance();
 	HashManager::deleteInstance();
+	DiskIoManager::deleteInstance();
 	LogManager::deleteInstance();
 	TimerManager::deleteInstance();
 
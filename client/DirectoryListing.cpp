@@ -76,7 +76,9 @@ UserPtr DirectoryListing::getUserFromFilename(const string& fileName) {
 	return ClientManager::getInstance()->getUser(cid);
 }
 
-void DirectoryListing::loadFile(const string& path) {
+namespace {
+template<typename F>
+void readList(const string& path, F f) {
 	string actualPath;
 	if(dcpp::File::getSize(path + ".bz2") != -1) {
 		actualPath = path + ".bz2";
@@ -88,12 +90,21 @@ void DirectoryListing::loadFile(const string& path) {
 	dcpp::File file(actualPath.empty() ? path : actualPath, dcpp::File::READ, dcpp::File::OPEN);
 
 	if(stricmp(ext, ".bz2") == 0) {
-		FilteredInputStream<UnBZFilter, false> f(&file);
-		loadXML(f, false);
+		FilteredInputStream<UnBZFilter, false> bz(&file);
+		f(bz);
 	} else if(stricmp(ext, ".xml") == 0) {
-		loadXML(file, false);
+		f(file);
 	}
 }
+}
+
+void DirectoryListing::loadFile(const string& path) {
+	readList(path, [this](InputStream& is) { loadXML(is, false); });
+}
+
+void DirectoryListing::matchFile(const string& path, const vector<TTHValue>& queued, Directory::TTHSet& matches) {
+	readList(path, [&](InputStream& is) { matchXML(is, queued, matches); });
+}
 
 class ListLoader : public SimpleXMLReader::CallBack {
 public:
@@ -112,6 +123,12 @@ public:
 		if(list->base.empty()) {
 			list->base = base;
 		}
+
+		// parsing failed half way, these never made it into the listing
+		for(auto& i: pending) {
+			std::for_each(i.directories.begin(), i.directories.end(), DeleteFunction());
+			std::for_each(i.files.begin(), i.files.end(), DeleteFunction());
+		}
 	}
 
 	void startTag(const string& name, StringPairList& attribs, bool simple);
@@ -120,9 +137,19 @@ public:
 	const string& getBase() const { return base; }
 
 private:
+	/** Children of a directory that is still being read; complete lists are sorted into place once per directory */
+	struct Pending {
+		vector<DirectoryListing::Directory::Ptr> directories;
+		vector<DirectoryListing::File::Ptr> files;
+	};
+
 	DirectoryListing* list;
 	DirectoryListing::Directory* cur;
 	UserPtr user;
+	vector<Pending> pending;
+
+	void beginDirectory();
+	void endDirectory();
 
 	StringMap params;
 	string base;
@@ -143,6 +170,28 @@ string DirectoryListing::loadXML(InputStream& is, bool updating) {
 	return ll.getBase();
 }
 
+/** Only looks at the TTH of each file, nothing of the listing is kept */
+class ListMatcher : public SimpleXMLReader::CallBack {
+public:
+	ListMatcher(const vector<TTHValue>& aQueued, DirectoryListing::Directory::TTHSet& aMatches) :
+		queued(aQueued),
+		matches(aMatches)
+	{
+	}
+
+	void startTag(const string& name, StringPairList& attribs, bool simple);
+
+private:
+	const vector<TTHValue>& queued;
+	DirectoryListing::Directory::TTHSet& matches;
+};
+
+void DirectoryListing::matchXML(InputStream& is, const vector<TTHValue>& queued, Directory::TTHSet& matches) {
+	ListMatcher lm(queued, matches);
+
+	SimpleXMLReader(&lm).parse(is, SETTING(MAX_FILELIST_SIZE) ? (size_t)SETTING(MAX_FILELIST_SIZE)*1024*1024 : 0);
+}
+
 static const string sFileListing = "FileListing";
 static const string sBase = "Base";
 static const string sGenerator = "Generator";
@@ -153,6 +202,19 @@ static const string sName = "Name";
 static const string sSize = "Size";
 static const string sTTH = "TTH";
 
+void ListMatcher::startTag(const string& name, StringPairList& attribs, bool) {
+	if(name != sFile)
+		return;
+
+	const string& h = getAttrib(attribs, sTTH, 2);
+	if(h.size() != 39)
+		return;
+
+	TTHValue tth(h);
+	if(std::binary_search(queued.begin(), queued.end(), tth))
+		matches.insert(tth);
+}
+
 void ListLoader::startTag(const string& name, StringPairList& attribs, bool simple) {
 	if(list->getAbort()) { throw Exception(); }
 
@@ -173,6 +235,11 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
 			TTHValue tth(h); /// @todo verify validity?
 
 			auto f = new DirectoryListing::File(cur, n, size, tth);
+			if(!updating) {
+				pending.back().files.push_back(f);
+				return;
+			}
+
 			auto insert = cur->files.insert(f);
 
 			if(!insert.second) {
@@ -199,6 +266,17 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
 			bool incomp = getAttrib(attribs, sIncomplete, 1) == "1";
 
 			auto d = new DirectoryListing::Directory(cur, n, false, !incomp);
+			if(!updating) {
+				pending.back().directories.push_back(d);
+				cur = d;
+				beginDirectory();
+
+				if(simple) {
+					endTag(name);
+				}
+				return;
+			}
+
 			auto insert = cur->directories.insert(d);
 
 			if(!insert.second) {
@@ -247,6 +325,7 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
 		}
 		cur->setComplete(true);
 		inListing = true;
+		beginDirectory();
 
 		string generator = getAttrib(attribs, sGenerator, 2);
 		ClientManager::getInstance()->setGenerator(user, generator);
@@ -261,14 +340,49 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
 void ListLoader::endTag(const string& name) {
 	if(inListing) {
 		if(name == sDirectory) {
+			endDirectory();
 			cur = cur->getParent();
 		} else if(name == sFileListing) {
+			endDirectory();
 			// cur should be root now...
 			inListing = false;
 		}
 	}
 }
 
+void ListLoader::beginDirectory() {
+	if(!updating) {
+		pending.push_back(Pending());
+	}
+}
+
+namespace {
+template<typename T, typename Less>
+void sortChildren(vector<T>& v, Less less) {
+	std::sort(v.begin(), v.end(), less);
+	if(std::adjacent_find(v.begin(), v.end(), [&](T a, T b) { return !less(a, b); }) != v.end()) {
+		// duplicates are forbidden in complete file lists
+		throw Exception(_("Duplicate item in the file list"));
+	}
+}
+}
+
+void ListLoader::endDirectory() {
+	if(updating || pending.empty())
+		return;
+
+	auto& p = pending.back();
+	sortChildren(p.directories, cur->directories.value_comp());
+	sortChildren(p.files, cur->files.value_comp());
+
+	cur->directories.insert(boost::container::ordered_unique_range, p.directories.begin(), p.directories.end());
+	p.directories.clear();
+	cur->files.insert(boost::container::ordered_unique_range, p.files.begin(), p.files.end());
+	p.files.clear();
+
+	pending.pop_back();
+}
+
 string DirectoryListing::getPath(const Directory* d) const {
 	if(d == root)
 		return "";
@@ -356,28 +470,32 @@ void DirectoryListing::Directory::filterList(DirectoryListing& dirList) {
 }
 
 void DirectoryListing::Directory::filterList(DirectoryListing::Directory::TTHSet& l) {
-	for(auto i = directories.begin(); i != directories.end();) {
-		auto d = *i;
-
+	// The kept entries are still sorted, so they go back in at once instead of erasing one at a time
+	vector<Ptr> dirs;
+	dirs.reserve(directories.size());
+	for(auto d: directories) {
 		d->filterList(l);
 
 		if(d->directories.empty() && d->files.empty()) {
-			i = directories.erase(i);
 			delete d;
 		} else {
-			++i;
+			dirs.push_back(d);
 		}
 	}
+	directories.clear();
+	directories.insert(boost::container::ordered_unique_range, dirs.begin(), dirs.end());
 
-	for(auto i = files.begin(); i != files.end();) {
-		auto f = *i;
+	vector<File::Ptr> kept;
+	kept.reserve(files.size());
+	for(auto f: files) {
 		if(l.find(f->getTTH()) != l.end()) {
-			i = files.erase(i);
 			delete f;
 		} else {
-			++i;
+			kept.push_back(f);
 		}
 	}
+	files.clear();
+	files.insert(boost::container::ordered_unique_range, kept.begin(), kept.end());
 }
 
 void DirectoryListing::Directory::getHashList(DirectoryListing::Directory::TTHSet& l) {
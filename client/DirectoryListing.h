@@ -19,9 +19,10 @@
 #ifndef DCPLUSPLUS_DCPP_DIRECTORY_LISTING_H
 #define DCPLUSPLUS_DCPP_DIRECTORY_LISTING_H
 
-#include <set>
+#include <memory>
 
 #include <boost/noncopyable.hpp>
+#include <boost/container/flat_set.hpp>
 
 #include "forward.h"
 #include "noexcept.h"
@@ -35,7 +36,8 @@
 
 namespace dcpp {
 
-using std::set;
+using std::unique_ptr;
+using boost::container::flat_set;
 
 class ListLoader;
 
@@ -65,9 +67,29 @@ public:
 		GETSET(int64_t, size, Size);
 		GETSET(Directory*, parent, Parent);
 		GETSET(bool, adls, Adls);
-		GETSET(int, adlsRaw, AdlsRaw);
-		GETSET(string, adlsComment, AdlsComment);
-		GETSET(int, adlsPriority, AdlsPriority);
+
+		int getAdlsRaw() const { return adlsInfo ? adlsInfo->raw : 0; }
+		void setAdlsRaw(int aRaw) { getAdlsInfo().raw = aRaw; }
+		const string& getAdlsComment() const { return adlsInfo ? adlsInfo->comment : Util::emptyString; }
+		void setAdlsComment(const string& aComment) { getAdlsInfo().comment = aComment; }
+		int getAdlsPriority() const { return adlsInfo ? adlsInfo->priority : 0; }
+		void setAdlsPriority(int aPriority) { getAdlsInfo().priority = aPriority; }
+
+	private:
+		/** Only the copies ADLSearch makes carry these, so plain list entries don't pay for them */
+		struct AdlsInfo {
+			AdlsInfo() : raw(0), priority(0) { }
+			int raw;
+			string comment;
+			int priority;
+		};
+		unique_ptr<AdlsInfo> adlsInfo;
+
+		AdlsInfo& getAdlsInfo() {
+			if(!adlsInfo)
+				adlsInfo.reset(new AdlsInfo);
+			return *adlsInfo;
+		}
 	};
 
 	class Directory : public FastAlloc<Directory>, boost::noncopyable {
@@ -80,8 +102,9 @@ public:
 			bool operator()(typename T::Ptr a, typename T::Ptr b) const { return compare(a->getName(), b->getName()) < 0; }
 		};
 
-		set<Ptr, Less<Directory>> directories;
-		set<File::Ptr, Less<File>> files;
+		// Sorted pointer arrays, a node based set costs more than the entries themselves in big lists
+		flat_set<Ptr, Less<Directory>> directories;
+		flat_set<File::Ptr, Less<File>> files;
 		
 		Directory(Directory* aParent, const string& aName, bool _adls, bool aComplete) :
 			boost::noncopyable(),
@@ -125,6 +148,10 @@ public:
 
 	void loadFile(const string& path);
 
+	/** Collect the TTHs of the list's files that appear in the sorted queued vector, without building the listing */
+	static void matchFile(const string& path, const vector<TTHValue>& queued, Directory::TTHSet& matches);
+	static void matchXML(InputStream& xml, const vector<TTHValue>& queued, Directory::TTHSet& matches);
+
 	string updateXML(const std::string&);
 	string loadXML(InputStream& xml, bool updating);
 
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2001-2011 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "stdinc.h"
+#include "DiskIoManager.h"
+
+#include "SettingsManager.h"
+#include "Text.h"
+#include "Util.h"
+
+namespace dcpp {
+
+using std::max;
+
+void DiskIoManager::Op::run() {
+	string err;
+	try {
+		f();
+	} catch(const Exception& e) {
+		err = e.getError();
+	} catch(const std::exception& e) {
+		err = e.what();
+	}
+	f = nullptr;
+
+	{
+		boost::lock_guard<boost::mutex> l(mtx);
+		error = err;
+		done = true;
+	}
+	cond.notify_all();
+}
+
+void DiskIoManager::Op::wait() {
+	boost::unique_lock<boost::mutex> l(mtx);
+	while(!done)
+		cond.wait(l);
+	if(!error.empty())
+		throw FileException(error);
+}
+
+bool DiskIoManager::Op::isDone() {
+	boost::lock_guard<boost::mutex> l(mtx);
+	return done;
+}
+
+DiskIoManager::DiskIoManager() : stopping(false) {
+}
+
+DiskIoManager::~DiskIoManager() {
+	vector<unique_ptr<Worker>> workers;
+	{
+		boost::lock_guard<boost::mutex> l(mtx);
+		stopping = true;
+		for(auto& d: devices) {
+			d.second.cond.notify_all();
+			for(auto& w: d.second.workers)
+				workers.push_back(move(w));
+		}
+	}
+
+	// the workers drain their queues before they return
+	for(auto& w: workers)
+		w->join();
+}
+
+bool DiskIoManager::isAsync() const {
+	return SETTING(DISK_QUEUE_DEPTH) > 0;
+}
+
+DiskIoManager::OpPtr DiskIoManager::submit(const string& device, const function<void ()>& f, Pool pool) {
+	auto op = std::make_shared<Op>();
+	op->f = f;
+
+	size_t depth = static_cast<size_t>(max(SETTING(DISK_QUEUE_DEPTH), 0));
+	if(depth > 0) {
+		// device keys are paths or numbers, they can't start with the control character
+		const string key = pool == POOL_HASH ? '\x01' + device : device;
+
+		boost::lock_guard<boost::mutex> l(mtx);
+		if(!stopping) {
+			auto& d = devices[key];
+			// workers are only added, a lower depth takes effect at the next start
+			while(d.workers.size() < depth) {
+				d.workers.push_back(unique_ptr<Worker>(new Worker(*this, key)));
+				d.workers.back()->start();
+			}
+
+			d.queue.push_back(op);
+			d.cond.notify_one();
+			return op;
+		}
+	}
+
+	op->run();
+	return op;
+}
+
+void DiskIoManager::work(const string& device) {
+	boost::unique_lock<boost::mutex> l(mtx);
+	// devices are never erased while the workers run, so the reference stays valid
+	auto& d = devices[device];
+
+	for(;;) {
+		while(d.queue.empty() && !stopping)
+			d.cond.wait(l);
+		if(d.queue.empty())
+			return;
+
+		auto op = d.queue.front();
+		d.queue.pop_front();
+
+		l.unlock();
+		op->run();
+		l.lock();
+	}
+}
+
+string DiskIoManager::getDevice(const string& path) {
+#ifdef _WIN32
+	if(path.size() >= 2 && path[1] == ':')
+		return Text::toLower(path.substr(0, 2));
+
+	if(path.size() > 2 && path[0] == '\\' && path[1] == '\\') {
+		// \\server\share
+		string::size_type i = path.find('\\', 2);
+		if(i != string::npos)
+			i = path.find('\\', i + 1);
+		return Text::toLower(path.substr(0, i));
+	}
+	return Util::emptyString;
+#else
+	struct stat s;
+	if(stat(Text::fromUtf8(Util::getFilePath(path)).c_str(), &s) == 0)
+		return Util::toString(static_cast<uint64_t>(s.st_dev));
+	return Util::emptyString;
+#endif
+}
+
+} // namespace dcpp
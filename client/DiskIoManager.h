@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2001-2011 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_DISK_IO_MANAGER_H
+#define DCPLUSPLUS_DCPP_DISK_IO_MANAGER_H
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "Singleton.h"
+#include "Streams.h"
+#include "Thread.h"
+
+namespace dcpp {
+
+using std::deque;
+using std::function;
+using std::shared_ptr;
+using std::unique_ptr;
+using std::unordered_map;
+
+/**
+ * Runs file reads and writes on worker threads, so that a slow disk stalls
+ * neither the socket threads nor the hasher. Every device gets its own queue
+ * with DISK_QUEUE_DEPTH workers, and another one for hashing jobs; 0 runs the
+ * I/O on the calling thread.
+ */
+class DiskIoManager : public Singleton<DiskIoManager> {
+public:
+	/** A queued job; wait() blocks until it has run and rethrows its error as a FileException */
+	class Op : boost::noncopyable {
+	public:
+		Op() : done(false) { }
+
+		void wait();
+		bool isDone();
+
+	private:
+		friend class DiskIoManager;
+
+		function<void ()> f;
+		boost::mutex mtx;
+		boost::condition_variable cond;
+		bool done;
+		string error;
+
+		void run();
+	};
+
+	typedef shared_ptr<Op> OpPtr;
+
+	/** Jobs that read and hash whole chunks go to queues of their own, the transfers' reads and writes don't wait behind them */
+	enum Pool {
+		POOL_IO,
+		POOL_HASH
+	};
+
+	/** Queue f for the device returned by getDevice, an empty key uses a shared queue */
+	OpPtr submit(const string& device, const function<void ()>& f, Pool pool = POOL_IO);
+
+	/** False when the depth is 0 and submit runs jobs synchronously */
+	bool isAsync() const;
+
+	/** Key of the device (volume, share or st_dev) holding path */
+	static string getDevice(const string& path);
+
+private:
+	friend class Singleton<DiskIoManager>;
+
+	class Worker : public Thread {
+	public:
+		Worker(DiskIoManager& aDm, const string& aDevice) : dm(aDm), device(aDevice) { }
+	private:
+		DiskIoManager& dm;
+		string device;
+		int run() { dm.work(device); return 0; }
+	};
+
+	struct Device {
+		deque<OpPtr> queue;
+		boost::condition_variable cond;
+		vector<unique_ptr<Worker>> workers;
+	};
+
+	boost::mutex mtx;
+	unordered_map<string, Device> devices;
+	bool stopping;
+
+	DiskIoManager();
+	~DiskIoManager();
+
+	void work(const string& device);
+};
+
+/**
+ * Write-behind stream: buffers what is written and hands full buffers to the
+ * DiskIoManager, so the caller goes on while the previous buffer reaches the disk.
+ * At most one write is in flight; its error surfaces on the next write or flush.
+ */
+template<bool managed>
+class DiskWriteStream : public OutputStream {
+public:
+	using OutputStream::write;
+
+	DiskWriteStream(OutputStream* aStream, const string& aPath, size_t aBufSize = 256 * 1024) :
+		s(aStream), device(DiskIoManager::getDevice(aPath)), bufSize(aBufSize) { buf.reserve(bufSize); }
+
+	~DiskWriteStream() {
+		try {
+			// don't lose bytes when a download is disconnected prematurely
+			submit();
+			wait();
+		} catch(const Exception&) {
+		}
+		if(managed)
+			delete s;
+	}
+
+	size_t write(const void* wbuf, size_t len) {
+		const uint8_t* b = (const uint8_t*)wbuf;
+		buf.insert(buf.end(), b, b + len);
+		if(buf.size() >= bufSize)
+			submit();
+		return len;
+	}
+
+	size_t flush() {
+		submit();
+		wait();
+		return s->flush();
+	}
+
+private:
+	OutputStream* s;
+	string device;
+	size_t bufSize;
+	ByteVector buf;
+	/** Being written by the pending op */
+	ByteVector writing;
+	DiskIoManager::OpPtr pending;
+
+	void wait() {
+		if(pending) {
+			auto op = pending;
+			pending.reset();
+			op->wait();
+		}
+	}
+
+	void submit() {
+		if(buf.empty())
+			return;
+		wait();
+		writing.swap(buf);
+		buf.clear();
+		pending = DiskIoManager::getInstance()->submit(device, [this] { s->write(&writing[0], writing.size()); });
+	}
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_DISK_IO_MANAGER_H)
@@ -79,7 +79,9 @@ Download::Download(UserConnection& conn, QueueItem& qi, const string& path) noex
 }
 
 Download::~Download() {
-	getUserConnection().setDownload(0);
+	// a pipelined download may go away while the one before it still runs
+	if(getUserConnection().getDownload() == this)
+		getUserConnection().setDownload(0);
 }
 
 AdcCommand Download::getCommand(bool zlib) const {
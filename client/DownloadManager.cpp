@@ -22,6 +22,7 @@
 #include "ResourceManager.h"
 #include "QueueManager.h"
 #include "Download.h"
+#include "DiskIoManager.h"
 #include "LogManager.h"
 #include "User.h"
 #include "File.h"
@@ -182,7 +183,54 @@ void DownloadManager::checkDownloads(UserConnection* aConn) {
 
 	dcdebug("Requesting " I64_FMT "/" I64_FMT "\n", d->getStartPos(), d->getSize());
 
-	aConn->send(d->getCommand(aConn->isSet(UserConnection::FLAG_SUPPORTS_ZLIB_GET)));
+	aConn->send(d->getCommand(useZlib(aConn, d)));
+}
+
+bool DownloadManager::canPipeline(UserConnection* aConn, const Download* d) {
+	return d->getType() == Transfer::TYPE_FILE && d->isSet(Download::FLAG_CHUNKED) &&
+		aConn->isSet(UserConnection::FLAG_SUPPORTS_PIPELINE) && BOOLSETTING(SEGMENT_PIPELINING);
+}
+
+bool DownloadManager::useZlib(UserConnection* aConn, const Download* d) {
+	// The end of a compressed segment is only known once it has been inflated, pipelining needs the exact length
+	return aConn->isSet(UserConnection::FLAG_SUPPORTS_ZLIB_GET) && !canPipeline(aConn, d);
+}
+
+void DownloadManager::pipelineDownload(UserConnection* aConn) {
+	dcassert(aConn->getPipelinedDownload() == NULL);
+
+	Download* d = QueueManager::getInstance()->getPipelinedDownload(*aConn);
+	if(!d)
+		return;
+
+	aConn->setPipelinedDownload(d);
+
+	dcdebug("Pipelining " I64_FMT "/" I64_FMT "\n", d->getStartPos(), d->getSize());
+
+	aConn->send(d->getCommand(useZlib(aConn, d)));
+}
+
+void DownloadManager::startPipelined(UserConnection* aConn) {
+	Download* d = aConn->getPipelinedDownload();
+	aConn->setPipelinedDownload(NULL);
+	aConn->setDownload(d);
+
+	// Already requested, so this is where we'd be after checkDownloads
+	aConn->setState(UserConnection::STATE_SND);
+
+	{
+		Lock l(cs);
+		downloads.push_back(d);
+	}
+	fire(DownloadManagerListener::Requesting(), d);
+}
+
+void DownloadManager::cancelPipelined(UserConnection* aConn) {
+	Download* d = aConn->getPipelinedDownload();
+	if(d) {
+		aConn->setPipelinedDownload(NULL);
+		QueueManager::getInstance()->putDownload(d, false);
+	}
 }
 
 void DownloadManager::on(AdcCommand::SND, UserConnection* aSource, const AdcCommand& cmd) noexcept {
@@ -240,7 +288,10 @@ void DownloadManager::startData(UserConnection* aSource, int64_t start, int64_t
 	}
 
 	try {
-		if((d->getType() == Transfer::TYPE_FILE || d->getType() == Transfer::TYPE_FULL_LIST) && SETTING(BUFFER_SIZE) > 0 ) {
+		if(d->getType() == Transfer::TYPE_FILE && DiskIoManager::getInstance()->isAsync()) {
+			// written behind on the threads of the target's disk, this buffers as well
+			d->setFile(new DiskWriteStream<true>(d->getFile(), d->getDownloadTarget(), max(SETTING(BUFFER_SIZE), 64) * 1024));
+		} else if((d->getType() == Transfer::TYPE_FILE || d->getType() == Transfer::TYPE_FULL_LIST) && SETTING(BUFFER_SIZE) > 0 ) {
 			d->setFile(new BufferedOutputStream<true>(d->getFile()));
 		}
 	} catch(const Exception& e) {
@@ -280,6 +331,11 @@ void DownloadManager::startData(UserConnection* aSource, int64_t start, int64_t
 		} catch(const Exception& e) {
 			failDownload(aSource, e.getError());
 		}
+	} else if(!z && canPipeline(aSource, d)) {
+		// Ask for the next segment now, so that it follows this one without a round trip in between.
+		// The uploader answers it after this segment, which therefore has to end at its exact length.
+		aSource->setDataMode(bytes);
+		pipelineDownload(aSource);
 	} else {
 		aSource->setDataMode();
 	}
@@ -353,7 +409,12 @@ void DownloadManager::endData(UserConnection* aSource) {
 		fire(DownloadManagerListener::Complete(), d, d->getType() == Transfer::TYPE_TREE);
 
 	QueueManager::getInstance()->putDownload(d, true, false);
-	checkDownloads(aSource);
+
+	if(aSource->getPipelinedDownload()) {
+		startPipelined(aSource);
+	} else {
+		checkDownloads(aSource);
+	}
 }
 
 int64_t DownloadManager::getRunningAverage() {
@@ -408,11 +469,13 @@ void DownloadManager::failDownload(UserConnection* aSource, const string& reason
 		QueueManager::getInstance()->putDownload(d, false);
 	}
 
+	cancelPipelined(aSource);
 	removeConnection(aSource);
 }
 
 void DownloadManager::removeConnection(UserConnectionPtr aConn) {
 	dcassert(aConn->getDownload() == NULL);
+	dcassert(aConn->getPipelinedDownload() == NULL);
 	aConn->removeListener(this);
 	aConn->disconnect();
 }
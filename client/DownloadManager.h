@@ -57,6 +57,11 @@ public:
 		return downloads.size();
 	}
 
+	void lockedOperation(const function<void (const DownloadList&)>& currentDownloads) {
+		Lock l(cs);
+		if(currentDownloads) currentDownloads(downloads);
+	}
+
 	bool startDownload(QueueItem::Priority prio);
 
 private:
@@ -80,6 +85,14 @@ private:
 	~DownloadManager();
 
 	void checkDownloads(UserConnection* aConn);
+
+	/** Whether the segment after d may be requested while d is streaming */
+	static bool canPipeline(UserConnection* aConn, const Download* d);
+	static bool useZlib(UserConnection* aConn, const Download* d);
+	void pipelineDownload(UserConnection* aConn);
+	void startPipelined(UserConnection* aConn);
+	void cancelPipelined(UserConnection* aConn);
+
 	void startData(UserConnection* aSource, int64_t start, int64_t newSize, bool z);
 	void endData(UserConnection* aSource);
 
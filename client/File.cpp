@@ -99,10 +99,19 @@ int64_t File::getPos() const noexcept {
 }
 
 void File::setSize(int64_t newSize) {
+#if _WIN32_WINNT >= 0x600
+	// leaves the file pointer alone; readAt/writeAt on other threads move it, the size must not depend on it
+	FILE_END_OF_FILE_INFO info;
+	info.EndOfFile.QuadPart = newSize;
+	if(!::SetFileInformationByHandle(h, FileEndOfFileInfo, &info, sizeof(info))) {
+		throw FileException(Util::translateError(GetLastError()));
+	}
+#else
 	int64_t pos = getPos();
 	setPos(newSize);
 	setEOF();
 	setPos(pos);
+#endif
 }
 void File::setPos(int64_t pos) noexcept {
 	LONG x = (LONG) (pos>>32);
@@ -135,6 +144,40 @@ size_t File::write(const void* buf, size_t len) {
 	dcassert(x == len);
 	return x;
 }
+
+size_t File::readAt(void* buf, size_t len, int64_t pos) {
+	OVERLAPPED o = { 0 };
+	o.Offset = (DWORD)(pos & 0xffffffff);
+	o.OffsetHigh = (DWORD)(pos >> 32);
+
+	DWORD x;
+	if(!::ReadFile(h, buf, (DWORD)len, &x, &o)) {
+		DWORD err = GetLastError();
+		if(err == ERROR_HANDLE_EOF)
+			return 0;
+		throw FileException(Util::translateError(err));
+	}
+	return x;
+}
+
+size_t File::writeAt(const void* buf, size_t len, int64_t pos) {
+	OVERLAPPED o = { 0 };
+	o.Offset = (DWORD)(pos & 0xffffffff);
+	o.OffsetHigh = (DWORD)(pos >> 32);
+
+	DWORD x;
+	if(!::WriteFile(h, buf, (DWORD)len, &x, &o)) {
+		throw FileException(Util::translateError(GetLastError()));
+	}
+	dcassert(x == len);
+	return x;
+}
+
+void File::preallocate(int64_t newSize) {
+	// SetEndOfFile allocates the clusters already unless the file is sparse
+	setSize(newSize);
+}
+
 void File::setEOF() {
 	dcassert(isOpen());
 	if(!SetEndOfFile(h)) {
@@ -299,6 +342,37 @@ size_t File::write(const void* buf, size_t len) {
 	return len;
 }
 
+size_t File::readAt(void* buf, size_t len, int64_t pos) {
+	ssize_t result;
+	do {
+		result = ::pread(h, buf, len, (off_t)pos);
+	} while(result == -1 && errno == EINTR);
+
+	if(result == -1) {
+		throw FileException(Util::translateError(errno));
+	}
+	return (size_t)result;
+}
+
+size_t File::writeAt(const void* buf, size_t len, int64_t pos) {
+	const char* pointer = (const char*)buf;
+	size_t left = len;
+
+	while(left > 0) {
+		ssize_t result = ::pwrite(h, pointer, left, (off_t)pos);
+		if(result == -1) {
+			if(errno != EINTR) {
+				throw FileException(Util::translateError(errno));
+			}
+		} else {
+			pointer += result;
+			pos += result;
+			left -= result;
+		}
+	}
+	return len;
+}
+
 // some ftruncate implementations can't extend files like SetEndOfFile,
 // not sure if the client code needs this...
 int File::extendFile(int64_t len) noexcept {
@@ -328,10 +402,25 @@ void File::setEOF() {
 }
 
 void File::setSize(int64_t newSize) {
-	int64_t pos = getPos();
-	setPos(newSize);
-	setEOF();
-	setPos(pos);
+	// POSIX ftruncate extends as well, no need for extendFile or the file position
+	if(ftruncate(h, (off_t)newSize) == -1)
+		throw FileException(Util::translateError(errno));
+}
+
+void File::preallocate(int64_t newSize) {
+#if defined(__linux__) || defined(__FreeBSD__)
+	int64_t size = getSize();
+	if(newSize > size) {
+		// reserves real blocks instead of leaving a hole, but never shrinks
+		int ret = posix_fallocate(h, (off_t)size, (off_t)(newSize - size));
+		if(ret == 0)
+			return;
+		if(ret != EINVAL && ret != EOPNOTSUPP)
+			throw FileException(Util::translateError(ret));
+		// the file system can't do it, fall back to a plain extension
+	}
+#endif
+	setSize(newSize);
 }
 
 size_t File::flush() {
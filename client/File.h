@@ -72,6 +72,8 @@ public:
 	void close() noexcept;
 	int64_t getSize() const noexcept;
 	void setSize(int64_t newSize);
+	/** Like setSize, but also reserves the disk space where the platform allows it */
+	void preallocate(int64_t newSize);
 
 	int64_t getPos() const noexcept;
 	void setPos(int64_t pos) noexcept;
@@ -81,6 +83,9 @@ public:
 
 	size_t read(void* buf, size_t& len);
 	size_t write(const void* buf, size_t len);
+	/** Positional I/O; on Windows they still move the file pointer, only setSize before Vista depends on it */
+	size_t readAt(void* buf, size_t len, int64_t pos);
+	size_t writeAt(const void* buf, size_t len, int64_t pos);
 	size_t flush();
 	void clear() { setPos(0); setEOF(); }
 
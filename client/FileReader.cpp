@@ -21,7 +21,9 @@
 #include "FileReader.h"
 
 #include "debug.h"
+#include "DiskIoManager.h"
 #include "File.h"
+#include "ScopedFunctor.h"
 #include "TimerManager.h"
 #include "Text.h"
 #include "Util.h"
@@ -273,7 +275,75 @@ size_t FileReader::readMapped(const string& file, const DataCallback& callback)
 
 
 size_t FileReader::readDirect(const string& file, const DataCallback& callback) {
-	return READ_FAILED;
+	int fd = open(Text::fromUtf8(file).c_str(), O_RDONLY);
+	if(fd == -1) {
+		dcdebug("Error opening file %s: %s\n", file.c_str(), Util::translateError(errno).c_str());
+		return READ_FAILED;
+	}
+	ScopedFunctor([fd] { close(fd); });
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	// like the overlapped reads on Windows: the next block is read on the disk's queue while the callback has this one
+	size_t bufSize = getBlockSize(0);
+	buffer.resize(bufSize * 2);
+
+	uint8_t* hbuf = &buffer[0];
+	uint8_t* rbuf = &buffer[bufSize];
+	size_t rn = 0;
+
+	auto device = DiskIoManager::getDevice(file);
+	auto readAt = [&](uint8_t* buf, int64_t pos) {
+		return DiskIoManager::getInstance()->submit(device, [&rn, fd, buf, pos, bufSize] {
+			ssize_t n;
+			do {
+				n = ::pread(fd, buf, bufSize, (off_t)pos);
+			} while(n == -1 && errno == EINTR);
+
+			if(n == -1)
+				throw FileException(Util::translateError(errno));
+			rn = static_cast<size_t>(n);
+		});
+	};
+
+	auto pending = readAt(hbuf, 0);
+	ScopedFunctor([&pending] { try { pending->wait(); } catch(const Exception&) { } });
+
+	try {
+		pending->wait();
+	} catch(const FileException& e) {
+		dcdebug("First read failed: %s\n", e.getError().c_str());
+		return READ_FAILED;
+	}
+
+	int64_t pos = 0;
+	size_t hn = rn;
+	bool go = true;
+	while(hn == bufSize && go) {
+		pending = readAt(rbuf, pos + hn);
+
+		go = callback(hbuf, hn);
+
+#ifdef POSIX_FADV_DONTNEED
+		// bypass the cache as far as we can, the data won't be needed again soon
+		posix_fadvise(fd, (off_t)pos, (off_t)hn, POSIX_FADV_DONTNEED);
+#endif
+		pos += hn;
+
+		pending->wait();
+		hn = rn;
+		swap(rbuf, hbuf);
+	}
+
+	if(hn != 0 && go) {
+		// Process leftovers
+		callback(hbuf, hn);
+		pos += hn;
+	}
+
+	return static_cast<size_t>(pos);
 }
 
 static const int64_t BUF_SIZE = 0x1000000 - (0x1000000 % getpagesize());
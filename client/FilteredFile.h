@@ -51,6 +51,27 @@ private:
 	int64_t count;
 };
 
+/** Writes everything to two streams; sizes reported are those of the first one */
+template<bool managed>
+class TeeOutputStream : public OutputStream {
+public:
+	using OutputStream::write;
+	TeeOutputStream(OutputStream* aStream, OutputStream* aStream2) : s(aStream), s2(aStream2) { }
+	~TeeOutputStream() { if(managed) { delete s; delete s2; } }
+
+	size_t flush() {
+		s2->flush();
+		return s->flush();
+	}
+	size_t write(const void* buf, size_t len) {
+		s2->write(buf, len);
+		return s->write(buf, len);
+	}
+private:
+	OutputStream* s;
+	OutputStream* s2;
+};
+
 template<class Filter, bool managed>
 class CalcOutputStream : public OutputStream {
 public:
@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2001-2011 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "stdinc.h"
+#include "GeoIP.h"
+
+#include "File.h"
+#include "ResourceManager.h"
+#include "Text.h"
+#include "Util.h"
+
+#include <unordered_map>
+
+#ifdef _WIN32
+#include "w.h"
+#include <intrin.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace dcpp {
+
+struct GeoIP::Header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t v4Count;
+	uint32_t v6Count;
+	uint32_t countryCount;
+	uint32_t namesSize;
+	/** Size of the IPv4 CSV the table was built from */
+	int64_t sourceSize;
+};
+
+namespace {
+
+const uint32_t MAGIC = 0x50496547; // "GeIP"
+const uint32_t VERSION = 1;
+
+/** Number of trailing one bits, v must have a zero bit */
+inline unsigned trailingOnes(size_t v) {
+	v = ~v;
+#ifdef _MSC_VER
+	unsigned long i;
+#ifdef _WIN64
+	_BitScanForward64(&i, v);
+#else
+	_BitScanForward(&i, v);
+#endif
+	return i;
+#else
+	return __builtin_ctzl(v);
+#endif
+}
+
+/**
+ * Position (1 based, 0 for none) of the first key not less than x in a table
+ * laid out in Eytzinger order: node k has its children at 2k and 2k + 1.
+ */
+template<typename T>
+inline size_t lowerBound(const T* keys, size_t n, T x) {
+	size_t k = 1;
+	while(k <= n)
+		k = 2 * k + (keys[k - 1] < x);
+	// back up over the right turns taken after the last left one
+	return k >> (trailingOnes(k) + 1);
+}
+
+/** A range of addresses [start, end] and its country */
+template<typename T>
+struct Span {
+	T start;
+	T end;
+	uint16_t country;
+
+	bool operator<(const Span& rhs) const { return start < rhs.start; }
+};
+
+/** An entry of the table: the end of a range, the gaps in between map to country 0 */
+template<typename T>
+struct Range {
+	T end;
+	uint16_t country;
+};
+
+template<typename T>
+vector<Range<T>> toRanges(vector<Span<T>>& spans) {
+	std::sort(spans.begin(), spans.end());
+
+	vector<Range<T>> ret;
+	ret.reserve(spans.size() * 2);
+	for(auto& s: spans) {
+		if(!ret.empty() && s.end <= ret.back().end)
+			continue;
+
+		if(ret.empty() ? s.start > 0 : s.start > ret.back().end + 1) {
+			Range<T> gap = { static_cast<T>(s.start - 1), 0 };
+			ret.push_back(gap);
+		}
+		Range<T> r = { s.end, s.country };
+		ret.push_back(r);
+	}
+	return ret;
+}
+
+/** Lays the sorted ranges out in Eytzinger order by an in-order walk of the implicit tree */
+template<typename T>
+void layout(const vector<Range<T>>& sorted, size_t& i, size_t k, vector<T>& keys, vector<uint16_t>& values) {
+	if(k > sorted.size())
+		return;
+
+	layout(sorted, i, 2 * k, keys, values);
+	keys[k - 1] = sorted[i].end;
+	values[k - 1] = sorted[i].country;
+	++i;
+	layout(sorted, i, 2 * k + 1, keys, values);
+}
+
+string trimField(const char* b, const char* e) {
+	while(b < e && (*b == ' ' || *b == '"'))
+		++b;
+	while(e > b && (e[-1] == ' ' || e[-1] == '"' || e[-1] == '\r'))
+		--e;
+	return string(b, e);
+}
+
+/** Calls f with the fields of every line; the sixth, the country name, may contain commas */
+template<typename F>
+void parseCsv(const string& data, F f) {
+	string fields[6];
+	const char* p = data.c_str();
+	const char* end = p + data.size();
+	while(p < end) {
+		const char* eol = std::find(p, end, '\n');
+		int n = 0;
+		for(; n < 5; ++n) {
+			const char* c = std::find(p, eol, ',');
+			if(c == eol)
+				break;
+			fields[n] = trimField(p, c);
+			p = c + 1;
+		}
+		if(n == 5) {
+			fields[5] = trimField(p, eol);
+			f(fields);
+		}
+		p = eol + 1;
+	}
+}
+
+/** Parses the ':' separated hex groups in [b, e); a dotted IPv4 tail counts as two. -1 when malformed */
+int parseGroups(const char* b, const char* e, uint16_t* out, int maxGroups) {
+	int n = 0;
+	while(b < e) {
+		const char* c = std::find(b, e, ':');
+		if(std::find(b, c, '.') != c) {
+			// the low 32 bits, never part of the prefix
+			if(c != e || n + 2 > maxGroups)
+				return -1;
+			out[n++] = 0;
+			out[n++] = 0;
+			break;
+		}
+
+		if(c == b || c - b > 4 || n == maxGroups)
+			return -1;
+
+		uint16_t g = 0;
+		for(; b < c; ++b) {
+			char ch = *b;
+			int d = (ch >= '0' && ch <= '9') ? ch - '0' : (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10 : (ch >= 'A' && ch <= 'F') ? ch - 'A' + 10 : -1;
+			if(d == -1)
+				return -1;
+			g = static_cast<uint16_t>(g << 4 | d);
+		}
+		out[n++] = g;
+
+		if(c == e)
+			break;
+		b = c + 1;
+		if(b == e)
+			return -1;
+	}
+	return n;
+}
+
+} // namespace
+
+GeoIP::GeoIP() : view(NULL), viewSize(0),
+#ifdef _WIN32
+	mapping(NULL),
+#endif
+	v4Keys(NULL), v4Values(NULL), v4Count(0), v6Keys(NULL), v6Values(NULL), v6Count(0)
+{
+}
+
+GeoIP::~GeoIP() {
+	close();
+}
+
+void GeoIP::compile(const string& v4File, const string& v6File, const string& target) {
+	StringPairList countries(1, make_pair(Util::emptyString, string("??")));
+	std::unordered_map<string, uint16_t> index;
+	auto addCountry = [&](const string& name, string code) -> uint16_t {
+		code.resize(2, '?');
+		auto i = index.find(code + name);
+		if(i != index.end())
+			return i->second;
+		if(countries.size() > UINT16_MAX)
+			return 0;
+		countries.push_back(make_pair(name, code));
+		return index[code + name] = static_cast<uint16_t>(countries.size() - 1);
+	};
+
+	vector<Span<uint32_t>> v4Spans;
+	int64_t sourceSize;
+	{
+		// "1.0.0.0","1.0.0.255","16777216","16777471","AU","Australia"
+		File f(v4File, File::READ, File::OPEN);
+		sourceSize = f.getSize();
+		parseCsv(f.read(), [&](const string (&fields)[6]) {
+			Span<uint32_t> s = { Util::toUInt32(fields[2]), Util::toUInt32(fields[3]), addCountry(fields[5], fields[4]) };
+			if(s.start <= s.end)
+				v4Spans.push_back(s);
+		});
+	}
+
+	vector<Span<uint64_t>> v6Spans;
+	if(Util::fileExists(v6File)) {
+		// "2001:200::", "2001:200:ffff:ffff:ffff:ffff:ffff:ffff", "4254...", "4254...", "JP", "Japan"
+		parseCsv(File(v6File, File::READ, File::OPEN).read(), [&](const string (&fields)[6]) {
+			Span<uint64_t> s = { 0, 0, 0 };
+			if(parsePrefix(fields[0], s.start) && parsePrefix(fields[1], s.end) && s.start <= s.end) {
+				s.country = addCountry(fields[5], fields[4]);
+				v6Spans.push_back(s);
+			}
+		});
+	}
+
+	auto v4 = toRanges(v4Spans);
+	auto v6 = toRanges(v6Spans);
+
+	vector<uint32_t> v4Keys(v4.size());
+	vector<uint16_t> v4Values(v4.size());
+	size_t i = 0;
+	layout(v4, i, 1, v4Keys, v4Values);
+
+	vector<uint64_t> v6Keys(v6.size());
+	vector<uint16_t> v6Values(v6.size());
+	i = 0;
+	layout(v6, i, 1, v6Keys, v6Values);
+
+	string names;
+	for(auto& c: countries)
+		names += c.second + c.first + '\0';
+
+	Header h = { MAGIC, VERSION, static_cast<uint32_t>(v4Keys.size()), static_cast<uint32_t>(v6Keys.size()),
+		static_cast<uint32_t>(countries.size()), static_cast<uint32_t>(names.size()), sourceSize };
+
+	// widest first, so that every array is aligned to its element
+	string tmp = target + ".tmp";
+	{
+		File out(tmp, File::WRITE, File::CREATE | File::TRUNCATE);
+		out.write(&h, sizeof(h));
+		if(!v6Keys.empty())
+			out.write(&v6Keys[0], v6Keys.size() * sizeof(uint64_t));
+		if(!v4Keys.empty())
+			out.write(&v4Keys[0], v4Keys.size() * sizeof(uint32_t));
+		if(!v6Values.empty())
+			out.write(&v6Values[0], v6Values.size() * sizeof(uint16_t));
+		if(!v4Values.empty())
+			out.write(&v4Values[0], v4Values.size() * sizeof(uint16_t));
+		out.write(names);
+	}
+	File::renameFile(tmp, target);
+}
+
+bool GeoIP::load(const string& path, int64_t sourceSize) noexcept {
+	close();
+
+#ifdef _WIN32
+	HANDLE f = ::CreateFile(Text::toT(path).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(f == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if(::GetFileSizeEx(f, &size) && size.QuadPart >= static_cast<LONGLONG>(sizeof(Header))) {
+		mapping = ::CreateFileMapping(f, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(mapping) {
+			view = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			viewSize = static_cast<size_t>(size.QuadPart);
+		}
+	}
+	::CloseHandle(f);
+#else
+	int f = ::open(Text::fromUtf8(path).c_str(), O_RDONLY);
+	if(f == -1)
+		return false;
+
+	struct stat s;
+	if(::fstat(f, &s) == 0 && s.st_size >= static_cast<off_t>(sizeof(Header))) {
+		void* p = ::mmap(0, s.st_size, PROT_READ, MAP_SHARED, f, 0);
+		if(p != MAP_FAILED) {
+			view = p;
+			viewSize = static_cast<size_t>(s.st_size);
+		}
+	}
+	::close(f);
+#endif
+
+	if(!view) {
+		close();
+		return false;
+	}
+
+	const Header& h = *static_cast<const Header*>(view);
+	uint64_t expected = sizeof(Header) + static_cast<uint64_t>(h.v6Count) * (sizeof(uint64_t) + sizeof(uint16_t)) +
+		static_cast<uint64_t>(h.v4Count) * (sizeof(uint32_t) + sizeof(uint16_t)) + h.namesSize;
+	if(h.magic != MAGIC || h.version != VERSION || expected != viewSize || h.countryCount == 0 ||
+		(sourceSize != -1 && h.sourceSize != sourceSize))
+	{
+		close();
+		return false;
+	}
+
+	const uint8_t* p = static_cast<const uint8_t*>(view) + sizeof(Header);
+	v6Keys = reinterpret_cast<const uint64_t*>(p);
+	p += h.v6Count * sizeof(uint64_t);
+	v4Keys = reinterpret_cast<const uint32_t*>(p);
+	p += h.v4Count * sizeof(uint32_t);
+	v6Values = reinterpret_cast<const uint16_t*>(p);
+	p += h.v6Count * sizeof(uint16_t);
+	v4Values = reinterpret_cast<const uint16_t*>(p);
+	p += h.v4Count * sizeof(uint16_t);
+	v4Count = h.v4Count;
+	v6Count = h.v6Count;
+
+	// a few hundred names, copied out so that callers can hold on to them
+	const char* n = reinterpret_cast<const char*>(p);
+	const char* end = n + h.namesSize;
+	countries.reserve(h.countryCount);
+	for(uint32_t i = 0; i < h.countryCount; ++i) {
+		const char* z = std::find(n, end, '\0');
+		if(z == end || z - n < 2) {
+			close();
+			return false;
+		}
+		countries.push_back(make_pair(string(n + 2, z), string(n, 2)));
+		n = z + 1;
+	}
+	countries[0].first = STRING(UNKNOWN);
+
+	return true;
+}
+
+void GeoIP::close() noexcept {
+#ifdef _WIN32
+	if(view)
+		::UnmapViewOfFile(view);
+	if(mapping)
+		::CloseHandle(mapping);
+	mapping = NULL;
+#else
+	if(view)
+		::munmap(view, viewSize);
+#endif
+	view = NULL;
+	viewSize = 0;
+
+	v4Keys = NULL;
+	v4Values = NULL;
+	v4Count = 0;
+	v6Keys = NULL;
+	v6Values = NULL;
+	v6Count = 0;
+	countries.clear();
+}
+
+int GeoIP::find(uint32_t ip) const {
+	size_t k = lowerBound(v4Keys, v4Count, ip);
+	if(k == 0)
+		return -1;
+	uint16_t c = v4Values[k - 1];
+	return c < countries.size() ? c : 0;
+}
+
+int GeoIP::find(const string& ip6) const {
+	uint64_t prefix;
+	if(!parsePrefix(ip6, prefix))
+		return -1;
+
+	size_t k = lowerBound(v6Keys, v6Count, prefix);
+	if(k == 0)
+		return -1;
+	uint16_t c = v6Values[k - 1];
+	return c < countries.size() ? c : 0;
+}
+
+bool GeoIP::parsePrefix(const string& ip6, uint64_t& prefix) {
+	uint16_t groups[8] = { 0 };
+	const char* b = ip6.c_str();
+	const char* e = b + ip6.size();
+
+	string::size_type gap = ip6.find("::");
+	if(gap == string::npos) {
+		if(parseGroups(b, e, groups, 8) != 8)
+			return false;
+	} else {
+		int head = parseGroups(b, b + gap, groups, 7);
+		if(head < 0)
+			return false;
+
+		uint16_t tail[8];
+		int n = parseGroups(b + gap + 2, e, tail, 7 - head);
+		if(n < 0)
+			return false;
+		std::copy(tail, tail + n, groups + 8 - n);
+	}
+
+	prefix = static_cast<uint64_t>(groups[0]) << 48 | static_cast<uint64_t>(groups[1]) << 32 |
+		static_cast<uint64_t>(groups[2]) << 16 | groups[3];
+	return true;
+}
+
+} // namespace dcpp
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2001-2011 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_GEOIP_H
+#define DCPLUSPLUS_DCPP_GEOIP_H
+
+#include <boost/noncopyable.hpp>
+
+#include "typedefs.h"
+
+namespace dcpp {
+
+/**
+ * Country of an IP address. The MaxMind CSVs are compiled into a range table
+ * (GeoIP.bin, native byte order) that is mapped into memory as is. The ranges
+ * are stored in Eytzinger (breadth first) order, so a lookup walks down the
+ * first few cache lines of the table and the comparisons don't branch.
+ */
+class GeoIP : boost::noncopyable {
+public:
+	GeoIP();
+	~GeoIP();
+
+	/**
+	 * Compile the IPv4 CSV, and the IPv6 one when it exists, into target.
+	 * @throw FileException
+	 */
+	static void compile(const string& v4File, const string& v6File, const string& target);
+
+	/** Map a compiled table; sourceSize is the IPv4 CSV's size it must have been built from, -1 to take any */
+	bool load(const string& path, int64_t sourceSize = -1) noexcept;
+	void close() noexcept;
+
+	/** Index into getCountries(), 0 for an address between ranges and -1 past the last one */
+	int find(uint32_t ip) const;
+	/** IPv6 ranges are looked up by the routing prefix, no country gets anything finer than a /64 */
+	int find(const string& ip6) const;
+
+	/** (name, code) pairs */
+	const StringPairList& getCountries() const { return countries; }
+
+	/** Upper 64 bits of a textual IPv6 address */
+	static bool parsePrefix(const string& ip6, uint64_t& prefix);
+
+private:
+	struct Header;
+
+	void* view;
+	size_t viewSize;
+#ifdef _WIN32
+	void* mapping;
+#endif
+
+	const uint32_t* v4Keys;
+	const uint16_t* v4Values;
+	size_t v4Count;
+	const uint64_t* v6Keys;
+	const uint16_t* v6Values;
+	size_t v6Count;
+
+	StringPairList countries;
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_GEOIP_H)
@@ -25,16 +25,18 @@ uint64_t HashBloom::get_m(size_t n, size_t k) {
 
 void HashBloom::add(const TTHValue& tth) {
 	for(size_t i = 0; i < k; ++i) {
-		bloom[pos(tth, i)] = true;
+		size_t bit = pos(tth, i);
+		bloom[bit / 64] |= static_cast<uint64_t>(1) << (bit % 64);
 	}
 }
 
 bool HashBloom::match(const TTHValue& tth) const {
-	if(bloom.empty()) {
+	if(m == 0) {
 		return false;
 	}
 	for(size_t i = 0; i < k; ++i) {
-		if(!bloom[pos(tth, i)]) {
+		size_t bit = pos(tth, i);
+		if(!(bloom[bit / 64] & (static_cast<uint64_t>(1) << (bit % 64)))) {
 			return false;
 		}
 	}
@@ -42,39 +44,51 @@ bool HashBloom::match(const TTHValue& tth) const {
 }
 
 void HashBloom::push_back(bool v) {
-	bloom.push_back(v);
+	if(m % 64 == 0) {
+		bloom.push_back(0);
+	}
+	if(v) {
+		bloom[m / 64] |= static_cast<uint64_t>(1) << (m % 64);
+	}
+	++m;
 }
 
-void HashBloom::reset(size_t k_, size_t m, size_t h_) {
-	bloom.resize(m);
+void HashBloom::reset(size_t k_, size_t m_, size_t h_) {
+	bloom.assign((m_ + 63) / 64, 0);
+	m = m_;
 	k = k_;
 	h = h_;
 }
 
+void HashBloom::clear() {
+	std::fill(bloom.begin(), bloom.end(), 0);
+}
+
 size_t HashBloom::pos(const TTHValue& tth, size_t n) const {
 	if((n+1)*h > TTHValue::BITS) {
 		return 0;
 	}
 	
-	uint64_t x = 0;
-	
+	// bits [n * h, (n + 1) * h) of the hash, least significant bit of each byte first
 	size_t start = n * h;
-	for(size_t i = 0; i < h; ++i) {
-		size_t bit = start + i;
-		size_t byte = bit / 8;
-		size_t pos = bit % 8;
-		
-		if(tth.data[byte] & (1 << pos)) {
-			x |= static_cast<uint64_t>(1 << i);
-		}
+	size_t byte = start / 8;
+	size_t shift = start % 8;
+	size_t bytes = (shift + h + 7) / 8;
+
+	uint64_t x = tth.data[byte] >> shift;
+	for(size_t i = 1; i < bytes; ++i) {
+		x |= static_cast<uint64_t>(tth.data[byte + i]) << (8 * i - shift);
+	}
+	if(h < 64) {
+		x &= (static_cast<uint64_t>(1) << h) - 1;
 	}
-	return x % bloom.size();
+	return static_cast<size_t>(x % m);
 }
 
 void HashBloom::copy_to(ByteVector& v) const {
-	v.resize(bloom.size() / 8);
-	for(size_t i = 0; i < bloom.size(); ++i) {
-		v[i/8] |= bloom[i] << (i % 8);
+	v.resize(m / 8);
+	for(size_t i = 0; i < v.size(); ++i) {
+		v[i] = static_cast<uint8_t>(bloom[i / 8] >> (i % 8 * 8));
 	}
 }
 
@@ -16,7 +16,7 @@ namespace dcpp {
  */
 class HashBloom {
 public:
-	HashBloom() : k(0), h(0) { }
+	HashBloom() : m(0), k(0), h(0) { }
 
 	/** Return a suitable value for k based on n */
 	static size_t get_k(size_t n, size_t h);
@@ -25,15 +25,22 @@ public:
 	
 	void add(const TTHValue& tth);
 	bool match(const TTHValue& tth) const;
+	/** Clears the filter and sets it up for k hashes of h bits into m bits */
 	void reset(size_t k, size_t m, size_t h);
+	/** Clears the bits but keeps the parameters */
+	void clear();
 	void push_back(bool v);
+
+	bool isFor(size_t k_, size_t m_, size_t h_) const { return m != 0 && k == k_ && m == m_ && h == h_; }
 	
 	void copy_to(ByteVector& v) const;
 private:	
 	
 	size_t pos(const TTHValue& tth, size_t n) const;
 	
-	std::vector<bool> bloom;
+	/** Bit i is bit i % 64 of word i / 64, the same order as the bytes on the wire */
+	std::vector<uint64_t> bloom;
+	size_t m;
 	size_t k;
 	size_t h;
 };
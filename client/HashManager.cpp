@@ -21,9 +21,11 @@
 
 #include <boost/scoped_array.hpp>
 
+#include "DiskIoManager.h"
 #include "File.h"
 #include "FileReader.h"
 #include "LogManager.h"
+#include "Metrics.h"
 #include "ScopedFunctor.h"
 #include "SimpleXML.h"
 #include "ZUtils.h"
@@ -41,6 +43,10 @@ using std::swap;
 #define HASH_FILE_VERSION_STRING "3"
 static const uint32_t HASH_FILE_VERSION = 3;
 const int64_t HashManager::MIN_BLOCK_SIZE = 64 * 1024;
+const int64_t HashManager::CHUNKED_SIZE = 256 * 1024 * 1024;
+
+/** Size of the ranges a chunked file is read in, rounded up to whole leaves */
+static const int64_t CHUNK_SIZE = 64 * 1024 * 1024;
 
 optional<TTHValue> HashManager::getTTH(const string& aFileName, int64_t aSize, uint32_t aTimeStamp) noexcept {
 	Lock l(cs);
@@ -96,6 +102,33 @@ void HashManager::HashStore::addFile(const string& aFileName, uint32_t aTimeStam
 	}
 
 	fileList.emplace_back(fname, tth.getRoot(), aTimeStamp, aUsed);
+	partialIndex.erase(aFileName);
+	dirty = true;
+}
+
+bool HashManager::HashStore::getPartial(const string& aFileName, int64_t aSize, uint32_t aTimeStamp, int64_t aBlockSize, vector<TTHValue>& leaves) {
+	auto i = partialIndex.find(aFileName);
+	if(i == partialIndex.end())
+		return false;
+
+	const PartialInfo& pi = i->second;
+	if(pi.size != aSize || pi.timeStamp != aTimeStamp || pi.blockSize != aBlockSize) {
+		// the file has changed since, start over
+		partialIndex.erase(i);
+		dirty = true;
+		return false;
+	}
+
+	leaves = pi.leaves;
+	return true;
+}
+
+void HashManager::HashStore::setPartial(const string& aFileName, int64_t aSize, uint32_t aTimeStamp, int64_t aBlockSize, const vector<TTHValue>& leaves) {
+	PartialInfo& pi = partialIndex[aFileName];
+	pi.size = aSize;
+	pi.timeStamp = aTimeStamp;
+	pi.blockSize = aBlockSize;
+	pi.leaves = leaves;
 	dirty = true;
 }
 
@@ -272,6 +305,15 @@ void HashManager::HashStore::rebuild() {
 			}
 		}
 
+		// checkpoints of files that are gone or have changed won't be resumed
+		for(auto i = partialIndex.begin(); i != partialIndex.end();) {
+			if(File::getSize(i->first) != i->second.size) {
+				partialIndex.erase(i++);
+			} else {
+				++i;
+			}
+		}
+
 		File::deleteFile(origName);
 		File::renameFile(tmpName, origName);
 		treeIndex = newTreeIndex;
@@ -326,7 +368,26 @@ void HashManager::HashStore::save() {
 					f.write(LIT("\"/>\r\n"));
 				}
 			}
-			f.write(LIT("\t</Files>\r\n</HashStore>"));
+			f.write(LIT("\t</Files>\r\n\t<Partials>\r\n"));
+
+			for (auto& i: partialIndex) {
+				const PartialInfo& pi = i.second;
+				f.write(LIT("\t\t<Partial Name=\""));
+				f.write(SimpleXML::escape(i.first, tmp, true));
+				f.write(LIT("\" Size=\""));
+				f.write(Util::toString(pi.size));
+				f.write(LIT("\" TimeStamp=\""));
+				f.write(Util::toString(pi.timeStamp));
+				f.write(LIT("\" BlockSize=\""));
+				f.write(Util::toString(pi.blockSize));
+				f.write(LIT("\" Leaves=\""));
+				for (auto& leaf: pi.leaves) {
+					b32tmp.clear();
+					f.write(leaf.toBase32(b32tmp));
+				}
+				f.write(LIT("\"/>\r\n"));
+			}
+			f.write(LIT("\t</Partials>\r\n</HashStore>"));
 			f.flush();
 			ff.close();
 			File::deleteFile( getIndexFile());
@@ -355,6 +416,7 @@ public:
 		version(HASH_FILE_VERSION),
 		inTrees(false),
 		inFiles(false),
+		inPartials(false),
 		inHashStore(false)
 	{ }
 	void startTag(const string& name, StringPairList& attribs, bool simple);
@@ -372,6 +434,7 @@ private:
 
 	bool inTrees;
 	bool inFiles;
+	bool inPartials;
 	bool inHashStore;
 };
 
@@ -502,6 +565,9 @@ static const string sIndex = "Index";
 static const string sBlockSize = "BlockSize";
 static const string sTimeStamp = "TimeStamp";
 static const string sRoot = "Root";
+static const string sPartials = "Partials";
+static const string sPartial = "Partial";
+static const string sLeaves = "Leaves";
 
 void HashLoader::startTag(const string& name, StringPairList& attribs, bool simple) {
 	ScopedFunctor([this] {
@@ -543,10 +609,24 @@ void HashLoader::startTag(const string& name, StringPairList& attribs, bool simp
 				}
 			}
 			
+		} else if (inPartials && name == sPartial) {
+			file = getAttrib(attribs, sName, 0);
+			HashManager::HashStore::PartialInfo pi;
+			pi.size = Util::toInt64(getAttrib(attribs, sSize, 1));
+			pi.timeStamp = Util::toUInt32(getAttrib(attribs, sTimeStamp, 2));
+			pi.blockSize = Util::toInt64(getAttrib(attribs, sBlockSize, 3));
+			const string& leaves = getAttrib(attribs, sLeaves, 4);
+			if(!file.empty() && pi.blockSize >= HashManager::MIN_BLOCK_SIZE && leaves.size() % 39 == 0) {
+				for(size_t i = 0; i < leaves.size(); i += 39)
+					pi.leaves.push_back(TTHValue(leaves.substr(i, 39)));
+				store.partialIndex[file] = std::move(pi);
+			}
 		} else if (name == sTrees) {
 			inTrees = !simple;
 		} else if (name == sFiles) {
 			inFiles = !simple;
+		} else if (name == sPartials) {
+			inPartials = !simple;
 		}
 	}
 }
@@ -652,7 +732,119 @@ void HashManager::Hasher::instantPause() {
 		s.wait();
 }
 
+bool HashManager::Hasher::hashChunked(const string& fileName, File& f, uint32_t timeStamp, TigerTree& tt) {
+	static Counter& hashedBytes = Metrics::counter("hash.bytes");
+
+	// Leaves only depend on the bytes of their own block, so leaf-aligned chunks can be hashed
+	// independently and their leaves concatenated. Chunks run on the hashing threads of the file's
+	// device, the ones completed in order are checkpointed to the store and resumed from.
+	struct Chunk {
+		vector<TTHValue> leaves;
+		DiskIoManager::OpPtr op;
+	};
+
+	const int64_t size = f.getSize();
+	const int64_t bs = tt.getBlockSize();
+	const size_t leaves = TigerTree::calcBlocks(size, bs);
+	const size_t chunkLeaves = static_cast<size_t>(max(CHUNK_SIZE / bs, static_cast<int64_t>(1)));
+	const size_t window = static_cast<size_t>(max(SETTING(DISK_QUEUE_DEPTH), 1));
+	const string device = DiskIoManager::getDevice(fileName);
+
+	vector<TTHValue> done;
+	if(HashManager::getInstance()->getPartial(fileName, size, timeStamp, bs, done) && !done.empty()) {
+		dcdebug("Resuming %s at leaf %u/%u\n", fileName.c_str(), (unsigned)done.size(), (unsigned)leaves);
+		Lock l(cs);
+		currentSize = max(currentSize - static_cast<int64_t>(done.size()) * bs, static_cast<int64_t>(0));
+	}
+
+	deque<shared_ptr<Chunk>> chunks;
+	// the chunks read f, none may be left running when we return
+	ScopedFunctor([&chunks] {
+		for(auto& c: chunks) {
+			try { c->op->wait(); } catch(const FileException&) { }
+		}
+	});
+
+	size_t next = done.size();
+	uint64_t lastRead = GET_TICK();
+	uint64_t lastCheckpoint = GET_TICK();
+
+	while(done.size() < leaves) {
+		while(chunks.size() < window && next < leaves) {
+			auto c = std::make_shared<Chunk>();
+			int64_t start = static_cast<int64_t>(next) * bs;
+			next = min(next + chunkLeaves, leaves);
+			int64_t end = min(size, static_cast<int64_t>(next) * bs);
+
+			c->op = DiskIoManager::getInstance()->submit(device, [this, &f, c, start, end, bs] {
+				TigerTree part(bs);
+				ByteVector buf(static_cast<size_t>(min(end - start, static_cast<int64_t>(1024 * 1024))));
+				for(int64_t pos = start; pos < end; ) {
+					if(stop)
+						return;
+					size_t n = f.readAt(&buf[0], static_cast<size_t>(min(end - pos, static_cast<int64_t>(buf.size()))), pos);
+					if(n == 0)
+						throw FileException(_("File was truncated while hashing"));
+					part.update(&buf[0], n);
+					hashedBytes.add(n);
+					pos += n;
+				}
+				part.finalize();
+				c->leaves = part.getLeaves();
+			}, DiskIoManager::POOL_HASH);
+			chunks.push_back(c);
+		}
+
+		auto c = chunks.front();
+		chunks.pop_front();
+		c->op->wait();
+		if(c->leaves.empty()) {
+			// stopped, keep what was done so far
+			HashManager::getInstance()->setPartial(fileName, size, timeStamp, bs, done);
+			return false;
+		}
+
+		int64_t n = static_cast<int64_t>(c->leaves.size()) * bs;
+		done.insert(done.end(), c->leaves.begin(), c->leaves.end());
+
+		{
+			Lock l(cs);
+			currentSize = max(currentSize - n, static_cast<int64_t>(0));
+		}
+
+		if(SETTING(MAX_HASH_SPEED) > 0) {
+			uint64_t minTime = n * 1000LL / (SETTING(MAX_HASH_SPEED) * 1024LL * 1024LL);
+			uint64_t now = GET_TICK();
+			if(lastRead + minTime > now) {
+				Thread::sleep(minTime - (now - lastRead));
+			}
+			lastRead = lastRead + minTime;
+		}
+
+		// the store is saved every minute, more often would only churn
+		if(done.size() < leaves && GET_TICK() - lastCheckpoint >= 30 * 1000) {
+			lastCheckpoint = GET_TICK();
+			HashManager::getInstance()->setPartial(fileName, size, timeStamp, bs, done);
+		}
+
+		instantPause();
+		if(stop) {
+			HashManager::getInstance()->setPartial(fileName, size, timeStamp, bs, done);
+			return false;
+		}
+	}
+
+	tt.getLeaves() = done;
+	tt.setFileSize(size);
+	tt.calcRoot();
+	return true;
+}
+
 int HashManager::Hasher::run() {
+	static Counter& hashedBytes = Metrics::counter("hash.bytes");
+	static Counter& hashedFiles = Metrics::counter("hash.files");
+	static Histogram& fileTime = Metrics::histogram("hash.file");
+
 	setThreadPriority(Thread::IDLE);
 
 	string fname;
@@ -681,6 +873,7 @@ int HashManager::Hasher::run() {
 
 		if(!fname.empty()) {
 			try {
+				ScopedTimer timer(fileTime);
 				auto start = GET_TICK();
 
 				File f(fname, File::READ, File::OPEN);
@@ -692,43 +885,54 @@ int HashManager::Hasher::run() {
 
 				TigerTree tt(bs);
 
-				auto lastRead = GET_TICK();
+				bool complete = true;
+				if(size >= CHUNKED_SIZE) {
+					complete = hashChunked(fname, f, timestamp, tt);
+				} else {
+					auto lastRead = GET_TICK();
+
+					FileReader fr(true);
+
+					fr.read(fname, [&](const void* buf, size_t n) -> bool {
+						if(SETTING(MAX_HASH_SPEED)> 0) {
+							uint64_t now = GET_TICK();
+							uint64_t minTime = n * 1000LL / (SETTING(MAX_HASH_SPEED) * 1024LL * 1024LL);
+							if(lastRead + minTime> now) {
+								Thread::sleep(minTime - (now - lastRead));
+							}
+							lastRead = lastRead + minTime;
+						} else {
+							lastRead = GET_TICK();
+						}
 
-				FileReader fr(true);
+						tt.update(buf, n);
+						hashedBytes.add(n);
 
-				fr.read(fname, [&](const void* buf, size_t n) -> bool {
-					if(SETTING(MAX_HASH_SPEED)> 0) {
-						uint64_t now = GET_TICK();
-						uint64_t minTime = n * 1000LL / (SETTING(MAX_HASH_SPEED) * 1024LL * 1024LL);
-						if(lastRead + minTime> now) {
-							Thread::sleep(minTime - (now - lastRead));
+						{
+							Lock l(cs);
+							currentSize = max(static_cast<uint64_t>(currentSize - n), static_cast<uint64_t>(0));
 						}
-						lastRead = lastRead + minTime;
-					} else {
-						lastRead = GET_TICK();
-					}
-
-					tt.update(buf, n);
+						sizeLeft -= n;
 
-					{
-						Lock l(cs);
-						currentSize = max(static_cast<uint64_t>(currentSize - n), static_cast<uint64_t>(0));
-					}
-					sizeLeft -= n;
+						instantPause();
+						return !stop;
+					});
 
-					instantPause();
-					return !stop;
-				});
+					tt.finalize();
+				}
 
 				f.close();
-				tt.finalize();
-				uint64_t end = GET_TICK();
-				int64_t speed = 0;
-				if(end > start) {
-					speed = size * 1000 / (end - start);
-				}
 
-				HashManager::getInstance()->hashDone(fname, timestamp, tt, speed, size);
+				if(complete) {
+					uint64_t end = GET_TICK();
+					int64_t speed = 0;
+					if(end > start) {
+						speed = size * 1000 / (end - start);
+					}
+
+					HashManager::getInstance()->hashDone(fname, timestamp, tt, speed, size);
+					++hashedFiles;
+				}
 			} catch(const FileException& e) {
 				LogManager::getInstance()->message(str(F_(STRING(ERROR_HASHING) + " %1%: %2%") % Util::addBrackets(fname) % e.getError()), LogManager::LOG_ERROR);
 			}
@@ -51,6 +51,8 @@ public:
 
 	/** We don't keep leaves for blocks smaller than this... */
 	static const int64_t MIN_BLOCK_SIZE;
+	/** Files this large are hashed in leaf-aligned chunks that are hashed in parallel and checkpointed */
+	static const int64_t CHUNKED_SIZE;
 
 	HashManager() {
 		TimerManager::getInstance()->addListener(this);
@@ -140,6 +142,8 @@ private:
 		int64_t currentSize;
 
 		void instantPause();
+		/** @return false when hashing was stopped before the tree was complete */
+		bool hashChunked(const string& fileName, File& f, uint32_t timeStamp, TigerTree& tt);
 	};
 
 	friend class Hasher;
@@ -160,6 +164,10 @@ private:
 		bool getTree(const TTHValue& root, TigerTree& tth);
 		int64_t getBlockSize(const TTHValue& root) const;
 		bool isDirty() { return dirty; }
+
+		/** Leaves hashed so far of a file that is hashed in chunks, if it hasn't changed since */
+		bool getPartial(const string& aFileName, int64_t aSize, uint32_t aTimeStamp, int64_t aBlockSize, vector<TTHValue>& leaves);
+		void setPartial(const string& aFileName, int64_t aSize, uint32_t aTimeStamp, int64_t aBlockSize, const vector<TTHValue>& leaves);
 	private:
 		/** Root -> tree mapping info, we assume there's only one tree for each root (a collision would mean we've broken tiger...) */
 		struct TreeInfo {
@@ -185,11 +193,22 @@ private:
 			GETSET(bool, used, Used);
 		};
 
+		/** Checkpoint of a file whose hashing was interrupted */
+		struct PartialInfo {
+			PartialInfo() : size(0), timeStamp(0), blockSize(0) { }
+
+			int64_t size;
+			uint32_t timeStamp;
+			int64_t blockSize;
+			vector<TTHValue> leaves;
+		};
+
 		friend class HashLoader;
 
 		unordered_map<string, vector<FileInfo>> fileIndex;
 		unordered_map<TTHValue, TreeInfo> treeIndex;
 		unordered_map<string, vector<FileInfo>> legacyIndex;
+		unordered_map<string, PartialInfo> partialIndex;
 
 		bool dirty;
 
@@ -214,6 +233,15 @@ private:
 
 	void hashDone(const string& aFileName, uint32_t aTimeStamp, const TigerTree& tth, int64_t speed, int64_t size);
 
+	bool getPartial(const string& aFileName, int64_t aSize, uint32_t aTimeStamp, int64_t aBlockSize, vector<TTHValue>& leaves) {
+		Lock l(cs);
+		return store.getPartial(aFileName, aSize, aTimeStamp, aBlockSize, leaves);
+	}
+	void setPartial(const string& aFileName, int64_t aSize, uint32_t aTimeStamp, int64_t aBlockSize, const vector<TTHValue>& leaves) {
+		Lock l(cs);
+		store.setPartial(aFileName, aSize, aTimeStamp, aBlockSize, leaves);
+	}
+
 	void doRebuild() {
 		Lock l(cs);
 		store.rebuild();
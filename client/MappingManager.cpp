@@ -63,7 +63,18 @@ bool MappingManager::open() {
 }
 
 void MappingManager::close() {
-	TimerManager::getInstance()->removeListener(this);
+	// removeTask waits for a renewal that is running, which may schedule the next one meanwhile
+	for(;;) {
+		TimerManager::TaskId task;
+		{
+			Lock l(cs);
+			task = renewalTask;
+			renewalTask = 0;
+		}
+		if(!task)
+			break;
+		TimerManager::getInstance()->removeTask(task);
+	}
 
 	if(working.get()) {
 		close(*working);
@@ -92,7 +103,7 @@ int MappingManager::run() {
 		ScopedFunctor([&mapper] { mapper.uninit(); });
 		if(!mapper.init()) {
 			// can't renew; try again later.
-			renewal = GET_TICK() + std::max(mapper.renewal(), 10u) * 60 * 1000;
+			scheduleRenewal(mapper.renewal());
 			return 0;
 		}
 
@@ -112,9 +123,7 @@ int MappingManager::run() {
 
 		auto minutes = mapper.renewal();
 		if(minutes) {
-			renewal = GET_TICK() + std::max(minutes, 10u) * 60 * 1000;
-		} else {
-			TimerManager::getInstance()->removeListener(this);
+			scheduleRenewal(minutes);
 		}
 
 		return 0;
@@ -179,8 +188,7 @@ int MappingManager::run() {
 
 		auto minutes = mapper.renewal();
 		if(minutes) {
-			renewal = GET_TICK() + std::max(minutes, 10u) * 60 * 1000;
-			TimerManager::getInstance()->addListener(this);
+			scheduleRenewal(minutes);
 		}
 		break;
 	}
@@ -217,9 +225,22 @@ string MappingManager::deviceString(Mapper& mapper) const {
 	return '"' + name + '"';
 }
 
-void MappingManager::on(TimerManagerListener::Minute, uint64_t tick) noexcept {
-	if(tick >= renewal && !busy.test_and_set())
-		start();
+void MappingManager::scheduleRenewal(unsigned minutes) {
+	// a one-shot task instead of polling the deadline every minute
+	uint64_t delay = std::max(minutes, 10u) * 60 * 1000;
+	renewal = GET_TICK() + delay;
+	Lock l(cs);
+	renewalTask = TimerManager::getInstance()->addTask("MappingManager renewal", [this](uint64_t) { renew(); }, delay);
+}
+
+void MappingManager::renew() {
+	if(busy.test_and_set()) {
+		// a mapping is already being set up; check back in a minute.
+		Lock l(cs);
+		renewalTask = TimerManager::getInstance()->addTask("MappingManager renewal", [this](uint64_t) { renew(); }, 60 * 1000);
+		return;
+	}
+	start();
 }
 
 } // namespace dcpp
@@ -39,8 +39,7 @@ using std::vector;
 
 class MappingManager :
 	public Singleton<MappingManager>,
-	private Thread,
-	private TimerManagerListener
+	private Thread
 {
 public:
 	/** add an implementation derived from the base Mapper class, passed as template parameter.
@@ -60,8 +59,11 @@ private:
 	static atomic_flag busy;
 	unique_ptr<Mapper> working; /// currently working implementation.
 	uint64_t renewal; /// when the next renewal should happen, if requested by the mapper.
+	TimerManager::TaskId renewalTask;
+	/** Guards renewalTask, set by the mapper and timer threads and removed by close() */
+	CriticalSection cs;
 
-	MappingManager() : renewal(0) { }
+	MappingManager() : renewal(0), renewalTask(0) { }
 	~MappingManager() { join(); }
 
 	int run();
@@ -70,7 +72,8 @@ private:
 	void log(const string& message, LogManager::Severity severity);
 	string deviceString(Mapper& mapper) const;
 
-	void on(TimerManagerListener::Minute, uint64_t tick) noexcept;
+	void scheduleRenewal(unsigned minutes);
+	void renew();
 };
 
 } // namespace dcpp
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2001-2011 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "stdinc.h"
+#include "Metrics.h"
+
+#include "File.h"
+#include "SettingsManager.h"
+#include "Util.h"
+
+#include <cstdlib>
+#include <limits>
+#include <new>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace dcpp {
+
+namespace {
+
+/** Index of the highest set bit, v must not be 0 */
+inline unsigned highBit(uint64_t v) {
+#ifdef _MSC_VER
+	unsigned long i;
+#ifdef _WIN64
+	_BitScanReverse64(&i, v);
+#else
+	if(_BitScanReverse(&i, static_cast<unsigned long>(v >> 32)))
+		return i + 32;
+	_BitScanReverse(&i, static_cast<unsigned long>(v));
+#endif
+	return i;
+#else
+	return 63 - __builtin_clzll(v);
+#endif
+}
+
+struct Registry {
+	CriticalSection cs;
+	map<string, unique_ptr<Counter>> counters;
+	map<string, unique_ptr<Histogram>> histograms;
+};
+
+Registry& registry() {
+	static Registry r;
+	return r;
+}
+
+atomic<size_t> nextShard(0);
+TimerManager::TaskId dumpTask = 0;
+
+string promName(const string& name) {
+	string ret = "dcpp_" + name;
+	replace(ret.begin(), ret.end(), '.', '_');
+	return ret;
+}
+
+} // namespace
+
+Counter::Counter() {
+	for(auto& s: shards)
+		s.value = 0;
+}
+
+void* Counter::operator new(size_t size) {
+#ifdef _WIN32
+	void* p = _aligned_malloc(size, alignof(Shard));
+#else
+	void* p = nullptr;
+	if(posix_memalign(&p, alignof(Shard), size) != 0)
+		p = nullptr;
+#endif
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void Counter::operator delete(void* p) {
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+uint64_t Counter::get() const {
+	uint64_t ret = 0;
+	for(auto& s: shards)
+		ret += s.value.load(std::memory_order_relaxed);
+	return ret;
+}
+
+size_t Counter::shard() {
+	static thread_local size_t shard = nextShard++ % SHARDS;
+	return shard;
+}
+
+Histogram::Histogram() : count(0), sum(0), maximum(0) {
+	for(auto& b: buckets)
+		b = 0;
+}
+
+size_t Histogram::bucketOf(uint64_t value) {
+	if(value < SUB_BUCKETS)
+		return static_cast<size_t>(value);
+	unsigned e = highBit(value);
+	return (e - SUB_BITS + 1) * SUB_BUCKETS + static_cast<size_t>(value >> (e - SUB_BITS)) - SUB_BUCKETS;
+}
+
+uint64_t Histogram::bucketStart(size_t i) {
+	if(i < SUB_BUCKETS)
+		return i;
+	unsigned e = static_cast<unsigned>(i / SUB_BUCKETS) + SUB_BITS - 1;
+	return static_cast<uint64_t>(SUB_BUCKETS + i % SUB_BUCKETS) << (e - SUB_BITS);
+}
+
+void Histogram::record(uint64_t value) {
+	buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(value, std::memory_order_relaxed);
+
+	uint64_t cur = maximum.load(std::memory_order_relaxed);
+	while(value > cur && !maximum.compare_exchange_weak(cur, value, std::memory_order_relaxed))
+		;
+}
+
+Histogram::Snapshot Histogram::getSnapshot() const {
+	Snapshot s = { 0, sum, maximum, 0, 0, 0 };
+
+	// buckets are read one by one while others record, so count them rather than trusting the total
+	uint64_t counts[BUCKETS];
+	for(size_t i = 0; i < BUCKETS; ++i) {
+		counts[i] = buckets[i];
+		s.count += counts[i];
+	}
+	if(s.count == 0)
+		return s;
+
+	// report the top of the bucket the percentile falls in, which never exceeds the real max
+	const uint64_t ranks[3] = { (s.count + 1) / 2, (s.count * 9 + 9) / 10, (s.count * 99 + 99) / 100 };
+	uint64_t* const values[3] = { &s.p50, &s.p90, &s.p99 };
+	uint64_t seen = 0;
+	size_t p = 0;
+	for(size_t i = 0; i < BUCKETS && p < 3; ++i) {
+		seen += counts[i];
+		while(p < 3 && seen >= ranks[p]) {
+			uint64_t top = i + 1 < BUCKETS ? bucketStart(i + 1) - 1 : std::numeric_limits<uint64_t>::max();
+			*values[p++] = std::min(top, s.max);
+		}
+	}
+	return s;
+}
+
+TimedCriticalSection::TimedCriticalSection(const string& aName) : depth(0), acquired(0),
+	wait(Metrics::histogram(aName + ".wait")), hold(Metrics::histogram(aName + ".hold"))
+{
+}
+
+Counter& Metrics::counter(const string& name) {
+	auto& r = registry();
+	Lock l(r.cs);
+	auto& c = r.counters[name];
+	if(!c)
+		c.reset(new Counter);
+	return *c;
+}
+
+Histogram& Metrics::histogram(const string& name) {
+	auto& r = registry();
+	Lock l(r.cs);
+	auto& h = r.histograms[name];
+	if(!h)
+		h.reset(new Histogram);
+	return *h;
+}
+
+string Metrics::report() {
+	auto& r = registry();
+	Lock l(r.cs);
+
+	string ret;
+	for(auto& i: r.counters)
+		ret += i.first + ": " + Util::toString(i.second->get()) + "\n";
+	for(auto& i: r.histograms) {
+		auto s = i.second->getSnapshot();
+		ret += i.first + ": count=" + Util::toString(s.count) + " mean=" + Util::toString(s.count ? s.sum / s.count : 0) +
+			"us p50=" + Util::toString(s.p50) + "us p90=" + Util::toString(s.p90) + "us p99=" + Util::toString(s.p99) +
+			"us max=" + Util::toString(s.max) + "us\n";
+	}
+	return ret;
+}
+
+string Metrics::toPrometheus() {
+	auto& r = registry();
+	Lock l(r.cs);
+
+	string ret;
+	for(auto& i: r.counters) {
+		string name = promName(i.first) + "_total";
+		ret += "# TYPE " + name + " counter\n" + name + " " + Util::toString(i.second->get()) + "\n";
+	}
+	for(auto& i: r.histograms) {
+		auto s = i.second->getSnapshot();
+		string name = promName(i.first) + "_microseconds";
+		ret += "# TYPE " + name + " summary\n";
+		ret += name + "{quantile=\"0.5\"} " + Util::toString(s.p50) + "\n";
+		ret += name + "{quantile=\"0.9\"} " + Util::toString(s.p90) + "\n";
+		ret += name + "{quantile=\"0.99\"} " + Util::toString(s.p99) + "\n";
+		ret += name + "{quantile=\"1\"} " + Util::toString(s.max) + "\n";
+		ret += name + "_sum " + Util::toString(s.sum) + "\n";
+		ret += name + "_count " + Util::toString(s.count) + "\n";
+	}
+	return ret;
+}
+
+void Metrics::startup() {
+	// checked every minute so the interval can be changed without a restart
+	dumpTask = TimerManager::getInstance()->addTask("Metrics dump", &Metrics::dump, 60 * 1000, 60 * 1000);
+}
+
+void Metrics::shutdown() {
+	if(dumpTask != 0) {
+		TimerManager::getInstance()->removeTask(dumpTask);
+		dumpTask = 0;
+	}
+}
+
+void Metrics::dump(uint64_t tick) {
+	static uint64_t lastDump = 0;
+
+	uint64_t interval = static_cast<uint64_t>(std::max(SETTING(METRICS_DUMP_INTERVAL), 0)) * 60 * 1000;
+	if(interval == 0 || tick < lastDump + interval)
+		return;
+	lastDump = tick;
+
+	try {
+		string file = Util::getPath(Util::PATH_USER_LOCAL) + "Metrics.log";
+		File f(file, File::WRITE, File::OPEN | File::CREATE);
+		f.setEndPos(0);
+		f.write(Util::formatTime("[%Y-%m-%d %H:%M:%S]\n", GET_TIME()) + report() + "\n");
+	} catch(const FileException&) {
+		// ...
+	}
+}
+
+} // namespace dcpp
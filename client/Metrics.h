@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2001-2011 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_METRICS_H
+#define DCPLUSPLUS_DCPP_METRICS_H
+
+#include <boost/noncopyable.hpp>
+
+#include "atomic.h"
+#include "CriticalSection.h"
+#include "TimerManager.h"
+
+namespace dcpp {
+
+/**
+ * Event counter for hot paths. Every thread bumps its own cache line, so
+ * counting from many threads doesn't bounce a shared one; reading sums them.
+ */
+class Counter : boost::noncopyable {
+public:
+	enum { SHARDS = 16 };
+
+	Counter();
+
+	/** Plain new doesn't honour the shards' alignment before C++17 */
+	static void* operator new(size_t size);
+	static void operator delete(void* p);
+
+	// nothing is ordered by the counts, they are only summed for reports
+	void add(uint64_t n) { shards[shard()].value.fetch_add(n, std::memory_order_relaxed); }
+	Counter& operator++() { add(1); return *this; }
+
+	uint64_t get() const;
+
+	/** Shard of the calling thread, assigned round robin on first use */
+	static size_t shard();
+
+private:
+	struct alignas(64) Shard {
+		atomic<uint64_t> value;
+	};
+
+	Shard shards[SHARDS];
+};
+
+/**
+ * Distribution of durations in microseconds. Buckets are log-linear like a
+ * HDR histogram: 8 per power of two, so percentiles are within 12.5%.
+ */
+class Histogram : boost::noncopyable {
+public:
+	enum {
+		SUB_BITS = 3,
+		SUB_BUCKETS = 1 << SUB_BITS,
+		BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS
+	};
+
+	struct Snapshot {
+		uint64_t count;
+		uint64_t sum;
+		uint64_t max;
+		uint64_t p50;
+		uint64_t p90;
+		uint64_t p99;
+	};
+
+	Histogram();
+
+	void record(uint64_t value);
+	Snapshot getSnapshot() const;
+
+	/** Lowest value that lands in bucket i */
+	static uint64_t bucketStart(size_t i);
+	static size_t bucketOf(uint64_t value);
+
+private:
+	atomic<uint64_t> buckets[BUCKETS];
+	atomic<uint64_t> count;
+	atomic<uint64_t> sum;
+	atomic<uint64_t> maximum;
+};
+
+/** Records the lifetime of the object into a histogram */
+class ScopedTimer : boost::noncopyable {
+public:
+	explicit ScopedTimer(Histogram& aHistogram) : histogram(aHistogram), start(GET_PRECISE_TICK()) { }
+	~ScopedTimer() { histogram.record(GET_PRECISE_TICK() - start); }
+private:
+	Histogram& histogram;
+	uint64_t start;
+};
+
+/**
+ * CriticalSection that records how long callers wait for it (<name>.wait) and
+ * how long it is held from the outermost lock to the matching unlock (<name>.hold).
+ * Use it through TimedLock.
+ */
+class TimedCriticalSection : boost::noncopyable {
+public:
+	explicit TimedCriticalSection(const string& aName);
+
+	void lock() {
+		uint64_t start = GET_PRECISE_TICK();
+		cs.lock();
+		if(depth++ == 0) {
+			acquired = GET_PRECISE_TICK();
+			wait.record(acquired - start);
+		}
+	}
+
+	bool try_lock() {
+		if(!cs.try_lock())
+			return false;
+		if(depth++ == 0)
+			acquired = GET_PRECISE_TICK();
+		return true;
+	}
+
+	void unlock() {
+		if(--depth == 0)
+			hold.record(GET_PRECISE_TICK() - acquired);
+		cs.unlock();
+	}
+
+private:
+	CriticalSection cs;
+	/** Recursion depth of the owner, only touched with cs held */
+	int depth;
+	uint64_t acquired;
+	Histogram& wait;
+	Histogram& hold;
+};
+
+typedef boost::unique_lock<TimedCriticalSection> TimedLock;
+
+/**
+ * Process-wide registry of named counters and histograms. Metrics are created
+ * on first lookup and live until exit, so call sites look them up once and
+ * keep the reference (a function-local static does nicely).
+ */
+class Metrics {
+public:
+	static Counter& counter(const string& name);
+	static Histogram& histogram(const string& name);
+
+	/** One line per metric, for logs */
+	static string report();
+	/** Prometheus text exposition format, names are prefixed with "dcpp_" and dots become underscores */
+	static string toPrometheus();
+
+	/** Appends a timestamped report to Metrics.log every METRICS_DUMP_INTERVAL minutes (0 disables) */
+	static void startup();
+	static void shutdown();
+
+private:
+	static void dump(uint64_t tick);
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_METRICS_H)
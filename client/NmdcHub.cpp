@@ -249,7 +249,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
 			chatMessage.text = chatMessage.text.substr(4);
 		}
 
-		if(PluginManager::getInstance()->runHook(HOOK_CHAT_IN, this, chatMessage.text))
+		if(PluginManager::getInstance()->runHook(PluginManager::CHAT_IN, this, chatMessage.text))
 			return;
 
 		fire(ClientListener::Message(), this, chatMessage);
@@ -874,7 +874,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
 		}
 
 		auto rtUser = findUser(rtNick);
-		if(!rtUser || PluginManager::getInstance()->runHook(HOOK_CHAT_PM_IN, rtUser.get(), message.text))
+		if(!rtUser || PluginManager::getInstance()->runHook(PluginManager::CHAT_PM_IN, rtUser.get(), message.text))
 			return;
 
 		fire(ClientListener::Message(), this, message);
@@ -928,7 +928,7 @@ void NmdcHub::revConnectToMe(const OnlineUser& aUser) {
 
 void NmdcHub::hubMessage(const string& aMessage, bool thirdPerson) { 
 	checkstate(); 
-	if(!PluginManager::getInstance()->runHook(HOOK_CHAT_OUT, this, aMessage))
+	if(!PluginManager::getInstance()->runHook(PluginManager::CHAT_OUT, this, aMessage))
 		send(fromUtf8( "<" + getMyNick() + "> " + escape(thirdPerson ? "/me " + aMessage : aMessage) + "|" ) );
 }
 
@@ -1132,7 +1132,9 @@ void NmdcHub::on(Connected) noexcept {
 
 void NmdcHub::on(Line, const string& aLine) noexcept {
 	Client::on(Line(), aLine);
-	if(PluginManager::getInstance()->runHook(HOOK_NETWORK_HUB_IN, this, validateMessage(aLine, true)))
+	// don't escape every line for nothing
+	if(PluginManager::getInstance()->isHooked(PluginManager::NETWORK_HUB_IN) &&
+		PluginManager::getInstance()->runHook(PluginManager::NETWORK_HUB_IN, this, validateMessage(aLine, true)))
 		return;
 	onLine(aLine);
 }
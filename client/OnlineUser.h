@@ -118,6 +118,7 @@ public:
 	std::map<string, string> getInfo() const;
 	string get(const char* name) const;
 	void set(const char* name, const string& val);
+	void set(const char* name, const char* val, size_t len);
 	bool isSet(const char* name) const;	
 	string getSIDString() const { uint32_t sid = getSID(); return string((const char*)&sid, 4); }
 	
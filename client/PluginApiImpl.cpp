@@ -42,39 +42,6 @@
 
 namespace dcpp {
 
-#define IMPL_HOOKS_COUNT 23
-
-static const char* hookGuids[IMPL_HOOKS_COUNT] = {
-	HOOK_CHAT_IN,
-	HOOK_CHAT_OUT,
-	HOOK_CHAT_PM_IN,
-	HOOK_CHAT_PM_OUT,
-
-	HOOK_TIMER_SECOND,
-	HOOK_TIMER_MINUTE,
-
-	HOOK_HUB_ONLINE,
-	HOOK_HUB_OFFLINE,
-
-	HOOK_NETWORK_HUB_IN,
-	HOOK_NETWORK_HUB_OUT,
-	HOOK_NETWORK_CONN_IN,
-	HOOK_NETWORK_CONN_OUT,
-	HOOK_NETWORK_UDP_IN,
-	HOOK_NETWORK_UDP_OUT,
-
-	HOOK_QUEUE_ADDED,
-	HOOK_QUEUE_MOVED,
-	HOOK_QUEUE_REMOVED,
-	HOOK_QUEUE_FINISHED,
-
-	HOOK_UI_CREATED,
-	HOOK_UI_CHAT_TAGS,
-	HOOK_UI_CHAT_DISPLAY,
-	HOOK_UI_CHAT_COMMAND,
-	HOOK_UI_CHAT_COMMAND_PM
-};
-
 static const char* hostName = APPNAME;
 
 DCHooks PluginApiImpl::dcHooks = {
@@ -213,8 +180,8 @@ void PluginApiImpl::init() {
 	dcCore.register_interface(DCINTF_DCPP_TAGGER, &dcTagger);
 
 	// Create provided hooks (since these outlast any plugin they don't need to be explictly released)
-	for(int i = 0; i < IMPL_HOOKS_COUNT; ++i)
-		dcHooks.create_hook(hookGuids[i], NULL);
+	for(int i = 0; i < PluginManager::HOST_HOOK_LAST; ++i)
+		dcHooks.create_hook(PluginManager::getHookGuid(static_cast<PluginManager::HostHook>(i)), NULL);
 }
 
 void PluginApiImpl::shutdown() {
@@ -689,7 +656,7 @@ void PluginApiImpl::sendLocalMessage(HubDataPtr hub, const char* msg, MsgType ty
 Bool PluginApiImpl::sendPrivateMessage(UserDataPtr user, const char* message, Bool thirdPerson) {
 	if(user) {
 		auto lock = ClientManager::getInstance()->lock();
-		OnlineUser* ou = ClientManager::getInstance()->findOnlineUser(CID(user->cid), user->hubHint, false);
+		OnlineUserPtr ou = ClientManager::getInstance()->findOnlineUser(CID(user->cid), user->hubHint, false);
 		if(!ou) return False;
 
 		// Lets make plugins life easier...
@@ -735,7 +702,7 @@ void PluginApiImpl::releaseData(HubDataPtr hub) {
 
 UserDataPtr PluginApiImpl::findUser(const char* cid, const char* hubUrl) {
 	auto lock = ClientManager::getInstance()->lock();
-	OnlineUser* ou = ClientManager::getInstance()->findOnlineUser(CID(cid), hubUrl, false);
+	OnlineUserPtr ou = ClientManager::getInstance()->findOnlineUser(CID(cid), hubUrl, false);
 	if(!ou) return NULL;
 	return ou->copyPluginObject();
 }
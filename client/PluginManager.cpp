@@ -57,7 +57,63 @@ namespace dcpp {
 using std::swap;
 using std::move;
 
-PluginManager::PluginManager() : dcCore(), shutdown(false), secNum(Util::rand()) {
+namespace {
+
+const char* hostHookGuids[PluginManager::HOST_HOOK_LAST] = {
+	HOOK_CHAT_IN,
+	HOOK_CHAT_OUT,
+	HOOK_CHAT_PM_IN,
+	HOOK_CHAT_PM_OUT,
+
+	HOOK_TIMER_SECOND,
+	HOOK_TIMER_MINUTE,
+
+	HOOK_HUB_ONLINE,
+	HOOK_HUB_OFFLINE,
+
+	HOOK_NETWORK_HUB_IN,
+	HOOK_NETWORK_HUB_OUT,
+	HOOK_NETWORK_CONN_IN,
+	HOOK_NETWORK_CONN_OUT,
+	HOOK_NETWORK_UDP_IN,
+	HOOK_NETWORK_UDP_OUT,
+
+	HOOK_QUEUE_ADDED,
+	HOOK_QUEUE_MOVED,
+	HOOK_QUEUE_REMOVED,
+	HOOK_QUEUE_FINISHED,
+
+	HOOK_UI_CREATED,
+	HOOK_UI_CHAT_TAGS,
+	HOOK_UI_CHAT_DISPLAY,
+	HOOK_UI_CHAT_COMMAND,
+	HOOK_UI_CHAT_COMMAND_PM
+};
+
+// Hook calls this thread is inside of; such a thread can't wait for hook calls to finish
+thread_local int hookDepth = 0;
+
+PluginHandle getModule(DCHOOK proc) {
+#ifdef _WIN32
+	HMODULE module = nullptr;
+	::GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+		reinterpret_cast<LPCTSTR>(proc), &module);
+	return module;
+#else
+	Dl_info info;
+	if(!::dladdr(reinterpret_cast<void*>(proc), &info))
+		return nullptr;
+	// Same handle dlopen gave us, without keeping a reference
+	void* module = ::dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD);
+	if(module)
+		::dlclose(module);
+	return module;
+#endif
+}
+
+}
+
+PluginManager::PluginManager() : hostHooks(), dcCore(), shutdown(false), secNum(Util::rand()) {
 }
 
 PluginManager::~PluginManager() {
@@ -177,6 +233,7 @@ void PluginManager::install(const DcextInfo& info) {
 			}
 		}
 	}
+	freeLibraries();
 
 	const auto source = Util::getTempPath() + "dcext" PATH_SEPARATOR_STR;
 	const auto target = getInstallPath(info.uuid);
@@ -215,35 +272,45 @@ void PluginManager::unloadPlugins() {
 	QueueManager::getInstance()->removeListener(this);
 	SettingsManager::getInstance()->removeListener(this);
 
-	Lock l(cs);
-	shutdown = true;
+	{
+		Lock l(cs);
+		shutdown = true;
 
-	saveSettings();
+		saveSettings();
 
-	// Off we go...
-	for(auto& plugin: plugins | boost::adaptors::reversed) {
-		if(plugin.handle) {
-			disable(plugin, false);
+		// Off we go...
+		for(auto& plugin: plugins | boost::adaptors::reversed) {
+			if(plugin.handle) {
+				disable(plugin, false);
+			}
 		}
+		plugins.clear();
 	}
-	plugins.clear();
+	freeLibraries();
+
+	Lock l(cs);
 
 	// Really unload plugins that have been flagged inactive (ON_UNLOAD returns False)
 	for(auto& i: inactive)
 		FREE_LIBRARY(i);
 
 	// Destroy hooks that may have not been correctly freed
+	std::fill(hostHooks, hostHooks + HOST_HOOK_LAST, nullptr);
 	hooks.clear();
 }
 
 void PluginManager::addPlugin(const string& path) {
-	Lock l(cs);
+	{
+		Lock l(cs);
 
-	Plugin plugin = { };
-	plugin.name = Util::getFileName(path);
-	plugin.path = path;
+		Plugin plugin = { };
+		plugin.name = Util::getFileName(path);
+		plugin.path = path;
 
-	enable(plugin, true, true);
+		enable(plugin, true, true);
+	}
+	// An update replaces the installed version's library
+	freeLibraries();
 }
 
 bool PluginManager::configPlugin(const string& guid, dcptr_t data) {
@@ -264,11 +331,14 @@ void PluginManager::enablePlugin(const string& guid) {
 }
 
 void PluginManager::disablePlugin(const string& guid) {
-	Lock l(cs);
-	auto p = findPlugin(guid);
-	if(p && p->handle) {
-		disable(*p, false);
+	{
+		Lock l(cs);
+		auto p = findPlugin(guid);
+		if(p && p->handle) {
+			disable(*p, false);
+		}
 	}
+	freeLibraries();
 }
 
 void PluginManager::movePlugin(const string& guid, int delta) {
@@ -280,14 +350,17 @@ void PluginManager::movePlugin(const string& guid, int delta) {
 }
 
 void PluginManager::removePlugin(const string& guid) {
-	Lock l(cs);
-	auto i = findPluginIter(guid);
-	if(i != plugins.end()) {
-		if(i->handle) {
-			disable(*i, true);
+	{
+		Lock l(cs);
+		auto i = findPluginIter(guid);
+		if(i != plugins.end()) {
+			if(i->handle) {
+				disable(*i, true);
+			}
+			plugins.erase(i);
 		}
-		plugins.erase(i);
 	}
+	freeLibraries();
 }
 
 bool PluginManager::isLoaded(const string& guid) const {
@@ -311,19 +384,22 @@ Plugin PluginManager::getPlugin(const string& guid) const {
 
 // Functions that call the plugin
 bool PluginManager::onUDP(bool out, const string& ip, const string& port, const string& data) {
+	if(!isHooked(out ? NETWORK_UDP_OUT : NETWORK_UDP_IN))
+		return false;
+
 	UDPData udp = { ip.c_str(), Util::toInt(port) };
-	return runHook(out ? HOOK_NETWORK_UDP_OUT : HOOK_NETWORK_UDP_IN, &udp,
+	return runHook(out ? NETWORK_UDP_OUT : NETWORK_UDP_IN, &udp,
 		reinterpret_cast<dcptr_t>(const_cast<char*>(data.c_str())));
 }
 
 bool PluginManager::onChatTags(Tagger& tagger, OnlineUserPtr from) {
 	TagData data = { reinterpret_cast<dcptr_t>(&tagger), True };
-	return runHook(HOOK_UI_CHAT_TAGS, from.get(), &data);
+	return runHook(UI_CHAT_TAGS, from.get(), &data);
 }
 
 bool PluginManager::onChatDisplay(string& htmlMessage, OnlineUserPtr from) {
 	StringData data = { htmlMessage.c_str() };
-	bool handled = runHook(HOOK_UI_CHAT_DISPLAY, from.get(), &data);
+	bool handled = runHook(UI_CHAT_DISPLAY, from.get(), &data);
 	if(handled && data.out) {
 		htmlMessage = data.out;
 		return true;
@@ -342,14 +418,14 @@ bool PluginManager::onChatCommand(Client* client, const string& line) {
 	}
 
 	CommandData data = { cmd.c_str(), param.c_str() };
-	return runHook(HOOK_UI_CHAT_COMMAND, client, &data);
+	return runHook(UI_CHAT_COMMAND, client, &data);
 }
 
 bool PluginManager::onChatCommandPM(const HintedUser& user, const string& line) {
 	// Hopefully this is safe...
 	bool res = false;
 	auto lock = ClientManager::getInstance()->lock();
-	OnlineUser* ou = ClientManager::getInstance()->findOnlineUser(user.user->getCID(), user.hint, false);
+	OnlineUserPtr ou = ClientManager::getInstance()->findOnlineUser(user.user->getCID(), user.hint, false);
 
 	if(ou) {
 		string cmd, param;
@@ -362,7 +438,7 @@ bool PluginManager::onChatCommandPM(const HintedUser& user, const string& line)
 		}
 
 		CommandData data = { cmd.c_str(), param.c_str() };
-		res = runHook(HOOK_UI_CHAT_COMMAND_PM, ou, &data);
+		res = runHook(UI_CHAT_COMMAND_PM, ou.get(), &data);
 	}
 
 	return res;
@@ -396,6 +472,10 @@ bool PluginManager::releaseInterface(intfHandle hInterface) {
 }
 
 // Plugin Hook system
+const char* PluginManager::getHookGuid(HostHook id) {
+	return hostHookGuids[id];
+}
+
 PluginHook* PluginManager::createHook(const string& guid, DCHOOK defProc) {
 	Lock l(csHook);
 
@@ -406,7 +486,14 @@ PluginHook* PluginManager::createHook(const string& guid, DCHOOK defProc) {
 	auto pHook = hook.get();
 	hook->guid = guid;
 	hook->defProc = defProc;
+	hook->subscribers = std::make_shared<PluginHook::SubscriberList>();
+	hook->active = defProc != NULL;
 	hooks[guid] = move(hook);
+
+	auto host = std::find(hostHookGuids, hostHookGuids + HOST_HOOK_LAST, guid);
+	if(host != hostHookGuids + HOST_HOOK_LAST)
+		hostHooks[host - hostHookGuids] = pHook;
+
 	return pHook;
 }
 
@@ -415,6 +502,7 @@ bool PluginManager::destroyHook(PluginHook* hook) {
 
 	auto i = hooks.find(hook->guid);
 	if(i != hooks.end()) {
+		std::replace(hostHooks, hostHooks + HOST_HOOK_LAST, hook, static_cast<PluginHook*>(nullptr));
 		hooks.erase(i);
 		return true;
 	}
@@ -431,33 +519,52 @@ HookSubscriber* PluginManager::bindHook(const string& guid, DCHOOK hookProc, voi
 	auto& hook = i->second;
 	{
 		Lock l(hook->cs);
-		auto subscription = unique_ptr<HookSubscriber>(new HookSubscriber);
-		auto pSub = subscription.get();
+		auto subscription = std::make_shared<HookSubscriber>();
 		subscription->hookProc = hookProc;
 		subscription->common = pCommon;
 		subscription->owner = hook->guid;
-		hook->subscribers.push_back(move(subscription));
+		subscription->module = getModule(hookProc);
+		auto& calls = hookCalls[subscription->module];
+		if(!calls)
+			calls = std::make_shared<atomic<long>>(0);
+		subscription->calls = calls;
+		subscription->released = false;
+
+		auto subscribers = std::make_shared<PluginHook::SubscriberList>(*hook->subscribers);
+		subscribers->push_back(subscription);
+		std::atomic_store(&hook->subscribers, shared_ptr<const PluginHook::SubscriberList>(subscribers));
+		hook->active = true;
 
-		return pSub;
+		return subscription.get();
 	}
 }
 
 bool PluginManager::runHook(PluginHook* hook, dcptr_t pObject, dcptr_t pData) {
 	dcassert(hook);
 
-	// Using shared lock (csHook) might be a tad safer, but it is also slower and I prefer not to teach plugins to rely on the effect it creates
-	Lock l(hook->cs);
+	if(!hook->active)
+		return false;
+
+	// No lock, subscribers released meanwhile stay alive in the snapshot and are skipped
+	++hookDepth;
+	ScopedFunctor([] { --hookDepth; });
+	auto subscribers = std::atomic_load(&hook->subscribers);
 
 	Bool bBreak = False;
 	Bool bRes = False;
-	for(auto& sub: hook->subscribers) {
-		if(sub->hookProc(pObject, pData, sub->common, &bBreak))
+	for(auto& sub: *subscribers) {
+		// Counted before looking at released: freeLibraries() either sees the call or the call sees the release
+		++*sub->calls;
+		Bool res = sub->released ? False : sub->hookProc(pObject, pData, sub->common, &bBreak);
+		--*sub->calls;
+
+		if(res)
 			bRes = True;
 		if(bBreak) return (bRes != False);
 	}
 
 	// Call default hook procedure for all unused hooks
-	if(hook->defProc && hook->subscribers.empty()) {
+	if(hook->defProc && subscribers->empty()) {
 		if(hook->defProc(pObject, pData, NULL, &bBreak))
 			bRes = True;
 	}
@@ -478,10 +585,14 @@ size_t PluginManager::releaseHook(HookSubscriber* subscription) {
 	auto& hook = i->second;
 	{
 		Lock l(hook->cs);
-		hook->subscribers.erase(std::remove_if(hook->subscribers.begin(), hook->subscribers.end(),
-			[subscription](const unique_ptr<HookSubscriber>& sub) { return sub.get() == subscription; }), hook->subscribers.end());
+		subscription->released = true;
+		auto subscribers = std::make_shared<PluginHook::SubscriberList>(*hook->subscribers);
+		subscribers->erase(std::remove_if(subscribers->begin(), subscribers->end(),
+			[subscription](const shared_ptr<HookSubscriber>& sub) { return sub.get() == subscription; }), subscribers->end());
+		std::atomic_store(&hook->subscribers, shared_ptr<const PluginHook::SubscriberList>(subscribers));
+		hook->active = !subscribers->empty() || hook->defProc;
 
-		return hook->subscribers.size();
+		return subscribers->size();
 	}
 }
 
@@ -623,12 +734,52 @@ void PluginManager::disable(Plugin& plugin, bool uninstall) {
 		}
 	}
 	if(isSafe) {
-		FREE_LIBRARY(plugin.handle);
+		Lock l(csHook);
+
+		// Release what the plugin left bound, nothing may call into it once it is freed
+		for(auto& i: hooks) {
+			auto& hook = i.second;
+			Lock l(hook->cs);
+			auto subscribers = std::make_shared<PluginHook::SubscriberList>(*hook->subscribers);
+			auto end = std::remove_if(subscribers->begin(), subscribers->end(),
+				[&plugin](const shared_ptr<HookSubscriber>& sub) { return sub->module == plugin.handle; });
+			if(end == subscribers->end())
+				continue;
+			std::for_each(end, subscribers->end(), [](const shared_ptr<HookSubscriber>& sub) { sub->released = true; });
+			subscribers->erase(end, subscribers->end());
+			std::atomic_store(&hook->subscribers, shared_ptr<const PluginHook::SubscriberList>(subscribers));
+			hook->active = !subscribers->empty() || hook->defProc;
+		}
+
+		// Hooks already running on other threads may still be inside the plugin, freeLibraries() waits for them
+		auto calls = hookCalls.find(plugin.handle);
+		retired.push_back(make_pair(plugin.handle, calls != hookCalls.end() ? calls->second : nullptr));
+		if(calls != hookCalls.end())
+			hookCalls.erase(calls);
+
 		plugin.handle = nullptr;
 		plugin.dcMain = nullptr;
 	}
 }
 
+void PluginManager::freeLibraries() {
+	// A hook calling us may be inside one of them; they wait for the next call instead
+	if(hookDepth > 0)
+		return;
+
+	decltype(retired) libraries;
+	{
+		Lock l(cs);
+		libraries.swap(retired);
+	}
+
+	for(auto& i: libraries) {
+		while(i.second && *i.second > 0)
+			Thread::yield();
+		FREE_LIBRARY(i.first);
+	}
+}
+
 void PluginManager::loadSettings() noexcept {
 	Lock l(cs);
 
@@ -729,27 +880,27 @@ vector<Plugin>::iterator PluginManager::findPluginIter(const string& guid) {
 
 // Listeners
 void PluginManager::on(ClientManagerListener::ClientConnected, const Client* aClient) noexcept {
-	runHook(HOOK_HUB_ONLINE, const_cast<Client*>(aClient));
+	runHook(HUB_ONLINE, const_cast<Client*>(aClient));
 }
 
 void PluginManager::on(ClientManagerListener::ClientDisconnected, const Client* aClient) noexcept {
-	runHook(HOOK_HUB_OFFLINE, const_cast<Client*>(aClient));
+	runHook(HUB_OFFLINE, const_cast<Client*>(aClient));
 }
 
 void PluginManager::on(QueueManagerListener::Added, QueueItem* qi) noexcept {
-	runHook(HOOK_QUEUE_ADDED, qi);
+	runHook(QUEUE_ADDED, qi);
 }
 
 void PluginManager::on(QueueManagerListener::Moved, const QueueItem* qi, const string& /*aSource*/) noexcept {
-	runHook(HOOK_QUEUE_MOVED, const_cast<QueueItem*>(qi));
+	runHook(QUEUE_MOVED, const_cast<QueueItem*>(qi));
 }
 
 void PluginManager::on(QueueManagerListener::Removed, const QueueItem* qi) noexcept {
-	runHook(HOOK_QUEUE_REMOVED, const_cast<QueueItem*>(qi));
+	runHook(QUEUE_REMOVED, const_cast<QueueItem*>(qi));
 }
 
 void PluginManager::on(QueueManagerListener::Finished, const QueueItem* qi, const string& /*dir*/, const Download* /*download*/) noexcept {
-	runHook(HOOK_QUEUE_FINISHED, const_cast<QueueItem*>(qi));
+	runHook(QUEUE_FINISHED, const_cast<QueueItem*>(qi));
 }
 
 void PluginManager::on(SettingsManagerListener::Save, SimpleXML& /*xml*/) noexcept {
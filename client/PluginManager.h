@@ -27,6 +27,7 @@
 
 #include "typedefs.h"
 
+#include "atomic.h"
 #include "ClientManagerListener.h"
 #include "PluginDefs.h"
 #include "PluginEntity.h"
@@ -46,6 +47,7 @@ namespace dcpp {
 
 using std::function;
 using std::map;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -55,14 +57,27 @@ struct HookSubscriber {
 	DCHOOK hookProc;
 	void* common;
 	string owner;
+
+	// Library hookProc lives in, and the calls in progress into that library
+	PluginHandle module;
+	shared_ptr<atomic<long>> calls;
+	// Set on release, runHook skips the subscriber from then on even in older snapshots
+	atomic<bool> released;
 };
 
 // Hookable event
 struct PluginHook {
+	PluginHook() : active(false) { }
+
 	string guid;
 	DCHOOK defProc;
 
-	vector<unique_ptr<HookSubscriber>> subscribers;
+	// Replaced as a whole under cs, runHook takes a snapshot without locking
+	typedef vector<shared_ptr<HookSubscriber>> SubscriberList;
+	shared_ptr<const SubscriberList> subscribers;
+
+	// Whether running the hook calls anything at all (subscribers or defProc)
+	atomic<bool> active;
 	CriticalSection cs;
 };
 
@@ -131,26 +146,44 @@ public:
 	bool onChatCommand(Client* client, const string& line);
 	bool onChatCommandPM(const HintedUser& user, const string& line);
 
+	// Hooks provided by the host, resolved once so that host calls don't look them up by guid
+	enum HostHook {
+		CHAT_IN, CHAT_OUT, CHAT_PM_IN, CHAT_PM_OUT,
+		TIMER_SECOND, TIMER_MINUTE,
+		HUB_ONLINE, HUB_OFFLINE,
+		NETWORK_HUB_IN, NETWORK_HUB_OUT, NETWORK_CONN_IN, NETWORK_CONN_OUT, NETWORK_UDP_IN, NETWORK_UDP_OUT,
+		QUEUE_ADDED, QUEUE_MOVED, QUEUE_REMOVED, QUEUE_FINISHED,
+		UI_CREATED, UI_CHAT_TAGS, UI_CHAT_DISPLAY, UI_CHAT_COMMAND, UI_CHAT_COMMAND_PM,
+		HOST_HOOK_LAST
+	};
+
+	static const char* getHookGuid(HostHook id);
+
+	/** Whether running the hook would call anything; lets callers skip preparing its data */
+	bool isHooked(HostHook id) const {
+		PluginHook* hook = hostHooks[id];
+		return !shutdown && hook && hook->active;
+	}
+
 	// runHook wrappers for host calls
-	bool runHook(const string& guid, dcptr_t pObject, dcptr_t pData) {
-		if(shutdown) return false;
-		auto i = hooks.find(guid);
-		dcassert(i != hooks.end());
-		return runHook(i->second.get(), pObject, pData);
+	bool runHook(HostHook id, dcptr_t pObject, dcptr_t pData) {
+		if(!isHooked(id)) return false;
+		return runHook(hostHooks[id], pObject, pData);
 	}
 
 	template<class T>
-	bool runHook(const string& guid, PluginEntity<T>* entity, dcptr_t pData = NULL) {
+	bool runHook(HostHook id, PluginEntity<T>* entity, dcptr_t pData = NULL) {
+		if(!isHooked(id)) return false;
 		if(entity) {
 			Lock l(entity->cs);
-			return runHook(guid, entity->getPluginObject(), pData);
+			return runHook(hostHooks[id], entity->getPluginObject(), pData);
 		}
-		return runHook(guid, nullptr, pData);
+		return runHook(hostHooks[id], nullptr, pData);
 	}
 
 	template<class T>
-	bool runHook(const string& guid, PluginEntity<T>* entity, const string& data) {
-		return runHook<T>(guid, entity, reinterpret_cast<dcptr_t>(const_cast<char*>(data.c_str())));
+	bool runHook(HostHook id, PluginEntity<T>* entity, const string& data) {
+		return runHook<T>(id, entity, reinterpret_cast<dcptr_t>(const_cast<char*>(data.c_str())));
 	}
 
 	// Plugin interface registry
@@ -176,6 +209,8 @@ public:
 private:
 	void enable(Plugin& plugin, bool install, bool runtime);
 	void disable(Plugin& plugin, bool uninstall);
+	/** Frees the libraries of disabled plugins once no hook call is inside them; call without holding cs */
+	void freeLibraries();
 
 	void loadSettings() noexcept;
 	void saveSettings() noexcept;
@@ -186,8 +221,8 @@ private:
 	vector<Plugin>::iterator findPluginIter(const string& guid);
 
 	// Listeners
-	void on(TimerManagerListener::Second, uint64_t ticks) noexcept { runHook(HOOK_TIMER_SECOND, NULL, &ticks); }
-	void on(TimerManagerListener::Minute, uint64_t ticks) noexcept { runHook(HOOK_TIMER_MINUTE, NULL, &ticks); }
+	void on(TimerManagerListener::Second, uint64_t ticks) noexcept { runHook(TIMER_SECOND, NULL, &ticks); }
+	void on(TimerManagerListener::Minute, uint64_t ticks) noexcept { runHook(TIMER_MINUTE, NULL, &ticks); }
 
 	void on(ClientManagerListener::ClientConnected, const Client* aClient) noexcept;
 	void on(ClientManagerListener::ClientDisconnected, const Client* aClient) noexcept;
@@ -203,6 +238,12 @@ private:
 	vector<PluginHandle> inactive;
 
 	map<string, unique_ptr<PluginHook>> hooks;
+	PluginHook* hostHooks[HOST_HOOK_LAST];
+
+	// Hook calls in progress per library, a plugin's code is only unloaded once its calls are done
+	map<PluginHandle, shared_ptr<atomic<long>>> hookCalls;
+	// Libraries of disabled plugins waiting for freeLibraries()
+	vector<pair<PluginHandle, shared_ptr<atomic<long>>>> retired;
 	map<string, dcptr_t> interfaces;
 
 	DCCore dcCore;
@@ -234,21 +234,26 @@ Segment QueueItem::getNextSegment(int64_t  blockSize, int64_t wantedSize, int64_
 		int64_t end = std::min(getSize(), start + curSize);
 		Segment block(start, end - start);
 		bool overlaps = false;
-		for(SegmentConstIter i = done.begin(); !overlaps && i != done.end(); ++i) {
-			if(curSize <= blockSize) {
-				int64_t dstart = i->getStart();
-				int64_t dend = i->getEnd();
-				// We accept partial overlaps, only consider the block done if it is fully consumed by the done block
-				if(dstart <= start && dend >= end) {
-					overlaps = true;
-				}
-			} else {
-				overlaps = block.overlaps(*i);
+		if(curSize <= blockSize) {
+			// We accept partial overlaps, only consider the block done if it is fully consumed by the done block
+			SegmentConstIter i = findDone(start);
+			if(i != done.end() && i->getEnd() >= end) {
+				// ...and so is every following block up to the end of that done segment
+				start = std::max(end, Util::roundDown(i->getEnd(), blockSize));
+				curSize = targetSize;
+				continue;
+			}
+
+			for(auto i = downloads.cbegin(); !overlaps && i != downloads.cend(); ++i) {
+				overlaps = block.overlaps((*i)->getSegment());
+			}
+		} else {
+			int64_t overlap = findOverlap(block);
+			if(overlap != -1) {
+				// Shrink the block so that it ends where the overlap starts
+				curSize = std::max(blockSize, Util::roundDown(overlap - start, blockSize));
+				continue;
 			}
-		}
-		
-		for(auto i = downloads.cbegin(); !overlaps && i != downloads.cend(); ++i) {
-			overlaps = block.overlaps((*i)->getSegment());
 		}
 		
 		if(!overlaps) {
@@ -274,12 +279,8 @@ Segment QueueItem::getNextSegment(int64_t  blockSize, int64_t wantedSize, int64_
 			}
 		}
 		
-		if(overlaps && (curSize > blockSize)) {
-			curSize -= blockSize;
-		} else {
-			start = end;
-			curSize = targetSize;
-		}
+		start = end;
+		curSize = targetSize;
 	}
 
 	if(!neededParts.empty()) {
@@ -342,12 +343,7 @@ Segment QueueItem::getNextSegment(int64_t  blockSize, int64_t wantedSize, int64_
 }
 
 uint64_t QueueItem::getDownloadedBytes() const {
-	uint64_t total = 0;
-
-	// count done segments
-	for(auto i = done.cbegin(); i != done.cend(); ++i) {
-		total += i->getSize();
-	}
+	uint64_t total = doneBytes;
 
 	// count running segments
 	for(auto i = downloads.cbegin(); i != downloads.cend(); ++i) {
@@ -359,26 +355,83 @@ uint64_t QueueItem::getDownloadedBytes() const {
 
 void QueueItem::addSegment(const Segment& segment) {
 	dcassert(segment.getOverlapped() == false);
-	done.insert(segment);
 
-	// Consolidate segments
-	if(done.size() == 1)
-		return;
-	
-	for(SegmentSet::iterator i = ++done.begin() ; i != done.end(); ) {
+	int64_t start = segment.getStart();
+	int64_t end = segment.getEnd();
+
+	// Consolidate with the done segments it overlaps or touches
+	SegmentSet::iterator i = done.lower_bound(Segment(start, 0));
+	if(i != done.begin()) {
 		SegmentSet::iterator prev = i;
-		prev--;
-		if(prev->getEnd() >= i->getStart()) {
-			Segment big(prev->getStart(), i->getEnd() - prev->getStart());
-			done.erase(prev);
-			done.erase(i++);
-			done.insert(big);
-		} else {
-			++i;
+		if((--prev)->getEnd() >= start)
+			i = prev;
+	}
+
+	while(i != done.end() && i->getStart() <= end) {
+		start = std::min(start, i->getStart());
+		end = std::max(end, i->getEnd());
+		doneBytes -= i->getSize();
+		done.erase(i++);
+	}
+
+	done.insert(i, Segment(start, end - start));
+	doneBytes += end - start;
+}
+
+void QueueItem::removeSegment(const Segment& segment) {
+	int64_t start = segment.getStart();
+	int64_t end = segment.getEnd();
+
+	SegmentSet::iterator i = done.lower_bound(Segment(start, 0));
+	if(i != done.begin()) {
+		SegmentSet::iterator prev = i;
+		if((--prev)->getEnd() > start)
+			i = prev;
+	}
+
+	while(i != done.end() && i->getStart() < end) {
+		Segment cut = *i;
+		doneBytes -= cut.getSize();
+		done.erase(i++);
+
+		if(cut.getStart() < start) {
+			done.insert(Segment(cut.getStart(), start - cut.getStart()));
+			doneBytes += start - cut.getStart();
+		}
+		if(cut.getEnd() > end) {
+			done.insert(Segment(end, cut.getEnd() - end));
+			doneBytes += cut.getEnd() - end;
 		}
 	}
 }
 
+QueueItem::SegmentConstIter QueueItem::findDone(int64_t pos) const {
+	SegmentConstIter i = done.upper_bound(Segment(pos, std::numeric_limits<int64_t>::max()));
+	if(i == done.begin())
+		return done.end();
+
+	--i;
+	return i->getEnd() > pos ? i : done.end();
+}
+
+int64_t QueueItem::findOverlap(const Segment& block) const {
+	int64_t overlap = -1;
+
+	SegmentConstIter i = findDone(block.getStart());
+	if(i == done.end())
+		i = done.lower_bound(Segment(block.getStart(), 0));
+	if(i != done.end() && block.overlaps(*i))
+		overlap = i->getStart();
+
+	for(auto d = downloads.cbegin(); d != downloads.cend(); ++d) {
+		const Segment& running = (*d)->getSegment();
+		if(block.overlaps(running) && (overlap == -1 || running.getStart() < overlap))
+			overlap = running.getStart();
+	}
+
+	return overlap;
+}
+
 bool QueueItem::isNeededPart(const PartsInfo& partsInfo, int64_t blockSize)
 {
 	dcassert(partsInfo.size() % 2 == 0);
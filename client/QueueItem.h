@@ -76,7 +76,9 @@ public:
 		/** Test user's file list for fake share */
 		FLAG_USER_CHECK			= 0x80,
 		/** Autodrop slow source is enabled for this file */
-		FLAG_AUTODROP			= 0x100
+		FLAG_AUTODROP			= 0x100,
+		/** The file is being rechecked, no segments are handed out meanwhile */
+		FLAG_RECHECK			= 0x200
 	};
 
 	/**
@@ -140,19 +142,20 @@ public:
 	
 	QueueItem(const string& aTarget, int64_t aSize, Priority aPriority, Flags::MaskType aFlag,
 		time_t aAdded, const TTHValue& tth) :
-		Flags(aFlag), target(aTarget), maxSegments(1), fileBegin(0),
-		size(aSize), priority(aPriority), added(aAdded),
-		tthRoot(tth), autoPriority(false), nextPublishingTime(0)
+		Flags(aFlag), tthRoot(tth), target(aTarget), fileBegin(0), nextPublishingTime(0),
+		size(aSize), added(aAdded), priority(aPriority), maxSegments(1),
+		autoPriority(false), doneBytes(0)
 	{
 		inc();
 		setFlag(FLAG_AUTODROP);
 	}
 
 	QueueItem(const QueueItem& rhs) : 
-		Flags(rhs), done(rhs.done), downloads(rhs.downloads), target(rhs.target), 
-		size(rhs.size), priority(rhs.priority), added(rhs.added), tthRoot(rhs.tthRoot),
-		autoPriority(rhs.autoPriority), maxSegments(rhs.maxSegments), fileBegin(rhs.fileBegin),
-		sources(rhs.sources), badSources(rhs.badSources), tempTarget(rhs.tempTarget), nextPublishingTime(rhs.nextPublishingTime)
+		Flags(rhs), tthRoot(rhs.tthRoot), downloads(rhs.downloads), target(rhs.target), 
+		fileBegin(rhs.fileBegin), nextPublishingTime(rhs.nextPublishingTime), size(rhs.size), added(rhs.added),
+		priority(rhs.priority), maxSegments(rhs.maxSegments), autoPriority(rhs.autoPriority),
+		done(rhs.done), sources(rhs.sources), badSources(rhs.badSources), tempTarget(rhs.tempTarget),
+		doneBytes(rhs.doneBytes)
 	{
 		inc();
 	}
@@ -188,17 +191,12 @@ public:
 	bool isChunkDownloaded(int64_t startPos, int64_t& len) const {
 		if(len <= 0) return false;
 
-		for(SegmentSet::const_iterator i = done.begin(); i != done.end(); ++i) {
-			int64_t first  = (*i).getStart();
-			int64_t second = (*i).getEnd();
+		SegmentConstIter i = findDone(startPos);
+		if(i == done.end())
+			return false;
 
-			if(first <= startPos && startPos < second){
-				len = min(len, second - startPos);
-				return true;
-			}
-		}
-
-		return false;
+		len = min(len, i->getEnd() - startPos);
+		return true;
 	}
 
 	/**
@@ -220,7 +218,9 @@ public:
 	Segment getNextSegment(int64_t blockSize, int64_t wantedSize, int64_t lastSpeed, const PartialSource::Ptr partialSource) const;
 	
 	void addSegment(const Segment& segment);
-	void resetDownloaded() { done.clear(); }
+	/** Forget that the bytes of segment were downloaded, done segments are cut around it */
+	void removeSegment(const Segment& segment);
+	void resetDownloaded() { done.clear(); doneBytes = 0; }
 	
 	bool isFinished() const {
 		return done.size() == 1 && *done.begin() == Segment(0, getSize());
@@ -247,8 +247,10 @@ public:
 
 	QueueData* getPluginObject() noexcept;
 
+	/** Done segments, kept sorted, disjoint and merged with their neighbours */
+	const SegmentSet& getDone() const { return done; }
+
 	GETSET(TTHValue, tthRoot, TTH);
-	GETSET(SegmentSet, done, Done);	
 	GETSET(DownloadList, downloads, Downloads);
 	GETSET(string, target, Target);
 	GETSET(uint64_t, fileBegin, FileBegin);
@@ -298,9 +300,17 @@ private:
 	QueueItem& operator=(const QueueItem&);
 
 	friend class QueueManager;
+	SegmentSet done;
 	SourceList sources;
 	SourceList badSources;
 	string tempTarget;
+	/** Sum of the done segment sizes */
+	int64_t doneBytes;
+
+	/** The done segment containing pos, done.end() if it isn't downloaded */
+	SegmentConstIter findDone(int64_t pos) const;
+	/** Start of the first done or running segment overlapping block, -1 if it overlaps none */
+	int64_t findOverlap(const Segment& block) const;
 
 	void addSource(const HintedUser& aUser);
 	void removeSource(const UserPtr& aUser, Flags::MaskType reason);
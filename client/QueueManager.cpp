@@ -27,6 +27,7 @@
 #include "ConnectionManager.h"
 #include "Download.h"
 #include "FileReader.h"
+#include "DiskIoManager.h"
 #include "DownloadManager.h"
 #include "HashManager.h"
 #include "LogManager.h"
@@ -137,6 +138,9 @@ QueueItem* QueueManager::FileQueue::add(const string& aTarget, int64_t aSize,
 
 void QueueManager::FileQueue::add(QueueItem* qi) {
 	queue.insert(make_pair(const_cast<string*>(&qi->getTarget()), qi));
+
+	if(qi->getSize() >= PARTIAL_SHARE_MIN_SIZE && !qi->isSet(QueueItem::FLAG_USER_LIST))
+		pfsPublishes.push(PFSPublish(qi));
 }
 
 void QueueManager::FileQueue::remove(QueueItem* qi) {
@@ -251,6 +255,10 @@ QueueItem* QueueManager::UserQueue::getNext(const UserPtr& aUser, QueueItem::Pri
 			dcassert(!i->second.empty());
 			for(auto j = i->second.begin(); j != i->second.end(); ++j) {
 				QueueItem* qi = *j;
+
+				// the rechecker verifies what is recorded as done, nothing may be added until it is through
+				if(qi->isSet(QueueItem::FLAG_RECHECK))
+					continue;
 				
 				QueueItem::SourceConstIter source = qi->getSource(aUser);
 				if(source->isSet(QueueItem::Source::FLAG_PARTIAL)) {
@@ -315,15 +323,26 @@ void QueueManager::UserQueue::addDownload(QueueItem* qi, Download* d) {
 	running[d->getUser()] = qi;
 }
 
+void QueueManager::UserQueue::addPipelinedDownload(QueueItem* qi, Download* d) {
+	// Queued behind the running download of the same item, which keeps the running entry
+	dcassert(getRunning(d->getUser()) == qi);
+	qi->getDownloads().push_back(d);
+}
+
 void QueueManager::UserQueue::removeDownload(QueueItem* qi, const UserPtr& user) {
 	running.erase(user);
 
-	for(DownloadList::iterator i = qi->getDownloads().begin(); i != qi->getDownloads().end(); ++i) {
-		if((*i)->getUser() == user) {
-			qi->getDownloads().erase(i);
-			break;
-		}
-	}
+	DownloadList& downloads = qi->getDownloads();
+	downloads.erase(std::remove_if(downloads.begin(), downloads.end(), [&](Download* d) { return d->getUser() == user; }), downloads.end());
+}
+
+void QueueManager::UserQueue::removeDownload(QueueItem* qi, Download* d) {
+	DownloadList& downloads = qi->getDownloads();
+	downloads.erase(std::remove(downloads.begin(), downloads.end(), d), downloads.end());
+
+	// A pipelined download of the same user keeps the item running
+	if(find_if(downloads.begin(), downloads.end(), [d](Download* i) { return i->getUser() == d->getUser(); }) == downloads.end())
+		running.erase(d->getUser());
 }
 
 void QueueManager::UserQueue::setPriority(QueueItem* qi, QueueItem::Priority p) {
@@ -396,40 +415,72 @@ void QueueManager::Rechecker::add(const string& file) {
 	}
 }
 
-int QueueManager::Rechecker::run() {
+/** A file being rechecked, its leaf ranges are hashed by jobs on the disk threads */
+struct QueueManager::Rechecker::Recheck {
+	Recheck() : size(0), pending(0), checked(0), total(0), lastProgress(0) { }
+
+	string file;
+	string tempTarget;
+	int64_t size;
+	TigerTree tt;
+	unique_ptr<File> f;
+
+	/** Leaf ranges (first, count) fully recorded as done, these are verified */
+	vector<pair<size_t, size_t>> ranges;
+	/** Leaves recorded only in part, their records are dropped */
+	vector<size_t> partial;
+	/** Written by the jobs, one per leaf */
+	vector<uint8_t> good;
+
+	size_t pending;
+	int64_t checked;
+	int64_t total;
+	uint64_t lastProgress;
+
+	Segment getLeaf(size_t i) const {
+		int64_t start = static_cast<int64_t>(i) * tt.getBlockSize();
+		return Segment(start, std::min(tt.getBlockSize(), size - start));
+	}
+};
+
+struct QueueManager::Rechecker::Job {
+	shared_ptr<Recheck> r;
+	size_t first;
+	size_t count;
+	DiskIoManager::OpPtr op;
+};
+
+shared_ptr<QueueManager::Rechecker::Recheck> QueueManager::Rechecker::next() {
 	while(true) {
 		string file;
 		{
 			Lock l(cs);
 			auto i = files.begin();
-			if(i == files.end()) {
-				active = false;
-				return 0;
-			}
+			if(i == files.end())
+				return nullptr;
 			file = *i;
 			files.erase(i);
 		}
 
-		QueueItem* q;
-		int64_t tempSize;
-		string tempTarget;
+		auto r = std::make_shared<Recheck>();
+		r->file = file;
 		TTHValue tth;
 
 		{
-			Lock l(qm->cs);
+			TimedLock l(qm->cs);
 
-			q = qm->fileQueue.find(file);
+			QueueItem* q = qm->fileQueue.find(file);
 			if(!q || q->isSet(QueueItem::FLAG_USER_LIST))
 				continue;
 
 			qm->fire(QueueManagerListener::RecheckStarted(), q->getTarget());
 			dcdebug("Rechecking %s\n", file.c_str());
 
-			tempTarget = q->getTempTarget();
-			if(!Util::fileExists(tempTarget))
-				tempTarget = q->getTarget();
+			r->tempTarget = q->getTempTarget();
+			if(!Util::fileExists(r->tempTarget))
+				r->tempTarget = q->getTarget();
 
-			tempSize = File::getSize(tempTarget);
+			int64_t tempSize = File::getSize(r->tempTarget);
 
 			if(tempSize == -1) {
 				qm->fire(QueueManagerListener::RecheckNoFile(), q->getTarget());
@@ -442,7 +493,7 @@ int QueueManager::Rechecker::run() {
 			}
 
 			if(tempSize != q->getSize()) {
-				File(tempTarget, File::WRITE, File::OPEN).setSize(q->getSize());
+				File(r->tempTarget, File::WRITE, File::OPEN).setSize(q->getSize());
 			}
 
 			if(q->isRunning()) {
@@ -451,76 +502,197 @@ int QueueManager::Rechecker::run() {
 			}
 
 			tth = q->getTTH();
+			r->size = q->getSize();
 		}
 
-		TigerTree tt;
-		bool gotTree = HashManager::getInstance()->getTree(tth, tt);
-
-		{
-			Lock l(qm->cs);
+		bool gotTree = HashManager::getInstance()->getTree(tth, r->tt);
 
-			// get q again in case it has been (re)moved
-			q = qm->fileQueue.find(file);
-			if(!q)
-				continue;
+		TimedLock l(qm->cs);
 
-			if(!gotTree) {
-				qm->fire(QueueManagerListener::RecheckNoTree(), q->getTarget());
-				continue;
-			}
+		// get q again in case it has been (re)moved
+		QueueItem* q = qm->fileQueue.find(file);
+		if(!q)
+			continue;
 
-			//Clear segments
-			q->resetDownloaded();
+		if(!gotTree) {
+			qm->fire(QueueManagerListener::RecheckNoTree(), q->getTarget());
+			continue;
+		}
 
-			tempTarget = q->getTempTarget();
-			if(!Util::fileExists(tempTarget))
-				tempTarget = q->getTarget();
+		if(q->isRunning()) {
+			qm->fire(QueueManagerListener::RecheckDownloadsRunning(), q->getTarget());
+			continue;
 		}
 
-		TigerTree ttFile(tt.getBlockSize());
+		r->tempTarget = q->getTempTarget();
+		if(!Util::fileExists(r->tempTarget))
+			r->tempTarget = q->getTarget();
 
 		try {
-			FileReader().read(tempTarget, [&](const void* x, size_t n) {
-				return ttFile.update(x, n), true;
-			});
-		} catch(const FileException & e) {
-			dcdebug("Error while reading file: %s\n", e.what());
+			r->f.reset(new File(r->tempTarget, File::READ, File::OPEN | File::SHARED));
+		} catch(const FileException&) {
+			qm->fire(QueueManagerListener::RecheckNoFile(), q->getTarget());
+			continue;
 		}
 
-		Lock l(qm->cs);
+		// Only what is recorded as done needs verifying, the rest will be downloaded anyway.
+		// The records stay in place meanwhile, the item gets no downloads until finish() so that
+		// it can't complete with leaves that weren't verified yet.
+		q->setFlag(QueueItem::FLAG_RECHECK);
+
+		const int64_t blockSize = r->tt.getBlockSize();
+		const size_t leaves = r->tt.getLeaves().size();
+		for(auto& s: q->getDone()) {
+			size_t first = static_cast<size_t>(s.getStart() / blockSize);
+			size_t last = std::min(leaves, static_cast<size_t>(Util::roundUp(s.getEnd(), blockSize) / blockSize));
+			for(size_t i = first; i < last; ++i) {
+				Segment leaf = r->getLeaf(i);
+				if(leaf.getStart() < s.getStart() || leaf.getEnd() > s.getEnd()) {
+					r->partial.push_back(i);
+				} else if(!r->ranges.empty() && r->ranges.back().first + r->ranges.back().second == i) {
+					r->ranges.back().second++;
+				} else {
+					r->ranges.push_back(make_pair(i, 1));
+				}
+			}
+		}
 
-		// get q again in case it has been (re)moved
-		q = qm->fileQueue.find(file);
-		if(!q)
-			continue;
+		r->good.resize(leaves, 0);
+		for(auto& range: r->ranges)
+			r->total += r->getLeaf(range.first + range.second - 1).getEnd() - r->getLeaf(range.first).getStart();
 
-		ttFile.finalize();
+		return r;
+	}
+}
 
-		if(ttFile.getRoot() == tth && tempTarget == q->getTempTarget()) {
-			//If no bad blocks then the file probably got stuck in the temp folder for some reason
-			qm->moveStuckFile(q);
-			continue;
+void QueueManager::Rechecker::finish(Recheck& r) {
+	TimedLock l(qm->cs);
+
+	// get q again in case it has been (re)moved
+	QueueItem* q = qm->fileQueue.find(r.file);
+	if(!q)
+		return;
+
+	q->unsetFlag(QueueItem::FLAG_RECHECK);
+
+	size_t verified = 0, bad = 0;
+	for(auto& range: r.ranges) {
+		for(size_t i = range.first; i < range.first + range.second; ++i) {
+			verified++;
+			if(!r.good[i]) {
+				bad++;
+				q->removeSegment(r.getLeaf(i));
+			}
 		}
+	}
+	for(auto i: r.partial)
+		q->removeSegment(r.getLeaf(i));
 
-		size_t pos = 0;
-		boost::for_each(tt.getLeaves(), ttFile.getLeaves(), [&](const TTHValue& our, const TTHValue& file) {
-			if(our == file) {
-				 q->addSegment(Segment(pos, tt.getBlockSize()));
+	if(bad == 0 && verified == r.tt.getLeaves().size() && r.tempTarget == q->getTempTarget()) {
+		//If no bad blocks then the file probably got stuck in the temp folder for some reason
+		qm->moveStuckFile(q);
+		return;
+	}
+
+	qm->rechecked(q);
+}
+
+int QueueManager::Rechecker::run() {
+	// Hashed in jobs of a few leaves on the threads of the file's disk, independent of each other.
+	// At most budget jobs are queued at a time so that transfers get their share of the disk,
+	// the window moves on to the next files while the ones before are still being hashed.
+	const size_t budget = static_cast<size_t>(std::max(SETTING(DISK_QUEUE_DEPTH), 1)) * 2;
+	const int64_t jobSize = 8 * 1024 * 1024;
+
+	deque<Job> jobs;
+	shared_ptr<Recheck> r;
+	size_t range = 0, leaf = 0;
+
+	while(true) {
+		while(jobs.size() < budget) {
+			if(!r || range == r->ranges.size()) {
+				r = next();
+				range = leaf = 0;
+				if(!r)
+					break;
+				if(r->ranges.empty()) {
+					finish(*r);
+					r.reset();
+					continue;
+				}
+			}
+
+			auto& cur = r->ranges[range];
+			Job job = { r, cur.first + leaf, std::min(cur.second - leaf, static_cast<size_t>(std::max(jobSize / r->tt.getBlockSize(), (int64_t)1))), nullptr };
+			leaf += job.count;
+			if(leaf == cur.second) {
+				range++;
+				leaf = 0;
 			}
 
-			pos += tt.getBlockSize();
-		});
+			auto jr = r;
+			size_t first = job.first, count = job.count;
+			job.op = DiskIoManager::getInstance()->submit(DiskIoManager::getDevice(r->tempTarget), [jr, first, count] {
+				Segment start = jr->getLeaf(first), end = jr->getLeaf(first + count - 1);
+				TigerTree tt(jr->tt.getBlockSize());
+				ByteVector buf(static_cast<size_t>(std::min(end.getEnd() - start.getStart(), (int64_t)1024 * 1024)));
 
-		qm->rechecked(q);
-	}
+				for(int64_t pos = start.getStart(); pos < end.getEnd(); ) {
+					size_t n = jr->f->readAt(&buf[0], static_cast<size_t>(std::min(end.getEnd() - pos, (int64_t)buf.size())), pos);
+					if(n == 0)
+						break;
+					tt.update(&buf[0], n);
+					pos += n;
+				}
+				tt.finalize();
+
+				for(size_t i = 0; i < count && i < tt.getLeaves().size(); ++i)
+					jr->good[first + i] = tt.getLeaves()[i] == jr->tt.getLeaves()[first + i];
+			}, DiskIoManager::POOL_HASH);
+			r->pending++;
+			jobs.push_back(job);
+		}
+
+		if(jobs.empty()) {
+			Lock l(cs);
+			if(files.empty()) {
+				active = false;
+				return 0;
+			}
+			continue;
+		}
+
+		Job job = jobs.front();
+		jobs.pop_front();
 
-	return 0;
+		try {
+			job.op->wait();
+		} catch(const FileException& e) {
+			// the leaves stay bad
+			dcdebug("Error while reading file: %s\n", e.what());
+		}
+
+		Recheck& done = *job.r;
+		done.checked += done.getLeaf(job.first + job.count - 1).getEnd() - done.getLeaf(job.first).getStart();
+		if(--done.pending == 0 && (done.checked == done.total)) {
+			done.f.reset();
+			finish(done);
+		} else if(GET_TICK() - done.lastProgress >= 1000) {
+			done.lastProgress = GET_TICK();
+			qm->fire(QueueManagerListener::RecheckProgress(), done.file, done.checked, done.total);
+		}
+	}
 }
 
 QueueManager::QueueManager() : 
-	lastSave(0), 
 	queueFile(Util::getPath(Util::PATH_USER_CONFIG) + "Queue.xml"),
+	lastSave(0), 
 	rechecker(this),
+	saver(this),
+	cs("queue.cs"),
+	journalSeq(0),
+	journalSize(0),
+	journalling(false),
 	dirty(true), 
 	nextSearch(0)
 { 
@@ -536,6 +708,7 @@ QueueManager::~QueueManager() {
 	TimerManager::getInstance()->removeListener(this); 
 	ClientManager::getInstance()->removeListener(this);
 
+	saver.join();
 	saveQueue();
 
 	if(!BOOLSETTING(KEEP_LISTS)) {
@@ -551,7 +724,7 @@ QueueManager::~QueueManager() {
 }
 
 bool QueueManager::getTTH(const string& name, TTHValue& tth) const noexcept {
-	Lock l(cs);
+	TimedLock l(cs);
 	QueueItem* qi = fileQueue.find(name);
 	if(qi) {
 		tth = qi->getTTH();
@@ -576,7 +749,7 @@ void QueueManager::on(TimerManagerListener::Minute, uint64_t aTick) noexcept {
 	TTHValue* tthPub = NULL;
 
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 
 		//find max 10 pfs sources to exchange parts
 		//the source basis interval is 3 minutes
@@ -584,8 +757,8 @@ void QueueManager::on(TimerManagerListener::Minute, uint64_t aTick) noexcept {
 		fileQueue.findPFSSources(sl);
 
 		for(PFSSourceList::const_iterator i = sl.begin(); i != sl.end(); i++){
-			QueueItem::PartialSource::Ptr source = (*i->first).getPartialSource();
-			const QueueItem* qi = i->second;
+			QueueItem::PartialSource::Ptr source = i->first;
+			QueueItem* qi = i->second;
 
 			PartsInfoReqParam* param = new PartsInfoReqParam;
 			
@@ -604,6 +777,7 @@ void QueueManager::on(TimerManagerListener::Minute, uint64_t aTick) noexcept {
 
 			source->setPendingQueryCount(source->getPendingQueryCount() + 1);
 			source->setNextQueryTime(aTick + 180000);		// 3 minutes
+			fileQueue.schedulePFSQuery(qi, source);
 		}
 		
 		if(BOOLSETTING(USE_DHT) && SETTING(INCOMING_CONNECTIONS) != SettingsManager::INCOMING_FIREWALL_PASSIVE)
@@ -704,7 +878,7 @@ void QueueManager::add(const string& aTarget, int64_t aSize, const TTHValue& roo
 	}
 	
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 
 		QueueItem* q = fileQueue.find(target);
 		if(q == NULL && !(aFlags & QueueItem::FLAG_USER_LIST)) {
@@ -717,6 +891,7 @@ void QueueManager::add(const string& aTarget, int64_t aSize, const TTHValue& roo
 				
 		if(q == NULL) {
 			q = fileQueue.add(target, aSize, aFlags, QueueItem::DEFAULT, tempTarget, GET_TIME(), root);
+			journalItem(q);
 
 			fire(QueueManagerListener::Added(), q);
 			newItem = !q->isSet(QueueItem::FLAG_USER_LIST);
@@ -736,7 +911,6 @@ void QueueManager::add(const string& aTarget, int64_t aSize, const TTHValue& roo
 		}
 
 		wantConnection = aUser.user && addSource(q, aUser, (Flags::MaskType)(addBad ? QueueItem::Source::FLAG_MASK : 0));
-		setDirty();
 	}
 
 	if(wantConnection && aUser.user->isOnline())
@@ -752,7 +926,7 @@ void QueueManager::add(const string& aTarget, int64_t aSize, const TTHValue& roo
 void QueueManager::readd(const string& target, const HintedUser& aUser) {
 	bool wantConnection = false;
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 		QueueItem* q = fileQueue.find(target);
 		if(q && q->isBadSource(aUser)) {
 			wantConnection = addSource(q, aUser, QueueItem::Source::FLAG_MASK);
@@ -762,13 +936,6 @@ void QueueManager::readd(const string& target, const HintedUser& aUser) {
 		ConnectionManager::getInstance()->getDownloadConnection(aUser);
 }
 
-void QueueManager::setDirty() {
-	if(!dirty) {
-		dirty = true;
-		lastSave = GET_TICK();
-	}
-}
-
 string QueueManager::checkTarget(const string& aTarget, bool checkExistence) {
 #ifdef _WIN32
 	if(aTarget.length() > MAX_PATH) {
@@ -825,7 +992,7 @@ bool QueueManager::addSource(QueueItem* qi, const HintedUser& aUser, Flags::Mask
 	}
 
 	fire(QueueManagerListener::SourcesUpdated(), qi);
-	setDirty();
+	journalSource(qi, aUser);
 
 	return wantConnection;
 }
@@ -833,7 +1000,7 @@ bool QueueManager::addSource(QueueItem* qi, const HintedUser& aUser, Flags::Mask
 void QueueManager::addDirectory(const string& aDir, const HintedUser& aUser, const string& aTarget, QueueItem::Priority p /* = QueueItem::DEFAULT */) noexcept {
 	bool needList;
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 		
 		auto dp = directories.equal_range(aUser);
 		
@@ -845,7 +1012,6 @@ void QueueManager::addDirectory(const string& aDir, const HintedUser& aUser, con
 		// Unique directory, fine...
 		directories.insert(make_pair(aUser, new DirectoryItem(aUser, aDir, aTarget, p)));
 		needList = (dp.first == dp.second);
-		setDirty();
 	}
 
 	if(needList) {
@@ -858,7 +1024,7 @@ void QueueManager::addDirectory(const string& aDir, const HintedUser& aUser, con
 }
 
 QueueItem::Priority QueueManager::hasDownload(const UserPtr& aUser) noexcept {
-	Lock l(cs);
+	TimedLock l(cs);
 	QueueItem* qi = userQueue.getNext(aUser, QueueItem::LOWEST);
 	if(!qi) {
 		return QueueItem::PAUSED;
@@ -866,39 +1032,55 @@ QueueItem::Priority QueueManager::hasDownload(const UserPtr& aUser) noexcept {
 	return qi->getPriority();
 }
 
-typedef unordered_map<TTHValue, const DirectoryListing::File*> TTHMap;
-
 namespace {
-void buildMap(const DirectoryListing::Directory* dir, TTHMap& tthMap) noexcept {
+void buildSet(const DirectoryListing::Directory* dir, DirectoryListing::Directory::TTHSet& tths) noexcept {
 	std::for_each(dir->directories.cbegin(), dir->directories.cend(), [&](DirectoryListing::Directory* d) {
 		if(!d->getAdls())
-			buildMap(d, tthMap);
+			buildSet(d, tths);
 	});
 
 	std::for_each(dir->files.cbegin(), dir->files.cend(), [&](DirectoryListing::File* f) {
-		tthMap.emplace(f->getTTH(), f);
+		tths.insert(f->getTTH());
 	});
 }
 }
 
 int QueueManager::matchListing(const DirectoryListing& dl) noexcept {
-	int matches = 0;
+	DirectoryListing::Directory::TTHSet tths;
+	buildSet(dl.getRoot(), tths);
+	return matchTTHs(tths, dl.getHintedUser());
+}
+
+void QueueManager::getQueuedTTHs(vector<TTHValue>& tths) noexcept {
 	{
-		Lock l(cs);
+		TimedLock l(cs);
+		tths.reserve(fileQueue.getQueue().size());
+		for(auto i = fileQueue.getQueue().cbegin(); i != fileQueue.getQueue().cend(); ++i) {
+			QueueItem* qi = i->second;
+			if(!qi->isFinished() && !qi->isSet(QueueItem::FLAG_USER_LIST))
+				tths.push_back(qi->getTTH());
+		}
+	}
+	std::sort(tths.begin(), tths.end());
+	tths.erase(std::unique(tths.begin(), tths.end()), tths.end());
+}
 
-		TTHMap tthMap;
-		buildMap(dl.getRoot(), tthMap);
+int QueueManager::matchTTHs(const DirectoryListing::Directory::TTHSet& tths, const HintedUser& user) noexcept {
+	int matches = 0;
+	if(tths.empty())
+		return matches;
 
+	{
+		TimedLock l(cs);
 		for(auto i = fileQueue.getQueue().cbegin(); i != fileQueue.getQueue().cend(); ++i) {
 			QueueItem* qi = i->second;
 			if(qi->isFinished())
 				continue;
 			if(qi->isSet(QueueItem::FLAG_USER_LIST))
 				continue;
-			TTHMap::iterator j = tthMap.find(qi->getTTH());
-			if(j != tthMap.end() && i->second->getSize() == qi->getSize()) {
+			if(tths.find(qi->getTTH()) != tths.end()) {
 				try {
-					addSource(qi, dl.getHintedUser(), QueueItem::Source::FLAG_FILE_NOT_AVAILABLE);
+					addSource(qi, user, QueueItem::Source::FLAG_FILE_NOT_AVAILABLE);
 					matches++;
 				} catch(...) {
 					// Ignore...
@@ -907,8 +1089,8 @@ int QueueManager::matchListing(const DirectoryListing& dl) noexcept {
 		}
 	}
 	if(matches > 0)
-		ConnectionManager::getInstance()->getDownloadConnection(dl.getHintedUser());
-		return matches;
+		ConnectionManager::getInstance()->getDownloadConnection(user);
+	return matches;
 }
 
 void QueueManager::move(const string& aSource, const string& aTarget) noexcept {
@@ -918,7 +1100,7 @@ void QueueManager::move(const string& aSource, const string& aTarget) noexcept {
 
 	bool delSource = false;
 
-	Lock l(cs);
+	TimedLock l(cs);
 	QueueItem* qs = fileQueue.find(aSource);
 	if(qs) {
 		// Don't move running downloads
@@ -934,9 +1116,9 @@ void QueueManager::move(const string& aSource, const string& aTarget) noexcept {
 		if(qt == NULL || stricmp(aSource, target) == 0) {
 			// Good, update the target and move in the queue...
 			fire(QueueManagerListener::Moved(), qs, aSource);
+			journalMove(qs->getTarget(), target);
 			fileQueue.move(qs, target);
 			fire(QueueManagerListener::Added(), qs);
-			setDirty();
 		} else {
 			// Don't move to target of different size
 			if(qs->getSize() != qt->getSize() || qs->getTTH() != qt->getTTH())
@@ -958,7 +1140,7 @@ void QueueManager::move(const string& aSource, const string& aTarget) noexcept {
 }
 
 bool QueueManager::getQueueInfo(const UserPtr& aUser, string& aTarget, int64_t& aSize, int& aFlags) noexcept {
-    Lock l(cs);
+    TimedLock l(cs);
     QueueItem* qi = userQueue.getNext(aUser);
 	if(qi == NULL)
 		return false;
@@ -971,7 +1153,7 @@ bool QueueManager::getQueueInfo(const UserPtr& aUser, string& aTarget, int64_t&
 }
 
 StringList QueueManager::getTargets(const TTHValue& tth) {
-	Lock l(cs);
+	TimedLock l(cs);
 	auto ql = fileQueue.find(tth);
 	StringList sl;
 	for(auto i = ql.cbegin(); i != ql.cend(); ++i) {
@@ -981,12 +1163,12 @@ StringList QueueManager::getTargets(const TTHValue& tth) {
 }
 
 void QueueManager::lockedOperation(const function<void (const QueueItem::StringMap&)>& currentQueue) {
- 	Lock l(cs);
+ 	TimedLock l(cs);
 	if(currentQueue) currentQueue(fileQueue.getQueue());
 }
 
 Download* QueueManager::getDownload(UserConnection& aSource, string& aMessage) noexcept {
-	Lock l(cs);
+	TimedLock l(cs);
 
 	const UserPtr& u = aSource.getUser();
 	dcdebug("Getting download for %s...", u->getCID().toBase32().c_str());
@@ -1016,6 +1198,35 @@ Download* QueueManager::getDownload(UserConnection& aSource, string& aMessage) n
 	return d;
 }
 
+Download* QueueManager::getPipelinedDownload(UserConnection& aSource) noexcept {
+	TimedLock l(cs);
+
+	Download* cur = aSource.getDownload();
+	dcassert(cur && cur->getType() == Transfer::TYPE_FILE);
+
+	QueueItem* q = fileQueue.find(cur->getPath());
+	if(!q || q != userQueue.getRunning(aSource.getUser()) || q->getPriority() == QueueItem::PAUSED || !q->isSource(aSource.getUser()))
+		return 0;
+
+	// The constructor takes the connection over, it stays with the running download until that one is done
+	Download* d = new Download(aSource, *q, q->getTarget());
+	aSource.setDownload(cur);
+
+	if(d->getType() != Transfer::TYPE_FILE || d->getSize() <= 0 || (d->isSet(Download::FLAG_OVERLAP) && cur->getSegment().contains(d->getSegment()))) {
+		// No free segment left, or only our own
+		if(d->isSet(Download::FLAG_OVERLAP))
+			cur->setOverlapped(false);
+		delete d;
+		return 0;
+	}
+
+	userQueue.addPipelinedDownload(q, d);
+
+	fire(QueueManagerListener::SourcesUpdated(), q);
+	dcdebug("Pipelined " I64_FMT "/" I64_FMT " of %s\n", d->getStartPos(), d->getSize(), q->getTarget().c_str());
+	return d;
+}
+
 namespace {
 class TreeOutputStream : public OutputStream {
 public:
@@ -1057,7 +1268,7 @@ private:
 
 void QueueManager::setFile(Download* d) {
 	if(d->getType() == Transfer::TYPE_FILE) {
-		Lock l(cs);
+		TimedLock l(cs);
 
 		QueueItem* qi = fileQueue.find(d->getPath());
 		if(!qi) {
@@ -1106,14 +1317,14 @@ void QueueManager::setFile(Download* d) {
 
 		// Only use antifrag if we don't have a previous non-antifrag part
 		if(BOOLSETTING(ANTI_FRAG) && f->getSize() != qi->getSize()) {
-			f->setSize(d->getTigerTree().getFileSize());
+			f->preallocate(d->getTigerTree().getFileSize());
 		}
 		
 		f->setPos(d->getSegment().getStart());
 		d->setFile(f);
 	} else if(d->getType() == Transfer::TYPE_FULL_LIST) {
 		{
-			Lock l(cs);
+			TimedLock l(cs);
 
 			QueueItem* qi = fileQueue.find(d->getPath());
 			if(!qi) {
@@ -1176,9 +1387,11 @@ void QueueManager::moveStuckFile(QueueItem* qi) {
 
 	if(!BOOLSETTING(KEEP_FINISHED_FILES)) {
 		fire(QueueManagerListener::Removed(), qi);
+		journalRemove(qi);
 		fileQueue.remove(qi);
 	 } else {
 		qi->addSegment(Segment(0, qi->getSize()));
+		journalSegment(qi, Segment(0, qi->getSize()));
 		fire(QueueManagerListener::StatusUpdated(), qi);
 	}
 
@@ -1189,7 +1402,7 @@ void QueueManager::rechecked(QueueItem* qi) {
 	fire(QueueManagerListener::RecheckDone(), qi->getTarget());
 	fire(QueueManagerListener::StatusUpdated(), qi);
 
-	setDirty();
+	journalItem(qi);
 }
 
 void QueueManager::putDownload(Download* aDownload, bool finished, bool reportFinish) noexcept {
@@ -1200,7 +1413,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished, bool reportFi
 	bool downloadList = false;
 
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 
 		delete aDownload->getFile();
 		aDownload->setFile(0);
@@ -1252,7 +1465,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished, bool reportFi
 						dcassert(aDownload->getTreeValid());
 						HashManager::getInstance()->addTree(aDownload->getTigerTree());
 
-						userQueue.removeDownload(q, aDownload->getUser());
+						userQueue.removeDownload(q, aDownload);
 						fire(QueueManagerListener::StatusUpdated(), q);
 					} else {
 						// Now, let's see if this was a directory download filelist...
@@ -1303,17 +1516,19 @@ void QueueManager::putDownload(Download* aDownload, bool finished, bool reportFi
 							
 							if(!BOOLSETTING(KEEP_FINISHED_FILES) || aDownload->getType() == Transfer::TYPE_FULL_LIST) {
 								fire(QueueManagerListener::Removed(), q);						
+								journalRemove(q);
 								fileQueue.remove(q);
 							} else {
+								journalSegment(q, aDownload->getSegment());
 								fire(QueueManagerListener::StatusUpdated(), q);
 							}
 						} else {
-							userQueue.removeDownload(q, aDownload->getUser());
+							journalSegment(q, aDownload->getSegment());
+							userQueue.removeDownload(q, aDownload);
 							if(aDownload->getType() != Transfer::TYPE_FILE || (reportFinish && q->isWaiting())) {
 								fire(QueueManagerListener::StatusUpdated(), q);
 							}
 						}
-						setDirty();
 					}
 				} else {
 					if(aDownload->getType() != Transfer::TYPE_TREE) {
@@ -1334,7 +1549,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished, bool reportFi
 								dcassert(downloaded < aDownload->getSize());
 								
 								q->addSegment(Segment(aDownload->getStartPos(), downloaded));
-								setDirty();
+								journalSegment(q, Segment(aDownload->getStartPos(), downloaded));
 							}
 						}
 					}
@@ -1343,7 +1558,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished, bool reportFi
 						q->getOnlineUsers(getConn);
 					}
 	
-					userQueue.removeDownload(q, aDownload->getUser());
+					userQueue.removeDownload(q, aDownload);
 					fire(QueueManagerListener::StatusUpdated(), q);
 
 					if(aDownload->isSet(Download::FLAG_OVERLAP)) {
@@ -1382,6 +1597,12 @@ void QueueManager::putDownload(Download* aDownload, bool finished, bool reportFi
 }
 
 void QueueManager::processList(const string& name, const HintedUser& user, int flags) {
+	if((flags & QueueItem::FLAG_MATCH_QUEUE) && !(flags & QueueItem::FLAG_DIRECTORY_DOWNLOAD)) {
+		// Matching only needs the TTHs, stream them against the queue instead of building the whole listing
+		matchList(name, user, flags);
+		return;
+	}
+
 	DirectoryListing dirList(user);
 	try {
 		if(flags & QueueItem::FLAG_TEXT) {
@@ -1398,7 +1619,7 @@ void QueueManager::processList(const string& name, const HintedUser& user, int f
 	if(flags & QueueItem::FLAG_DIRECTORY_DOWNLOAD) {
 		vector<DirectoryItemPtr> dl;
 		{
-			Lock l(cs);
+			TimedLock l(cs);
 			auto dp = directories.equal_range(user) | map_values;
 			dl.assign(boost::begin(dp), boost::end(dp));
 			directories.erase(user);
@@ -1416,6 +1637,29 @@ void QueueManager::processList(const string& name, const HintedUser& user, int f
 	}
 }
 
+void QueueManager::matchList(const string& name, const HintedUser& user, int flags) {
+	vector<TTHValue> queued;
+	getQueuedTTHs(queued);
+
+	DirectoryListing::Directory::TTHSet tths;
+	if(!queued.empty()) {
+		try {
+			if(flags & QueueItem::FLAG_TEXT) {
+				MemoryInputStream mis(name);
+				DirectoryListing::matchXML(mis, queued, tths);
+			} else {
+				DirectoryListing::matchFile(name, queued, tths);
+			}
+		} catch(const Exception&) {
+			LogManager::getInstance()->message(STRING(UNABLE_TO_OPEN_FILELIST) + " " + name, LogManager::LOG_ERROR);
+			return;
+		}
+	}
+
+	string tmp = STRING_F(MATCHED_FILES, matchTTHs(tths, user));
+	LogManager::getInstance()->message(Util::toString(ClientManager::getInstance()->getNicks(user)) + ": " + tmp, LogManager::LOG_INFO);
+}
+
 void QueueManager::recheck(const string& aTarget) {
 	rechecker.add(aTarget);
 }
@@ -1423,7 +1667,7 @@ void QueueManager::recheck(const string& aTarget) {
 void QueueManager::remove(const string& aTarget) noexcept {
 	UserList x;
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 
 		QueueItem* q = fileQueue.find(aTarget);
 		if(!q)
@@ -1451,9 +1695,8 @@ void QueueManager::remove(const string& aTarget) noexcept {
 		if(!q->isFinished()) {
 			userQueue.remove(q);
 		}
+		journalRemove(q);
 		fileQueue.remove(q);
-
-		setDirty();
 	}
 
 	for(auto i = x.begin(); i != x.end(); ++i) {
@@ -1465,7 +1708,7 @@ void QueueManager::removeSource(const string& aTarget, const UserPtr& aUser, Fla
 	bool isRunning = false;
 	bool removeCompletely = false;
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 		QueueItem* q = fileQueue.find(aTarget);
 		if(!q)
 			return;
@@ -1495,7 +1738,7 @@ void QueueManager::removeSource(const string& aTarget, const UserPtr& aUser, Fla
 		q->removeSource(aUser, reason);
 		
 		fire(QueueManagerListener::SourcesUpdated(), q);
-		setDirty();
+		journalRemoveSource(q, aUser);
 	}
 endCheck:
 	if(isRunning && removeConn) {
@@ -1511,7 +1754,7 @@ void QueueManager::removeSource(const UserPtr& aUser, Flags::MaskType reason) no
 	bool isRunning = false;
 	string removeRunning;
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 		QueueItem* qi = NULL;
 		while( (qi = userQueue.getNext(aUser, QueueItem::PAUSED)) != NULL) {
 			if(qi->isSet(QueueItem::FLAG_USER_LIST)) {
@@ -1520,7 +1763,7 @@ void QueueManager::removeSource(const UserPtr& aUser, Flags::MaskType reason) no
 				userQueue.remove(qi, aUser);
 				qi->removeSource(aUser, reason);
 				fire(QueueManagerListener::SourcesUpdated(), qi);
-				setDirty();
+				journalRemoveSource(qi, aUser);
 			}
 		}
 		
@@ -1535,7 +1778,7 @@ void QueueManager::removeSource(const UserPtr& aUser, Flags::MaskType reason) no
 				qi->removeSource(aUser, reason);
 				fire(QueueManagerListener::StatusUpdated(), qi);
 				fire(QueueManagerListener::SourcesUpdated(), qi);
-				setDirty();
+				journalRemoveSource(qi, aUser);
 			}
 		}
 	}
@@ -1553,7 +1796,7 @@ void QueueManager::setPriority(const string& aTarget, QueueItem::Priority p) noe
 	bool running = false;
 
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 	
 		QueueItem* q = fileQueue.find(aTarget);
 		if( (q != NULL) && (q->getPriority() != p) && !q->isFinished() ) {
@@ -1564,7 +1807,7 @@ void QueueManager::setPriority(const string& aTarget, QueueItem::Priority p) noe
 				q->getOnlineUsers(getConn);
 			}
 			userQueue.setPriority(q, p);
-			setDirty();
+			journalPriority(q);
 			fire(QueueManagerListener::StatusUpdated(), q);
 		}
 	}
@@ -1583,7 +1826,7 @@ void QueueManager::setAutoPriority(const string& aTarget, bool ap) noexcept {
 	vector<pair<string, QueueItem::Priority> > priorities;
 
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 	
 		QueueItem* q = fileQueue.find(aTarget);
 		if( (q != NULL) && (q->getAutoPriority() != ap) ) {
@@ -1591,7 +1834,7 @@ void QueueManager::setAutoPriority(const string& aTarget, bool ap) noexcept {
 			if(ap) {
 				priorities.push_back(make_pair(q->getTarget(), q->calculateAutoPriority()));
 			}
-			setDirty();
+			journalPriority(q);
 			fire(QueueManagerListener::StatusUpdated(), q);
 		}
 	}
@@ -1601,127 +1844,383 @@ void QueueManager::setAutoPriority(const string& aTarget, bool ap) noexcept {
 	}
 }
 
-void QueueManager::saveQueue(bool force) noexcept {
-	if(!dirty && !force)
-		return;
-		
-	try {
-		Lock l(cs);	
-		
-		File file(getQueueFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
-		BufferedOutputStream<false> f(&file);
-		
-		f.write(SimpleXML::utf8Header);
-		f.write(LIT("<Downloads Version=\"" VERSIONSTRING "\">\r\n"));
-		string tmp;
-		string b32tmp;
-		for(auto i = fileQueue.getQueue().cbegin(); i != fileQueue.getQueue().cend(); ++i) {
-			QueueItem* qi = i->second;
-			if(!qi->isSet(QueueItem::FLAG_USER_LIST)) {
-				f.write(LIT("\t<Download Target=\""));
-				f.write(SimpleXML::escape(qi->getTarget(), tmp, true));
-				f.write(LIT("\" Size=\""));
-				f.write(Util::toString(qi->getSize()));
-				f.write(LIT("\" Priority=\""));
-				f.write(Util::toString((int)qi->getPriority()));
-				f.write(LIT("\" Added=\""));
-				f.write(Util::toString(qi->getAdded()));
-				b32tmp.clear();
-				f.write(LIT("\" TTH=\""));
-				f.write(qi->getTTH().toBase32(b32tmp));
-				if(!qi->getDone().empty()) {
-					f.write(LIT("\" TempTarget=\""));
-					f.write(SimpleXML::escape(qi->getTempTarget(), tmp, true));
-				}
-				f.write(LIT("\" AutoPriority=\""));
-				f.write(Util::toString(qi->getAutoPriority()));
-				f.write(LIT("\" MaxSegments=\""));
-				f.write(Util::toString(qi->getMaxSegments()));
-				f.write(LIT("\">\r\n"));
-
-				for(QueueItem::SegmentSet::const_iterator i = qi->getDone().begin(); i != qi->getDone().end(); ++i) {
-					f.write(LIT("\t\t<Segment Start=\""));
-					f.write(Util::toString(i->getStart()));
-					f.write(LIT("\" Size=\""));
-					f.write(Util::toString(i->getSize()));
-					f.write(LIT("\"/>\r\n"));
-				}
+QueueManager::SavedItem::SavedItem(QueueItem* qi) : target(qi->getTarget()), size(qi->getSize()), added(qi->getAdded()),
+	tth(qi->getTTH()), priority(qi->getPriority()), maxSegments(qi->getMaxSegments()), autoPriority(qi->getAutoPriority()),
+	done(qi->getDone().begin(), qi->getDone().end())
+{
+	if(!done.empty())
+		tempTarget = qi->getTempTarget();
 
-				for(QueueItem::SourceConstIter j = qi->sources.begin(); j != qi->sources.end(); ++j) {
-					if(j->isSet(QueueItem::Source::FLAG_PARTIAL) || j->getUser().hint == "DHT") continue;
-					
-					const CID& cid = j->getUser().user->getCID();
-					const string& hint = j->getUser().hint;
-
-					f.write(LIT("\t\t<Source CID=\""));
-					f.write(cid.toBase32());
-					f.write(LIT("\" Nick=\""));
-					f.write(SimpleXML::escape(ClientManager::getInstance()->getNicks(cid, hint)[0], tmp, true));
-					if(!hint.empty()) {
-						f.write(LIT("\" HubHint=\""));
-						f.write(hint);
-					}
-					f.write(LIT("\"/>\r\n"));
-				}
+	for(auto i = qi->getSources().cbegin(); i != qi->getSources().cend(); ++i) {
+		if(i->isSet(QueueItem::Source::FLAG_PARTIAL) || i->getUser().hint == "DHT") continue;
+		sources.push_back(i->getUser());
+	}
+}
+
+void QueueManager::SavedItem::write(OutputStream& f, string& tmp, uint64_t seq) const {
+	f.write(LIT("\t<Download "));
+	if(seq != 0) {
+		f.write(LIT("Seq=\""));
+		f.write(Util::toString(seq));
+		f.write(LIT("\" "));
+	}
+	f.write(LIT("Target=\""));
+	f.write(SimpleXML::escape(target, tmp, true));
+	f.write(LIT("\" Size=\""));
+	f.write(Util::toString(size));
+	f.write(LIT("\" Priority=\""));
+	f.write(Util::toString((int)priority));
+	f.write(LIT("\" Added=\""));
+	f.write(Util::toString(added));
+	tmp.clear();
+	f.write(LIT("\" TTH=\""));
+	f.write(tth.toBase32(tmp));
+	if(!tempTarget.empty()) {
+		f.write(LIT("\" TempTarget=\""));
+		f.write(SimpleXML::escape(tempTarget, tmp, true));
+	}
+	f.write(LIT("\" AutoPriority=\""));
+	f.write(Util::toString(autoPriority));
+	f.write(LIT("\" MaxSegments=\""));
+	f.write(Util::toString(maxSegments));
+	f.write(LIT("\">\r\n"));
+
+	for(auto i = done.cbegin(); i != done.cend(); ++i) {
+		f.write(LIT("\t\t<Segment Start=\""));
+		f.write(Util::toString(i->getStart()));
+		f.write(LIT("\" Size=\""));
+		f.write(Util::toString(i->getSize()));
+		f.write(LIT("\"/>\r\n"));
+	}
 
-				f.write(LIT("\t</Download>\r\n"));
+	for(auto j = sources.cbegin(); j != sources.cend(); ++j) {
+		const CID& cid = j->user->getCID();
+
+		f.write(LIT("\t\t<Source CID=\""));
+		f.write(cid.toBase32());
+		f.write(LIT("\" Nick=\""));
+		f.write(SimpleXML::escape(ClientManager::getInstance()->getNicks(cid, j->hint)[0], tmp, true));
+		if(!j->hint.empty()) {
+			f.write(LIT("\" HubHint=\""));
+			f.write(j->hint);
+		}
+		f.write(LIT("\"/>\r\n"));
+	}
+
+	f.write(LIT("\t</Download>\r\n"));
+}
+
+void QueueManager::QueueSaver::save() {
+	Lock l(cs);
+	pending = true;
+	if(!active) {
+		active = true;
+		start();
+	}
+}
+
+int QueueManager::QueueSaver::run() {
+	for(;;) {
+		{
+			Lock l(cs);
+			if(!pending) {
+				active = false;
+				return 0;
 			}
+			pending = false;
 		}
+		qm->saveQueue();
+	}
+}
+
+/*
+ * Queue.xml holds a snapshot of the queue and Queue.xml.journal the changes made since, one
+ * record per change. Records carry increasing sequence numbers and the snapshot stores the last
+ * one it contains, so a crash at any point of the compaction only loses records that hadn't
+ * been written yet; records already contained in the snapshot are skipped on load.
+ */
+static const char journalHeader[] = "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"yes\"?>\r\n<QueueJournal>\r\n";
+
+void QueueManager::beginRecord(string& rec, const char* name, const string& target) {
+	string tmp;
+	rec += "\t<";
+	rec += name;
+	rec += " Seq=\"";
+	rec += Util::toString(++journalSeq);
+	rec += "\" Target=\"";
+	rec += SimpleXML::escape(target, tmp, true);
+	rec += '"';
+}
 
-		f.write("</Downloads>\r\n");
-		f.flush();
-		file.close();
+void QueueManager::journal(const string& rec) {
+	FastLock l(journalCs);
+	journalBuffer += rec;
+}
 
-		File::deleteFile(getQueueFile() + ".bak");
-		if(Util::fileExists(getQueueFile()))
-			File::renameFile(getQueueFile(), getQueueFile() + ".bak");
-		File::renameFile(getQueueFile() + ".tmp", getQueueFile());
+void QueueManager::journalItem(QueueItem* qi) {
+	if(!journalling || qi->isSet(QueueItem::FLAG_USER_LIST))
+		return;
 
-		dirty = false;
+	string rec, tmp;
+	StringRefOutputStream os(rec);
+	SavedItem(qi).write(os, tmp, ++journalSeq);
+	journal(rec);
+}
+
+void QueueManager::journalRemove(QueueItem* qi) {
+	if(!journalling || qi->isSet(QueueItem::FLAG_USER_LIST))
+		return;
+
+	string rec;
+	beginRecord(rec, "Remove", qi->getTarget());
+	rec += "/>\r\n";
+	journal(rec);
+}
+
+void QueueManager::journalMove(const string& source, const string& target) {
+	if(!journalling)
+		return;
+
+	string rec, tmp;
+	beginRecord(rec, "Move", source);
+	rec += " NewTarget=\"";
+	rec += SimpleXML::escape(target, tmp, true);
+	rec += "\"/>\r\n";
+	journal(rec);
+}
+
+void QueueManager::journalSegment(QueueItem* qi, const Segment& segment) {
+	if(!journalling || qi->isSet(QueueItem::FLAG_USER_LIST))
+		return;
+
+	string rec, tmp;
+	beginRecord(rec, "Segment", qi->getTarget());
+	rec += " Start=\"";
+	rec += Util::toString(segment.getStart());
+	rec += "\" Size=\"";
+	rec += Util::toString(segment.getSize());
+	rec += "\" TempTarget=\"";
+	rec += SimpleXML::escape(qi->getTempTarget(), tmp, true);
+	rec += "\"/>\r\n";
+	journal(rec);
+}
+
+void QueueManager::journalSource(QueueItem* qi, const HintedUser& aUser) {
+	if(!journalling || qi->isSet(QueueItem::FLAG_USER_LIST) || aUser.hint == "DHT")
+		return;
+
+	const CID& cid = aUser.user->getCID();
+
+	string rec, tmp;
+	beginRecord(rec, "Source", qi->getTarget());
+	rec += " CID=\"";
+	rec += cid.toBase32();
+	rec += "\" Nick=\"";
+	rec += SimpleXML::escape(ClientManager::getInstance()->getNicks(cid, aUser.hint)[0], tmp, true);
+	if(!aUser.hint.empty()) {
+		rec += "\" HubHint=\"";
+		rec += aUser.hint;
+	}
+	rec += "\"/>\r\n";
+	journal(rec);
+}
+
+void QueueManager::journalRemoveSource(QueueItem* qi, const UserPtr& aUser) {
+	if(!journalling || qi->isSet(QueueItem::FLAG_USER_LIST))
+		return;
+
+	string rec;
+	beginRecord(rec, "RemoveSource", qi->getTarget());
+	rec += " CID=\"";
+	rec += aUser->getCID().toBase32();
+	rec += "\"/>\r\n";
+	journal(rec);
+}
+
+void QueueManager::journalPriority(QueueItem* qi) {
+	if(!journalling || qi->isSet(QueueItem::FLAG_USER_LIST))
+		return;
+
+	string rec;
+	beginRecord(rec, "Priority", qi->getTarget());
+	rec += " Priority=\"";
+	rec += Util::toString((int)qi->getPriority());
+	rec += "\" AutoPriority=\"";
+	rec += Util::toString(qi->getAutoPriority());
+	rec += "\"/>\r\n";
+	journal(rec);
+}
+
+void QueueManager::appendJournal(const string& records) {
+	if(records.empty())
+		return;
+
+	File f(getJournalFile(), File::WRITE, File::OPEN | File::CREATE);
+	if(f.getSize() == 0) {
+		f.write(journalHeader, sizeof(journalHeader) - 1);
+	} else {
+		f.setEndPos(0);
+	}
+	f.write(records);
+	f.flush();
+
+	journalSize += records.size();
+	dirty = true;
+}
+
+void QueueManager::writeSnapshot() {
+	vector<SavedItem> items;
+	uint64_t seq;
+	string records;
+	{
+		TimedLock l(cs);
+		items.reserve(fileQueue.getSize());
+		for(auto i = fileQueue.getQueue().cbegin(); i != fileQueue.getQueue().cend(); ++i) {
+			if(!i->second->isSet(QueueItem::FLAG_USER_LIST))
+				items.push_back(SavedItem(i->second));
+		}
+		seq = journalSeq;
+
+		FastLock jl(journalCs);
+		records.swap(journalBuffer);
+	}
+
+	// Records up to seq are in the snapshot, but the journal must hold them until it's in place
+	appendJournal(records);
+
+	File file(getQueueFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
+	BufferedOutputStream<false> f(&file);
+	
+	f.write(SimpleXML::utf8Header);
+	f.write(LIT("<Downloads Version=\"" VERSIONSTRING "\" JournalSeq=\""));
+	f.write(Util::toString(seq));
+	f.write(LIT("\">\r\n"));
+	string tmp;
+	for(auto i = items.cbegin(); i != items.cend(); ++i) {
+		i->write(f, tmp, 0);
+	}
+
+	f.write("</Downloads>\r\n");
+	f.flush();
+	file.close();
+
+	File::deleteFile(getQueueFile() + ".bak");
+	if(Util::fileExists(getQueueFile()))
+		File::renameFile(getQueueFile(), getQueueFile() + ".bak");
+	File::renameFile(getQueueFile() + ".tmp", getQueueFile());
+
+	File journalFile(getJournalFile(), File::WRITE, File::CREATE | File::TRUNCATE);
+	journalFile.write(journalHeader, sizeof(journalHeader) - 1);
+
+	journalSize = 0;
+	dirty = false;
+}
+
+void QueueManager::saveQueue(bool force) noexcept {
+	try {
+		Lock l(saveCs);
+
+		string records;
+		{
+			FastLock jl(journalCs);
+			records.swap(journalBuffer);
+		}
+		appendJournal(records);
+
+		// A large journal is compacted right away, but still not more often than every 10 seconds
+		uint64_t interval = journalSize >= JOURNAL_COMPACT_SIZE ? 10000 : JOURNAL_COMPACT_TIME;
+		if(force || (dirty && (lastSave + interval) < GET_TICK())) {
+			// Put this here to avoid very many saves tries when disk is full...
+			lastSave = GET_TICK();
+			writeSnapshot();
+		}
 	} catch(...) {
 		// ...
 	}
-	// Put this here to avoid very many saves tries when disk is full...
-	lastSave = GET_TICK();
 }
 
 class QueueLoader : public SimpleXMLReader::CallBack {
 public:
-	QueueLoader(const CountedInputStream<false>& countedStream, uint64_t fileSize, function<void (float)> progressF) :
+	QueueLoader(const CountedInputStream<false>& countedStream, uint64_t fileSize, function<void (float)> progressF, uint64_t lastSeq = 0) :
 		countedStream(countedStream),
 		streamPos(0),
 		fileSize(fileSize),
 		progressF(progressF),
+		lastSeq(lastSeq),
 		cur(nullptr),
-		inDownloads(false)
+		inDownloads(false),
+		inJournal(false),
+		skip(false)
 	{ }
 	void startTag(const string& name, StringPairList& attribs, bool simple);
 	void endTag(const string& name);
 
+	/** Sequence number of the last change contained in the loaded file */
+	uint64_t getLastSeq() const { return lastSeq; }
+
 private:
 	const CountedInputStream<false>& countedStream;
 	uint64_t streamPos;
 	uint64_t fileSize;
 	function<void (float)> progressF;
+	uint64_t lastSeq;
 
 	string target;
 
 	QueueItem* cur;
 	bool inDownloads;
+	bool inJournal;
+	/** Inside a journal record that Queue.xml already contains */
+	bool skip;
+
+	QueueItem* findItem(StringPairList& attribs);
+	void setPriority(QueueItem* qi, QueueItem::Priority p);
+	void loadJournalRecord(const string& name, StringPairList& attribs);
 };
 
 void QueueManager::loadQueue(function<void (float)> progressF) noexcept {
+	uint64_t lastSeq = 0;
 	try {
 		Util::migrate(getQueueFile());
 
-		File f(getQueueFile(), File::READ, File::OPEN);
+		// Queue.xml goes missing if we crash while replacing it, the journal covers everything since the backup
+		string queueFile = getQueueFile();
+		if(!Util::fileExists(queueFile) && Util::fileExists(queueFile + ".bak"))
+			queueFile += ".bak";
+
+		File f(queueFile, File::READ, File::OPEN);
 		CountedInputStream<false> countedStream(&f);
 		QueueLoader l(countedStream, f.getSize(), progressF);
 		SimpleXMLReader(&l).parse(countedStream);
+		lastSeq = l.getLastSeq();
 		dirty = false;
 	} catch(const Exception&) {
 		// ...
 	}
+
+	uint64_t snapshotSeq = lastSeq;
+	try {
+		File f(getJournalFile(), File::READ, File::OPEN);
+		CountedInputStream<false> countedStream(&f);
+		QueueLoader l(countedStream, f.getSize(), progressF, snapshotSeq);
+		try {
+			SimpleXMLReader(&l).parse(countedStream);
+		} catch(const SimpleXMLException&) {
+			// The journal is never closed and the last record may have been cut short by a crash
+		}
+		lastSeq = l.getLastSeq();
+	} catch(const Exception&) {
+		// ...
+	}
+
+	TimedLock l(cs);
+	journalSeq = lastSeq;
+	if(lastSeq != snapshotSeq) {
+		// Fold the replayed records into Queue.xml at the next compaction
+		dirty = true;
+		journalSize = File::getSize(getJournalFile());
+	}
+	journalling = true;
 }
 
 static const string sDownload = "Download";
@@ -1740,6 +2239,64 @@ static const string sSegment = "Segment";
 static const string sStart = "Start";
 static const string sAutoPriority = "AutoPriority";
 static const string sMaxSegments = "MaxSegments";
+static const string sJournalSeq = "JournalSeq";
+static const string sQueueJournal = "QueueJournal";
+static const string sSeq = "Seq";
+static const string sRemove = "Remove";
+static const string sRemoveSource = "RemoveSource";
+static const string sMove = "Move";
+static const string sNewTarget = "NewTarget";
+
+QueueItem* QueueLoader::findItem(StringPairList& attribs) {
+	if(cur)
+		return cur;
+	if(!inJournal)
+		return nullptr;
+	return QueueManager::getInstance()->fileQueue.find(getAttrib(attribs, sTarget, 1));
+}
+
+void QueueLoader::loadJournalRecord(const string& name, StringPairList& attribs) {
+	QueueManager* qm = QueueManager::getInstance();
+	QueueItem* qi = findItem(attribs);
+	if(qi == nullptr)
+		return;
+
+	if(name == sRemove) {
+		// Not QueueManager::remove, the temp file may belong to a later record by now
+		qm->fire(QueueManagerListener::Removed(), qi);
+		if(!qi->isFinished())
+			qm->userQueue.remove(qi);
+		qm->fileQueue.remove(qi);
+	} else if(name == sRemoveSource) {
+		const string& cid = getAttrib(attribs, sCID, 2);
+		if(cid.length() != 39)
+			return;
+
+		UserPtr user = ClientManager::getInstance()->findUser(CID(cid));
+		if(user && qi->isSource(user)) {
+			if(!qi->isFinished())
+				qm->userQueue.remove(qi, user);
+			qi->getSources().erase(qi->getSource(user));
+			qm->fire(QueueManagerListener::SourcesUpdated(), qi);
+		}
+	} else if(name == sPriority) {
+		QueueItem::Priority p = (QueueItem::Priority)Util::toInt(getAttrib(attribs, sPriority, 2));
+		if(p < QueueItem::PAUSED || p >= QueueItem::LAST)
+			return;
+
+		qi->setAutoPriority(Util::toInt(getAttrib(attribs, sAutoPriority, 3)) == 1);
+		setPriority(qi, p);
+	} else if(name == sMove) {
+		const string& newTarget = getAttrib(attribs, sNewTarget, 2);
+		if(qi->isRunning() || qm->fileQueue.find(newTarget))
+			return;
+
+		string source = qi->getTarget();
+		qm->fire(QueueManagerListener::Moved(), qi, source);
+		qm->fileQueue.move(qi, newTarget);
+		qm->fire(QueueManagerListener::Added(), qi);
+	}
+}
 
 void QueueLoader::startTag(const string& name, StringPairList& attribs, bool simple) {
 	ScopedFunctor([this] {
@@ -1753,7 +2310,24 @@ void QueueLoader::startTag(const string& name, StringPairList& attribs, bool sim
 	QueueManager* qm = QueueManager::getInstance();	
 	if(!inDownloads && name == "Downloads") {
 		inDownloads = true;
+		lastSeq = Util::toUInt64(getAttrib(attribs, sJournalSeq, 1));
+	} else if(!inDownloads && name == sQueueJournal) {
+		inDownloads = true;
+		inJournal = true;
 	} else if(inDownloads) {
+		if(skip)
+			return;
+
+		if(inJournal && cur == nullptr) {
+			uint64_t seq = Util::toUInt64(getAttrib(attribs, sSeq, 0));
+			if(seq <= lastSeq) {
+				// Already in Queue.xml
+				skip = !simple;
+				return;
+			}
+			lastSeq = seq;
+		}
+
 		if(cur == nullptr && name == sDownload) {
 			int64_t size = Util::toInt64(getAttrib(attribs, sSize, 1));
 			if(size == 0)
@@ -1799,18 +2373,49 @@ void QueueLoader::startTag(const string& name, StringPairList& attribs, bool sim
 				qi->setMaxSegments(max((uint8_t)1, maxSegments));
 				
 				qm->fire(QueueManagerListener::Added(), qi);
+			} else if(inJournal) {
+				// The record replaces everything but the sources, which are journaled one by one
+				if(!tempTarget.empty())
+					qi->setTempTarget(tempTarget);
+				qi->resetDownloaded();
+				qi->setAutoPriority(Util::toInt(getAttrib(attribs, sAutoPriority, 7)) == 1);
+				qi->setMaxSegments(max((uint8_t)1, maxSegments));
+				if(p >= QueueItem::PAUSED && p < QueueItem::LAST)
+					setPriority(qi, p);
+
+				qm->fire(QueueManagerListener::StatusUpdated(), qi);
 			}
 			if(!simple)
 				cur = qi;
-		} else if(cur && name == sSegment) {
+		} else if(name == sSegment) {
+			QueueItem* qi = findItem(attribs);
+			if(qi == nullptr)
+				return;
+
 			int64_t start = Util::toInt64(getAttrib(attribs, sStart, 0));
 			int64_t size = Util::toInt64(getAttrib(attribs, sSize, 1));
 			
-			if(size > 0 && start >= 0 && (start + size) <= cur->getSize()) {
-				cur->addSegment(Segment(start, size));
-				cur->setPriority(cur->calculateAutoPriority());
+			if(size > 0 && start >= 0 && (start + size) <= qi->getSize()) {
+				if(cur == nullptr) {
+					const string& tempTarget = getAttrib(attribs, sTempTarget, 4);
+					if(!tempTarget.empty())
+						qi->setTempTarget(tempTarget);
+				}
+
+				qi->addSegment(Segment(start, size));
+				if(!inJournal) {
+					qi->setPriority(qi->calculateAutoPriority());
+				} else if(qi->isFinished()) {
+					qm->userQueue.remove(qi);
+				} else {
+					setPriority(qi, qi->calculateAutoPriority());
+				}
 			}
-		} else if(cur && name == sSource) {
+		} else if(name == sSource) {
+			QueueItem* qi = findItem(attribs);
+			if(qi == nullptr)
+				return;
+
 			const string& cid = getAttrib(attribs, sCID, 0);
 			if(cid.length() != 39) {
 				// Skip loading this source - sorry old users
@@ -1822,18 +2427,35 @@ void QueueLoader::startTag(const string& name, StringPairList& attribs, bool sim
 			try {
 				const string& hubHint = getAttrib(attribs, sHubHint, 1);
 				HintedUser hintedUser(user, hubHint);
-				if(qm->addSource(cur, hintedUser, 0) && user->isOnline())
+				if(qm->addSource(qi, hintedUser, 0) && user->isOnline())
 					ConnectionManager::getInstance()->getDownloadConnection(hintedUser);
 			} catch(const Exception&) {
 				return;
 			}
+		} else if(inJournal && cur == nullptr) {
+			loadJournalRecord(name, attribs);
 		}
 	}
 }
 
+void QueueLoader::setPriority(QueueItem* qi, QueueItem::Priority p) {
+	if(qi->getPriority() == p)
+		return;
+
+	if(qi->isFinished())
+		qi->setPriority(p);
+	else
+		QueueManager::getInstance()->userQueue.setPriority(qi, p);
+}
+
 void QueueLoader::endTag(const string& name) {
 	if(inDownloads) {
 		if(name == sDownload) {
+			if(skip) {
+				skip = false;
+				return;
+			}
+
 			// Do not keep finished files, that don't exist, in queue
 			if(cur && BOOLSETTING(KEEP_FINISHED_FILES)) {
 				if(cur->isFinished() && !Util::fileExists(cur->getTempTarget()) && !Util::fileExists(cur->getTarget()))
@@ -1860,7 +2482,7 @@ void QueueManager::on(SearchManagerListener::SR, const SearchResultPtr& sr) noex
 	size_t users = 0;
 
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 		auto matches = fileQueue.find(sr->getTTH());
 
 		for(auto i = matches.begin(); i != matches.end(); ++i) {
@@ -1902,7 +2524,7 @@ void QueueManager::on(SearchManagerListener::SR, const SearchResultPtr& sr) noex
 void QueueManager::on(ClientManagerListener::UserConnected, const UserPtr& aUser) noexcept {
 	bool hasDown = false;
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 		for(int i = 0; i < QueueItem::LAST; ++i) {
 			auto j = userQueue.getList(i).find(aUser);
 			if(j != userQueue.getList(i).end()) {
@@ -1921,7 +2543,7 @@ void QueueManager::on(ClientManagerListener::UserConnected, const UserPtr& aUser
 }
 
 void QueueManager::on(ClientManagerListener::UserDisconnected, const UserPtr& aUser) noexcept {
-	Lock l(cs);
+	TimedLock l(cs);
 	for(int i = 0; i < QueueItem::LAST; ++i) {
 		auto j = userQueue.getList(i).find(aUser);
 		if(j != userQueue.getList(i).end()) {
@@ -1932,15 +2554,20 @@ void QueueManager::on(ClientManagerListener::UserDisconnected, const UserPtr& aU
 }
 
 void QueueManager::on(TimerManagerListener::Second, uint64_t aTick) noexcept {
-	if(dirty && ((lastSave + 10000) < aTick)) {
-		saveQueue();
+	bool pending;
+	{
+		FastLock l(journalCs);
+		pending = !journalBuffer.empty();
+	}
+	if(pending || (dirty && (lastSave + JOURNAL_COMPACT_TIME) < aTick)) {
+		saver.save();
 	}
 
 
 	vector<pair<string, QueueItem::Priority> > priorities;
 
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 
 		auto um = getRunningFiles();
 		for(auto j = um.cbegin(); j != um.cend(); ++j) {
@@ -1968,7 +2595,7 @@ bool QueueManager::dropSource(Download* d) {
 	uint64_t overallSpeed;
 
 	{
-	    Lock l(cs);
+	    TimedLock l(cs);
 
 		QueueItem* q = userQueue.getRunning(d->getUser());
 
@@ -2016,7 +2643,7 @@ bool QueueManager::handlePartialResult(const HintedUser& aUser, const TTHValue&
 	dcassert(outPartialInfo.empty());
 
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 
 		// Locate target QueueItem in download queue
 		auto ql = fileQueue.find(tth);
@@ -2068,6 +2695,7 @@ bool QueueManager::handlePartialResult(const HintedUser& aUser, const TTHValue&
 				QueueItem::PartialSource* ps = new QueueItem::PartialSource(partialSource.getMyNick(),
 					partialSource.getHubIpPort(), partialSource.getIp(), partialSource.getUdpPort());
 				si->setPartialSource(ps);
+				fileQueue.schedulePFSQuery(qi, ps);
 
 				userQueue.add(qi, aUser);
 				dcassert(si != qi->getSources().end());
@@ -2090,7 +2718,7 @@ bool QueueManager::handlePartialResult(const HintedUser& aUser, const TTHValue&
 
 bool QueueManager::handlePartialSearch(const TTHValue& tth, QueueItem::PartsInfo& _outPartsInfo) {
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 
 		// Locate target QueueItem in download queue
 		auto ql = fileQueue.find(tth);
@@ -2118,78 +2746,82 @@ bool QueueManager::handlePartialSearch(const TTHValue& tth, QueueItem::PartsInfo
 }
 
 // compare nextQueryTime, get the oldest ones
+bool QueueManager::FileQueue::isShared(const QueueItem* qi) const {
+	// Don't share when file does not exist
+	return Util::fileExists(qi->isFinished() ? qi->getTarget() : const_cast<QueueItem*>(qi)->getTempTarget());
+}
+
+void QueueManager::FileQueue::schedulePFSQuery(QueueItem* qi, const QueueItem::PartialSource::Ptr& source) {
+	if(source->getPendingQueryCount() < 10 && source->getUdpPort() > 0)
+		pfsQueries.push(PFSQuery(source->getNextQueryTime(), source, qi));
+}
+
 void QueueManager::FileQueue::findPFSSources(PFSSourceList& sl) 
 {
-	typedef multimap<time_t, pair<QueueItem::SourceConstIter, const QueueItem*> > Buffer;
-	Buffer buffer;
 	uint64_t now = GET_TICK();
 
-	for(auto i = queue.cbegin(); i != queue.cend(); ++i) {
-		QueueItem* q = i->second;
+	dcassert(sl.empty());
+	const size_t maxElements = 10;
+	sl.reserve(maxElements);
 
-		if(q->getSize() < PARTIAL_SHARE_MIN_SIZE) continue;
+	while(!pfsQueries.empty() && sl.size() < maxElements) {
+		if(pfsQueries.top().time > now)
+			break;
 
-		// Don't share when file does not exist
-		if(!Util::fileExists(q->isFinished() ? q->getTarget() : q->getTempTarget()))
-			continue;
+		PFSQuery query = pfsQueries.top();
+		pfsQueries.pop();
 
-		const auto& sources = q->getSources();
-		const auto& badSources = q->getBadSources();
+		// Rescheduled since, or the item is gone
+		if(query.time != query.source->getNextQueryTime() || !isQueued(query.qi.get()))
+			continue;
 
-		for(auto j = sources.cbegin(); j != sources.cend(); ++j) {
-			if(	(*j).isSet(QueueItem::Source::FLAG_PARTIAL) && (*j).getPartialSource()->getNextQueryTime() <= now &&
-				(*j).getPartialSource()->getPendingQueryCount() < 10 && (*j).getPartialSource()->getUdpPort() > 0)
-			{
-				buffer.insert(make_pair((*j).getPartialSource()->getNextQueryTime(), make_pair(j, q)));
-			}
+		auto isSource = [&query](const QueueItem::Source& s) { return s.getPartialSource() == query.source; };
+		const auto& sources = query.qi->getSources();
+		const auto& badSources = query.qi->getBadSources();
+		auto j = find_if(sources.cbegin(), sources.cend(), isSource);
+		if(j == sources.cend()) {
+			j = find_if(badSources.cbegin(), badSources.cend(), isSource);
+			if(j == badSources.cend() || j->isSet(QueueItem::Source::FLAG_TTH_INCONSISTENCY))
+				continue;
 		}
+		if(!j->isSet(QueueItem::Source::FLAG_PARTIAL))
+			continue;
 
-		for(auto j = badSources.cbegin(); j != badSources.cend(); ++j) {
-			if(	(*j).isSet(QueueItem::Source::FLAG_TTH_INCONSISTENCY) == false && (*j).isSet(QueueItem::Source::FLAG_PARTIAL) &&
-				(*j).getPartialSource()->getNextQueryTime() <= now && (*j).getPartialSource()->getPendingQueryCount() < 10 &&
-				(*j).getPartialSource()->getUdpPort() > 0)
-			{
-				buffer.insert(make_pair((*j).getPartialSource()->getNextQueryTime(), make_pair(j, q)));
-			}
+		if(!isShared(query.qi.get())) {
+			// Try again next time
+			query.source->setNextQueryTime(now + 60000);
+			schedulePFSQuery(query.qi.get(), query.source);
+			continue;
 		}
-	}
 
-	// copy to results
-	dcassert(sl.empty());
-	const int32_t maxElements = 10;
-	sl.reserve(maxElements);
-	for(Buffer::iterator i = buffer.begin(); i != buffer.end() && sl.size() < maxElements; i++){
-		sl.push_back(i->second);
+		sl.push_back(make_pair(query.source, query.qi.get()));
 	}
 }
 
 TTHValue* QueueManager::FileQueue::findPFSPubTTH()
 {
 	uint64_t now = GET_TICK();
-	QueueItemPtr cand = NULL;
 
-	for(auto i = queue.cbegin(); i != queue.cend(); i++)
-	{
-		QueueItemPtr qi = i->second;
+	for(int checked = 0; checked < PFS_MAX_CHECKS && !pfsPublishes.empty(); ++checked) {
+		if(pfsPublishes.top().time > now)
+			break;
 
-		// Don't share when file does not exist
-		if(!Util::fileExists(qi->isFinished() ? qi->getTarget() : qi->getTempTarget()))
+		ItemPtr qi = pfsPublishes.top().qi;
+		uint64_t time = pfsPublishes.top().time;
+		pfsPublishes.pop();
+
+		// Rescheduled since, or the item is gone
+		if(time != qi->getNextPublishingTime() || !isQueued(qi.get()))
 			continue;
 
-		if(qi && qi->getSize() >= PARTIAL_SHARE_MIN_SIZE && now >= qi->getNextPublishingTime() && qi->getPriority() > QueueItem::PAUSED)
-		{
-			if(cand == NULL || cand->getNextPublishingTime() > qi->getNextPublishingTime() || (cand->getNextPublishingTime() == qi->getNextPublishingTime() && cand->getPriority() < qi->getPriority()) )
-			{
-				if(qi->getDownloadedBytes() > HashManager::getInstance()->getBlockSize(qi->getTTH()))
-					cand = qi;
-			}
+		if(qi->getPriority() > QueueItem::PAUSED && qi->getDownloadedBytes() > HashManager::getInstance()->getBlockSize(qi->getTTH()) && isShared(qi.get())) {
+			qi->setNextPublishingTime(now + PFS_REPUBLISH_TIME);		// one hour
+			pfsPublishes.push(PFSPublish(qi.get()));
+			return new TTHValue(qi->getTTH());
 		}
-	}
 
-	if(cand)
-	{
-		cand->setNextPublishingTime(now + PFS_REPUBLISH_TIME);		// one hour
-		return new TTHValue(cand->getTTH());	
+		qi->setNextPublishingTime(now + PFS_RECHECK_TIME);
+		pfsPublishes.push(PFSPublish(qi.get()));
 	}
 
 	return NULL;
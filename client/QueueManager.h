@@ -22,8 +22,10 @@
 #include <functional>
 #include <unordered_map>
 #include <map>
+#include <queue>
 
 #include "TimerManager.h"
+#include "Metrics.h"
 
 #include "Exception.h"
 #include "User.h"
@@ -67,7 +69,7 @@ public:
 	void addList(const HintedUser& HintedUser, Flags::MaskType aFlags, const string& aInitialDir = Util::emptyString);
 
 	void removeUserCheck(const HintedUser& aUser) noexcept {
-		Lock l(cs);
+		TimedLock l(cs);
 		for(auto i = fileQueue.getQueue().cbegin(); i != fileQueue.getQueue().cend(); ++i) {
 			if(i->second->isSource(aUser) && i->second->isSet(QueueItem::FLAG_USER_CHECK)) {
 				remove(i->second->getTarget());
@@ -77,7 +79,7 @@ public:
 	}
 
 	void removeOfflineChecks() noexcept {
-		Lock l(cs);
+		TimedLock l(cs);
 		const QueueItem::StringMap& queue = fileQueue.getQueue();
 		if(queue.size() > 1) {
 			for(auto i = queue.cbegin(); i != queue.cend(); ++i) {
@@ -118,13 +120,15 @@ public:
 
 	void lockedOperation(const function<void(const QueueItem::StringMap&)>& currentQueue);
 
-	QueueItem::SourceList getSources(const QueueItem* qi) const { Lock l(cs); return qi->getSources(); }
-	QueueItem::SourceList getBadSources(const QueueItem* qi) const { Lock l(cs); return qi->getBadSources(); }
-	size_t getSourcesCount(const QueueItem* qi) const { Lock l(cs); return qi->getSources().size(); }
-	vector<Segment> getChunksVisualisation(const QueueItem* qi, int type) const { Lock l(cs); return qi->getChunksVisualisation(type); }
+	QueueItem::SourceList getSources(const QueueItem* qi) const { TimedLock l(cs); return qi->getSources(); }
+	QueueItem::SourceList getBadSources(const QueueItem* qi) const { TimedLock l(cs); return qi->getBadSources(); }
+	size_t getSourcesCount(const QueueItem* qi) const { TimedLock l(cs); return qi->getSources().size(); }
+	vector<Segment> getChunksVisualisation(const QueueItem* qi, int type) const { TimedLock l(cs); return qi->getChunksVisualisation(type); }
 
 	bool getQueueInfo(const UserPtr& aUser, string& aTarget, int64_t& aSize, int& aFlags) noexcept;
 	Download* getDownload(UserConnection& aSource, string& aMessage) noexcept;
+	/** Reserves the next segment of the file aSource is downloading, 0 if there is none to pipeline */
+	Download* getPipelinedDownload(UserConnection& aSource) noexcept;
 	void putDownload(Download* aDownload, bool finished, bool reportFinish = true) noexcept;
 	void setFile(Download* download);
 	
@@ -154,7 +158,7 @@ public:
 	}
 
 	bool getTargetByRoot(const TTHValue& tth, string& target, string& tempTarget) {
-		Lock l(cs);
+		TimedLock l(cs);
 		auto ql = fileQueue.find(tth);
 
 		if(ql.empty()) return false;
@@ -165,7 +169,7 @@ public:
 	}
 
 	bool isChunkDownloaded(const TTHValue& tth, int64_t startPos, int64_t& bytes, string& target) {
-		Lock l(cs);
+		TimedLock l(cs);
 		auto ql = fileQueue.find(tth);
 
 		if(ql.empty()) return false;
@@ -177,11 +181,19 @@ public:
 		return qi->isChunkDownloaded(startPos, bytes);
 	}
 
-	GETSET(uint64_t, lastSave, LastSave);
+	uint64_t getLastSave() const { return lastSave; }
+	void setLastSave(uint64_t aLastSave) { lastSave = aLastSave; }
 	GETSET(string, queueFile, QueueFile);
 
 private:
+	/** The save state below is read by the timer and written by the saver thread */
+	atomic<uint64_t> lastSave;
+
 	enum { MOVER_LIMIT = 10*1024*1024 };
+	/** Compact the journal into Queue.xml when it grows past this size... */
+	enum { JOURNAL_COMPACT_SIZE = 4*1024*1024 };
+	/** ...or when it has been holding changes for this long (ms) */
+	enum { JOURNAL_COMPACT_TIME = 10*60*1000 };
 	class FileMover : public Thread {
 	public:
 		FileMover() : active(false) { }
@@ -200,7 +212,7 @@ private:
 		CriticalSection cs;
 	} mover;
 
-	typedef vector<pair<QueueItem::SourceConstIter, const QueueItem*> > PFSSourceList;
+	typedef vector<pair<QueueItem::PartialSource::Ptr, QueueItem*> > PFSSourceList;
 
 	class Rechecker : public Thread {
 		struct DummyOutputStream : OutputStream {
@@ -216,13 +228,55 @@ private:
 		virtual int run();
 
 	private:
+		struct Recheck;
+		struct Job;
+
 		QueueManager* qm;
 		bool active;
 
 		StringList files;
 		CriticalSection cs;
+
+		/** Takes the next file that can be rechecked off the list, null when it is empty */
+		std::shared_ptr<Recheck> next();
+		void finish(Recheck& r);
 	} rechecker;
 
+	/** Persistent state of a queue item, copied under cs so it can be written without it */
+	struct SavedItem {
+		explicit SavedItem(QueueItem* qi);
+
+		string target;
+		string tempTarget;
+		int64_t size;
+		time_t added;
+		TTHValue tth;
+		QueueItem::Priority priority;
+		uint8_t maxSegments;
+		bool autoPriority;
+		vector<Segment> done;
+		HintedUserList sources;
+
+		void write(OutputStream& os, string& tmp, uint64_t seq) const;
+	};
+
+	/** Appends queued journal records to disk and compacts the journal, away from the timer thread */
+	class QueueSaver : public Thread {
+	public:
+		explicit QueueSaver(QueueManager* qm_) : qm(qm_), active(false), pending(false) { }
+		virtual ~QueueSaver() { join(); }
+
+		void save();
+		virtual int run();
+
+	private:
+		QueueManager* qm;
+		bool active;
+		bool pending;
+
+		CriticalSection cs;
+	} saver;
+
 	/** All queue items by target */
 	class FileQueue {
 	public:
@@ -238,6 +292,8 @@ private:
 
 		// find some PFS sources to exchange parts info
 		void findPFSSources(PFSSourceList&);
+		// queue a PFS source for a parts info query at its next query time
+		void schedulePFSQuery(QueueItem* qi, const QueueItem::PartialSource::Ptr& source);
 
 		// return a PFS tth to DHT publish
 		TTHValue* findPFSPubTTH();
@@ -248,7 +304,41 @@ private:
 		void move(QueueItem* qi, const string& aTarget);
 		void remove(QueueItem* qi);
 	private:
+		/** How long to wait before checking again whether an unpublishable file can be published */
+		enum { PFS_RECHECK_TIME = 10*60*1000 };
+		/** Max number of publish candidates checked per call to findPFSPubTTH */
+		enum { PFS_MAX_CHECKS = 100 };
+
+		typedef boost::intrusive_ptr<QueueItem> ItemPtr;
+
+		/** A partial source's next parts info query */
+		struct PFSQuery {
+			PFSQuery(uint64_t time, const QueueItem::PartialSource::Ptr& source, QueueItem* qi) : time(time), source(source), qi(qi) { }
+			bool operator<(const PFSQuery& rhs) const { return time > rhs.time; }
+
+			uint64_t time;
+			QueueItem::PartialSource::Ptr source;
+			ItemPtr qi;
+		};
+
+		/** A partially downloaded file's next DHT publish */
+		struct PFSPublish {
+			explicit PFSPublish(QueueItem* qi) : time(qi->getNextPublishingTime()), priority(qi->getPriority()), qi(qi) { }
+			bool operator<(const PFSPublish& rhs) const { return time > rhs.time || (time == rhs.time && priority < rhs.priority); }
+
+			uint64_t time;
+			QueueItem::Priority priority;
+			ItemPtr qi;
+		};
+
 		QueueItem::StringMap queue;
+
+		/** Earliest deadline first, stale entries are dropped when they come up */
+		std::priority_queue<PFSQuery> pfsQueries;
+		std::priority_queue<PFSPublish> pfsPublishes;
+
+		bool isQueued(const QueueItem* qi) const { return find(qi->getTarget()) == qi; }
+		bool isShared(const QueueItem* qi) const;
 	};
 
 	/** All queue items indexed by user (this is a cache for the FileQueue really...) */
@@ -259,7 +349,9 @@ private:
 		QueueItem* getNext(const UserPtr& aUser, QueueItem::Priority minPrio = QueueItem::LOWEST, int64_t wantedSize = 0, int64_t lastSpeed = 0, bool allowRemove = false);
 		QueueItem* getRunning(const UserPtr& aUser);
 		void addDownload(QueueItem* qi, Download* d);
+		void addPipelinedDownload(QueueItem* qi, Download* d);
 		void removeDownload(QueueItem* qi, const UserPtr& d);
+		void removeDownload(QueueItem* qi, Download* d);
 		void remove(QueueItem* qi, bool removeRunning = true);
 		void remove(QueueItem* qi, const UserPtr& aUser, bool removeRunning = true);
 		void setPriority(QueueItem* qi, QueueItem::Priority p);
@@ -288,7 +380,19 @@ private:
 	QueueManager();
 	~QueueManager();
 	
-	mutable CriticalSection cs;
+	mutable TimedCriticalSection cs;
+
+	/** Serializes writes to Queue.xml and its journal */
+	CriticalSection saveCs;
+	/** Journal records waiting to be written by the saver */
+	FastCriticalSection journalCs;
+	string journalBuffer;
+	/** Sequence number of the last journal record, Queue.xml stores the last one it contains */
+	uint64_t journalSeq;
+	/** Bytes in the journal file since Queue.xml was last written */
+	atomic<int64_t> journalSize;
+	/** Changes are only journaled once the saved queue has been loaded */
+	bool journalling;
 
 	/** QueueItems by target */
 	FileQueue fileQueue;
@@ -298,8 +402,8 @@ private:
 	unordered_multimap<UserPtr, DirectoryItemPtr, User::Hash> directories;
 	/** Recent searches list, to avoid searching for the same thing too often */
 	deque<string> recent;
-	/** The queue needs to be saved */
-	bool dirty;
+	/** Queue.xml is older than the journal */
+	atomic<bool> dirty;
 	/** Next search */
 	uint64_t nextSearch;
 	/** File lists not to delete */
@@ -311,6 +415,10 @@ private:
 	bool addSource(QueueItem* qi, const HintedUser& aUser, Flags::MaskType addBad);
 
 	void processList(const string& name, const HintedUser& user, int flags);
+	void matchList(const string& name, const HintedUser& user, int flags);
+	/** Sorted snapshot of the TTHs worth matching file lists against */
+	void getQueuedTTHs(vector<TTHValue>& tths) noexcept;
+	int matchTTHs(const DirectoryListing::Directory::TTHSet& tths, const HintedUser& user) noexcept;
 
 	void load(const SimpleXML& aXml);
 	void moveFile(const string& source, const string& target);
@@ -318,7 +426,22 @@ private:
 	void moveStuckFile(QueueItem* qi);
 	void rechecked(QueueItem* qi);
 
-	void setDirty();
+	string getJournalFile() const { return getQueueFile() + ".journal"; }
+
+	/** Journal records, to be called with cs held */
+	void journalItem(QueueItem* qi);
+	void journalRemove(QueueItem* qi);
+	void journalMove(const string& source, const string& target);
+	void journalSegment(QueueItem* qi, const Segment& segment);
+	void journalSource(QueueItem* qi, const HintedUser& aUser);
+	void journalRemoveSource(QueueItem* qi, const UserPtr& aUser);
+	void journalPriority(QueueItem* qi);
+
+	void beginRecord(string& rec, const char* name, const string& target);
+	void journal(const string& rec);
+
+	void appendJournal(const string& records);
+	void writeSnapshot();
 
 	// TimerManagerListener
 	void on(TimerManagerListener::Second, uint64_t aTick) noexcept;
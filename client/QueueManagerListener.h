@@ -48,6 +48,7 @@ public:
 	typedef X<12> RecheckNoTree;
 	typedef X<13> RecheckAlreadyFinished;
 	typedef X<14> RecheckDone;
+	typedef X<16> RecheckProgress;
 	
 	typedef X<15> FileMoved;
 
@@ -66,6 +67,8 @@ public:
 	virtual void on(RecheckNoTree, const string&) noexcept { }
 	virtual void on(RecheckAlreadyFinished, const string&) noexcept { }
 	virtual void on(RecheckDone, const string&) noexcept { }
+	/** Bytes of the recorded segments verified so far, out of total */
+	virtual void on(RecheckProgress, const string&, int64_t /*checked*/, int64_t /*total*/) noexcept { }
 
 	virtual void on(FileMoved, const string&) noexcept { }
 };
@@ -31,6 +31,7 @@
 #include "QueueManager.h"
 #include "StringTokenizer.h"
 #include "FinishedManager.h"
+#include "Metrics.h"
 #include "SimpleXML.h"
 
 namespace dcpp {
@@ -169,7 +170,8 @@ int SearchManager::run() {
 				string data(reinterpret_cast<char*>(&buf[0]), len);
 				string sRemoteAddr = inet_ntoa(remoteAddr.sin_addr);
 
-				if(PluginManager::getInstance()->onUDP(false, sRemoteAddr, Util::toString(port), data))
+				if(PluginManager::getInstance()->isHooked(PluginManager::NETWORK_UDP_IN) &&
+					PluginManager::getInstance()->onUDP(false, sRemoteAddr, Util::toString(port), data))
 					continue;
 
 				onData(data, sRemoteAddr);
@@ -210,6 +212,8 @@ int SearchManager::run() {
 }
 
 int SearchManager::UdpQueue::run() {
+	static Histogram& resultTime = Metrics::histogram("search.udp_result");
+
 	string x = Util::emptyString;
 	string remoteIp = Util::emptyString;
 	stop = false;
@@ -228,6 +232,8 @@ int SearchManager::UdpQueue::run() {
 			resultList.pop_front();
 		}
 
+		ScopedTimer timer(resultTime);
+
 		if(x.compare(0, 4, "$SR ") == 0) {
 			string::size_type i, j;
 			// Directories: $SR <nick><0x20><directory><0x20><free slots>/<total slots><0x05><Hubname><0x20>(<Hubip:port>)
@@ -372,6 +378,8 @@ int SearchManager::UdpQueue::run() {
 }
 
 void SearchManager::onData(const string& data, const string& remoteIp /*= Util::emptyString*/) {
+	static Counter& packets = Metrics::counter("search.udp_in");
+	++packets;
 	queue.addResult(data, remoteIp);
 }
 
@@ -135,6 +135,7 @@ const string SettingsManager::settingTags[] =
 	"FilterEnter", "SortFavUsersFirst", "ShowShellMenu", "SendBloom", "OverlapChunks", "ShowQuickSearch",
 	"UcSubMenu", "AutoSlots", "Coral", "UseDHT", "DHTPort", "UpdateIP", "KeepFinishedFiles",
 	"AllowNATTraversal", "UseExplorerTheme", "MDIMaximized", "AutoDetectIncomingConnection", "SettingsSaveInterval",
+	"DHTPublishRate", "MetricsDumpInterval", "DiskQueueDepth", "SegmentPipelining",
 
 	 // ApexDC++
 	"ShowDescriptionLimit", "ProtectTray", "ProtectStart", "ProtectClose",
@@ -635,6 +636,10 @@ SettingsManager::SettingsManager()
 	setDefault(POPUP_TITLE_TEXTCOLOR, RGB(255, 255, 255));
 	
 	setDefault(USE_DHT, false);
+	setDefault(DHT_PUBLISH_RATE, 30);
+	setDefault(METRICS_DUMP_INTERVAL, 0);
+	setDefault(DISK_QUEUE_DEPTH, 2);
+	setDefault(SEGMENT_PIPELINING, false);
 	setDefault(UPDATE_IP, false);
 	setDefault(ALLOW_NAT_TRAVERSAL, true);
 	setDefault(USE_EXPLORER_THEME, true);
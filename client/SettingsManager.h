@@ -155,6 +155,7 @@ public:
 		FILTER_ENTER, SORT_FAVUSERS_FIRST, SHOW_SHELL_MENU, SEND_BLOOM, OVERLAP_CHUNKS, SHOW_QUICK_SEARCH,
 		UC_SUBMENU, AUTO_SLOTS, CORAL, USE_DHT, DHT_PORT, UPDATE_IP, KEEP_FINISHED_FILES,
 		ALLOW_NAT_TRAVERSAL, USE_EXPLORER_THEME, MDI_MAXIMIZED, AUTO_DETECT_CONNECTION, SETTINGS_SAVE_INTERVAL,
+		DHT_PUBLISH_RATE, METRICS_DUMP_INTERVAL, DISK_QUEUE_DEPTH, SEGMENT_PIPELINING,
 
 		// ApexDC++
 		SHOW_DESCRIPTION_LIMIT, PROTECT_TRAY, PROTECT_START, PROTECT_CLOSE,
@@ -62,9 +62,9 @@ using std::numeric_limits;
 
 atomic_flag ShareManager::refreshing = ATOMIC_FLAG_INIT;
 
-ShareManager::ShareManager() : hits(0), xmlListLen(0), bzXmlListLen(0),
+ShareManager::ShareManager() : hits(0), sharedSize(0), xmlListLen(0), bzXmlListLen(0),
 	xmlDirty(true), forceXmlRefresh(true), refreshDirs(false), update(false), listN(0),
-	lastXmlUpdate(0), lastFullUpdate(GET_TICK()), bloom(1<<20), sharedSize(0)
+	searches(0), lastXmlUpdate(0), lastFullUpdate(GET_TICK()), cs("share.cs"), bloom(0), tthBloomValid(false)
 {
 	SettingsManager::getInstance()->addListener(this);
 	TimerManager::getInstance()->addListener(this);
@@ -84,6 +84,10 @@ ShareManager::~ShareManager() {
 		bzXmlRef.reset();
 		File::deleteFile(getBZXmlFile());
 	}
+	if(xmlRef.get()) {
+		xmlRef.reset();
+		File::deleteFile(getXmlFile());
+	}
 }
 
 ShareManager::Directory::Directory(const string& aName, const ShareManager::Directory::Ptr& aParent) :
@@ -145,6 +149,15 @@ size_t ShareManager::Directory::countFiles() const noexcept {
 	return tmp;
 }
 
+size_t ShareManager::Directory::getNameLength() const noexcept {
+	size_t tmp = getName().size();
+	for(auto& i: files)
+		tmp += i.getName().size();
+	for(auto& i: directories)
+		tmp += i.second->getNameLength();
+	return tmp;
+}
+
 string ShareManager::toVirtual(const TTHValue& tth) const {
 	if(bzXmlRoot && tth == bzXmlRoot) {
 		return Transfer::USER_LIST_NAME_BZ;
@@ -152,7 +165,7 @@ string ShareManager::toVirtual(const TTHValue& tth) const {
 		return Transfer::USER_LIST_NAME;
 	}
 
-	Lock l(cs);
+	TimedLock l(cs);
 	auto i = tthIndex.find(tth);
 	if(i != tthIndex.end()) {
 		return i->second->getADCPath();
@@ -166,16 +179,17 @@ string ShareManager::toReal(const string& virtualFile, bool hideShare) {
 }
 
 pair<string, int64_t> ShareManager::toRealWithSize(const string& virtualFile, bool hideShare) {
-	Lock l(cs);
+	TimedLock l(cs);
 
 	if(virtualFile == "MyList.DcLst") {
 		throw ShareException("NMDC-style lists no longer supported, please upgrade your client");
 	}
 	if(virtualFile == Transfer::USER_LIST_NAME_BZ || virtualFile == Transfer::USER_LIST_NAME) {
 		generateXmlList();
+		bool bz = virtualFile == Transfer::USER_LIST_NAME_BZ || getXmlFile().empty();
 		if(hideShare)
-			return make_pair(Util::getPath(Util::PATH_USER_CONFIG) + "Emptyfiles.xml.bz2", 0);
-		return make_pair(getBZXmlFile(), 0);
+			return make_pair(Util::getPath(Util::PATH_USER_CONFIG) + (bz ? "Emptyfiles.xml.bz2" : "Emptyfiles.xml"), 0);
+		return make_pair(bz ? getBZXmlFile() : getXmlFile(), 0);
 	}
 
 	auto f = findFile(virtualFile);
@@ -188,7 +202,7 @@ StringList ShareManager::getRealPaths(const string& virtualPath, bool hideShare)
 
 	StringList ret;
 
-	Lock l(cs);
+	TimedLock l(cs);
 
 	if(*(virtualPath.end() - 1) == '/') {
 		// directory
@@ -217,7 +231,7 @@ StringList ShareManager::getRealPaths(const string& virtualPath, bool hideShare)
 }
 
 optional<TTHValue> ShareManager::getTTH(const string& virtualFile) const {
-	Lock l(cs);
+	TimedLock l(cs);
 	if(virtualFile == Transfer::USER_LIST_NAME_BZ) {
 		return bzXmlRoot;
 	} else if(virtualFile == Transfer::USER_LIST_NAME) {
@@ -277,7 +291,7 @@ AdcCommand ShareManager::getFileInfo(const string& aFile) {
 		throw ShareException(UserConnection::FILE_NOT_AVAILABLE);
 
 	TTHValue val(aFile.substr(4));
-	Lock l(cs);
+	TimedLock l(cs);
 	auto i = tthIndex.find(val);
 	if(i == tthIndex.end()) {
 		throw ShareException(UserConnection::FILE_NOT_AVAILABLE);
@@ -347,12 +361,12 @@ string ShareManager::validateVirtual(const string& aVirt) const noexcept {
 }
 
 bool ShareManager::hasVirtual(const string& virtualName) const noexcept {
-	Lock l(cs);
+	TimedLock l(cs);
 	return directories.find(virtualName) != directories.end();
 }
 
 void ShareManager::load(SimpleXML& aXml) {
-	Lock l(cs);
+	TimedLock l(cs);
 
 	aXml.resetCurrentChild();
 	if(aXml.findChild("Share")) {
@@ -389,7 +403,7 @@ void ShareManager::load(SimpleXML& aXml) {
 }
 
 void ShareManager::save(SimpleXML& aXml) {
-	Lock l(cs);
+	TimedLock l(cs);
 
 	aXml.addTag("Share");
 	aXml.stepIn();
@@ -435,7 +449,7 @@ void ShareManager::addDirectory(const string& realPath, const string& virtualNam
 
 	list<string> removeMap;
 	{
-		Lock l(cs);
+		TimedLock l(cs);
 
 		for(auto& i: shares) {
 			if(strnicmp(realPath, i.first, i.first.length()) == 0) {
@@ -459,7 +473,7 @@ void ShareManager::addDirectory(const string& realPath, const string& virtualNam
 	string vName = validateVirtual(virtualName);
 	dp->setName(vName);
 
-	Lock l(cs);
+	TimedLock l(cs);
 
 	shares[realPath] = move(vName);
 
@@ -547,7 +561,7 @@ void ShareManager::removeDirectory(const string& realPath) {
 
 	HashManager::getInstance()->stopHashing(realPath);
 
-	Lock l(cs);
+	TimedLock l(cs);
 
 	auto i = shares.find(realPath);
 	if(i == shares.end()) {
@@ -580,7 +594,7 @@ void ShareManager::renameDirectory(const string& realPath, const string& virtual
 }
 
 int64_t ShareManager::getShareSize(const string& realPath) const noexcept {
-	Lock l(cs);
+	TimedLock l(cs);
 	dcassert(realPath.size()>0);
 	auto i = shares.find(realPath);
 
@@ -594,7 +608,7 @@ int64_t ShareManager::getShareSize(const string& realPath) const noexcept {
 }
 
 int64_t ShareManager::getShareSize() const noexcept {
-	Lock l(cs);
+	TimedLock l(cs);
 	int64_t tmp = 0;
 	for(auto& i: tthIndex) {
 		tmp += i.second->getSize();
@@ -603,7 +617,7 @@ int64_t ShareManager::getShareSize() const noexcept {
 }
 
 size_t ShareManager::getSharedFiles() const noexcept {
-	Lock l(cs);
+	TimedLock l(cs);
 	return tthIndex.size();
 }
 
@@ -747,11 +761,33 @@ void ShareManager::updateIndices(Directory& dir) {
 void ShareManager::rebuildIndices() {
 	sharedSize = 0;
 	tthIndex.clear();
-	bloom.clear();
+
+	// a name has length - 4 5-grams, the slack doesn't hurt and the filter caps its size
+	size_t nameLength = 0;
+	for(auto& i: directories)
+		nameLength += i.second->getNameLength();
+	bloom.resize(nameLength);
+
+	// BLOM requests fall back to waiting on cs instead of getting a half filled filter
+	bool refill;
+	{
+		Lock l(tthBloomCs);
+		refill = tthBloomValid;
+		tthBloomValid = false;
+	}
 
 	for(auto& i: directories) {
 		updateIndices(*i.second);
 	}
+
+	if(refill) {
+		Lock l(tthBloomCs);
+		tthBloom.clear();
+		for(auto& i: tthIndex) {
+			tthBloom.add(i.first);
+		}
+		tthBloomValid = true;
+	}
 }
 
 void ShareManager::updateIndices(Directory& dir, const decltype(std::declval<Directory>().files.begin())& i) {
@@ -769,6 +805,7 @@ void ShareManager::updateIndices(Directory& dir, const decltype(std::declval<Dir
 
 	tthIndex[*f.tth] = &f;
 	bloom.add(Text::toLower(f.getName()));
+	addTTHBloom(*f.tth);
 
 	dht::IndexManager* im = dht::IndexManager::getInstance();
 	if(im && im->isTimeForPublishing())
@@ -800,7 +837,7 @@ void ShareManager::refresh(bool dirs, bool aUpdate, bool block, function<void (f
 }
 
 StringPairList ShareManager::getDirectories() const noexcept {
-	Lock l(cs);
+	TimedLock l(cs);
 	StringPairList ret;
 	for(auto& i: shares) {
 		ret.emplace_back(i.second, i.first);
@@ -844,7 +881,7 @@ void ShareManager::runRefresh(function<void (float)> progressF) {
 		}
 
 		{
-			Lock l(cs);
+			TimedLock l(cs);
 			directories.clear();
 
 			for(auto& i: newDirs) {
@@ -870,19 +907,34 @@ void ShareManager::runRefresh(function<void (float)> progressF) {
 }
 
 void ShareManager::getBloom(ByteVector& v, size_t k, size_t m, size_t h) const {
+	{
+		Lock l(tthBloomCs);
+		if(tthBloomValid && tthBloom.isFor(k, m, h)) {
+			tthBloom.copy_to(v);
+			return;
+		}
+	}
+
 	dcdebug("Creating bloom filter, k=%u, m=%u, h=%u\n", k, m, h);
-	Lock l(cs);
+	TimedLock l(cs);
+	Lock l2(tthBloomCs);
 
-	HashBloom bloom;
-	bloom.reset(k, m, h);
+	tthBloom.reset(k, m, h);
 	for(auto& i: tthIndex) {
-		bloom.add(i.first);
+		tthBloom.add(i.first);
 	}
-	bloom.copy_to(v);
+	tthBloomValid = true;
+	tthBloom.copy_to(v);
+}
+
+void ShareManager::addTTHBloom(const TTHValue& tth) {
+	Lock l(tthBloomCs);
+	if(tthBloomValid)
+		tthBloom.add(tth);
 }
 
 void ShareManager::generateXmlList() {
-	Lock l(cs);
+	TimedLock l(cs);
 	if(forceXmlRefresh || (xmlDirty && (lastXmlUpdate + 15 * 60 * 1000 < GET_TICK() || lastXmlUpdate < lastFullUpdate))) {
 		listN++;
 
@@ -891,13 +943,18 @@ void ShareManager::generateXmlList() {
 			string indent;
 
 			string newXmlName = Util::getPath(Util::PATH_USER_CONFIG) + "files" + Util::toString(listN) + ".xml.bz2";
+			string newPlainName = Util::getPath(Util::PATH_USER_CONFIG) + "files" + Util::toString(listN) + ".xml";
 			{
 				File f(newXmlName, File::WRITE, File::TRUNCATE | File::CREATE);
 				// We don't care about the leaves...
 				CalcOutputStream<TTFilter<1024*1024*1024>, false> bzTree(&f);
 				FilteredOutputStream<BZFilter, false> bzipper(&bzTree);
-				CountOutputStream<false> count(&bzipper);
-				CalcOutputStream<TTFilter<1024*1024*1024>, false> newXmlFile(&count);
+
+				// The plain list is written in the same pass, requests for files.xml then need no unpacking
+				File plain(newPlainName, File::WRITE, File::TRUNCATE | File::CREATE);
+				BufferedOutputStream<false> plainBuf(&plain, 256 * 1024);
+				TeeOutputStream<false> tee(&bzipper, &plainBuf);
+				CalcOutputStream<TTFilter<1024*1024*1024>, false> newXmlFile(&tee);
 
 				newXmlFile.write(SimpleXML::utf8Header);
 				newXmlFile.write("<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() + "\" Base=\"/\" Generator=\"" APPNAME " " VERSIONSTRING "\">\r\n");
@@ -907,7 +964,7 @@ void ShareManager::generateXmlList() {
 				newXmlFile.write("</FileListing>");
 				newXmlFile.flush();
 
-				xmlListLen = count.getCount();
+				xmlListLen = plain.getSize();
 
 				newXmlFile.getFilter().getTree().finalize();
 				bzTree.getFilter().getTree().finalize();
@@ -917,18 +974,25 @@ void ShareManager::generateXmlList() {
 			}
 
 			string emptyXmlName = Util::getPath(Util::PATH_USER_CONFIG) + "Emptyfiles.xml.bz2"; // Hide Share Mod
-			if(!Util::fileExists(emptyXmlName)) {
-				FilteredOutputStream<BZFilter, true> emptyXmlFile(new File(emptyXmlName, File::WRITE, File::TRUNCATE | File::CREATE));
+			if(!Util::fileExists(emptyXmlName) || !Util::fileExists(emptyXmlName.substr(0, emptyXmlName.size() - 4))) {
+				File emptyPlain(emptyXmlName.substr(0, emptyXmlName.size() - 4), File::WRITE, File::TRUNCATE | File::CREATE);
+				FilteredOutputStream<BZFilter, true> emptyBz(new File(emptyXmlName, File::WRITE, File::TRUNCATE | File::CREATE));
+				TeeOutputStream<false> emptyXmlFile(&emptyBz, &emptyPlain);
 				emptyXmlFile.write(SimpleXML::utf8Header);
 				emptyXmlFile.write("<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() + "\" Base=\"/\" Generator=\"DC++ " DCVERSIONSTRING "\">\r\n"); // Hide Share Mod
 				emptyXmlFile.write("</FileListing>");
 				emptyXmlFile.flush();
 			}
 
+			// Both versions are replaced together, under cs, so a request never mixes an old root with a new file
 			if(bzXmlRef.get()) {
 				bzXmlRef.reset();
 				File::deleteFile(getBZXmlFile());
 			}
+			if(xmlRef.get()) {
+				xmlRef.reset();
+				File::deleteFile(getXmlFile());
+			}
 
 			try {
 				File::renameFile(newXmlName, Util::getPath(Util::PATH_USER_CONFIG) + "files.xml.bz2");
@@ -936,9 +1000,17 @@ void ShareManager::generateXmlList() {
 			} catch(const FileException&) {
 				// Ignore, this is for caching only...
 			}
+			try {
+				File::renameFile(newPlainName, Util::getPath(Util::PATH_USER_CONFIG) + "files.xml");
+				newPlainName = Util::getPath(Util::PATH_USER_CONFIG) + "files.xml";
+			} catch(const FileException&) {
+				// Still being uploaded from, keep the numbered one
+			}
 			bzXmlRef = unique_ptr<File>(new File(newXmlName, File::READ, File::OPEN));
 			setBZXmlFile(newXmlName);
 			bzXmlListLen = File::getSize(newXmlName);
+			xmlRef = unique_ptr<File>(new File(newPlainName, File::READ, File::OPEN));
+			setXmlFile(newPlainName);
 			LogManager::getInstance()->message(str(F_("File list %1% generated") % Util::addBrackets(bzXmlFile)), LogManager::LOG_INFO);
 		} catch(const Exception&) {
 			// No new file lists...
@@ -969,7 +1041,7 @@ MemoryInputStream* ShareManager::generatePartialList(const string& dir, bool rec
 	StringRefOutputStream sos(xml);
 	string indent = "\t";
 
-	Lock l(cs);
+	TimedLock l(cs);
 	if(dir == "/") {
 		for(auto& i: directories) {
 			tmp.clear();
@@ -1244,9 +1316,13 @@ void ShareManager::Directory::search(SearchResultList& results, SearchQuery& que
 }
 
 SearchResultList ShareManager::search(SearchQuery&& query, size_t maxResults) noexcept {
+	static Histogram& searchTime = Metrics::histogram("share.search");
+	ScopedTimer timer(searchTime);
+
 	SearchResultList results;
+	++searches;
 
-	Lock l(cs);
+	TimedLock l(cs);
 
 	if(query.root) {
 		auto i = tthIndex.find(*query.root);
@@ -1258,9 +1334,14 @@ SearchResultList ShareManager::search(SearchQuery&& query, size_t maxResults) no
 		return results;
 	}
 
+	static Counter& bloomTerms = Metrics::counter("share.bloom.terms");
+	static Counter& bloomRejected = Metrics::counter("share.bloom.rejected");
 	for(auto& i: query.includeInit) {
-		if(!bloom.match(i.getPattern()))
+		++bloomTerms;
+		if(!bloom.match(i.getPattern())) {
+			++bloomRejected;
 			return results;
+		}
 	}
 
 	for(auto& dir: directories) {
@@ -1373,7 +1454,7 @@ void ShareManager::on(QueueManagerListener::FileMoved, const string& realPath) n
 			return;
 		}
 
-		Lock l(cs);
+		TimedLock l(cs);
 		// Check if the finished download dir is supposed to be shared
 		auto dir = getDirectory(realPath);
 		if(dir) {
@@ -1386,13 +1467,17 @@ void ShareManager::on(QueueManagerListener::FileMoved, const string& realPath) n
 }
 
 void ShareManager::on(HashManagerListener::TTHDone, const string& realPath, const TTHValue& root) noexcept {
-	Lock l(cs);
+	TimedLock l(cs);
 	auto f = getFile(realPath);
 	if(f) {
-		if(f->tth && root != f->tth)
+		if(f->tth && root != f->tth) {
 			tthIndex.erase(*f->tth);
+			Lock l(tthBloomCs);
+			tthBloomValid = false;
+		}
 		const_cast<Directory::File&>(*f).tth = root;
 		tthIndex[*f->tth] = &f.get();
+		addTTHBloom(root);
 
 		setDirty();
 		forceXmlRefresh = true;
@@ -35,10 +35,12 @@
 
 #include "Exception.h"
 #include "CriticalSection.h"
+#include "Metrics.h"
 #include "StringSearch.h"
 #include "Singleton.h"
 #include "BloomFilter.h"
 #include "FastAlloc.h"
+#include "HashBloom.h"
 #include "MerkleTree.h"
 #include "Pointer.h"
 
@@ -122,18 +124,23 @@ public:
 		hits += aHits;
 	}
 
+	/** Searches run against the share since startup */
+	uint64_t getSearches() const { return searches; }
+
 	const string& getOwnListFile() {
 		generateXmlList();
 		return getBZXmlFile();
 	}
 
 	bool isTTHShared(const TTHValue& tth) const {
-		Lock l(cs);
+		TimedLock l(cs);
 		return tthIndex.find(tth) != tthIndex.end();
 	}
 
 	GETSET(uint32_t, hits, Hits);
 	GETSET(string, bzXmlFile, BZXmlFile);
+	/** Uncompressed copy of the bz2 list, so that files.xml requests are served like any file */
+	GETSET(string, xmlFile, XmlFile);
 	GETSET(int64_t, sharedSize, SharedSize);
 
 private:
@@ -192,6 +199,8 @@ private:
 
 		int64_t getSize() const noexcept;
 		size_t countFiles() const noexcept;
+		/** Total length of the names of this directory and everything below it */
+		size_t getNameLength() const noexcept;
 
 		void search(SearchResultList& results, SearchQuery& query, size_t maxResults) const noexcept;
 
@@ -252,6 +261,7 @@ private:
 	int64_t bzXmlListLen;
 	optional<TTHValue> bzXmlRoot;
 	unique_ptr<File> bzXmlRef;
+	unique_ptr<File> xmlRef;
 
 	bool xmlDirty;
 	bool forceXmlRefresh; /// bypass the 15-minutes guard
@@ -262,10 +272,12 @@ private:
 
 	static atomic_flag refreshing;
 
+	atomic<uint64_t> searches;
+
 	uint64_t lastXmlUpdate;
 	uint64_t lastFullUpdate;
 
-	mutable CriticalSection cs;
+	mutable TimedCriticalSection cs;
 
 	// List of root directory items
 	unordered_map<string, Directory::Ptr, noCaseStringHash, noCaseStringEq> directories;
@@ -281,12 +293,22 @@ private:
 
 	BloomFilter<5> bloom;
 
+	/**
+	 * The TTH filter last asked for by a hub. Files are added to it as they are
+	 * indexed, so later requests with the same parameters are served from it
+	 * without cs. Removing a TTH invalidates it; bits can't be taken back.
+	 */
+	mutable HashBloom tthBloom;
+	mutable bool tthBloomValid;
+	mutable CriticalSection tthBloomCs;
+
 	const Directory::File& findFile(const string& virtualFile) const;
 
 	Directory::Ptr buildTree(const string& realPath, optional<const string&> dirName, const Directory::Ptr& parent = nullptr);
 	bool checkHidden(const string& realPath) const;
 
 	void rebuildIndices();
+	void addTTHBloom(const TTHValue& tth);
 
 	void updateIndices(Directory& aDirectory);
 	void updateIndices(Directory& dir, const decltype(std::declval<Directory>().files.begin())& i);
@@ -30,7 +30,7 @@ CriticalSection SharedFileStream::critical_section;
 SharedFileStream::SharedFileHandleMap SharedFileStream::file_handle_pool;
 
 SharedFileHandle::SharedFileHandle(const string& aFileName, int access, int mode) : 
-	File(aFileName, access, mode)
+	File(aFileName, access, mode), name(aFileName), ref_cnt(0)
 {
 #ifdef _WIN32
 	if(!SETTING(ANTI_FRAG))
@@ -42,62 +42,57 @@ SharedFileHandle::SharedFileHandle(const string& aFileName, int access, int mode
 #endif
 }
 
-SharedFileStream::SharedFileStream(const string& aFileName, int access, int mode)
+SharedFileStream::SharedFileStream(const string& aFileName, int access, int mode) : pos(0)
 {
 	Lock l(critical_section);
 
-	if(file_handle_pool.count(aFileName) > 0)
+	auto& handle = file_handle_pool[aFileName];
+	if(!handle)
 	{
-	    shared_handle_ptr = file_handle_pool[aFileName];
-		shared_handle_ptr->ref_cnt++;
-	}
-	else
-	{
-	    shared_handle_ptr = new SharedFileHandle(aFileName, access, mode);
-	    shared_handle_ptr->ref_cnt = 1;
-		file_handle_pool[aFileName] = shared_handle_ptr;
+		try
+		{
+			handle = new SharedFileHandle(aFileName, access, mode);
+		}
+		catch(const FileException&)
+		{
+			file_handle_pool.erase(aFileName);
+			throw;
+		}
 	}
+
+	shared_handle_ptr = handle;
+	shared_handle_ptr->ref_cnt++;
 }
 
 SharedFileStream::~SharedFileStream()
 {
 	Lock l(critical_section);
 
-	shared_handle_ptr->ref_cnt--;
-
-	if(!shared_handle_ptr->ref_cnt)
+	if(--shared_handle_ptr->ref_cnt == 0)
 	{
-		for(SharedFileHandleMap::iterator i = file_handle_pool.begin(); i != file_handle_pool.end(); ++i)
-		{
-			if(i->second == shared_handle_ptr)
-			{
-				file_handle_pool.erase(i);
-				delete shared_handle_ptr;
-				return;
-			}
-		}
-
-		dcassert(0);
+		dcassert(file_handle_pool[shared_handle_ptr->name] == shared_handle_ptr);
+		file_handle_pool.erase(shared_handle_ptr->name);
+		delete shared_handle_ptr;
 	}
 }
 
 size_t SharedFileStream::write(const void* buf, size_t len)
 {
+#if defined(_WIN32) && _WIN32_WINNT < 0x600
 	Lock l(*shared_handle_ptr);
+#endif
+	shared_handle_ptr->writeAt(buf, len, pos);
 
-	shared_handle_ptr->setPos(pos);
-	shared_handle_ptr->write(buf, len);
-
-    pos += len;
+	pos += len;
 	return len;
 }
 
 size_t SharedFileStream::read(void* buf, size_t& len) 
 {
+#if defined(_WIN32) && _WIN32_WINNT < 0x600
 	Lock l(*shared_handle_ptr);
-
-	shared_handle_ptr->setPos(pos);
-	len = shared_handle_ptr->read(buf, len);
+#endif
+	len = shared_handle_ptr->readAt(buf, len, pos);
 
 	pos += len;
 	return len;
@@ -105,7 +100,6 @@ size_t SharedFileStream::read(void* buf, size_t& len)
 
 int64_t SharedFileStream::getSize() const noexcept
 {
-	Lock l(*shared_handle_ptr);
 	return shared_handle_ptr->getSize();
 }
 
@@ -115,4 +109,10 @@ void SharedFileStream::setSize(int64_t newSize)
 	shared_handle_ptr->setSize(newSize);
 }
 
+void SharedFileStream::preallocate(int64_t newSize)
+{
+	Lock l(*shared_handle_ptr);
+	shared_handle_ptr->preallocate(newSize);
+}
+
 }
@@ -20,6 +20,8 @@
 #ifndef _SHAREDFILESTREAM_H
 #define _SHAREDFILESTREAM_H
 
+#include <unordered_map>
+
 #include "noexcept.h"
 
 #include "File.h"
@@ -27,8 +29,15 @@
 
 namespace dcpp {
 
+/**
+ * A file opened once for every stream on it. Reads and writes go through
+ * File::readAt/writeAt, so the segments of a download and partial uploads
+ * from it don't lock; only resizing does. Before Vista resizing goes through
+ * the file pointer, which readAt/writeAt move too, so they lock as well.
+ */
 struct SharedFileHandle : File, CriticalSection
 {
+	string				name;
     int					ref_cnt;
 
 	SharedFileHandle(const string& aFileName, int access, int mode);
@@ -38,7 +47,7 @@ struct SharedFileHandle : File, CriticalSection
 class SharedFileStream : public IOStream
 {
 public:
-	typedef map<string, SharedFileHandle*> SharedFileHandleMap;
+	typedef unordered_map<string, SharedFileHandle*> SharedFileHandleMap;
 
 	SharedFileStream(const string& aFileName, int access, int mode);
 	~SharedFileStream();
@@ -48,10 +57,11 @@ public:
 
 	int64_t getSize() const noexcept;
 	void setSize(int64_t newSize);
+	/** Sets the size and reserves the disk space up front, for antifragmentation */
+	void preallocate(int64_t newSize);
 
 	size_t flush()
 	{
-		Lock l(*shared_handle_ptr);
 		return shared_handle_ptr->flush();
 	}
 
@@ -60,6 +70,7 @@ public:
 		pos = _pos; 
 	}
 
+	/** Only guards the pool and the reference counts */
     static CriticalSection critical_section;
 	static SharedFileHandleMap file_handle_pool;
 
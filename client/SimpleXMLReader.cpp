@@ -74,6 +74,40 @@ SimpleXMLReader::SimpleXMLReader(SimpleXMLReader::CallBack* callback) :
 	attribs.reserve(16);
 }
 
+void SimpleXMLReader::pushElement() {
+	if(elementPool.empty()) {
+		elements.push_back(std::string());
+	} else {
+		elements.push_back(std::move(elementPool.back()));
+		elementPool.pop_back();
+		elements.back().clear();
+	}
+}
+
+void SimpleXMLReader::popElement() {
+	elementPool.push_back(std::move(elements.back()));
+	elements.pop_back();
+}
+
+void SimpleXMLReader::pushAttrib() {
+	if(attribPool.empty()) {
+		attribs.push_back(StringPair());
+	} else {
+		attribs.push_back(std::move(attribPool.back()));
+		attribPool.pop_back();
+		attribs.back().first.clear();
+		attribs.back().second.clear();
+	}
+}
+
+void SimpleXMLReader::clearAttribs() {
+	// Keep the strings around so that the next tag can reuse their buffers
+	for(auto& i: attribs) {
+		attribPool.push_back(std::move(i));
+	}
+	attribs.clear();
+}
+
 void SimpleXMLReader::append(std::string& str, size_t maxLen, int c) {
 	if(str.size() + 1 > maxLen) {
 		error("Buffer overflow");
@@ -147,7 +181,7 @@ bool SimpleXMLReader::element() {
 		}
 
 		state = STATE_ELEMENT_NAME;
-		elements.push_back(std::string());
+		pushElement();
 		append(elements.back(), MAX_NAME_SIZE, c);
 
 		advancePos(2);
@@ -179,7 +213,7 @@ bool SimpleXMLReader::elementName() {
 			append(elements.back(), MAX_NAME_SIZE, buf.begin() + bufPos, buf.begin() + bufPos + i);
 
 			cb->startTag(elements.back(), attribs, false);
-			attribs.clear();
+			clearAttribs();
 
 			state = STATE_CONTENT;
 			advancePos(i + 1);
@@ -202,7 +236,7 @@ bool SimpleXMLReader::elementAttr() {
 
 	int c = charAt(0);
 	if(isNameStartChar(c)) {
-		attribs.push_back(StringPair());
+		pushAttrib();
 		append(attribs.back().first, MAX_NAME_SIZE, c);
 
 		state = STATE_ELEMENT_ATTR_NAME;
@@ -242,29 +276,33 @@ bool SimpleXMLReader::elementAttrName() {
 }
 
 bool SimpleXMLReader::elementAttrValue() {
-	size_t i = 0;
-	for(size_t iend = bufSize(); i < iend; ++i) {
-		int c = charAt(i);
+	const char* begin = &buf[bufPos];
+	const char* end = begin + bufSize();
 
-		if((state == STATE_ELEMENT_ATTR_VALUE_APOS && c == '\'') || (state == STATE_ELEMENT_ATTR_VALUE_QUOT && c == '"')) {
-			append(attribs.back().second, MAX_VALUE_SIZE, buf.begin() + bufPos, buf.begin() + bufPos + i);
+	// memchr is vectorized by the CRT, which beats looking at the value one char at a time
+	const char* quote = static_cast<const char*>(memchr(begin, state == STATE_ELEMENT_ATTR_VALUE_APOS ? '\'' : '"', end - begin));
+	const char* amp = static_cast<const char*>(memchr(begin, '&', (quote ? quote : end) - begin));
 
-			if(!encoding.empty() && encoding != Text::utf8) {
-				attribs.back().second = Text::toUtf8(attribs.back().second, encoding);
-			}
+	if(amp) {
+		append(attribs.back().second, MAX_VALUE_SIZE, buf.begin() + bufPos, buf.begin() + bufPos + (amp - begin));
+		advancePos(amp - begin);
+		return entref(attribs.back().second);
+	}
 
-			state = STATE_ELEMENT_ATTR;
-			advancePos(i + 1);
-			return true;
-		} else if(c == '&') {
-			append(attribs.back().second, MAX_VALUE_SIZE, buf.begin() + bufPos, buf.begin() + bufPos + i);
-			advancePos(i);
-			return entref(attribs.back().second);
+	if(quote) {
+		append(attribs.back().second, MAX_VALUE_SIZE, buf.begin() + bufPos, buf.begin() + bufPos + (quote - begin));
+
+		if(!encoding.empty() && encoding != Text::utf8) {
+			attribs.back().second = Text::toUtf8(attribs.back().second, encoding);
 		}
+
+		state = STATE_ELEMENT_ATTR;
+		advancePos(quote - begin + 1);
+		return true;
 	}
 
-	append(attribs.back().second, MAX_VALUE_SIZE, buf.begin() + bufPos, buf.begin() + bufPos + i);
-	advancePos(i);
+	append(attribs.back().second, MAX_VALUE_SIZE, buf.begin() + bufPos, buf.end());
+	advancePos(end - begin);
 
 	return true;
 }
@@ -276,8 +314,8 @@ bool SimpleXMLReader::elementEndSimple() {
 
 	if(charAt(0) == '>') {
 		cb->startTag(elements.back(), attribs, true);
-		elements.pop_back();
-		attribs.clear();
+		popElement();
+		clearAttribs();
 
 		state = STATE_CONTENT;
 		advancePos(1);
@@ -294,7 +332,7 @@ bool SimpleXMLReader::elementEndComplex() {
 
 	if(charAt(0) == '>') {
 		cb->startTag(elements.back(), attribs, false);
-		attribs.clear();
+		clearAttribs();
 
 		state = STATE_CONTENT;
 		advancePos(1);
@@ -375,18 +413,22 @@ bool SimpleXMLReader::declEncodingValue() {
 
 bool SimpleXMLReader::comment() {
 	while(bufSize() > 0) {
-		int c = charAt(0);
+		const char* begin = &buf[bufPos];
+		const char* dash = static_cast<const char*>(memchr(begin, '-', bufSize()));
+		if(!dash) {
+			advancePos(bufSize());
+			break;
+		}
+		advancePos(dash - begin);
 
 		// TODO We shouldn't allow ---> to end a comment
-		if(c == '-') {
-			if(!needChars(3)) {
-				return true;
-			}
-			if(charAt(1) == '-' && charAt(2) == '>') {
-				state = STATE_CONTENT;
-				advancePos(3);
-				return true;
-			}
+		if(!needChars(3)) {
+			return true;
+		}
+		if(charAt(1) == '-' && charAt(2) == '>') {
+			state = STATE_CONTENT;
+			advancePos(3);
+			return true;
 		}
 
 		advancePos(1);
@@ -397,20 +439,26 @@ bool SimpleXMLReader::comment() {
 
 bool SimpleXMLReader::cdata() {
 	while(bufSize() > 0) {
-		int c = charAt(0);
+		const char* begin = &buf[bufPos];
+		const char* bracket = static_cast<const char*>(memchr(begin, ']', bufSize()));
+		size_t n = bracket ? bracket - begin : bufSize();
 
-		if(c == ']') {
-			if(!needChars(3)) {
-				return true;
-			}
-			if(charAt(1) == ']' && charAt(2) == '>') {
-				state = STATE_CONTENT;
-				advancePos(3);
-				return true;
-			}
+		append(value, MAX_VALUE_SIZE, buf.begin() + bufPos, buf.begin() + bufPos + n);
+		advancePos(n);
+		if(!bracket) {
+			break;
 		}
 
-		append(value, MAX_VALUE_SIZE, c);
+		if(!needChars(3)) {
+			return true;
+		}
+		if(charAt(1) == ']' && charAt(2) == '>') {
+			state = STATE_CONTENT;
+			advancePos(3);
+			return true;
+		}
+
+		append(value, MAX_VALUE_SIZE, ']');
 		advancePos(1);
 	}
 
@@ -492,9 +540,16 @@ bool SimpleXMLReader::content() {
 		return entref(value);
 	}
 
-	append(value, MAX_VALUE_SIZE, c);
+	// Everything up to the next markup or entity is plain data
+	const char* begin = &buf[bufPos];
+	const char* end = begin + bufSize();
+	const char* lt = static_cast<const char*>(memchr(begin + 1, '<', end - begin - 1));
+	const char* amp = static_cast<const char*>(memchr(begin + 1, '&', (lt ? lt : end) - begin - 1));
+	size_t n = (amp ? amp : lt ? lt : end) - begin;
+
+	append(value, MAX_VALUE_SIZE, buf.begin() + bufPos, buf.begin() + bufPos + n);
 
-	advancePos(1);
+	advancePos(n);
 
 	return true;
 }
@@ -525,7 +580,7 @@ bool SimpleXMLReader::elementEndEnd() {
 
 	if(charAt(0) == '>') {
 		cb->endTag(elements.back());
-		elements.pop_back();
+		popElement();
 
 		state = STATE_CONTENT;
 		advancePos(1);
@@ -144,6 +144,8 @@ private:
 	uint64_t pos;
 
 	StringPairList attribs;
+	/** Strings of earlier tags, reused to avoid allocating for every tag */
+	StringPairList attribPool;
 	std::string value;
 
 	CallBack* cb;
@@ -152,6 +154,12 @@ private:
 	ParseState state;
 
 	StringList elements;
+	StringList elementPool;
+
+	void pushElement();
+	void popElement();
+	void pushAttrib();
+	void clearAttribs();
 
 	void append(std::string& str, size_t maxLen, int c);
 	void append(std::string& str, size_t maxLen, std::string::const_iterator begin, std::string::const_iterator end);
@@ -26,6 +26,7 @@
 #include "TimerManager.h"
 #include "UploadManager.h"
 #include "ClientManager.h"
+#include "Metrics.h"
 
 namespace dcpp {
 /**
@@ -161,6 +162,9 @@ bool ThrottleManager::getCurThrottling() {
 }
 
 void ThrottleManager::waitToken() {
+	static Histogram& waitTime = Metrics::histogram("throttle.wait");
+	ScopedTimer timer(waitTime);
+
 	// no tokens, wait for them, so long as throttling still active
 	// avoid keeping stateCS lock on whole function
 	CriticalSection *curCS = 0;
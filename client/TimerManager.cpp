@@ -19,15 +19,130 @@
 #include "stdinc.h"
 #include "TimerManager.h"
 
+#include <thread>
+#include <typeinfo>
+
 #include <boost/date_time/posix_time/ptime.hpp>
+#include <boost/date_time/posix_time/posix_time_duration.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 namespace dcpp {
 
+using std::deque;
+using std::unordered_map;
 using namespace boost::posix_time;
 
-TimerManager::TimerManager() {
-	// This mutex will be unlocked only upon shutdown
-	mtx.lock();
+class TimerManager::Scheduler {
+public:
+	typedef TimerManager::TaskId TaskId;
+	typedef TimerManager::TaskStats TaskStats;
+
+	Scheduler();
+
+	void stop();
+
+	void addListener(TimerManagerListener* aListener);
+	void removeListener(TimerManagerListener* aListener);
+	TaskId addTask(const string& aName, const function<void (uint64_t)>& f, uint64_t delay, uint64_t period);
+	void removeTask(TaskId id);
+	vector<TaskStats> getStats();
+
+	int run();
+
+private:
+	enum {
+		/** Milliseconds per slot of the lowest wheel */
+		RESOLUTION = 10,
+		WHEEL_BITS = 6,
+		WHEEL_SIZE = 1 << WHEEL_BITS,
+		WHEEL_LEVELS = 4,
+		MAX_WORKERS = 4
+	};
+
+	enum JobType {
+		JOB_SECOND,
+		JOB_MINUTE,
+		JOB_TASK
+	};
+
+	struct Job {
+		JobType type;
+		uint64_t due;
+	};
+
+	struct Task {
+		Task(const string& aName, TimerManagerListener* aListener, const function<void (uint64_t)>& f, bool aPeriodic);
+
+		TaskId id;
+		TimerManagerListener* listener;
+		function<void (uint64_t)> f;
+		deque<Job> jobs;
+		bool periodic;
+		/** Waiting in the ready queue or running */
+		bool queued;
+		bool running;
+		bool removed;
+		/** Removed from within its own call */
+		bool detached;
+		std::thread::id thread;
+		TaskStats stats;
+	};
+
+	struct Timer {
+		Timer(JobType aType, TaskId aTask, uint64_t aDue, uint64_t aPeriod) : type(aType), task(aTask), due(aDue), period(aPeriod) { }
+
+		JobType type;
+		TaskId task;
+		uint64_t due;
+		uint64_t period;
+	};
+
+	class Worker : public Thread {
+	public:
+		Worker(Scheduler& aScheduler) : scheduler(aScheduler) { }
+	private:
+		Scheduler& scheduler;
+		int run() { scheduler.work(); return 0; }
+	};
+
+	boost::mutex mtx;
+	boost::condition_variable timerCond;
+	boost::condition_variable workCond;
+	boost::condition_variable doneCond;
+	bool stopping;
+
+	unordered_map<TaskId, unique_ptr<Task>> tasks;
+	unordered_map<TimerManagerListener*, TaskId> listenerTasks;
+	TaskId nextId;
+	deque<Task*> ready;
+	vector<unique_ptr<Worker>> workers;
+
+	vector<Timer> wheel[WHEEL_LEVELS][WHEEL_SIZE];
+	/** Next slot to expire, in RESOLUTION units */
+	uint64_t wheelTime;
+
+	void work();
+
+	TaskId add(Task* task);
+	void remove(TaskId id, boost::unique_lock<boost::mutex>& l);
+	void schedule(const Timer& timer);
+	void expire(uint64_t now);
+	void post(Task& task, JobType type, uint64_t due);
+	uint64_t nextExpiry() const;
+};
+
+TimerManager::Scheduler::Task::Task(const string& aName, TimerManagerListener* aListener, const function<void (uint64_t)>& f, bool aPeriodic) :
+	id(0), listener(aListener), f(f), periodic(aPeriodic), queued(false), running(false), removed(false), detached(false)
+{
+	stats.name = aName;
+	stats.runs = stats.skipped = 0;
+	stats.lateTotal = stats.lateMax = 0;
+	stats.durationTotal = stats.durationMax = 0;
+}
+
+TimerManager::TimerManager() : scheduler(new Scheduler) {
 }
 
 TimerManager::~TimerManager() {
@@ -35,40 +150,370 @@ TimerManager::~TimerManager() {
 }
 
 void TimerManager::shutdown() {
-	mtx.unlock();
+	scheduler->stop();
 	join();
 }
 
+void TimerManager::addListener(TimerManagerListener* aListener) {
+	Speaker<TimerManagerListener>::addListener(aListener);
+	scheduler->addListener(aListener);
+}
+
+void TimerManager::removeListener(TimerManagerListener* aListener) {
+	Speaker<TimerManagerListener>::removeListener(aListener);
+	scheduler->removeListener(aListener);
+}
+
+TimerManager::TaskId TimerManager::addTask(const string& aName, const function<void (uint64_t)>& f, uint64_t delay, uint64_t period) {
+	return scheduler->addTask(aName, f, delay, period);
+}
+
+void TimerManager::removeTask(TaskId id) {
+	scheduler->removeTask(id);
+}
+
+vector<TimerManager::TaskStats> TimerManager::getStats() {
+	return scheduler->getStats();
+}
+
 int TimerManager::run() {
-	int nextMin = 0;
+	return scheduler->run();
+}
 
-	ptime now = microsec_clock::universal_time();
-	ptime nextSecond = now + seconds(1);
+TimerManager::Scheduler::Scheduler() : stopping(false), nextId(0), wheelTime(getTick() / RESOLUTION) {
+}
 
-	while(!mtx.timed_lock(nextSecond)) {
-		uint64_t t = getTick();
-		now = microsec_clock::universal_time();
-		nextSecond += seconds(1);
-		if(nextSecond < now) {
-			nextSecond = now;
+void TimerManager::Scheduler::stop() {
+	{
+		boost::lock_guard<boost::mutex> l(mtx);
+		stopping = true;
+	}
+	timerCond.notify_all();
+}
+
+void TimerManager::Scheduler::addListener(TimerManagerListener* aListener) {
+	boost::lock_guard<boost::mutex> l(mtx);
+	if(listenerTasks.find(aListener) == listenerTasks.end()) {
+		listenerTasks[aListener] = add(new Task(typeid(*aListener).name(), aListener, nullptr, true));
+	}
+}
+
+void TimerManager::Scheduler::removeListener(TimerManagerListener* aListener) {
+	boost::unique_lock<boost::mutex> l(mtx);
+	auto i = listenerTasks.find(aListener);
+	if(i != listenerTasks.end()) {
+		TaskId id = i->second;
+		listenerTasks.erase(i);
+		remove(id, l);
+	}
+}
+
+TimerManager::TaskId TimerManager::Scheduler::addTask(const string& aName, const function<void (uint64_t)>& f, uint64_t delay, uint64_t period) {
+	boost::lock_guard<boost::mutex> l(mtx);
+	TaskId id = add(new Task(aName, nullptr, f, period != 0));
+	schedule(Timer(JOB_TASK, id, getTick() + delay, period));
+	timerCond.notify_one();
+	return id;
+}
+
+void TimerManager::Scheduler::removeTask(TaskId id) {
+	boost::unique_lock<boost::mutex> l(mtx);
+	remove(id, l);
+}
+
+vector<TimerManager::TaskStats> TimerManager::Scheduler::getStats() {
+	vector<TaskStats> ret;
+	boost::lock_guard<boost::mutex> l(mtx);
+	ret.reserve(tasks.size());
+	for(auto& i: tasks) {
+		ret.push_back(i.second->stats);
+	}
+	return ret;
+}
+
+TimerManager::TaskId TimerManager::Scheduler::add(Task* task) {
+	while(tasks.find(++nextId) != tasks.end() || nextId == 0)
+		;
+	task->id = nextId;
+	tasks[nextId].reset(task);
+	return nextId;
+}
+
+void TimerManager::Scheduler::remove(TaskId id, boost::unique_lock<boost::mutex>& l) {
+	auto i = tasks.find(id);
+	if(i == tasks.end() || i->second->removed)
+		return;
+
+	Task* task = i->second.get();
+	task->removed = true;
+	task->jobs.clear();
+
+	if(task->running) {
+		// Calling it from within the task itself; the worker erases it once the call returns
+		if(task->thread == std::this_thread::get_id()) {
+			task->detached = true;
+			return;
 		}
 
-		fire(TimerManagerListener::Second(), t);
-		if(nextMin++ >= 60) {
-			fire(TimerManagerListener::Minute(), t);
-			nextMin = 0;
+		while(task->running) {
+			doneCond.wait(l);
 		}
+	} else if(task->queued) {
+		ready.erase(std::find(ready.begin(), ready.end(), task));
+	}
+
+	// Timers that still refer to the id are dropped when they expire
+	tasks.erase(id);
+}
+
+void TimerManager::Scheduler::schedule(const Timer& timer) {
+	uint64_t slot = std::max((timer.due + RESOLUTION - 1) / RESOLUTION, wheelTime);
+	uint64_t delta = slot - wheelTime;
+
+	int level = 0;
+	while(level < WHEEL_LEVELS - 1 && delta >= (uint64_t(1) << ((level + 1) * WHEEL_BITS))) {
+		++level;
+	}
+
+	if(delta >= (uint64_t(1) << (WHEEL_LEVELS * WHEEL_BITS))) {
+		// Too far out for the wheel, park it in the last slot and let it cascade back in
+		slot = wheelTime + (uint64_t(1) << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
 	}
 
+	wheel[level][(slot >> (level * WHEEL_BITS)) & (WHEEL_SIZE - 1)].push_back(timer);
+}
+
+void TimerManager::Scheduler::expire(uint64_t now) {
+	while(wheelTime <= now) {
+		auto index = wheelTime & (WHEEL_SIZE - 1);
+
+		// Each time a wheel wraps around, the next slot of the wheel above is spread over the lower ones
+		auto upper = index;
+		for(int level = 1; upper == 0 && level < WHEEL_LEVELS; ++level) {
+			upper = (wheelTime >> (level * WHEEL_BITS)) & (WHEEL_SIZE - 1);
+			vector<Timer> cascade;
+			cascade.swap(wheel[level][upper]);
+			for(auto& i: cascade) {
+				schedule(i);
+			}
+		}
+
+		vector<Timer> expired;
+		expired.swap(wheel[0][index]);
+		for(auto& i: expired) {
+			if((i.due + RESOLUTION - 1) / RESOLUTION > wheelTime) {
+				// was parked
+				schedule(i);
+				continue;
+			}
+
+			if(i.type == JOB_TASK) {
+				auto t = tasks.find(i.task);
+				if(t == tasks.end() || t->second->removed)
+					continue;
+				post(*t->second, JOB_TASK, i.due);
+			} else {
+				for(auto& l: listenerTasks) {
+					post(*tasks[l.second], i.type, i.due);
+				}
+			}
+
+			if(i.period) {
+				uint64_t tick = wheelTime * RESOLUTION;
+				i.due += i.period;
+				if(i.due <= tick) {
+					// we were suspended or starved; keep the phase but don't replay missed periods
+					i.due = tick + i.period - (tick - i.due) % i.period;
+				}
+				schedule(i);
+			}
+		}
+
+		++wheelTime;
+	}
+}
+
+void TimerManager::Scheduler::post(Task& task, JobType type, uint64_t due) {
+	for(auto& i: task.jobs) {
+		if(i.type == type) {
+			task.stats.skipped++;
+			return;
+		}
+	}
+
+	Job job = { type, due };
+	task.jobs.push_back(job);
+
+	if(!task.queued) {
+		task.queued = true;
+		ready.push_back(&task);
+		workCond.notify_one();
+	}
+}
+
+uint64_t TimerManager::Scheduler::nextExpiry() const {
+	for(uint64_t i = wheelTime; ; ++i) {
+		if(!wheel[0][i & (WHEEL_SIZE - 1)].empty())
+			return i;
+		if(((i + 1) & (WHEEL_SIZE - 1)) == 0)
+			return i + 1; // the upper wheels cascade there
+	}
+}
+
+int TimerManager::Scheduler::run() {
+	size_t workerCount = std::min(std::max(boost::thread::hardware_concurrency(), 2u), (unsigned)MAX_WORKERS);
+	for(size_t i = 0; i < workerCount; ++i) {
+		workers.emplace_back(new Worker(*this));
+		workers.back()->start();
+	}
+
+	boost::unique_lock<boost::mutex> l(mtx);
+
+	uint64_t now = getTick();
+	schedule(Timer(JOB_SECOND, 0, now + 1000, 1000));
+	schedule(Timer(JOB_MINUTE, 0, now + 60 * 1000, 60 * 1000));
+
+	while(!stopping) {
+		expire(getTick() / RESOLUTION);
+
+		uint64_t next = nextExpiry() * RESOLUTION;
+		now = getTick();
+		if(next > now) {
+			timerCond.timed_wait(l, milliseconds(next - now));
+		}
+	}
+
+	l.unlock();
+	workCond.notify_all();
+	for(auto& i: workers) {
+		i->join();
+	}
+	workers.clear();
+
 	dcdebug("TimerManager done\n");
 	return 0;
 }
 
-uint64_t TimerManager::getTick() {
+void TimerManager::Scheduler::work() {
+	boost::unique_lock<boost::mutex> l(mtx);
+	while(true) {
+		while(!stopping && ready.empty()) {
+			workCond.wait(l);
+		}
+		if(stopping)
+			break;
+
+		Task* task = ready.front();
+		ready.pop_front();
+
+		Job job = task->jobs.front();
+		task->jobs.pop_front();
+		task->running = true;
+		task->thread = std::this_thread::get_id();
+
+		uint64_t start = getTick();
+		l.unlock();
+
+		switch(job.type) {
+			case JOB_SECOND: task->listener->on(TimerManagerListener::Second(), start); break;
+			case JOB_MINUTE: task->listener->on(TimerManagerListener::Minute(), start); break;
+			case JOB_TASK: task->f(start); break;
+		}
+
+		uint64_t end = getTick();
+		l.lock();
+
+		auto& stats = task->stats;
+		uint64_t late = start > job.due ? start - job.due : 0;
+		uint64_t duration = end - start;
+		stats.runs++;
+		stats.lateTotal += late;
+		stats.lateMax = std::max(stats.lateMax, late);
+		stats.durationTotal += duration;
+		stats.durationMax = std::max(stats.durationMax, duration);
+
+		task->running = false;
+		task->thread = std::thread::id();
+
+		if(task->detached || (!task->removed && !task->periodic && task->jobs.empty())) {
+			// Removed from within the call, or a one-shot task that is done
+			tasks.erase(task->id);
+		} else if(task->removed) {
+			// remove() is waiting for us and erases it
+		} else if(!task->jobs.empty()) {
+			ready.push_back(task);
+		} else {
+			task->queued = false;
+		}
+		doneCond.notify_all();
+	}
+}
+
+namespace {
+
+#ifdef _WIN32
+typedef ULONGLONG (WINAPI *GetTickCount64Func)();
+
+// Not available on XP, where we fall back to the (much slower) boost clock
+GetTickCount64Func getTickCount64() {
+	static GetTickCount64Func f = (GetTickCount64Func)::GetProcAddress(::GetModuleHandle(_T("kernel32.dll")), "GetTickCount64");
+	return f;
+}
+
+uint64_t coarseTick() {
+	if(getTickCount64())
+		return getTickCount64()();
+
 	static ptime start = microsec_clock::universal_time();
 	return (microsec_clock::universal_time() - start).total_milliseconds();
 }
 
+uint64_t preciseTick() {
+	static LARGE_INTEGER freq = { };
+	if(freq.QuadPart == 0)
+		::QueryPerformanceFrequency(&freq);
+
+	LARGE_INTEGER now;
+	::QueryPerformanceCounter(&now);
+	return now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+}
+
+#else
+
+#ifdef CLOCK_MONOTONIC_COARSE
+// Read from the vDSO without touching the clock source, good to a jiffy
+#define COARSE_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define COARSE_CLOCK CLOCK_MONOTONIC
+#endif
+
+uint64_t coarseTick() {
+	timespec ts;
+	clock_gettime(COARSE_CLOCK, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t preciseTick() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif
+
+}
+
+uint64_t TimerManager::getTick() {
+	// Counted from the first call, like before; the clocks themselves are monotonic and 64 bits wide
+	static const uint64_t start = coarseTick();
+	return coarseTick() - start;
+}
+
+uint64_t TimerManager::getPreciseTick() {
+	static const uint64_t start = preciseTick();
+	return preciseTick() - start;
+}
+
 } // namespace dcpp
 
 /**
@@ -23,7 +23,8 @@
 #include "Speaker.h"
 #include "Singleton.h"
 
-#include <boost/thread/mutex.hpp>
+#include <functional>
+#include <memory>
 
 #ifndef _WIN32
 #include <sys/time.h>
@@ -31,6 +32,9 @@
 
 namespace dcpp {
 
+using std::function;
+using std::unique_ptr;
+
 class TimerManagerListener {
 public:
 	virtual ~TimerManagerListener() { }
@@ -43,24 +47,61 @@ public:
 	virtual void on(Minute, uint64_t) noexcept { }
 };
 
+/**
+ * Keeps tasks and the Second / Minute listeners in a hierarchical timer wheel and runs them on a
+ * small worker pool. Calls to the same listener or task never overlap, so a slow one only delays
+ * itself; a period that comes up while the previous call is still waiting to start is dropped.
+ */
 class TimerManager : public Speaker<TimerManagerListener>, public Singleton<TimerManager>, public Thread
 {
 public:
+	typedef uint32_t TaskId;
+
+	struct TaskStats {
+		string name;
+		uint64_t runs;
+		uint64_t skipped;
+		/** Milliseconds between the due time and the start of the call */
+		uint64_t lateTotal;
+		uint64_t lateMax;
+		/** Milliseconds spent in the call */
+		uint64_t durationTotal;
+		uint64_t durationMax;
+	};
+
 	void shutdown();
 
+	void addListener(TimerManagerListener* aListener);
+	/** Waits for a running call of the listener to return, unless it is the caller */
+	void removeListener(TimerManagerListener* aListener);
+
+	/** Call f(tick) once after delay ms, and then every period ms unless period is 0 */
+	TaskId addTask(const string& aName, const function<void (uint64_t)>& f, uint64_t delay, uint64_t period = 0);
+	/** Waits for a running call of the task to return, unless it is the caller */
+	void removeTask(TaskId id);
+
+	vector<TaskStats> getStats();
+
 	static time_t getTime() { return (time_t)time(NULL); }
+	/** Milliseconds since startup, with the resolution of the scheduler tick (10-16 ms); cheap enough for hot paths */
 	static uint64_t getTick();
+	/** Microseconds since startup, for measuring durations */
+	static uint64_t getPreciseTick();
 private:
 	friend class Singleton<TimerManager>;
-	boost::timed_mutex mtx;
+
+	/** The wheel, the worker pool and their lock; kept out of here so that includers don't pull in boost.thread */
+	class Scheduler;
+	unique_ptr<Scheduler> scheduler;
 
 	TimerManager();
 	~TimerManager();
-	
+
 	int run();
 };
 
 #define GET_TICK() TimerManager::getTick()
+#define GET_PRECISE_TICK() TimerManager::getPreciseTick()
 #define GET_TIME() TimerManager::getTime()
 
 } // namespace dcpp
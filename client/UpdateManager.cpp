@@ -32,6 +32,7 @@
 #include "LogManager.h"
 #include "FavoriteManager.h"
 #include "ClientManager.h"
+#include "GeoIP.h"
 
 #include "ZipFile.h"
 #include "SimpleXML.h"
@@ -408,6 +409,7 @@ void UpdateManager::geoipDownload(const HttpConnection* conn, File* file, Flags:
 
 			string srcPath = UPDATE_TEMP_DIR + TTH(UPDATE_TEMP_DIR "GeoIP_Update.zip") + PATH_SEPARATOR;
 			string dstPath = Util::getFilePath(currentBinary);
+			string geoipPath = srcPath;
 
 #ifdef _WIN32
 			if(srcPath[srcPath.size() - 1] == PATH_SEPARATOR)
@@ -427,6 +429,12 @@ void UpdateManager::geoipDownload(const HttpConnection* conn, File* file, Flags:
 
 			zip.Close();
 
+			// compiled now and installed along with the CSV, so that startup only has to map it
+			try {
+				GeoIP::compile(geoipPath + "GeoIPCountryWhois.csv", geoipPath + "GeoIPv6.csv", geoipPath + "GeoIP.bin");
+			} catch(const FileException&) {
+			}
+
 			File::deleteFile(UPDATE_TEMP_DIR "GeoIP_Update.zip");
 			fire(UpdateListener::UpdateComplete(), currentBinary, "/update \"" + srcPath + "\" \"" + dstPath + "\"");
 		} catch(ZipFileException& e) {
@@ -38,11 +38,19 @@
 #include "FinishedManager.h"
 #include "File.h"
 #include "SharedFileStream.h"
+#include "DiskIoManager.h"
 
 namespace dcpp {
 
 static const string UPLOAD_AREA = "Uploads";
 
+/** Disk queue the upload's reads go to, none for the ones served from memory */
+static string getDevice(const Upload* u) {
+	if(u->getType() == Transfer::TYPE_FILE || u->getType() == Transfer::TYPE_FULL_LIST)
+		return DiskIoManager::getDevice(u->getPath());
+	return Util::emptyString;
+}
+
 UploadManager::UploadManager() noexcept : running(0), extra(0), lastGrant(0), lastFreeSlots(-1),
 	m_iHighSpeedStartTick(0), isFireball(false), isFileServer(false), extraPartial(0) {	
 	ClientManager::getInstance()->addListener(this);
@@ -107,8 +115,8 @@ bool UploadManager::prepareFile(UserConnection& aSource, const string& aType, co
 		if(aType == Transfer::names[Transfer::TYPE_FILE]) {
 			sourceFile = ShareManager::getInstance()->toReal(aFile, !isInSharingHub);
 
-			if(aFile == Transfer::USER_LIST_NAME) {
-				// Unpack before sending...
+			if(aFile == Transfer::USER_LIST_NAME && Util::getFileExt(sourceFile) == ".bz2") {
+				// No plain copy of the list, unpack before sending...
 				string bz2 = File(sourceFile, File::READ, File::OPEN).read();
 				string xml;
 				CryptoManager::getInstance()->decodeBZ2(reinterpret_cast<const uint8_t*>(bz2.data()), bz2.size(), xml);
@@ -402,11 +410,16 @@ void UploadManager::on(UserConnectionListener::Send, UserConnection* aSource) no
 	u->setStart(GET_TICK());
 	u->tick();
 	aSource->setState(UserConnection::STATE_RUNNING);
-	aSource->transmitFile(u->getStream());
+	aSource->transmitFile(u->getStream(), getDevice(u));
 	fire(UploadManagerListener::Starting(), u);
 }
 
 void UploadManager::on(AdcCommand::GET, UserConnection* aSource, const AdcCommand& c) noexcept {
+	if(aSource->getState() == UserConnection::STATE_RUNNING && aSource->isSet(UserConnection::FLAG_SUPPORTS_PIPELINE) && !aSource->hasPipelinedGet()) {
+		// The next segment, requested early - answered when the running one has been sent
+		aSource->setPipelinedGet(c);
+		return;
+	}
 	if(aSource->getState() != UserConnection::STATE_GET) {
 		dcdebug("UM::onGET Bad state, ignoring\n");
 		return;
@@ -441,7 +454,7 @@ void UploadManager::on(AdcCommand::GET, UserConnection* aSource, const AdcComman
 		u->setStart(GET_TICK());
 		u->tick();
 		aSource->setState(UserConnection::STATE_RUNNING);
-		aSource->transmitFile(u->getStream());
+		aSource->transmitFile(u->getStream(), getDevice(u));
 		fire(UploadManagerListener::Starting(), u);
 	}
 }
@@ -480,6 +493,10 @@ void UploadManager::on(UserConnectionListener::TransmitDone, UserConnection* aSo
 	} else {
 		removeUpload(u, true);
 	}
+
+	if(aSource->hasPipelinedGet()) {
+		on(AdcCommand::GET(), aSource, aSource->takePipelinedGet());
+	}
 }
 
 void UploadManager::logUpload(const Upload* u) {
@@ -107,6 +107,11 @@ public:
 	/** @return Number of uploads. */ 
 	size_t getUploadCount() { Lock l(cs); return uploads.size(); }
 
+	void lockedOperation(const function<void (const UploadList&)>& currentUploads) {
+		Lock l(cs);
+		if(currentUploads) currentUploads(uploads);
+	}
+
 	/**
 	 * @remarks This is only used in the tray icons. Could be used in
 	 * MainFrame too.
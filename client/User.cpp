@@ -195,12 +195,20 @@ bool Identity::isSet(const char* name) const {
 
 
 void Identity::set(const char* name, const string& val) {
+	set(name, val.data(), val.size());
+}
+
+void Identity::set(const char* name, const char* val, size_t len) {
 	FastLock l(cs);
-	if(val.empty())
+	if(len == 0) {
 		info.erase(*(const short*)name);
-	else
-		info[*(const short*)name] = val;
-	updateCachedInfo(name, val);
+		updateCachedInfo(name, Util::emptyString);
+	} else {
+		// assigned in place, an updated field reuses the old string's buffer
+		string& s = info[*(const short*)name];
+		s.assign(val, len);
+		updateCachedInfo(name, s);
+	}
 }
 
 bool Identity::supports(const string& name) const {
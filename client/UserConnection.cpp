@@ -41,6 +41,7 @@ const string UserConnection::FEATURE_ADC_BAS0 = "BAS0";
 const string UserConnection::FEATURE_ADC_BASE = "BASE";
 const string UserConnection::FEATURE_ADC_BZIP = "BZIP";
 const string UserConnection::FEATURE_ADC_TIGR = "TIGR";
+const string UserConnection::FEATURE_ADC_PIPE = "PIPE";
 
 const string UserConnection::FILE_NOT_AVAILABLE = "File Not Available";
 
@@ -59,7 +60,7 @@ void UserConnection::on(BufferedSocketListener::Line, const string& aLine) noexc
 	if(aLine[0] == '$')
 		setFlag(FLAG_NMDC);
 
-	if(PluginManager::getInstance()->runHook(HOOK_NETWORK_CONN_IN, this, aLine))
+	if(PluginManager::getInstance()->runHook(PluginManager::NETWORK_CONN_IN, this, aLine))
 		return;
 
 	if(aLine[0] == 'C' && !isSet(FLAG_NMDC)) {
@@ -320,7 +321,7 @@ ConnectionData* UserConnection::getPluginObject() noexcept {
 }
 
 void UserConnection::send(const string& aString) {
-	if(PluginManager::getInstance()->runHook(HOOK_NETWORK_CONN_OUT, this, aString))
+	if(PluginManager::getInstance()->runHook(PluginManager::NETWORK_CONN_OUT, this, aString))
 		return;
 
 	lastActivity = GET_TICK();
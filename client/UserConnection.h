@@ -49,6 +49,7 @@ public:
 	static const string FEATURE_ADC_BASE;
 	static const string FEATURE_ADC_BZIP;
 	static const string FEATURE_ADC_TIGR;
+	static const string FEATURE_ADC_PIPE;
 
 	static const string FILE_NOT_AVAILABLE;
 	
@@ -66,7 +67,8 @@ public:
 		FLAG_SUPPORTS_TTHL			= 0x400,
 		FLAG_SUPPORTS_TTHF			= 0x800,
 		FLAG_STEALTH				= 0x1000,
-		FLAG_SECURE					= 0x2000
+		FLAG_SECURE					= 0x2000,
+		FLAG_SUPPORTS_PIPELINE		= 0x4000
 	};
 	
 	enum States {
@@ -148,7 +150,7 @@ public:
 	void updated() { if(socket) socket->updated(); }
 
 	void disconnect(bool graceless = false) { if(socket) socket->disconnect(graceless); }
-	void transmitFile(InputStream* f) { socket->transmitFile(f); }
+	void transmitFile(InputStream* f, const string& device) { socket->transmitFile(f, device); }
 
 	const string& getDirectionString() const {
 		dcassert(isSet(FLAG_UPLOAD) ^ isSet(FLAG_DOWNLOAD));
@@ -171,6 +173,15 @@ public:
 	void setDownload(Download* d) { dcassert(isSet(FLAG_DOWNLOAD)); download = d; }
 	Upload* getUpload() { dcassert(isSet(FLAG_UPLOAD)); return upload; }
 	void setUpload(Upload* u) { dcassert(isSet(FLAG_UPLOAD)); upload = u; }
+
+	/** Next segment, requested while the current download is still streaming */
+	Download* getPipelinedDownload() { dcassert(isSet(FLAG_DOWNLOAD)); return pipelinedDownload; }
+	void setPipelinedDownload(Download* d) { dcassert(isSet(FLAG_DOWNLOAD)); pipelinedDownload = d; }
+
+	/** GET received while an upload was running, answered once it is done */
+	bool hasPipelinedGet() const { return pipelinedGet.get() != nullptr; }
+	void setPipelinedGet(const AdcCommand& c) { pipelinedGet.reset(new AdcCommand(c)); }
+	AdcCommand takePipelinedGet() { AdcCommand c(*pipelinedGet); pipelinedGet.reset(); return c; }
 	
 	void handle(AdcCommand::SUP t, const AdcCommand& c) { fire(t, this, c); }
 	void handle(AdcCommand::INF t, const AdcCommand& c) { fire(t, this, c); }
@@ -208,9 +219,12 @@ private:
 		Upload* upload;
 	};
 
+	Download* pipelinedDownload;
+	std::unique_ptr<AdcCommand> pipelinedGet;
+
 	// We only want ConnectionManager to create this...
-	UserConnection(bool secure_) noexcept : encoding(const_cast<string*>(&Text::systemCharset)), state(STATE_UNCONNECTED),
-		lastActivity(0), speed(0), chunkSize(0), socket(0), download(NULL), slotType(NOSLOT) {
+	UserConnection(bool secure_) noexcept : speed(0), lastActivity(0), encoding(const_cast<string*>(&Text::systemCharset)),
+		state(STATE_UNCONNECTED), slotType(NOSLOT), chunkSize(0), socket(0), download(NULL), pipelinedDownload(NULL) {
 		if(secure_) {
 			setFlag(FLAG_SECURE);
 		}
@@ -35,6 +35,7 @@
 #include "SettingsManager.h"
 #include "version.h"
 #include "File.h"
+#include "GeoIP.h"
 #include "SimpleXML.h"
 #include "RegEx.h"
 
@@ -66,8 +67,7 @@ bool Util::away = false;
 string Util::awayMsg;
 time_t Util::awayTime;
 
-Util::CountryList Util::countries;
-StringPairList Util::countryNames;
+GeoIP Util::geoIp;
 
 string Util::paths[Util::PATH_LAST];
 
@@ -203,58 +203,20 @@ void Util::initialize(PathsMap pathOverrides) {
 	File::ensureDirectory(paths[PATH_USER_CONFIG]);
 	File::ensureDirectory(paths[PATH_USER_LOCAL]);
 	
-	try {
-		// This product includes GeoIP data created by MaxMind, available from http://maxmind.com/
-		// Updates at http://www.maxmind.com/app/geoip_country
-		string file = getPath(PATH_RESOURCES) + "GeoIpCountryWhois.csv";
-		string data = File(file, File::READ, File::OPEN).read();
-
-		const char* start = data.c_str();
-		string::size_type linestart = 0, lineend, pos, pos2;
-		auto last = countries.end();
-		uint32_t startIP = 0, endIP = 0, endIPprev = 0;
-
-		countryNames.push_back(make_pair(STRING(UNKNOWN), "??"));
-		auto addCountry = [](const string& countryName, const string& countryCode) -> size_t {
-			auto begin = countryNames.cbegin(), end = countryNames.cend();
-			auto countryPair = make_pair(countryName, countryCode);
-			auto pos = std::find(begin, end, countryPair);
-			if(pos != end)
-				return pos - begin;
-			countryNames.push_back(countryPair);
-			return countryNames.size() - 1;
-		};
-
-		while(true) {
-			pos = data.find(',', linestart);
-			if(pos == string::npos) break;
-			pos = data.find(',', pos + 1);
-			if(pos == string::npos) break;
-			startIP = toUInt32(start + pos + 2) - 1;
-
-			pos = data.find(',', pos + 1);
-			if(pos == string::npos) break;
-			endIP = toUInt32(start + pos + 2);
-
-			pos = data.find(',', pos + 1);
-			if(pos == string::npos) break;
-
-			pos2 = data.find(',', pos + 1);
-			if(pos2 == string::npos) break;
-
-			lineend = data.find('\n', pos);
-			if(lineend == string::npos) break;
-
-			if(startIP != endIPprev)
-				last = countries.insert(last, make_pair(startIP, 0));
-			pos += 2;
-			pos2 += 2;
-			last = countries.insert(last, make_pair(endIP, addCountry(data.substr(pos2, lineend - 1 - pos2), data.substr(pos, 2))));
-
-			endIPprev = endIP;
-			linestart = lineend + 1;
+	// This product includes GeoIP data created by MaxMind, available from http://maxmind.com/
+	// Updates at http://www.maxmind.com/app/geoip_country
+	// The update compiles GeoIP.bin next to the CSV; otherwise it's built once into the user's directory
+	string csv = getPath(PATH_RESOURCES) + "GeoIpCountryWhois.csv";
+	int64_t csvSize = File::getSize(csv);
+	if(!geoIp.load(getPath(PATH_RESOURCES) + "GeoIP.bin", csvSize) && csvSize != -1) {
+		string cache = getPath(PATH_USER_LOCAL) + "GeoIP.bin";
+		if(!geoIp.load(cache, csvSize)) {
+			try {
+				GeoIP::compile(csv, getPath(PATH_RESOURCES) + "GeoIPv6.csv", cache);
+				geoIp.load(cache, csvSize);
+			} catch(const FileException&) {
+			}
 		}
-	} catch(const FileException&) {
 	}
 }
 
@@ -1156,23 +1118,29 @@ uint32_t Util::rand() {
 */
 const string& Util::getIpCountry (const string& IP, bool full) {
 	if (BOOLSETTING(GET_USER_COUNTRY)) {
-		if(count(IP.begin(), IP.end(), '.') != 3)
-			return emptyString;
-
-		//e.g IP 23.24.25.26 : w=23, x=24, y=25, z=26
-		string::size_type a = IP.find('.');
-		string::size_type b = IP.find('.', a+1);
-		string::size_type c = IP.find('.', b+2);
-
-		/// @todo this is impl dependant and is working by chance because we are currently using atoi!
-		uint32_t ipnum = (toUInt32(IP.c_str()) << 24) |
-			(toUInt32(IP.c_str() + a + 1) << 16) |
-			(toUInt32(IP.c_str() + b + 1) << 8) |
-			(toUInt32(IP.c_str() + c + 1) );
-
-		auto i = countries.lower_bound(ipnum);
-		if(i != countries.end()) {
-			const auto& countryPair = countryNames[i->second];
+		int country;
+		if(IP.find(':') != string::npos) {
+			country = geoIp.find(IP);
+		} else {
+			if(count(IP.begin(), IP.end(), '.') != 3)
+				return emptyString;
+
+			//e.g IP 23.24.25.26 : w=23, x=24, y=25, z=26
+			string::size_type a = IP.find('.');
+			string::size_type b = IP.find('.', a+1);
+			string::size_type c = IP.find('.', b+2);
+
+			/// @todo this is impl dependant and is working by chance because we are currently using atoi!
+			uint32_t ipnum = (toUInt32(IP.c_str()) << 24) |
+				(toUInt32(IP.c_str() + a + 1) << 16) |
+				(toUInt32(IP.c_str() + b + 1) << 8) |
+				(toUInt32(IP.c_str() + c + 1) );
+
+			country = geoIp.find(ipnum);
+		}
+
+		if(country != -1) {
+			const auto& countryPair = geoIp.getCountries()[country];
 			return full ? countryPair.first : countryPair.second;
 		}
 	}
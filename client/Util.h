@@ -56,6 +56,8 @@ namespace dcpp {
 using boost::find_if;
 using std::map;
 
+class GeoIP;
+
 #if !defined NOCASE_WCSCMP_FUNC && !defined wcscasecmp
 inline int wcscasecmp( const wchar_t *s1, const wchar_t *s2 )
 {
@@ -501,10 +503,7 @@ private:
 	static time_t awayTime;
 	static time_t startTime;
 	
-	typedef map<uint32_t, uint16_t> CountryList;
-	typedef CountryList::iterator CountryIter;
-	static CountryList countries;
-	static StringPairList countryNames;
+	static GeoIP geoIp;
 
 	static void loadBootConfig();
 };
@@ -23,8 +23,14 @@
 #include "QueueManager.h"
 #include "FinishedManager.h"
 #include "LogManager.h"
+#include "Metrics.h"
 #include "ClientManager.h"
+#include "DownloadManager.h"
+#include "Download.h"
+#include "HashManager.h"
+#include "ShareManager.h"
 #include "UploadManager.h"
+#include "Upload.h"
 #include "StringTokenizer.h"
 #include "ResourceManager.h"
 #include "SearchResult.h"
@@ -33,11 +39,17 @@
 #include "ZUtils.h"
 #include "version.h"
 
+#include "../dht/DHT.h"
+
+#include <functional>
+#include <tuple>
+
 namespace dcpp {
 
 static const char* monNames[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
 static const char* dayNames[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
 static const uint32_t POLL_TIMEOUT = 250;
+static const uint64_t STATS_MAX_AGE = 1000;
 
 WebServer::WebServer(bool aSecure, uint16_t aPort, const string& aIp /* = "0.0.0.0" */) : port(0), secure(aSecure), die(false) {
 	sock.create();
@@ -349,6 +361,8 @@ void WebConnection::on(BufferedSocketListener::Line, const string& aLine) noexce
 		request.compress = COMPRESS_NONE;
 		request.time = GET_TIME();
 		request.modified = (time_t)-1;
+		request.etag.clear();
+		request.auth.clear();
 		request.dataSize = 0;
 
 		response.file.reset();
@@ -395,6 +409,10 @@ void WebConnection::on(BufferedSocketListener::Line, const string& aLine) noexce
 		}
 	} else if(Util::findSubString(aLine, "If-Modified-Since") != string::npos) {
 		WebServer::parseServerDate(aLine.substr(19, aLine.length() - 20), request.modified);
+	} else if(Util::findSubString(aLine, "If-None-Match") != string::npos) {
+		request.etag = aLine.substr(15, aLine.length() - 16);
+	} else if(Util::findSubString(aLine, "Authorization") != string::npos) {
+		request.auth = aLine.substr(15, aLine.length() - 16);
 	} else if(Util::findSubString(aLine, "Connection") != string::npos) {
 		closing = aLine.substr(12, aLine.length() - 13).compare("close") == 0;
 	}
@@ -411,9 +429,36 @@ void WebConnection::on(BufferedSocketListener::Line, const string& aLine) noexce
 			ContentType type = getContentTypeFromExt(Util::getFileExt(request.page));
 			string date = WebServer::getServerDate(request.time);
 			string lastModified = Util::emptyString;
+			string etag = Util::emptyString;
 			int64_t size = 0;
 
-			if(type.type != 0) {
+			if(WebServerManager::isStatsPage(request.page)) {
+				if(!WebServerManager::getInstance()->isLoggedIn(sock->getIp()) && !WebServerManager::getInstance()->isAuthorized(request.auth)) {
+					type.ext = ".html"; type.type = "text/html"; type.compress = true;
+					WebServerManager::getInstance()->getErrorPage(response, "401 Unauthorized");
+					response.header += "WWW-Authenticate: Basic realm=\"" APPNAME "\"\r\n";
+				} else {
+					etag = WebServerManager::getInstance()->getStatsPage(response, request.page, request.args, request.etag);
+					if(etag == request.etag) {
+						response.header = "HTTP/1.1 304 Not Modified\r\n";
+
+						if(!date.empty()) response.header += "Date: " + date + "\r\n";
+						response.header += "Server: " APPNAME "/" VERSIONSTRING_FULL "\r\n";
+						response.header += "ETag: " + etag + "\r\n";
+						response.header += "\r\n";
+
+						sock->write(response.header);
+
+						if(closing) sock->disconnect();
+						request.type = REQ_COMPLETE;
+						return;
+					}
+
+					type.type = Util::getFileExt(request.page) == ".json" ? "application/json" : "text/plain; version=0.0.4";
+					type.compress = true;
+				}
+				size = response.page.size();
+			} else if(type.type != 0) {
 				if(strcmp(type.type, "text/html") == 0) {
 					// Get the html page... 404 on an unknown page.
 					if(!WebServerManager::getInstance()->isLoggedIn(sock->getIp())) {
@@ -459,6 +504,7 @@ void WebConnection::on(BufferedSocketListener::Line, const string& aLine) noexce
 			if(!date.empty()) response.header += "Date: " + date + "\r\n";
 			response.header += "Server: " APPNAME "/" VERSIONSTRING_FULL "\r\n";
 			if(!lastModified.empty()) response.header += "Last-Modified: " + lastModified + "\r\n";
+			if(!etag.empty()) response.header += "ETag: " + etag + "\r\nCache-Control: no-cache\r\n";
 			response.header += "Content-Type: " + string(type.type) + "\r\n";
 
 			ByteArray compressed(NULL);
@@ -819,6 +865,264 @@ WebServerManager::StaticFileInfo WebServerManager::getStaticFile(WebConnection::
 	return StaticFileInfo(0, -1);
 }
 
+namespace {
+
+string toBase64(const string& data) {
+	static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	string ret;
+	ret.reserve((data.size() + 2) / 3 * 4);
+	for(size_t i = 0; i < data.size(); i += 3) {
+		uint32_t n = static_cast<uint8_t>(data[i]) << 16;
+		if(i + 1 < data.size()) n |= static_cast<uint8_t>(data[i + 1]) << 8;
+		if(i + 2 < data.size()) n |= static_cast<uint8_t>(data[i + 2]);
+
+		ret += chars[(n >> 18) & 0x3f];
+		ret += chars[(n >> 12) & 0x3f];
+		ret += i + 1 < data.size() ? chars[(n >> 6) & 0x3f] : '=';
+		ret += i + 2 < data.size() ? chars[n & 0x3f] : '=';
+	}
+	return ret;
+}
+
+void jsonString(string& out, const string& str) {
+	out += '"';
+	for(string::const_iterator i = str.begin(); i != str.end(); ++i) {
+		unsigned char c = *i;
+		switch(c) {
+			case '"': out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			case '\n': out += "\\n"; break;
+			case '\r': out += "\\r"; break;
+			case '\t': out += "\\t"; break;
+			default:
+				if(c < 0x20) {
+					char buf[8];
+					snprintf(buf, sizeof(buf), "\\u%04x", c);
+					out += buf;
+				} else {
+					out += c;
+				}
+		}
+	}
+	out += '"';
+}
+
+void metric(string& out, const char* name, const char* type, const string& value) {
+	out += "# TYPE dcpp_"; out += name; out += ' '; out += type; out += '\n';
+	out += "dcpp_"; out += name; out += ' '; out += value; out += '\n';
+}
+
+string labelValue(const string& str) {
+	string ret;
+	for(string::const_iterator i = str.begin(); i != str.end(); ++i) {
+		if(*i == '\\' || *i == '"') ret += '\\';
+		if(*i == '\n') { ret += "\\n"; continue; }
+		ret += *i;
+	}
+	return ret;
+}
+
+}
+
+bool WebServerManager::isAuthorized(const string& auth) const {
+	// nothing configured doesn't mean empty credentials are good
+	if(SETTING(WEBSERVER_USER).empty() && SETTING(WEBSERVER_PASS).empty())
+		return false;
+	return !auth.empty() && auth == "Basic " + toBase64(SETTING(WEBSERVER_USER) + ":" + SETTING(WEBSERVER_PASS));
+}
+
+void WebServerManager::getQueue(vector<QueueInfo>& items) {
+	// Only copy while downloads wait for the queue lock, rendering happens after
+	QueueManager::getInstance()->lockedOperation([&items](const QueueItem::StringMap& li) {
+		items.reserve(li.size());
+		for(QueueItem::StringMap::const_iterator j = li.begin(); j != li.end(); ++j) {
+			QueueItem* qi = j->second;
+			QueueInfo info = { qi->getTarget(), qi->getSize(), static_cast<int64_t>(qi->getDownloadedBytes()), static_cast<int64_t>(qi->getAverageSpeed()),
+				static_cast<int>(qi->getDownloads().size()), static_cast<int>(qi->getMaxSegments()), static_cast<int>(qi->getPriority()) };
+			items.push_back(info);
+		}
+	});
+}
+
+WebServerManager::StatsPtr WebServerManager::getStats() {
+	StatsPtr current = std::atomic_load(&stats);
+	if(current && GET_TICK() - current->tick < STATS_MAX_AGE)
+		return current;
+
+	Lock l(statsCs);
+
+	// another request may have taken one while we waited
+	current = std::atomic_load(&stats);
+	if(current && GET_TICK() - current->tick < STATS_MAX_AGE)
+		return current;
+
+	auto s = std::make_shared<Stats>();
+	s->tick = GET_TICK();
+
+	s->downSpeed = DownloadManager::getInstance()->getRunningAverage();
+	s->upSpeed = UploadManager::getInstance()->getRunningAverage();
+	s->totalDown = Socket::getTotalDown();
+	s->totalUp = Socket::getTotalUp();
+
+	DownloadManager::getInstance()->lockedOperation([&s](const DownloadList& dl) {
+		for(DownloadList::const_iterator i = dl.begin(); i != dl.end(); ++i) {
+			const Download* d = *i;
+			TransferInfo t = { d->getHintedUser(), Util::emptyString, Util::getFileName(d->getPath()), false, d->getPos(), d->getSize(), static_cast<int64_t>(d->getAverageSpeed()) };
+			s->transfers.push_back(t);
+		}
+	});
+	UploadManager::getInstance()->lockedOperation([&s](const UploadList& ul) {
+		for(UploadList::const_iterator i = ul.begin(); i != ul.end(); ++i) {
+			const Upload* u = *i;
+			TransferInfo t = { u->getHintedUser(), Util::emptyString, Util::getFileName(u->getPath()), true, u->getPos(), u->getSize(), static_cast<int64_t>(u->getAverageSpeed()) };
+			s->transfers.push_back(t);
+		}
+	});
+
+	// ClientManager's lock mustn't be taken inside the transfer locks
+	for(vector<TransferInfo>::iterator i = s->transfers.begin(); i != s->transfers.end(); ++i)
+		i->nick = ClientManager::getInstance()->getNicks(i->user)[0];
+
+	getQueue(s->queue);
+	s->queueSize = 0;
+	s->queueDownloaded = 0;
+	for(vector<QueueInfo>::const_iterator i = s->queue.begin(); i != s->queue.end(); ++i) {
+		s->queueSize += max(i->size, (int64_t)0);
+		s->queueDownloaded += i->downloaded;
+	}
+
+	HashManager::getInstance()->getStats(s->hashFile, s->hashBytesLeft, s->hashFilesLeft);
+
+	s->shareSize = ShareManager::getInstance()->getShareSize();
+	s->sharedFiles = ShareManager::getInstance()->getSharedFiles();
+	s->searches = ShareManager::getInstance()->getSearches();
+	s->searchHits = ShareManager::getInstance()->getHits();
+
+	dht::DHT* d = dht::DHT::getInstance();
+	s->dhtActive = BOOLSETTING(USE_DHT) && d->isConnected();
+	s->dhtFirewalled = d->isFirewalled();
+	s->dhtNodes = d->getNodesCount();
+
+	s->tasks = TimerManager::getInstance()->getStats();
+
+	renderStats(*s);
+	s->metricsHash = std::hash<string>()(s->metrics);
+
+	// unchanged data keeps its ETag
+	s->generation = current && current->json == s->json && current->queue == s->queue ? current->generation : ++statsGeneration;
+
+	std::atomic_store(&stats, StatsPtr(s));
+	return s;
+}
+
+void WebServerManager::renderStats(Stats& s) {
+	// timer figures change on every call, so they only go to the metrics for conditional requests to work
+	string& j = s.json;
+	j.reserve(1024 + s.transfers.size() * 128);
+
+	j += "\"transfers\":{\"download_speed\":" + Util::toString(s.downSpeed) + ",\"upload_speed\":" + Util::toString(s.upSpeed) +
+		",\"total_down\":" + Util::toString(s.totalDown) + ",\"total_up\":" + Util::toString(s.totalUp) + ",\"connections\":[";
+	for(vector<TransferInfo>::const_iterator i = s.transfers.begin(); i != s.transfers.end(); ++i) {
+		if(i != s.transfers.begin()) j += ',';
+		j += "{\"user\":"; jsonString(j, i->nick);
+		j += ",\"hub\":"; jsonString(j, i->user.hint);
+		j += ",\"file\":"; jsonString(j, i->file);
+		j += ",\"upload\":"; j += i->upload ? "true" : "false";
+		j += ",\"pos\":" + Util::toString(i->pos) + ",\"size\":" + Util::toString(i->size) + ",\"speed\":" + Util::toString(i->speed) + "}";
+	}
+	j += "]},\"hashing\":{\"file\":"; jsonString(j, s.hashFile);
+	j += ",\"bytes_left\":" + Util::toString(s.hashBytesLeft) + ",\"files_left\":" + Util::toString(s.hashFilesLeft) + "}";
+	j += ",\"share\":{\"size\":" + Util::toString(s.shareSize) + ",\"files\":" + Util::toString(s.sharedFiles) + "}";
+	j += ",\"search\":{\"searches\":" + Util::toString(s.searches) + ",\"hits\":" + Util::toString(s.searchHits) + "}";
+	j += ",\"dht\":{\"active\":"; j += s.dhtActive ? "true" : "false";
+	j += ",\"firewalled\":"; j += s.dhtFirewalled ? "true" : "false";
+	j += ",\"nodes\":" + Util::toString(s.dhtNodes) + "}";
+
+	string& m = s.metrics;
+	m.reserve(2048 + s.tasks.size() * 256);
+
+	metric(m, "download_speed_bytes", "gauge", Util::toString(s.downSpeed));
+	metric(m, "upload_speed_bytes", "gauge", Util::toString(s.upSpeed));
+	metric(m, "downloaded_bytes_total", "counter", Util::toString(s.totalDown));
+	metric(m, "uploaded_bytes_total", "counter", Util::toString(s.totalUp));
+
+	size_t uploads = std::count_if(s.transfers.begin(), s.transfers.end(), [](const TransferInfo& t) { return t.upload; });
+	m += "# TYPE dcpp_transfers gauge\n";
+	m += "dcpp_transfers{direction=\"download\"} " + Util::toString(s.transfers.size() - uploads) + "\n";
+	m += "dcpp_transfers{direction=\"upload\"} " + Util::toString(uploads) + "\n";
+
+	metric(m, "queue_items", "gauge", Util::toString(s.queue.size()));
+	metric(m, "queue_size_bytes", "gauge", Util::toString(s.queueSize));
+	metric(m, "queue_downloaded_bytes", "gauge", Util::toString(s.queueDownloaded));
+	metric(m, "hash_bytes_left", "gauge", Util::toString(s.hashBytesLeft));
+	metric(m, "hash_files_left", "gauge", Util::toString(s.hashFilesLeft));
+	metric(m, "share_size_bytes", "gauge", Util::toString(s.shareSize));
+	metric(m, "share_files", "gauge", Util::toString(s.sharedFiles));
+	metric(m, "searches_total", "counter", Util::toString(s.searches));
+	metric(m, "search_hits_total", "counter", Util::toString(s.searchHits));
+	metric(m, "dht_active", "gauge", s.dhtActive ? "1" : "0");
+	metric(m, "dht_firewalled", "gauge", s.dhtFirewalled ? "1" : "0");
+	metric(m, "dht_nodes", "gauge", Util::toString(s.dhtNodes));
+
+	m += "# TYPE dcpp_timer_runs_total counter\n";
+	for(vector<TimerManager::TaskStats>::const_iterator i = s.tasks.begin(); i != s.tasks.end(); ++i)
+		m += "dcpp_timer_runs_total{task=\"" + labelValue(i->name) + "\"} " + Util::toString(i->runs) + "\n";
+	m += "# TYPE dcpp_timer_skipped_total counter\n";
+	for(vector<TimerManager::TaskStats>::const_iterator i = s.tasks.begin(); i != s.tasks.end(); ++i)
+		m += "dcpp_timer_skipped_total{task=\"" + labelValue(i->name) + "\"} " + Util::toString(i->skipped) + "\n";
+	m += "# TYPE dcpp_timer_late_max_ms gauge\n";
+	for(vector<TimerManager::TaskStats>::const_iterator i = s.tasks.begin(); i != s.tasks.end(); ++i)
+		m += "dcpp_timer_late_max_ms{task=\"" + labelValue(i->name) + "\"} " + Util::toString(i->lateMax) + "\n";
+	m += "# TYPE dcpp_timer_duration_max_ms gauge\n";
+	for(vector<TimerManager::TaskStats>::const_iterator i = s.tasks.begin(); i != s.tasks.end(); ++i)
+		m += "dcpp_timer_duration_max_ms{task=\"" + labelValue(i->name) + "\"} " + Util::toString(i->durationMax) + "\n";
+
+	// hot path counters, histograms and lock timings
+	m += Metrics::toPrometheus();
+}
+
+string WebServerManager::getStatsPage(WebConnection::WebResponse& response, const string& file, const StringMap& args, const string& ifNoneMatch) {
+	StatsPtr s = getStats();
+
+	// the ETag comes from the snapshot alone, so an unchanged page isn't rendered at all
+	string etag = file == "/metrics.txt" ?
+		"\"m" + Util::toString(static_cast<uint64_t>(s->metricsHash)) + "\"" :
+		"\"" + Util::toString(s->generation) + "\"";
+	if(etag == ifNoneMatch)
+		return etag;
+
+	response.header = "HTTP/1.1 200 OK\r\n";
+
+	if(file == "/metrics.txt") {
+		response.page = s->metrics;
+		return etag;
+	}
+
+	// queue items are paginated with ?offset=&limit=, at most MAX_STATS_ITEMS at a time
+	StringMap::const_iterator i = args.find("offset");
+	size_t offset = min(i != args.end() ? static_cast<size_t>(max(Util::toInt(i->second), 0)) : 0, s->queue.size());
+	i = args.find("limit");
+	size_t limit = min(i != args.end() ? static_cast<size_t>(max(Util::toInt(i->second), 0)) : 100, static_cast<size_t>(MAX_STATS_ITEMS));
+	size_t end = offset + min(limit, s->queue.size() - offset);
+
+	string& j = response.page;
+	j.reserve(s->json.size() + 128 + (end - offset) * 160);
+	j = "{" + s->json;
+	j += ",\"queue\":{\"items\":" + Util::toString(s->queue.size()) + ",\"size\":" + Util::toString(s->queueSize) +
+		",\"downloaded\":" + Util::toString(s->queueDownloaded) + ",\"offset\":" + Util::toString(offset) + ",\"list\":[";
+	for(size_t n = offset; n < end; ++n) {
+		const QueueInfo& q = s->queue[n];
+		if(n != offset) j += ',';
+		j += "{\"target\":"; jsonString(j, q.target);
+		j += ",\"size\":" + Util::toString(q.size) + ",\"downloaded\":" + Util::toString(q.downloaded) + ",\"speed\":" + Util::toString(q.speed) +
+			",\"segments\":" + Util::toString(q.segments) + ",\"max_segments\":" + Util::toString(q.maxSegments) + ",\"priority\":" + Util::toString(q.priority) + "}";
+	}
+	j += "]}}";
+
+	return etag;
+}
+
 void WebServerManager::search(string searchStr, SearchManager::TypeModes ftype) {
 	if (!sentSearch) {
 		string::size_type i = 0;
@@ -979,10 +1283,18 @@ string WebServerManager::getSearch() {
 }
 
 string WebServerManager::getFinished(bool uploads){
-	string ret;
+	// Copy the few fields shown so that finishing transfers don't wait for the rendering
+	vector<std::tuple<time_t, string, int64_t>> items;
+	{
+		const FinishedItem::List& fl = FinishedManager::getInstance()->lockList(uploads);
+		items.reserve(fl.size());
+		for(FinishedItem::List::const_iterator i = fl.begin(); i != fl.end(); ++i)
+			items.push_back(std::make_tuple((*i)->getTime(), (*i)->getTarget(), (*i)->getSize()));
+		FinishedManager::getInstance()->unlockList();
+	}
 
-	const FinishedItem::List& fl = FinishedManager::getInstance()->lockList(uploads);
-	ret = "	<h1>Finished ";
+	string ret = "	<h1>Finished ";
+	ret.reserve(512 + items.size() * 128);
 	ret += (uploads ? "Uploads" : "Downloads");
 	ret += "</h1>";
 	ret += "	<table  width='100%'>";
@@ -991,45 +1303,43 @@ string WebServerManager::getFinished(bool uploads){
 	ret += "			<td>Name</td>";
 	ret += "			<td>Size</td>";
 	ret += "		</tr>";
-	for(FinishedItem::List::const_iterator i = fl.begin(); i != fl.end(); ++i) {
+	for(auto i = items.begin(); i != items.end(); ++i) {
 		ret+="<tr>";
-		ret+="	<td>" + Util::formatTime("%Y-%m-%d %H:%M:%S", (*i)->getTime()) + "</td>";
-		ret+="	<td>" + Util::getFileName((*i)->getTarget()) + "</td>";
-		ret+="	<td>" + Util::formatBytes((*i)->getSize()) + "</td>";			
+		ret+="	<td>" + Util::formatTime("%Y-%m-%d %H:%M:%S", std::get<0>(*i)) + "</td>";
+		ret+="	<td>" + Util::getFileName(std::get<1>(*i)) + "</td>";
+		ret+="	<td>" + Util::formatBytes(std::get<2>(*i)) + "</td>";			
 		ret+="</tr>";
 	}
 	ret+="</table>";
-	FinishedManager::getInstance()->unlockList();
 
 	return ret;
 }
 
 string WebServerManager::getDLQueue(){
-	string ret;
+	vector<QueueInfo> items;
+	getQueue(items);
 
-	QueueManager::getInstance()->lockedOperation([&ret](const QueueItem::StringMap& li) {
-		ret = "	<h1>Download Queue</h1>";
-		ret += "	<table  width='100%'>";
-		ret += "		<tr class='tucne'>";
-		ret += "			<td>Name</td>";
-		ret += "			<td>Size</td>";
-		ret += "			<td>Downloaded</td>";
-		ret += "			<td>Speed</td>";
-		ret += "			<td>Segments</td>";
-		ret += "		</tr>";
-		for(QueueItem::StringMap::const_iterator j = li.begin(); j != li.end(); ++j) {
-			QueueItem* aQI = j->second;
-			double percent = (aQI->getSize() > 0) ? aQI->getDownloadedBytes() * 100.0 / aQI->getSize() : 0;
-			ret += "	<tr>";
-			ret += "		<td>" + aQI->getTargetFileName() + "</td>";
-			ret += "		<td>" + Util::formatBytes(aQI->getSize()) + "</td>";
-			ret += "		<td>" + Util::formatBytes(aQI->getDownloadedBytes()) + " ("+ Util::toString(percent) + "%)</td>";
-			ret += "		<td>" + Util::formatBytes(aQI->getAverageSpeed()) + "/s</td>";
-			ret += "		<td>" + Util::toString((int)aQI->getDownloads().size())+"/"+Util::toString(aQI->getMaxSegments()) + "</td>";
-			ret += "	</tr>";
-		}
-		ret+="</table>";
-	});
+	string ret = "	<h1>Download Queue</h1>";
+	ret.reserve(512 + items.size() * 256);
+	ret += "	<table  width='100%'>";
+	ret += "		<tr class='tucne'>";
+	ret += "			<td>Name</td>";
+	ret += "			<td>Size</td>";
+	ret += "			<td>Downloaded</td>";
+	ret += "			<td>Speed</td>";
+	ret += "			<td>Segments</td>";
+	ret += "		</tr>";
+	for(vector<QueueInfo>::const_iterator i = items.begin(); i != items.end(); ++i) {
+		double percent = (i->size > 0) ? i->downloaded * 100.0 / i->size : 0;
+		ret += "	<tr>";
+		ret += "		<td>" + Util::getFileName(i->target) + "</td>";
+		ret += "		<td>" + Util::formatBytes(i->size) + "</td>";
+		ret += "		<td>" + Util::formatBytes(i->downloaded) + " ("+ Util::toString(percent) + "%)</td>";
+		ret += "		<td>" + Util::formatBytes(i->speed) + "/s</td>";
+		ret += "		<td>" + Util::toString(i->segments)+"/"+Util::toString(i->maxSegments) + "</td>";
+		ret += "	</tr>";
+	}
+	ret+="</table>";
 
 	return ret;
 }
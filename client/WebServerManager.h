@@ -25,10 +25,12 @@
 #include "typedefs.h"
 
 #include "BufferedSocket.h"
+#include "HintedUser.h"
 
 #include "SearchManager.h"
 #include "Singleton.h"
 #include "Thread.h"
+#include "TimerManager.h"
 #include "Speaker.h"
 #include "ZipFile.h"
 
@@ -137,6 +139,8 @@ private:
 		CompMethod compress;
 		time_t time;
 		time_t modified;
+		string etag;
+		string auth;
 		string page;
 		StringMap args;
 
@@ -177,6 +181,13 @@ public:
 	void getLoginPage(WebConnection::WebResponse& response, const string& dest = "/index.html");
 	StaticFileInfo getStaticFile(WebConnection::WebResponse& response, const string& file, bool compress);
 
+	/** Pages for monitoring tools: /stats.json and Prometheus text format /metrics.txt */
+	static bool isStatsPage(const string& file) { return file == "/stats.json" || file == "/metrics.txt"; }
+	/** Renders a stats page from the latest snapshot unless its ETag is ifNoneMatch, returns the ETag */
+	string getStatsPage(WebConnection::WebResponse& response, const string& file, const StringMap& args, const string& ifNoneMatch);
+	/** Checks HTTP basic authorization against the web server login, for scrapers that can't use the form */
+	bool isAuthorized(const string& auth) const;
+
 	void search(string searchStr, SearchManager::TypeModes ftype);
 	void reset(bool cancel = false);
 
@@ -214,9 +225,12 @@ public:
 private:
 	friend class Singleton<WebServerManager>;
 
-	WebServerManager() : started(false), sentSearch(false), searchInterval(10000), server(NULL) { }
+	WebServerManager() : started(false), sentSearch(false), searchInterval(10000), server(NULL), statsGeneration(0) { }
 	~WebServerManager() { shutdown(); }
 
+	/** Most queue items a /stats.json request gets */
+	enum { MAX_STATS_ITEMS = 1000 };
+
 	enum PageID {
 		PAGE_INDEX,
 		PAGE_DOWNLOAD_QUEUE,
@@ -242,6 +256,75 @@ private:
 	typedef map<string, uint64_t> SessionMap;
 	typedef vector<WebConnection*> ConnectionMap;
 
+	struct QueueInfo {
+		string target;
+		int64_t size;
+		int64_t downloaded;
+		int64_t speed;
+		int segments;
+		int maxSegments;
+		int priority;
+
+		bool operator==(const QueueInfo& rhs) const {
+			return target == rhs.target && size == rhs.size && downloaded == rhs.downloaded && speed == rhs.speed &&
+				segments == rhs.segments && maxSegments == rhs.maxSegments && priority == rhs.priority;
+		}
+	};
+
+	struct TransferInfo {
+		HintedUser user;
+		string nick;
+		string file;
+		bool upload;
+		int64_t pos;
+		int64_t size;
+		int64_t speed;
+	};
+
+	/** Copy of everything the stats pages show, taken with each manager's lock held only while copying */
+	struct Stats {
+		uint64_t generation;
+		uint64_t tick;
+
+		int64_t downSpeed;
+		int64_t upSpeed;
+		uint64_t totalDown;
+		uint64_t totalUp;
+		vector<TransferInfo> transfers;
+
+		vector<QueueInfo> queue;
+		int64_t queueSize;
+		int64_t queueDownloaded;
+
+		string hashFile;
+		uint64_t hashBytesLeft;
+		size_t hashFilesLeft;
+
+		int64_t shareSize;
+		size_t sharedFiles;
+		uint64_t searches;
+		uint32_t searchHits;
+
+		bool dhtActive;
+		bool dhtFirewalled;
+		size_t dhtNodes;
+
+		vector<TimerManager::TaskStats> tasks;
+
+		/** Everything but the queue items, which are paginated per request */
+		string json;
+		string metrics;
+		/** The metrics change between snapshots with the same generation, their ETag hashes the text */
+		size_t metricsHash;
+	};
+
+	typedef std::shared_ptr<const Stats> StatsPtr;
+
+	/** Returns a snapshot at most a second old */
+	StatsPtr getStats();
+	void getQueue(vector<QueueInfo>& items);
+	static void renderStats(Stats& stats);
+
 	string getDLQueue();
 	string getULQueue();
 	string getFinished(bool uploads);
@@ -267,6 +350,11 @@ private:
 	ZipFile::FileMap staticFiles;
 	SessionMap sessions;
 	ConnectionMap activeConnections;
+
+	/** Latest stats, readers take it with atomic_load; statsCs only serializes taking a new one */
+	StatsPtr stats;
+	uint64_t statsGeneration;
+	CriticalSection statsCs;
 };
 
 } // namespace dcpp
@@ -28,6 +28,7 @@ namespace dht
 
 #define DHT_UDPPORT					6250							// default DHT port
 #define DHT_FILE					"dht.xml"						// local file with all information got from the network
+#define INDEX_FILE					"DHTIndexes.dat"				// sources other nodes published to us
 
 #define ID_BITS						192								// size of identificator (in bits)
 
@@ -39,7 +40,10 @@ namespace dht
 
 #define SEARCH_ALPHA				3								// degree of search parallelism
 #define MAX_SEARCH_RESULTS			300								// maximum of allowed search results
-#define SEARCH_PROCESSTIME			3*1000	// 3 seconds			// how often to process done search requests				
+#define SEARCH_PROCESSTIME			1*1000	// 1 second				// how often to expire timed out requests and finished searches
+#define SEARCH_INITIAL_RTT			1500	// 1.5 seconds			// round-trip estimate used before any response has been measured
+#define SEARCH_MIN_TIMEOUT			500		// 0.5 seconds			// lower bound of the adaptive request timeout
+#define SEARCH_MAX_TIMEOUT			5*1000	// 5 seconds			// upper bound of the adaptive request timeout
 #define SEARCH_STOPTIME				15*1000	// 15 seconds			// how long to wait for delayed search results before deleting the search
 #define SEARCHNODE_LIFETIME			20*1000	// 45 seconds			// how long to try searching for node
 #define SEARCHFILE_LIFETIME			45*1000	// 45 seconds			// how long to try searching for file
@@ -52,8 +56,9 @@ namespace dht
 #define MIN_PUBLISH_FILESIZE		1024 * 1024 // 1 MiB			// files below this size won't be published
 #define REPUBLISH_TIME				5*60*60*1000	// 5 hours		// when our filelist should be republished
 #define PFS_REPUBLISH_TIME			1*60*60*1000	// 1 hour		// when partially downloaded files should be republished
-#define MAX_PUBLISHES_AT_TIME		3								// how many files can be published at one time
-#define PUBLISH_TIME				2*1000	// 2 seconds			// how often publishes files
+#define MAX_PUBLISHES_AT_TIME		8								// how many publishing lookups can run at one time
+#define PUBLISH_TIME				1*1000	// 1 second				// how often publishes files
+#define PUBLISH_BATCH				20								// how many files fit in one PUB command to nodes supporting BULK_PUBLISH_FEATURE
 
 #define FW_RESPONSES				3								// how many UDP port checks are needed to detect we are firewalled
 #define FWCHECK_TIME				1*60*60*1000					// how often request firewalled UDP check
@@ -69,6 +74,7 @@ namespace dht
 #define TCP4_FEATURE				"TCP4"							// support for active TCP
 #define UDP4_FEATURE				"UDP4"							// support for active UDP
 #define DHT_FEATURE					"DHT0"
+#define BULK_PUBLISH_FEATURE		"BPUB"							// several files in one PUB command
 
 const std::string NetworkName =		"DHT";
 
@@ -32,6 +32,7 @@
 #include "../client/ClientManager.h"
 #include "../client/CryptoManager.h"
 #include "../client/LogManager.h"
+#include "../client/Metrics.h"
 #include "../client/SettingsManager.h"
 #include "../client/ShareManager.h"
 #include "../client/UploadManager.h"
@@ -122,6 +123,11 @@ namespace dht
 	 */
 	void DHT::dispatch(const string& aLine, const string& ip, uint16_t port, bool isUdpKeyValid)
 	{
+		static Counter& packets = Metrics::counter("dht.packets_in");
+		static Histogram& dispatchTime = Metrics::histogram("dht.dispatch");
+		++packets;
+		ScopedTimer timer(dispatchTime);
+
 		// check node's IP address
 		if(!Utils::isGoodIPPort(ip, port))
 		{
@@ -206,6 +212,9 @@ namespace dht
 	 */
 	void DHT::send(AdcCommand& cmd, const string& ip, uint16_t port, const CID& targetCID, const CID& udpKey)
 	{
+		static Counter& packets = Metrics::counter("dht.packets_out");
+		++packets;
+
 		{
 			// FW check
 			Lock l(fwCheckCs);
@@ -326,9 +335,7 @@ namespace dht
 		if(!isFirewalled())
 			su += UDP4_FEATURE ",";
 			
-		if(!su.empty()) {
-			su.erase(su.size() - 1);
-		}
+		su += BULK_PUBLISH_FEATURE;
 		cmd.addParam("SU", su);
 			
 		send(cmd, ip, port, targetCID, udpKey);
@@ -373,14 +380,15 @@ namespace dht
 			if(f.getLastModified() > time(NULL) - 7 * 24 * 60 * 60)
 				bucket->loadNodes(xml);
 			
-			// load indexes
-			IndexManager::getInstance()->loadIndexes(xml);
 			xml.stepOut();
 		}
 		catch(Exception& e)
 		{
 			dcdebug("%s\n", e.getError().c_str());
 		}
+
+		// load indexes
+		IndexManager::getInstance()->loadIndexes();
 	}
 
 	/*
@@ -400,11 +408,11 @@ namespace dht
 		// save nodes
 		bucket->saveNodes(xml);	
 		
-		// save foreign published files
-		IndexManager::getInstance()->saveIndexes(xml);
-		
 		xml.stepOut();
 		
+		// save foreign published files
+		IndexManager::getInstance()->saveIndexes();
+		
 		try
 		{
 			dcpp::File file(Util::getPath(Util::PATH_USER_CONFIG) + DHT_FILE + ".tmp", dcpp::File::WRITE, dcpp::File::CREATE | dcpp::File::TRUNCATE);
@@ -21,9 +21,11 @@
 #include "DHT.h"
 #include "IndexManager.h"
 #include "SearchManager.h"
+#include "Utils.h"
 
 #include "../client/CID.h"
 #include "../client/LogManager.h"
+#include "../client/SettingsManager.h"
 #include "../client/ShareManager.h"
 #include "../client/TimerManager.h"
 
@@ -31,6 +33,7 @@ namespace dht
 {
 
 	IndexManager::IndexManager(void) :
+		expiredSlot(GET_TICK() / EXPIRY_SLOT), queueSorted(true), packetBudget(0), lastRefill(GET_TICK()),
 		publish(false), publishing(0), nextRepublishTime(GET_TICK())
 	{
 	}
@@ -39,6 +42,18 @@ namespace dht
 	{
 	}
 
+	string Source::getIp() const
+	{
+		in_addr addr;
+		addr.s_addr = ip;
+		return inet_ntoa(addr);
+	}
+
+	void Source::setIp(const string& aIp)
+	{
+		ip = inet_addr(aIp.c_str());
+	}
+
 	/*
 	 * Add new source to tth list
 	 */
@@ -51,38 +66,39 @@ namespace dht
 		source.setSize(size);
 		source.setExpires(GET_TICK() + (partial ? PFS_REPUBLISH_TIME : REPUBLISH_TIME));
 		source.setPartial(partial);
-			
-		Lock l(cs);
+
+		{
+			Shard& shard = getShard(tth);
+			Lock l(shard.cs);
+			addSource(shard, tth, source);
+		}
 		
-		TTHMap::iterator i = tthList.find(tth);
-		if(i != tthList.end())
+		DHT::getInstance()->setDirty();
+	}
+
+	void IndexManager::addSource(Shard& shard, const TTHValue& tth, const Source& source)
+	{
+		SourceList& sources = shard.tthList[tth];
+
+		// no user duplicites
+		for(SourceList::iterator s = sources.begin(); s != sources.end(); s++)
 		{
-			// no user duplicites
-			SourceList& sources = i->second;
-			for(SourceList::iterator s = sources.begin(); s != sources.end(); s++)
+			if(source.getCID() == s->getCID())
 			{
-				if(node->getUser()->getCID() == (*s).getCID())
-				{
-					// delete old item
-					sources.erase(s);
-					break;
-				}
+				// delete old item
+				sources.erase(s);
+				break;
 			}
-			
-			// old items in front, new items in back
-			sources.push_back(source);
-			
-			// if maximum sources reached, remove the oldest one
-			if(sources.size() > MAX_SEARCH_RESULTS)
-				sources.pop_front();
 		}
-		else
-		{
-			// new file		
-			tthList.insert(std::make_pair(tth, SourceList(1, source)));
-		}
-		
-		DHT::getInstance()->setDirty();
+
+		// old items in front, new items in back
+		sources.push_back(source);
+
+		// if maximum sources reached, remove the oldest one
+		if(sources.size() > MAX_SEARCH_RESULTS)
+			sources.erase(sources.begin());
+
+		shard.expiring[(source.getExpires() / EXPIRY_SLOT) % EXPIRY_SLOTS].push_back(tth);
 	}
 
 	/*
@@ -91,105 +107,252 @@ namespace dht
 	bool IndexManager::findResult(const TTHValue& tth, SourceList& sources) const
 	{
 		// TODO: does file exist in my own sharelist?
-		Lock l(cs);
-		TTHMap::const_iterator i = tthList.find(tth);
-		if(i != tthList.end())
+		uint64_t now = GET_TICK();
+
+		const Shard& shard = getShard(tth);
+		Lock l(shard.cs);
+		TTHMap::const_iterator i = shard.tthList.find(tth);
+		if(i != shard.tthList.end())
 		{
-			sources = i->second;
-			return true;
+			// expired ones may still be waiting for their slot of the expiry wheel
+			for(SourceList::const_iterator j = i->second.begin(); j != i->second.end(); ++j)
+			{
+				if(j->getExpires() > now)
+					sources.push_back(*j);
+			}
+			return !sources.empty();
 		}
 			
 		return false;
 	}
 
 	/*
-	 * Try to publish next file in queue 
+	 * Starts publishing the next files in queue as far as the packet budget allows 
 	 */
 	void IndexManager::publishNextFile()
 	{
-		File f;
+		std::vector<File::List> batches;
 		{
 			Lock l(cs);
-						
-			if(publishQueue.empty() || publishing >= MAX_PUBLISHES_AT_TIME)
-				return;
 
-			incPublishing();
-				
-			f = publishQueue.front(); // get the first file in queue
-			publishQueue.pop_front(); // and remove it from queue
+			// unused budget doesn't pile up, a long idle period mustn't end with a burst
+			uint64_t tick = GET_TICK();
+			int64_t rate = max(SETTING(DHT_PUBLISH_RATE), 1);
+			packetBudget = min(packetBudget + rate * static_cast<int64_t>(tick - lastRefill) / 1000, rate);
+			lastRefill = tick;
+
+			// the batches are charged when they are sent, until then they share what is left
+			int64_t budget = packetBudget;
+			while(publishing < MAX_PUBLISHES_AT_TIME && budget > 0)
+			{
+				File::List files;
+				if(!partialQueue.empty())
+				{
+					files.push_back(partialQueue.front());
+					partialQueue.pop_front();
+				}
+				else if(!publishQueue.empty())
+				{
+					sortQueue();
+					files.push_back(publishQueue.back());
+					publishQueue.pop_back();
+
+					// the same nodes are most likely responsible for the following keys too, as many as the budget covers
+					takeNeighbours(CID(files.front().tth.data), publishRadius, files, max(filesForBudget(budget), (size_t)1));
+				}
+				else
+				{
+					break;
+				}
+
+				budget -= static_cast<int64_t>((files.size() * K + PUBLISH_BATCH - 1) / PUBLISH_BATCH);
+
+				incPublishing();
+				batches.push_back(std::move(files));
+			}
+		}
+
+		for(std::vector<File::List>::const_iterator i = batches.begin(); i != batches.end(); ++i)
+			SearchManager::getInstance()->findStore(*i);
+	}
+
+	/*
+	 * Takes queued files which are closer to key than radius until files holds maxFiles 
+	 */
+	void IndexManager::takeNeighbours(const CID& key, const CID& radius, File::List& files, size_t maxFiles)
+	{
+		Lock l(cs);
+		sortQueue();
+		while(files.size() < maxFiles && !publishQueue.empty() && Utils::getDistance(CID(publishQueue.back().tth.data), key) < radius)
+		{
+			files.push_back(publishQueue.back());
+			publishQueue.pop_back();
+		}
+	}
+
+	/*
+	 * Returns files whose publishing didn't take place back to the queue 
+	 */
+	void IndexManager::requeue(const File::List& files)
+	{
+		Lock l(cs);
+		for(File::List::const_iterator i = files.begin(); i != files.end(); ++i)
+		{
+			if(i->partial)
+			{
+				partialQueue.push_back(*i);
+			}
+			else
+			{
+				publishQueue.push_back(*i);
+				queueSorted = false;
+			}
+		}
+	}
+
+	/*
+	 * Sorts the queue by descending key 
+	 */
+	void IndexManager::sortQueue()
+	{
+		if(!queueSorted)
+		{
+			std::sort(publishQueue.begin(), publishQueue.end(), [](const File& a, const File& b) { return b.tth < a.tth; });
+			queueSorted = true;
 		}
-		SearchManager::getInstance()->findStore(f.tth.toBase32(), f.size, f.partial);
+	}
+
+	namespace
+	{
+		/** Binary index file: header, then fixed size records */
+		const char INDEX_MAGIC[4] = { 'D', 'H', 'T', 'I' };
+		const uint32_t INDEX_VERSION = 1;
+
+		/** TTH, CID, IPv4, UDP port, size, seconds left */
+		const size_t RECORD_SIZE = TTHValue::BYTES + CID::SIZE + 4 + 2 + 8 + 4;
+
+		template<typename T>
+		uint8_t* put(uint8_t* p, const T& v) { memcpy(p, &v, sizeof(T)); return p + sizeof(T); }
+
+		template<typename T>
+		const uint8_t* get(const uint8_t* p, T& v) { memcpy(&v, p, sizeof(T)); return p + sizeof(T); }
 	}
 
 	/*
 	 * Loads existing indexes from disk 
 	 */
-	void IndexManager::loadIndexes(SimpleXML& xml)
+	void IndexManager::loadIndexes()
 	{
-		xml.resetCurrentChild();
-		if(xml.findChild("Indexes"))
+		try
 		{
-			xml.stepIn();
-			while(xml.findChild("Index"))
+			dcpp::File f(Util::getPath(Util::PATH_USER_CONFIG) + INDEX_FILE, dcpp::File::READ, dcpp::File::OPEN);
+
+			char magic[sizeof(INDEX_MAGIC)];
+			uint32_t version;
+			size_t len = sizeof(magic);
+			if(f.read(magic, len) != sizeof(magic) || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0)
+				return;
+			len = sizeof(version);
+			if(f.read(&version, len) != sizeof(version) || version != INDEX_VERSION)
+				return;
+
+			uint64_t now = GET_TICK();
+			ByteVector buf(RECORD_SIZE * 4096);
+			while(true)
 			{
-				const TTHValue tth = TTHValue(xml.getChildAttrib("TTH"));
-				SourceList sources;
-				
-				xml.stepIn();
-				while(xml.findChild("Source"))
+				len = buf.size();
+				f.read(&buf[0], len);
+				if(len < RECORD_SIZE)
+					break;
+
+				for(const uint8_t* p = &buf[0], *end = p + len - len % RECORD_SIZE; p != end; )
 				{
+					TTHValue tth;
+					uint8_t cid[CID::SIZE];
+					uint32_t ttl;
+
 					Source source;
-					source.setCID(CID(xml.getChildAttrib("CID")));
-					source.setIp(xml.getChildAttrib("I4"));
-					source.setUdpPort(static_cast<uint16_t>(xml.getIntChildAttrib("U4")));
-					source.setSize(xml.getLongLongChildAttrib("SI"));
-					source.setExpires(xml.getLongLongChildAttrib("EX"));
-					source.setPartial(false);
-					
-					sources.push_back(source);
+					p = get(p, tth.data);
+					p = get(p, cid);
+					p = get(p, source.ip);
+					p = get(p, source.udpPort);
+					p = get(p, source.size);
+					p = get(p, ttl);
+
+					if(ttl == 0)
+						continue;
+
+					source.setCID(CID(cid));
+					source.setExpires(now + static_cast<uint64_t>(ttl) * 1000);
+
+					Shard& shard = getShard(tth);
+					Lock l(shard.cs);
+					addSource(shard, tth, source);
 				}
-				
-				tthList.insert(std::make_pair(tth, sources));
-				xml.stepOut();
+
+				if(len % RECORD_SIZE)
+					f.setPos(f.getPos() - len % RECORD_SIZE);
 			}
-			xml.stepOut();
+		}
+		catch(const Exception& e)
+		{
+			dcdebug("%s\n", e.getError().c_str());
 		}
 	}
 
 	/*
 	 * Save all indexes to disk 
 	 */
-	void IndexManager::saveIndexes(SimpleXML& xml)
+	void IndexManager::saveIndexes()
 	{
-		xml.addTag("Files");
-		xml.stepIn();
-
-		Lock l(cs);
-		for(TTHMap::const_iterator i = tthList.begin(); i != tthList.end(); i++)
+		string fileName = Util::getPath(Util::PATH_USER_CONFIG) + INDEX_FILE;
+		try
 		{
-			xml.addTag("File");
-			xml.addChildAttrib("TTH", i->first.toBase32());
-			
-			xml.stepIn();
-			for(SourceList::const_iterator j = i->second.begin(); j != i->second.end(); j++)
+			dcpp::File f(fileName + ".tmp", dcpp::File::WRITE, dcpp::File::CREATE | dcpp::File::TRUNCATE);
+			f.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+			f.write(&INDEX_VERSION, sizeof(INDEX_VERSION));
+
+			uint64_t now = GET_TICK();
+			ByteVector buf;
+			for(size_t n = 0; n < SHARDS; ++n)
 			{
-				const Source& source = *j;
-				
-				if(source.getPartial())
-					continue;	// don't store partial sources
-					
-				xml.addTag("Source");
-				xml.addChildAttrib("CID", source.getCID().toBase32());
-				xml.addChildAttrib("I4", source.getIp());
-				xml.addChildAttrib("U4", source.getUdpPort());
-				xml.addChildAttrib("SI", source.getSize());
-				xml.addChildAttrib("EX", source.getExpires());
+				// copy out under the lock, write without it
+				{
+					Lock l(shards[n].cs);
+					for(TTHMap::const_iterator i = shards[n].tthList.begin(); i != shards[n].tthList.end(); i++)
+					{
+						for(SourceList::const_iterator j = i->second.begin(); j != i->second.end(); j++)
+						{
+							const Source& source = *j;
+
+							if(source.getPartial() || source.getExpires() <= now)
+								continue;	// don't store partial sources
+
+							buf.resize(buf.size() + RECORD_SIZE);
+							uint8_t* p = &buf[buf.size() - RECORD_SIZE];
+							p = put(p, i->first.data);
+							memcpy(p, source.getCID().data(), CID::SIZE);
+							p += CID::SIZE;
+							p = put(p, source.ip);
+							p = put(p, source.getUdpPort());
+							p = put(p, source.getSize());
+							p = put(p, static_cast<uint32_t>((source.getExpires() - now) / 1000));
+						}
+					}
+				}
+
+				if(!buf.empty())
+					f.write(&buf[0], buf.size());
+				buf.clear();
 			}
-			xml.stepOut();
+
+			f.close();
+			dcpp::File::deleteFile(fileName);
+			dcpp::File::renameFile(fileName + ".tmp", fileName);
+		}
+		catch(const FileException&)
+		{
 		}
-		
-		xml.stepOut();
 	}
 	
 	/*
@@ -197,23 +360,67 @@ namespace dht
 	 */
 	void IndexManager::processPublishSourceRequest(const Node::Ptr& node, const AdcCommand& cmd)
 	{
-		string tth;
-		if(!cmd.getParam("TR", 1, tth))
-			return;	// nothing to identify a file?
-			
-		string size;
-		if(!cmd.getParam("SI", 1, size))
-			return;	// no file size?
-	
-		string partial;
-		cmd.getParam("PF", 1, partial);
-		
-		addSource(TTHValue(tth), node, Util::toInt64(size), partial == "1");
+		string firstTTH;
+		string tth, size, partial;
+		size_t files = 0;
+
+		if(!node->getIdentity().supports(BULK_PUBLISH_FEATURE))
+		{
+			// a single file, its parameters may come in any order
+			if(!cmd.getParam("TR", 1, tth))
+				return;	// nothing to identify a file?
+
+			if(!cmd.getParam("SI", 1, size))
+				return;	// no file size?
+
+			cmd.getParam("PF", 1, partial);
+
+			addSource(TTHValue(tth), node, Util::toInt64(size), partial == "1");
+			firstTTH = tth;
+			files = 1;
+		}
+		else
+		{
+			// several files in one command, each one starting with its TR
+			const StringList& params = cmd.getParameters();
+			for(size_t i = 1; i <= params.size(); ++i)
+			{
+				bool next = i == params.size() || params[i].compare(0, 2, "TR") == 0;
+				if(next && !tth.empty() && !size.empty() && files < PUBLISH_BATCH)
+				{
+					addSource(TTHValue(tth), node, Util::toInt64(size), partial == "1");
+					if(files++ == 0)
+						firstTTH = tth;
+				}
+
+				if(i == params.size())
+					break;
+
+				const string& param = params[i];
+				if(next)
+				{
+					tth = param.substr(2);
+					size.clear();
+					partial.clear();
+				}
+				else if(param.compare(0, 2, "SI") == 0)
+				{
+					size = param.substr(2);
+				}
+				else if(param.compare(0, 2, "PF") == 0)
+				{
+					partial = param.substr(2);
+				}
+			}
+		}
+
+		if(files == 0)
+			return;	// nothing to identify a file or no file size?
 		
 		// send response
 		AdcCommand res(AdcCommand::SEV_SUCCESS, AdcCommand::SUCCESS, "File published", AdcCommand::TYPE_UDP);
 		res.addParam("FC", "PUB");
-		res.addParam("TR", tth);
+		res.addParam("TR", firstTTH);
 		DHT::getInstance()->send(res, node->getIdentity().getIp(), static_cast<uint16_t>(Util::toInt(node->getIdentity().getUdpPort())), node->getUser()->getCID(), node->getUdpKey());	
 	}
 
@@ -222,32 +429,40 @@ namespace dht
 	 */
 	void IndexManager::checkExpiration(uint64_t aTick)
 	{
-		Lock l(cs);
-		
 		bool dirty = false;
 
-		TTHMap::iterator i = tthList.begin();
-		while(i != tthList.end())
+		uint64_t slot = aTick / EXPIRY_SLOT;
+		uint64_t first = std::max(expiredSlot, slot > EXPIRY_SLOTS ? slot - EXPIRY_SLOTS : 0);
+		for(uint64_t s = first; s < slot; ++s)
 		{
-			SourceList::iterator j = i->second.begin();
-			while(j != i->second.end())
+			for(size_t n = 0; n < SHARDS; ++n)
 			{
-				const Source& source = *j;
-				if(source.getExpires() <= aTick)
+				Shard& shard = shards[n];
+				Lock l(shard.cs);
+
+				std::vector<TTHValue> expiring;
+				expiring.swap(shard.expiring[s % EXPIRY_SLOTS]);
+
+				for(std::vector<TTHValue>::const_iterator t = expiring.begin(); t != expiring.end(); ++t)
 				{
-					dirty = true;
-					j = i->second.erase(j);
+					TTHMap::iterator i = shard.tthList.find(*t);
+					if(i == shard.tthList.end())
+						continue;
+
+					SourceList& sources = i->second;
+					SourceList::iterator j = std::remove_if(sources.begin(), sources.end(), [aTick](const Source& source) { return source.getExpires() <= aTick; });
+					if(j != sources.end())
+					{
+						dirty = true;
+						sources.erase(j, sources.end());
+					}
+
+					if(sources.empty())
+						shard.tthList.erase(i);
 				}
-				else
-					break;	// list is sorted, so finding first non-expired can stop iteration
-				
 			}
-			
-			if(i->second.empty())
-				tthList.erase(i++);
-			else
-				++i;
 		}
+		expiredSlot = std::max(expiredSlot, slot);
 		
 		if(dirty)
 			DHT::getInstance()->setDirty();	
@@ -260,6 +475,7 @@ namespace dht
 		{
 			Lock l(cs);
 			publishQueue.push_back(File(tth, size, false));
+			queueSorted = false;
 		}
 	}
 	
@@ -269,7 +485,7 @@ namespace dht
 	void IndexManager::publishPartialFile(const TTHValue& tth)
 	{
 		Lock l(cs);
-		publishQueue.push_front(File(tth, 0, true));
+		partialQueue.push_back(File(tth, 0, true));
 	}
 	
 
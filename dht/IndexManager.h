@@ -44,16 +44,31 @@ namespace dht
 	
 		/** Is it partially downloaded file? */
 		bool partial;
+
+		typedef std::vector<File> List;
 	};
 
+	/** Fixed size record, millions of these are kept when we are close to popular hashes */
 	struct Source
 	{
+		Source() : expires(0), size(0), ip(0), udpPort(0), partial(false) { }
+
 		GETSET(CID, cid, CID);
-		GETSET(string, ip, Ip);
 		GETSET(uint64_t, expires, Expires);
 		GETSET(uint64_t, size, Size);
+
+	public:
+		/** The address is kept in binary form, DHT is IPv4 only */
+		string getIp() const;
+		void setIp(const string& aIp);
+
+	private:
+		uint32_t ip;
+
 		GETSET(uint16_t, udpPort, UdpPort);
 		GETSET(bool, partial, Partial);
+
+		friend class IndexManager;
 	};
 
 	class IndexManager :
@@ -63,19 +78,34 @@ namespace dht
 		IndexManager(void);
 		~IndexManager(void);
 
-		typedef std::deque<Source> SourceList;
+		typedef std::vector<Source> SourceList;
 		
 		/** Finds TTH in known indexes and returns it */
 		bool findResult(const TTHValue& tth, SourceList& sources) const;
 	
-		/** Try to publish next file in queue */
+		/** Starts publishing the next files in queue as far as the packet budget allows */
 		void publishNextFile();
+
+		/** Takes queued files which are closer to key than radius until files holds maxFiles, they will be published to the same nodes */
+		void takeNeighbours(const CID& key, const CID& radius, File::List& files, size_t maxFiles);
+
+		/** Returns files whose publishing didn't take place back to the queue */
+		void requeue(const File::List& files);
+
+		/** Remembers how far the K closest nodes of the last publishing lookup reached */
+		void setPublishRadius(const CID& radius) { Lock l(cs); publishRadius = radius; }
+
+		/** Charges UDP packets sent while publishing against the budget */
+		void usePackets(size_t packets) { Lock l(cs); packetBudget -= static_cast<int64_t>(packets); }
+
+		/** How many files the budget left after packets more would still publish to K nodes */
+		size_t getPublishLimit(size_t packets) const { Lock l(cs); return filesForBudget(packetBudget - static_cast<int64_t>(packets)); }
 	
 		/** Loads existing indexes from disk */
-		void loadIndexes(SimpleXML& xml);
+		void loadIndexes();
 	
 		/** Save all indexes to disk */
-		void saveIndexes(SimpleXML& xml);
+		void saveIndexes();
 		
 		/** How many files is currently being published */
 		void incPublishing() { ++publishing; }
@@ -105,13 +135,51 @@ namespace dht
 	
 	private:
 
+		enum
+		{
+			SHARDS = 16,
+			/** Granularity of the expiry wheel */
+			EXPIRY_SLOT = 10*60*1000,
+			/** Enough slots to cover the longest lifetime of a source */
+			EXPIRY_SLOTS = (REPUBLISH_TIME) / EXPIRY_SLOT + 2
+		};
+
 		/** Contains known hashes in the network and their sources */
 		typedef std::unordered_map<TTHValue, SourceList> TTHMap;
-		TTHMap tthList;
+
+		/** A part of the known hashes, so that publishes and searches for different hashes don't wait for each other */
+		struct Shard
+		{
+			TTHMap tthList;
+
+			/** Hashes by the slot in which one of their sources expires; expiration only visits those */
+			std::vector<TTHValue> expiring[EXPIRY_SLOTS];
+
+			mutable CriticalSection cs;
+		};
+
+		Shard shards[SHARDS];
+
+		Shard& getShard(const TTHValue& tth) { return shards[tth.data[0] % SHARDS]; }
+		const Shard& getShard(const TTHValue& tth) const { return shards[tth.data[0] % SHARDS]; }
+
+		/** Expiry slots before this one have been processed */
+		uint64_t expiredSlot;
 	
-		/** Queue of files prepared for publishing */
+		/** Shared files prepared for publishing, sorted by descending key so that neighbours are taken from the back */
+		File::List publishQueue;
+		bool queueSorted;
+
+		/** Partially downloaded files are published first */
 		typedef std::deque<File> FileQueue;
-		FileQueue publishQueue;
+		FileQueue partialQueue;
+
+		/** Distance covered by K closest nodes in the last publishing lookup, estimates how many neighbours to group */
+		CID publishRadius;
+
+		/** Packets we may still send this second, goes negative when a batch overdraws it */
+		int64_t packetBudget;
+		uint64_t lastRefill;
 	
 		/** Is publishing allowed? */
 		bool publish;
@@ -122,12 +190,21 @@ namespace dht
 		/** Time when our sharelist should be republished */
 		uint64_t nextRepublishTime;	
 	
-		/** Synchronizes access to tthList */
+		/** Synchronizes access to the publishing queues and budget */
 		mutable CriticalSection cs;
 	
+		/** Sorts publishQueue if files were added since the last time, cs must be locked */
+		void sortQueue();
+
+		/** Files that budget packets publish to K nodes supporting bulk publishing */
+		static size_t filesForBudget(int64_t budget) { return budget > 0 ? static_cast<size_t>(budget) * PUBLISH_BATCH / K : 0; }
+
 		/** Add new source to tth list */
 		void addSource(const TTHValue& tth, const Node::Ptr& node, uint64_t size, bool partial);
 
+		/** Add source to its shard, the shard must be locked */
+		void addSource(Shard& shard, const TTHValue& tth, const Source& source);
+
 	};
 
 } // namespace dht
@@ -44,29 +44,38 @@ namespace dht
 	/*
 	 * Process this search request 
 	 */
-	void Search::process()
+	void Search::process(uint64_t timeout)
 	{
 		if(stopping)
 			return;
-			
-		// no node to search
-		if(possibleNodes.empty()/* || respondedNodes.size() >= MAX_SEARCH_RESULTS*/)
+
+		// requests without response in time don't hold back the lookup anymore, late responses are still accepted
+		uint64_t tick = GET_TICK();
+		for(RequestMap::iterator i = pendingNodes.begin(); i != pendingNodes.end(); )
+		{
+			if(i->second + timeout <= tick)
+				pendingNodes.erase(i++);
+			else
+				++i;
+		}
+
+		// no node to search or the closest nodes have been found
+		if((possibleNodes.empty() && pendingNodes.empty()) || isFinished())
 		{
 			stopping = true;
 			lifeTime = GET_TICK() + SEARCH_STOPTIME; // wait before deleting not to lose so much delayed results
 			return;
 		}
 			
-		// send search request to the first ALPHA closest nodes
-		size_t nodesCount = min((size_t)SEARCH_ALPHA, possibleNodes.size());
-		Node::Map::iterator it;
-		for(size_t i = 0; i < nodesCount; i++)
+		// keep SEARCH_ALPHA requests to the closest untried nodes in flight
+		while(pendingNodes.size() < SEARCH_ALPHA && !possibleNodes.empty())
 		{
-			it = possibleNodes.begin();
+			Node::Map::iterator it = possibleNodes.begin();
 			Node::Ptr node = it->second;
 				
 			// move to tried and delete from possibles
 			triedNodes[it->first] = node;
+			pendingNodes[it->first] = tick;
 			possibleNodes.erase(it);
 			
 			// send SCH command
@@ -75,12 +84,31 @@ namespace dht
 			cmd.addParam("TY", Util::toString(type));
 			cmd.addParam("TO", token);
 			
-			//node->setTimeout();
 			DHT::getInstance()->send(cmd, node->getIdentity().getIp(), static_cast<uint16_t>(Util::toInt(node->getIdentity().getUdpPort())), node->getUser()->getCID(), node->getUdpKey());
 		}
 	}
+
+	/*
+	 * Checks whether the K closest nodes known so far have all responded 
+	 */
+	bool Search::isFinished() const
+	{
+		if(respondedNodes.size() < K)
+			return false;
+
+		Node::Map::const_iterator kth = respondedNodes.begin();
+		std::advance(kth, K - 1);
+
+		// anything untried or still awaited closer than the K-th responder could improve the result
+		if(!possibleNodes.empty() && possibleNodes.begin()->first < kth->first)
+			return false;
+		if(!pendingNodes.empty() && pendingNodes.begin()->first < kth->first)
+			return false;
+
+		return true;
+	}
 		
-	SearchManager::SearchManager(void) : lastSearchFile(0)
+	SearchManager::SearchManager(void) : srtt(SEARCH_INITIAL_RTT), rttvar(SEARCH_INITIAL_RTT / 2), lastSearchFile(0)
 	{
 	}
 
@@ -147,12 +175,15 @@ namespace dht
 	}
 	
 	/*
-	 * Performs node lookup to store key/value pair in the network 
+	 * Performs node lookup to store files close to the first one in the network 
 	 */
-	void SearchManager::findStore(const string& tth, int64_t size, bool partial)
+	void SearchManager::findStore(const File::List& files)
 	{
+		string tth = files.front().tth.toBase32();
 		if(isAlreadySearchingFor(tth))
 		{
+			// publish them once the running search is over
+			IndexManager::getInstance()->requeue(files);
 			IndexManager::getInstance()->decPublishing();
 			return;
 		}
@@ -160,8 +191,7 @@ namespace dht
 		Search* s = new Search();
 		s->type = Search::TYPE_STOREFILE;
 		s->term = tth;
-		s->filesize = size;
-		s->partial = partial;
+		s->files = files;
 		s->token = Util::toString(Util::rand());
 		
 		search(*s);		
@@ -200,7 +230,7 @@ namespace dht
 		// store search
 		searches[&s.token] = &s;
 
-		s.process();
+		s.process(getRequestTimeout());
 	}
 	
 	/*
@@ -325,7 +355,15 @@ namespace dht
 		Search* s = i->second;
 		
 		// store this node
-		s->respondedNodes.insert(std::make_pair(Utils::getDistance(node->getUser()->getCID(), CID(s->term)), node));
+		CID nodeDistance = Utils::getDistance(node->getUser()->getCID(), CID(s->term));
+		s->respondedNodes.insert(std::make_pair(nodeDistance, node));
+
+		Search::RequestMap::iterator req = s->pendingNodes.find(nodeDistance);
+		if(req != s->pendingNodes.end())
+		{
+			updateRtt(GET_TICK() - req->second);
+			s->pendingNodes.erase(req);
+		}
 		
 		try
 		{
@@ -431,29 +469,69 @@ namespace dht
 		{
 			// malformed node list
 		}
+
+		// don't wait for the next processSearches, query the closest new nodes right away
+		s->process(getRequestTimeout());
 	}
 	
 	/*
-	 * Sends publishing request 
+	 * Sends publishing requests for a finished store lookup 
 	 */
-	void SearchManager::publishFile(const Node::Map& nodes, const string& tth, int64_t size, bool partial)
+	void SearchManager::publishFiles(const Search& s)
 	{
-		// send PUB command to K nodes
+		if(s.respondedNodes.empty())
+			return;
+
+		// the K closest nodes are responsible for every key closer to the term than the farthest of them
+		Node::Map::const_iterator last = s.respondedNodes.begin();
+		std::advance(last, min((size_t)K, s.respondedNodes.size()) - 1);
+		const CID& radius = last->first;
+		CID key(s.term);
+
+		IndexManager* im = IndexManager::getInstance();
+
+		// neighbours were guessed by the radius of the previous lookup, return those which are out of reach
+		File::List files(1, s.files.front()), rest;
+		for(File::List::const_iterator i = s.files.begin() + 1; i != s.files.end(); ++i)
+		{
+			if(Utils::getDistance(CID(i->tth.data), key) < radius)
+				files.push_back(*i);
+			else
+				rest.push_back(*i);
+		}
+
+		// the lookup's packets aren't charged yet, what the rest of the budget doesn't cover stays queued
+		size_t packets = s.triedNodes.size();
+		im->requeue(rest);
+		im->takeNeighbours(key, radius, files, max(im->getPublishLimit(packets), files.size()));
+		im->setPublishRadius(radius);
+
+		// send PUB command to K nodes, as few of them as possible
 		int n = K;
-		for(Node::Map::const_iterator i = nodes.begin(); i != nodes.end() && n > 0; i++, n--)
+		for(Node::Map::const_iterator i = s.respondedNodes.begin(); i != s.respondedNodes.end() && n > 0; i++, n--)
 		{
 			const Node::Ptr& node = i->second;
-			
-			AdcCommand cmd(AdcCommand::CMD_PUB, AdcCommand::TYPE_UDP);
-			cmd.addParam("TR", tth);
-			cmd.addParam("SI", Util::toString(size));
-			
-			if(partial)
-				cmd.addParam("PF", "1");
+			size_t batch = node->getIdentity().supports(BULK_PUBLISH_FEATURE) ? PUBLISH_BATCH : 1;
+
+			for(size_t j = 0; j < files.size(); )
+			{
+				AdcCommand cmd(AdcCommand::CMD_PUB, AdcCommand::TYPE_UDP);
+				for(size_t end = min(files.size(), j + batch); j < end; ++j)
+				{
+					const File& f = files[j];
+					cmd.addParam("TR", f.tth.toBase32());
+					cmd.addParam("SI", Util::toString(f.size));
+					
+					if(f.partial)
+						cmd.addParam("PF", "1");
+				}
 		
-			//i->second->setTimeout();
-			DHT::getInstance()->send(cmd, node->getIdentity().getIp(), static_cast<uint16_t>(Util::toInt(node->getIdentity().getUdpPort())), node->getUser()->getCID(), node->getUdpKey());
+				DHT::getInstance()->send(cmd, node->getIdentity().getIp(), static_cast<uint16_t>(Util::toInt(node->getIdentity().getUdpPort())), node->getUser()->getCID(), node->getUdpKey());
+				++packets;
+			}
 		}
+
+		im->usePackets(packets);
 	}
 	
 	/*
@@ -463,23 +541,24 @@ namespace dht
 	{
 		Lock l(cs);
 		
+		uint64_t timeout = getRequestTimeout();
 		SearchMap::iterator it = searches.begin();
 		while(it != searches.end())
 		{
 			Search* s = it->second;
 			
-			// process active search
-			s->process();
+			// replace timed out requests
+			s->process(timeout);
 			
-			// remove long search
-			if(s->lifeTime < GET_TICK())
+			// remove long search, store lookups don't need to wait for delayed results
+			if(s->lifeTime < GET_TICK() || (s->stopping && s->type == Search::TYPE_STOREFILE))
 			{
 				// search timed out, stop it
 				searches.erase(it++);
 					
 				if(s->type == Search::TYPE_STOREFILE)
 				{
-					publishFile(s->respondedNodes, s->term, s->filesize, s->partial);
+					publishFiles(*s);
 				}
 
 				delete s;
@@ -541,5 +620,24 @@ namespace dht
 		
 		return false;
 	}
+
+	/*
+	 * Adds a round-trip sample to the estimate 
+	 */
+	void SearchManager::updateRtt(uint64_t rtt)
+	{
+		// the usual TCP retransmission timer smoothing (RFC 6298)
+		uint64_t delta = rtt > srtt ? rtt - srtt : srtt - rtt;
+		rttvar = (3 * rttvar + delta) / 4;
+		srtt = (7 * srtt + rtt) / 8;
+	}
+
+	/*
+	 * Returns how long to wait for a search response before asking another node 
+	 */
+	uint64_t SearchManager::getRequestTimeout() const
+	{
+		return max((uint64_t)SEARCH_MIN_TIMEOUT, min(srtt + 4 * rttvar, (uint64_t)SEARCH_MAX_TIMEOUT));
+	}
 	
 }
@@ -19,6 +19,7 @@
 #ifndef _SEARCHMANAGER_H
 #define _SEARCHMANAGER_H
 
+#include "IndexManager.h"
 #include "KBucket.h"
 
 #include "../client/CID.h"
@@ -35,7 +36,7 @@ namespace dht
 		public FastAlloc<Search>
 	{
 		
-		Search() : partial(false), stopping(false)
+		Search() : stopping(false)
 		{
 		}
 
@@ -47,16 +48,21 @@ namespace dht
 		Node::Map triedNodes;		// nodes where search request has already been sent to
 		Node::Map respondedNodes;	// nodes who responded to this search request
 
+		typedef std::map<CID, uint64_t> RequestMap;
+		RequestMap pendingNodes;	// tried nodes still within their timeout, with the time the request was sent
+
 		string token;				// search identificator
 		string term;				// search term (TTH/CID)
 		uint64_t lifeTime;			// time when this search has been started
-		int64_t filesize;			// file size
+		File::List files;			// files to publish, the first one is the search term and the rest its neighbours
 		SearchType type;			// search type
-		bool partial;				// is this partial file search?
 		bool stopping;				// search is being stopped
 		
-		/** Processes this search request */
-		void process();
+		/** Expires requests older than timeout and keeps SEARCH_ALPHA requests in flight */
+		void process(uint64_t timeout);
+
+		/** Checks whether the K closest nodes known so far have all responded */
+		bool isFinished() const;
 	};
 		
 	class SearchManager :
@@ -72,8 +78,8 @@ namespace dht
 		/** Performs value lookup in the network */
 		void findFile(const string& tth, const string& token);
 		
-		/** Performs node lookup to store key/value pair in the network */
-		void findStore(const string& tth, int64_t size, bool partial);		
+		/** Performs node lookup to store files close to the first one in the network */
+		void findStore(const File::List& files);
 		
 		/** Process incoming search request */
 		void processSearchRequest(const Node::Ptr& node, const AdcCommand& cmd);
@@ -102,12 +108,22 @@ namespace dht
 		/** Performs general search operation in the network */
 		void search(Search& s);
 		
-		/** Sends publishing request */
-		void publishFile(const Node::Map& nodes, const string& tth, int64_t size, bool partial);
+		/** Sends publishing requests for a finished store lookup */
+		void publishFiles(const Search& s);
 		
 		/** Checks whether we are alreading searching for a term */
 		bool isAlreadySearchingFor(const string& term);
 
+		/** Smoothed round-trip time and its mean deviation, measured from search responses */
+		uint64_t srtt;
+		uint64_t rttvar;
+
+		/** Adds a round-trip sample to the estimate */
+		void updateRtt(uint64_t rtt);
+
+		/** Returns how long to wait for a search response before asking another node */
+		uint64_t getRequestTimeout() const;
+
 		uint64_t lastSearchFile;
 		
 	};
@@ -175,7 +175,7 @@ LRESULT MainFrame::OnCreate(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/,
 	UpdateManager::getInstance()->addListener(this);
 
 	WinUtil::init(m_hWnd);
-	PluginManager::getInstance()->runHook(HOOK_UI_CREATED, m_hWnd, NULL);
+	PluginManager::getInstance()->runHook(PluginManager::UI_CREATED, m_hWnd, NULL);
 	refreshPluginMenu();
 
 	trayMessage = RegisterWindowMessage(_T("TaskbarCreated"));
@@ -1566,6 +1566,10 @@ void QueueFrame::on(QueueManagerListener::RecheckAlreadyFinished, const string&
 void QueueFrame::on(QueueManagerListener::RecheckDone, const string& target) noexcept {
 	onRechecked(target, STRING(DONE));
 }
+
+void QueueFrame::on(QueueManagerListener::RecheckProgress, const string& target, int64_t checked, int64_t total) noexcept {
+	onRechecked(target, Util::toString(total > 0 ? checked * 100 / total : 100) + "%");
+}
 	
 /**
  * @file
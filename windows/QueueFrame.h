@@ -391,6 +391,7 @@ private:
 	void on(QueueManagerListener::RecheckNoTree, const string& target) noexcept;
 	void on(QueueManagerListener::RecheckAlreadyFinished, const string& target) noexcept;
 	void on(QueueManagerListener::RecheckDone, const string& target) noexcept;
+	void on(QueueManagerListener::RecheckProgress, const string& target, int64_t checked, int64_t total) noexcept;
 };
 
 #endif // !defined(QUEUE_FRAME_H)